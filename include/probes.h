@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef QB_PROBES_H_DEFINED
+#define QB_PROBES_H_DEFINED
+
+/*
+ * Static (USDT) probes, built in with --enable-usdt.
+ *
+ * A probe is a nop in the code and a note in the ELF file, tools like
+ * bpftrace, perf and systemtap patch in a breakpoint when they attach.
+ * Without --enable-usdt they go away completely.
+ *
+ * provider "libqb":
+ *
+ * rb__commit       (name, len, write_pt)
+ * rb__read         (name, len, read_pt)
+ * rb__reclaim      (name, len, read_pt)
+ * rb__forward      (name, size, generation)
+ * ipc__request__start (service, pid, id, size)
+ * ipc__request__done  (service, pid, id, res)
+ * ipc__response__send (service, pid, res)
+ * ipc__event__send    (service, pid, res)
+ * loop__dispatch__start (item, type, priority)
+ * loop__dispatch__done  (item, type, priority)
+ * timer__expire    (timer, expire_ns, now_ns)
+ * log__emit        (priority, function, filename, lineno, format)
+ *
+ * Latencies are the time between a __start and its __done, the tracer
+ * reads the clock so nothing is timed when no one is looking.
+ *
+ * Keep the list in lib/Makefile.am (QB_PROBES) in step with this one.
+ */
+#include "os_base.h"
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define QB_PROBE1(name, a) \
+	DTRACE_PROBE1(libqb, name, a)
+#define QB_PROBE2(name, a, b) \
+	DTRACE_PROBE2(libqb, name, a, b)
+#define QB_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(libqb, name, a, b, c)
+#define QB_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(libqb, name, a, b, c, d)
+#define QB_PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(libqb, name, a, b, c, d, e)
+#else
+/* sizeof keeps the arguments "used" without evaluating them */
+#define QB_PROBE1(name, a) \
+	do { (void)sizeof(a); } while (0)
+#define QB_PROBE2(name, a, b) \
+	do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define QB_PROBE3(name, a, b, c) \
+	do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define QB_PROBE4(name, a, b, c, d) \
+	do { QB_PROBE3(name, a, b, c); (void)sizeof(d); } while (0)
+#define QB_PROBE5(name, a, b, c, d, e) \
+	do { QB_PROBE4(name, a, b, c, d); (void)sizeof(e); } while (0)
+#endif /* HAVE_USDT */
+
+#endif /* QB_PROBES_H_DEFINED */
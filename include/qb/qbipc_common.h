@@ -61,6 +61,7 @@ enum qb_ipc_type {
 #define QB_IPC_MSG_AUTHENTICATE -1
 #define QB_IPC_MSG_NEW_EVENT_SOCK -2
 #define QB_IPC_MSG_DISCONNECT -3
+#define QB_IPC_MSG_LARGE -4
 
 /* *INDENT-OFF* */
 #ifdef __cplusplus
@@ -64,6 +64,17 @@ extern "C" {
 
 typedef struct qb_ipcc_connection qb_ipcc_connection_t;
 
+/**
+ * qb_ipcc_send_flags() flag: send on the connection's priority lane.
+ *
+ * The server drains the priority lane before any other request and
+ * it is not subject to flow control. It is meant for small control
+ * messages and is only available on shared memory connections to
+ * services that turned it on with qb_ipcs_priority_lane_set(),
+ * elsewhere the message is sent as normal.
+ */
+#define QB_IPCC_SEND_PRIORITY 0x01
+
 /**
  * Create a connection to an IPC service.
  *
@@ -133,6 +144,9 @@ int32_t qb_ipcc_fc_enable_max_set(qb_ipcc_connection_t * c, uint32_t max);
  * @note the msg_ptr must include a qb_ipc_request_header at
  * the top of the message. The server will read the size field
  * to determine how much to recv.
+ * @note messages bigger than the ring fail with -EMSGSIZE unless
+ * passing them by memfd has been turned on, see
+ * qb_ipcc_large_msg_threshold_set().
  */
 ssize_t qb_ipcc_send(qb_ipcc_connection_t* c, const void *msg_ptr,
                      size_t msg_len);
@@ -149,6 +163,70 @@ ssize_t qb_ipcc_send(qb_ipcc_connection_t* c, const void *msg_ptr,
  */
 ssize_t qb_ipcc_sendv(qb_ipcc_connection_t* c, const struct iovec* iov,
 	size_t iov_len);
+
+/**
+ * Send a message with flags.
+ *
+ * @param c connection instance
+ * @param msg_ptr pointer to a message to send
+ * @param msg_len the size of the message
+ * @param flags 0 or QB_IPCC_SEND_PRIORITY
+ * @return (size sent, -errno == error)
+ *
+ * @note priority messages are limited to
+ * qb_ipcc_priority_msg_size_get() bytes.
+ */
+ssize_t qb_ipcc_send_flags(qb_ipcc_connection_t* c, const void *msg_ptr,
+			   size_t msg_len, uint32_t flags);
+
+/**
+ * Send a message (iovec) with flags.
+ *
+ * @param c connection instance
+ * @param iov pointer to an iovec struct to send
+ * @param iov_len the number of iovecs used
+ * @param flags 0 or QB_IPCC_SEND_PRIORITY
+ * @return (size sent, -errno == error)
+ */
+ssize_t qb_ipcc_sendv_flags(qb_ipcc_connection_t* c, const struct iovec* iov,
+			    size_t iov_len, uint32_t flags);
+
+/**
+ * Get the largest message that can go on the priority lane.
+ *
+ * @param c connection instance
+ * @return size in bytes, 0 if there is no priority lane
+ * or -errno for errors
+ */
+int32_t qb_ipcc_priority_msg_size_get(qb_ipcc_connection_t *c);
+
+/**
+ * Pass requests above a size to the server in a sealed memfd instead
+ * of copying them through the request ring.
+ *
+ * The server maps the memfd read-only and passes it to msg_process()
+ * like any other request, so the rings can stay small while the odd
+ * multi-megabyte request still gets through. This is off by default,
+ * requests larger than the ring's max_msg_size then fail with
+ * -EMSGSIZE.
+ *
+ * @param c connection instance
+ * @param threshold size in bytes (capped at the ring's max_msg_size),
+ * 0 turns it off again
+ * @return 0, -ENOTSUP if large requests can't be passed on this
+ * connection (socket transport, older server or no memfd support)
+ * or -EINVAL
+ *
+ * @note this applies to the normal lane only, priority messages
+ * are still limited by qb_ipcc_priority_msg_size_get().
+ * @note if the server can't map a memfd the request doesn't reach
+ * msg_process(), the response is then a bare qb_ipc_response_header
+ * with id QB_IPC_MSG_LARGE and error set to -errno.
+ * @note responses and events are not passed this way, they are still
+ * limited by the ring size the server picked.
+ */
+int32_t qb_ipcc_large_msg_threshold_set(qb_ipcc_connection_t *c,
+					size_t threshold);
 /**
  * Receive a response.
  *
@@ -187,6 +265,33 @@ ssize_t qb_ipcc_sendv_recv(qb_ipcc_connection_t *c,
 			   void *msg_ptr, size_t msg_len,
 			   int32_t ms_timeout);
 
+/**
+ * Let several threads share the connection.
+ *
+ * Once enabled, any number of threads may call qb_ipcc_sendv_recv()
+ * on the connection at the same time. The requests are numbered as
+ * they are put on the request ring and each response is handed to
+ * the thread whose request it answers, so the threads don't need a
+ * connection each nor a lock around every call.
+ *
+ * qb_ipcc_send() and qb_ipcc_sendv() may be used concurrently too, but
+ * only for requests the server doesn't answer.
+ *
+ * @param c connection instance
+ * @param enable QB_TRUE to share the connection, QB_FALSE to stop
+ * @return 0 (success), -EBUSY (threads are still waiting on it)
+ *
+ * @note This relies on the server sending exactly one response per
+ * request. A server of this version echoes the request's tag so the
+ * responses may come back in any order, e.g. from unordered deferred
+ * requests; an older one must answer in the order the requests came
+ * in. Don't call qb_ipcc_recv() or send on the priority lane while
+ * threads are waiting for responses.
+ * @note Enable it before handing the connection to other threads and
+ * disable it (or disconnect) only once they are done with it.
+ */
+int32_t qb_ipcc_thread_safe_set(qb_ipcc_connection_t *c, int32_t enable);
+
 /**
  * Receive an event.
  *
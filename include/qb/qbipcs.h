@@ -57,11 +57,39 @@ typedef struct qb_ipcs_connection qb_ipcs_connection_t;
 struct qb_ipcs_service;
 typedef struct qb_ipcs_service qb_ipcs_service_t;
 
+struct qb_ipcs_pending;
+typedef struct qb_ipcs_pending qb_ipcs_pending_t;
+
+/**
+ * Return value of the msg_process callback for a request that has
+ * been handed off with qb_ipcs_request_defer().
+ */
+#define QB_IPCS_MSG_PENDING 1
+
+/**
+ * qb_ipcs_request_defer() flag: stop reading from the connection
+ * until the request has been completed, so responses go out in
+ * request order.
+ */
+#define QB_IPCS_DEFER_ORDERED 0x01
+
 struct qb_ipcs_stats {
 	uint32_t active_connections;
 	uint32_t closed_connections;
 };
 
+/**
+ * Number of connection classes available for fair queuing.
+ */
+#define QB_IPCS_CLASSES_MAX 16
+
+struct qb_ipcs_class_stats {
+	uint32_t connections;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t throttled;
+};
+
 struct qb_ipcs_connection_stats {
 	int32_t client_pid;
 	uint64_t requests;
@@ -83,6 +111,9 @@ struct qb_ipcs_connection_stats_2 {
 	int32_t flow_control_state;
 	uint64_t flow_control_count;
 	uint32_t event_q_length;
+	uint32_t event_backlog_length;
+	uint64_t events_coalesced;
+	uint64_t resident_bytes;
 };
 
 typedef int32_t (*qb_ipcs_dispatch_fn_t) (int32_t fd, int32_t revents,
@@ -153,6 +184,10 @@ typedef void (*qb_ipcs_connection_destroyed_fn) (qb_ipcs_connection_t *c);
 /**
  * This is the message processing calback.
  * It is called with the message data.
+ *
+ * @return 0 when done, a negative value to back off, or
+ * QB_IPCS_MSG_PENDING when the request has been deferred with
+ * qb_ipcs_request_defer() and will be answered later.
  */
 typedef int32_t (*qb_ipcs_msg_process_fn) (qb_ipcs_connection_t *c,
 		void *data, size_t size);
@@ -244,6 +279,107 @@ void qb_ipcs_destroy(qb_ipcs_service_t* s);
 void qb_ipcs_request_rate_limit(qb_ipcs_service_t* s,
 			       	enum qb_ipcs_rate_limit rl);
 
+/**
+ * Schedule request processing fairly between connections.
+ *
+ * Each time a connection with pending requests is dispatched it
+ * earns a quantum of bytes (deficit round robin) and requests are
+ * processed until it has used it up. The quantum is scaled by the
+ * weight of the connection's class divided by the number of
+ * connections in that class that have requests waiting, and by the
+ * connection's own weight.
+ *
+ * @param s service instance
+ * @param quantum bytes per round for a weight of 1 (0 disables
+ * fair queuing, which is the default)
+ * @return 0 == ok; -errno to indicate a failure
+ *
+ * @see qb_ipcs_class_weight_set() qb_ipcs_connection_class_set()
+ */
+int32_t qb_ipcs_fair_queuing_set(qb_ipcs_service_t *s, uint32_t quantum);
+
+/**
+ * Set the weight of a connection class (default 1).
+ *
+ * @param s service instance
+ * @param class_id class, less than QB_IPCS_CLASSES_MAX
+ * @param weight relative share of the class
+ * @return 0 == ok; -errno to indicate a failure
+ */
+int32_t qb_ipcs_class_weight_set(qb_ipcs_service_t *s, uint32_t class_id,
+				 uint32_t weight);
+
+/**
+ * Get the statistics of a connection class.
+ *
+ * @param s service instance
+ * @param class_id class, less than QB_IPCS_CLASSES_MAX
+ * @param stats (out) the statistics structure
+ * @param clear_after_read clear stats after copying them into stats
+ * @return 0 == ok; -errno to indicate a failure
+ *
+ * @note throttled counts the times a connection still had requests
+ * queued when it ran out of quantum.
+ */
+int32_t qb_ipcs_class_stats_get(qb_ipcs_service_t *s, uint32_t class_id,
+				struct qb_ipcs_class_stats *stats,
+				int32_t clear_after_read);
+
+/**
+ * Give new connections a priority lane.
+ *
+ * Each shared memory connection made after this gets a small extra
+ * request ring that is drained ahead of the normal one, see
+ * QB_IPCC_SEND_PRIORITY. It is off by default, which saves the ring
+ * (a file in /dev/shm and a mapping) on every connection.
+ *
+ * @param s service instance
+ * @param enable QB_TRUE or QB_FALSE
+ * @return 0 == ok; -ENOTSUP if s is not a QB_IPC_SHM service
+ */
+int32_t qb_ipcs_priority_lane_set(qb_ipcs_service_t *s, int32_t enable);
+
+/**
+ * Poll the shared memory request rings from a dedicated thread.
+ *
+ * Once requests come in, a thread watches the request (and priority)
+ * rings of every connection and the clients stop writing a wakeup to
+ * the socket for each request. After nothing has arrived for
+ * idle_usec the thread goes back to sleep and the clients go back to
+ * the socket, the next request through it starts polling again.
+ *
+ * msg_process() is still called from the service's poll loop, the
+ * thread only wakes the loop up when a ring has moved.
+ *
+ * @param s service instance
+ * @param idle_usec how long to keep polling without a request
+ * (0 stops the thread, which is the default)
+ * @return 0 == ok; -ENOTSUP if s is not a QB_IPC_SHM service,
+ * -EINVAL if the poll handlers haven't been set yet.
+ *
+ * @note this keeps a CPU busy while requests are flowing.
+ */
+int32_t qb_ipcs_busy_poll_set(qb_ipcs_service_t *s, uint32_t idle_usec);
+
+/**
+ * Give back the ring memory of connections that have gone quiet.
+ *
+ * A connection with no requests, responses or events for idle_ms has
+ * the pages of its (empty) response and event rings released, they
+ * come back as zeroed pages when next written to. The request rings
+ * are left alone since the client writes those. Each connection's
+ * resident_bytes in qb_ipcs_connection_stats_2 shows the effect.
+ *
+ * @param s service instance
+ * @param idle_ms quiet period before trimming (0 disables, the default)
+ * @return 0 == ok; -ENOTSUP if s is not a QB_IPC_SHM service or there
+ * are no timerfds, -EINVAL if the poll handlers haven't been set yet.
+ *
+ * @note the pages are allocated again on use, if /dev/shm has filled
+ * up in the meantime that ends with a SIGBUS.
+ */
+int32_t qb_ipcs_idle_trim_set(qb_ipcs_service_t *s, uint32_t idle_ms);
+
 /**
  * Send a response to a incoming request.
  *
@@ -277,6 +413,55 @@ ssize_t qb_ipcs_response_send(qb_ipcs_connection_t *c, const void *data,
 ssize_t qb_ipcs_response_sendv(qb_ipcs_connection_t *c,
 			       const struct iovec * iov, size_t iov_len);
 
+/**
+ * Defer the request currently being processed.
+ *
+ * Call this from within the msg_process callback and then return
+ * QB_IPCS_MSG_PENDING. The returned token can be handed to another
+ * thread which answers the request with qb_ipcs_response_complete().
+ *
+ * @param c connection instance (as passed to msg_process)
+ * @param flags 0 or QB_IPCS_DEFER_ORDERED
+ * @return the pending request token or NULL (errno set)
+ *
+ * @note The request is copied, so it stays valid when the client
+ * disconnects. Without QB_IPCS_DEFER_ORDERED the connection carries
+ * on processing requests, so responses may be sent out of order.
+ * With QB_IPCS_DEFER_ORDERED no further requests are read from the
+ * connection until this one is completed.
+ */
+qb_ipcs_pending_t *qb_ipcs_request_defer(qb_ipcs_connection_t *c,
+					 uint32_t flags);
+
+/**
+ * Get the request data of a deferred request.
+ *
+ * @param p pending request token
+ * @param size (out) the size of the request (may be NULL)
+ * @return the request, valid until qb_ipcs_response_complete()
+ */
+void *qb_ipcs_pending_request_get(qb_ipcs_pending_t *p, size_t *size);
+
+/**
+ * Complete a deferred request.
+ *
+ * This may be called from any thread. The response is copied and
+ * sent from the mainloop, after which the request is released and
+ * the token freed.
+ *
+ * @param p pending request token
+ * @param data the response to send (NULL to send nothing)
+ * @param size the size of the response
+ * @return 0 or -errno for errors
+ *
+ * @note the data must include a qb_ipc_response_header at
+ * the top of the message.
+ * @note Every deferred request must be completed before the
+ * service is destroyed.
+ */
+int32_t qb_ipcs_response_complete(qb_ipcs_pending_t *p,
+				  const void *data, size_t size);
+
 /**
  * Send an asyncronous event message to the client.
  *
@@ -314,6 +499,68 @@ ssize_t qb_ipcs_event_send(qb_ipcs_connection_t *c, const void *data,
 ssize_t qb_ipcs_event_sendv(qb_ipcs_connection_t *c, const struct iovec * iov,
 			    size_t iov_len);
 
+/**
+ * Keep events the client has no room for on the connection.
+ *
+ * Without a backlog qb_ipcs_event_send() returns -EAGAIN when the
+ * client's event buffer is full. With one, up to max_events events
+ * are queued on the connection instead and sent, in order, as the
+ * client catches up. -EAGAIN is only returned once the backlog is
+ * full too.
+ *
+ * Events sent with qb_ipcs_event_send_keyed() replace a queued event
+ * with the same key in place, so a slow client skips straight to the
+ * latest value.
+ *
+ * @param c connection instance
+ * @param max_events size of the backlog, 0 turns it off and drops
+ * anything queued
+ * @return 0 or -errno
+ */
+int32_t qb_ipcs_event_backlog_set(qb_ipcs_connection_t *c,
+				  uint32_t max_events);
+
+/**
+ * Send an event that supersedes any queued event with the same key.
+ *
+ * @param c connection instance
+ * @param key identifies what the event is about (e.g. an object id)
+ * @param data the message to send
+ * @param size the size of the message
+ * @return size sent or queued, or -errno for errors
+ *
+ * @note this is the same as qb_ipcs_event_send() unless a backlog
+ * has been set up with qb_ipcs_event_backlog_set().
+ */
+ssize_t qb_ipcs_event_send_keyed(qb_ipcs_connection_t *c, uint64_t key,
+				 const void *data, size_t size);
+
+/**
+ * Resize the response and event rings of a connection.
+ *
+ * Connections start out with rings just big enough for one message
+ * of the buffer size. A client that has many responses or events
+ * queued can be given more room without reconnecting, and be shrunk
+ * back later. The client switches over to the new rings once it has
+ * read what was in the old ones (see qb_rb_resize()).
+ *
+ * @param c connection instance
+ * @param size bytes for each ring, at least the buffer size
+ * @return 0 == ok; -ENOTSUP if c is not a QB_IPC_SHM connection or
+ * the client's libqb is too old to follow, -EINVAL if size is smaller
+ * than the buffer size, -EAGAIN if a ring is completely full (try
+ * again once the client has read something), -ENOMEM if the
+ * connection could not be put back on the busy poll list (the rings
+ * are resized, requests are picked up through the socket instead).
+ *
+ * @note If the event ring can't be resized the response ring is put
+ * back to its old size. Should that fail too the two are left at
+ * different sizes and a warning is logged, the client follows either
+ * way.
+ */
+int32_t qb_ipcs_connection_ring_size_set(qb_ipcs_connection_t *c,
+					 size_t size);
+
 /**
  * Increment the connection's reference counter.
  *
@@ -444,6 +691,22 @@ qb_ipcs_connection_t * qb_ipcs_connection_next_get(qb_ipcs_service_t* pt,
 void qb_ipcs_connection_auth_set(qb_ipcs_connection_t *conn, uid_t uid,
 				 gid_t gid, mode_t mode);
 
+/**
+ * Put a connection into a fair queuing class.
+ *
+ * New connections are in class 0 with a weight of 1.
+ *
+ * @param conn connection instance
+ * @param class_id class, less than QB_IPCS_CLASSES_MAX
+ * @param weight the connection's share within its class
+ * @return 0 == ok; -errno to indicate a failure
+ *
+ * @note this is intended to be called within the
+ * qb_ipcs_connection_accept_fn() callback, based on uid/gid.
+ */
+int32_t qb_ipcs_connection_class_set(qb_ipcs_connection_t *conn,
+				     uint32_t class_id, uint32_t weight);
+
 /**
  * Retrieve the connection ipc buffer size. This reflects the
  * largest size msg that can be sent or received.
@@ -36,6 +36,7 @@ extern "C" {
 #include <syslog.h>
 #include <string.h>
 #include <qb/qbutil.h>
+#include <qb/qbloop.h>
 #include <qb/qbconfig.h>
 
 #ifdef S_SPLINT_S
@@ -103,6 +104,19 @@ extern "C" {
  *	qb_log_ctl(mytarget, QB_LOG_CONF_FILE_SYNC, QB_TRUE);
  * @endcode
  *
+ * To log a message that keeps repeating only once every 10 seconds,
+ * followed by "last message repeated N times" when it changes or
+ * the 10 seconds are up (default 0, off)
+ * @code
+ *	qb_log_ctl(mytarget, QB_LOG_CONF_COALESCE, 10);
+ * @endcode
+ * A message repeats when it comes from the same callsite with the
+ * same text. The count is written out when the target logs something
+ * else, is disabled, or the period is over. Only threaded targets are
+ * checked by the logging thread. Other targets need a loop set with
+ * qb_log_coalesce_loop_set(). Without one, the count waits for the
+ * next message.
+ *
  *
  * @par Filtering messages.
  * To have more power over what log messages go to which target you can apply
@@ -418,6 +432,7 @@ enum qb_log_conf {
 	QB_LOG_CONF_STATE_GET,
 	QB_LOG_CONF_FILE_SYNC,
 	QB_LOG_CONF_EXTENDED,
+	QB_LOG_CONF_COALESCE,
 };
 
 enum qb_log_filter_type {
@@ -575,6 +590,52 @@ int32_t qb_log_file_open(const char *filename);
  */
 void qb_log_file_close(int32_t t);
 
+/**
+ * Open a log target that sends to a log collector over the network.
+ *
+ * @param address "udp:<host>:<port>", "tcp:<host>:<port>" or
+ * "unix:<path>" (a unix stream socket). IPv6 hosts may be written in
+ * brackets.
+ *
+ * Records are newline terminated and collected in a buffer of
+ * QB_LOG_CONF_SIZE bytes (64KB by default). For udp each record is one
+ * datagram. When the target is threaded (QB_LOG_CONF_THREADED) the log
+ * thread sends whatever has collected in one go once it has no more
+ * records queued, otherwise every record is sent as it is logged.
+ * Connecting never blocks the caller; a lost connection is retried
+ * with an increasing backoff and records that don't fit in the buffer
+ * meanwhile are dropped and counted (see qb_log_net_stats_get()).
+ *
+ * @retval -errno on error
+ * @retval 3 to 31 (to be passed into other qb_log_* functions)
+ */
+int32_t qb_log_net_open(const char *address);
+
+/**
+ * Close a network log target, sending what is buffered if possible.
+ */
+void qb_log_net_close(int32_t t);
+
+struct qb_log_net_stats {
+	uint64_t records_sent;
+	uint64_t frames_sent;
+	uint64_t records_dropped;
+	uint64_t connects;
+	uint64_t connect_failures;
+	uint64_t bytes_pending;
+};
+
+/**
+ * Get the counters of a network log target.
+ *
+ * frames_sent counts the system calls that sent records, so
+ * records_sent / frames_sent is the batching achieved.
+ *
+ * @retval 0 success
+ * @retval -EBADF t is not a network log target
+ */
+int32_t qb_log_net_stats_get(int32_t t, struct qb_log_net_stats *stats);
+
 /**
  * When using threaded logging set the pthread policy and priority.
  *
@@ -588,6 +649,16 @@ int32_t qb_log_thread_priority_set(int32_t policy, int32_t priority);
  */
 int32_t qb_log_thread_start(void);
 
+/**
+ * Write out the repeat counts of targets that are not threaded from a
+ * timer on a loop, once their QB_LOG_CONF_COALESCE period is over.
+ *
+ * @param l the loop (NULL to stop)
+ * @retval 0 success
+ * @retval -errno from qb_loop_timer_add()
+ */
+int32_t qb_log_coalesce_loop_set(qb_loop_t *l);
+
 /**
  * Write the blackbox to file.
  */
@@ -598,6 +669,23 @@ ssize_t qb_log_blackbox_write_to_file(const char *filename);
  */
 void qb_log_blackbox_print_from_file(const char* filename);
 
+/**
+ * Print the blackbox of a running process as it is written.
+ *
+ * The blackbox is mapped read only, so the process being followed
+ * doesn't notice. The records already in it are printed first, then
+ * new ones as they are committed. If the writer overwrites records
+ * before they are printed a "--- N records lost ---" line says so.
+ *
+ * @param name the blackbox ring name ("<name>-<pid>-blackbox") or the
+ * path of its header file.
+ * @param ms_poll how often to look for new records.
+ * @retval 0 the writer closed (or reloaded) the blackbox, or exited
+ * @retval -ENOTSUP the writer's libqb doesn't support following
+ * @retval -errno couldn't open the blackbox
+ */
+int32_t qb_log_blackbox_follow(const char *name, int32_t ms_poll);
+
 /**
  * Open a custom log target.
  *
@@ -48,6 +48,30 @@ enum qb_loop_priority {
 	QB_LOOP_HIGH = 2,
 };
 
+/**
+ * The kind of source a dispatched callback belongs to.
+ */
+enum qb_loop_source_type {
+	QB_LOOP_SOURCE_FD = 0,
+	QB_LOOP_SOURCE_JOB = 1,
+	QB_LOOP_SOURCE_TIMER = 2,
+	QB_LOOP_SOURCE_SIG = 3,
+};
+
+/**
+ * A dispatch that took longer than the watchdog threshold.
+ * @see qb_loop_watchdog_set()
+ */
+struct qb_loop_stall {
+	void *dispatch_fn;
+	enum qb_loop_source_type type;
+	enum qb_loop_priority p;
+	int32_t fd;
+	uint32_t count;
+	uint64_t duration;
+	uint64_t last_seen;
+};
+
 /**
  * An opaque data type representing the main loop.
  */
@@ -89,6 +113,62 @@ void qb_loop_stop(qb_loop_t *l);
  */
 void qb_loop_run(qb_loop_t *l);
 
+/**
+ * Run a single bounded iteration of the main loop.
+ *
+ * This polls all sources once (waiting at most ms_timeout) and
+ * dispatches what is ready. Use it together with qb_loop_fd_get()
+ * to nest a qb_loop inside another event loop.
+ *
+ * @param l pointer to the loop instance
+ * @param ms_timeout maximum time to wait for an event (-1 == no limit)
+ * @return number of dispatched items (>= 0) or -errno on failure
+ */
+int32_t qb_loop_run_once(qb_loop_t *l, int32_t ms_timeout);
+
+/**
+ * Get a file descriptor that becomes readable when the loop has work.
+ *
+ * The descriptor can be added to another event loop (glib, libuv,
+ * epoll ...), when it polls readable call qb_loop_run_once(l, 0).
+ * Jobs and timers also make it readable when they are due.
+ *
+ * @note The descriptor belongs to the loop, don't read from or close it.
+ *
+ * @param l pointer to the loop instance
+ * @return file descriptor (>= 0) or -errno (-ENOTSUP if the poll driver
+ * can't provide one)
+ */
+int32_t qb_loop_fd_get(qb_loop_t *l);
+
+
+/**
+ * Time every dispatch and record the ones that are too slow.
+ *
+ * Each callback that runs for longer than threshold_ns is logged and
+ * recorded (callback address, source type, fd and duration) in a small
+ * ring that can be read back with qb_loop_stalls_get().
+ *
+ * @param l pointer to the loop instance
+ * @param threshold_ns stall threshold in nano seconds (0 == disable)
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_watchdog_set(qb_loop_t *l, uint64_t threshold_ns);
+
+/**
+ * Get the worst recorded stalls.
+ *
+ * Records of the same callback (and fd) are merged, the result is sorted
+ * by the longest duration seen, count is the number of times it stalled
+ * and duration is its worst time (both within the recorded window).
+ *
+ * @param l pointer to the loop instance
+ * @param stalls (out) array to fill
+ * @param max size of the stalls array
+ * @return number of entries written (>= 0) or -errno
+ */
+int32_t qb_loop_stalls_get(qb_loop_t *l, struct qb_loop_stall *stalls,
+			   int32_t max);
 
 /**
  * Add a job to the mainloop.
@@ -25,6 +25,7 @@
 #ifndef S_SPLINT_S
 #include <unistd.h>
 #endif /* S_SPLINT_S */
+#include <qb/qbloop.h>
 
 /* *INDENT-OFF* */
 #ifdef __cplusplus
@@ -90,6 +91,18 @@ extern "C" {
  *		    NULL);
  *
  * @endcode
+ *
+ * @par Batched notifications
+ * Normally notifiers are called from within qb_map_put() and
+ * qb_map_rm(). For bulk updates the calls can be queued and delivered
+ * in one go instead, either when you commit or from a qb_loop job:
+ * @code
+ * qb_map_notify_batch_start(m, QB_MAP_BATCH_DEDUP);
+ * for (...) {
+ *     qb_map_put(m, key, value);
+ * }
+ * qb_map_notify_batch_commit(m);
+ * @endcode
  */
 
 /**
@@ -205,6 +218,64 @@ int32_t qb_map_notify_del_2(qb_map_t* m, const char* key,
 			    qb_map_notify_fn fn, int32_t events,
 			    void *user_data);
 
+/**
+ * Fold later changes to a key into the batched notification that is
+ * already queued for it (per notifier), e.g. an insert followed by
+ * replacements is delivered as one insert with the last value and an
+ * insert followed by a delete is not delivered at all.
+ * QB_MAP_NOTIFY_FREE is never folded.
+ */
+#define QB_MAP_BATCH_DEDUP	1
+
+/**
+ * Start queueing notifications instead of calling the notifiers
+ * straight away.
+ *
+ * The queued notifications are delivered in order by
+ * qb_map_notify_batch_flush() or qb_map_notify_batch_commit(), or by
+ * a job if qb_map_notify_batch_loop_set() is used. The keys are
+ * copied, but values are passed on as they are; use a
+ * QB_MAP_NOTIFY_FREE notifier (which is batched too) to free them.
+ *
+ * @param m the map instance
+ * @param flags 0 or QB_MAP_BATCH_DEDUP
+ *
+ * @retval 0 success
+ * @retval -EEXIST already batching
+ */
+int32_t qb_map_notify_batch_start(qb_map_t *m, uint32_t flags);
+
+/**
+ * Deliver batched notifications from a job on a loop.
+ *
+ * A job is added whenever something is queued and delivers the
+ * whole batch, so a loop iteration's worth of changes arrives at once.
+ *
+ * @param m the map instance
+ * @param l the loop (NULL to stop using a job)
+ * @param p the priority of the job
+ *
+ * @retval 0 success
+ * @retval -EINVAL not batching
+ */
+int32_t qb_map_notify_batch_loop_set(qb_map_t *m, qb_loop_t *l,
+				     enum qb_loop_priority p);
+
+/**
+ * Deliver the queued notifications and keep batching.
+ */
+void qb_map_notify_batch_flush(qb_map_t *m);
+
+/**
+ * Deliver the queued notifications and stop batching.
+ *
+ * @note qb_map_destroy() commits a batch before removing the items.
+ *
+ * @retval 0 success
+ * @retval -EINVAL not batching
+ */
+int32_t qb_map_notify_batch_commit(qb_map_t *m);
+
 /**
  * Inserts a new key and value into a qb_map_t.
  *
@@ -275,6 +346,169 @@ void qb_map_iter_free(qb_map_iter_t* i);
  */
 void qb_map_destroy(qb_map_t *map);
 
+#define QB_MAP_STATS_HISTOGRAM_LEN	16
+
+/**
+ * What a map looks like inside, see qb_map_stats_get().
+ */
+struct qb_map_stats {
+	size_t count;		/**< number of items */
+	size_t mem_used;	/**< bytes allocated by the map itself */
+	size_t nodes;		/**< nodes allocated (including inner ones) */
+	size_t slots;		/**< buckets, slots or levels in use */
+	size_t notifiers;	/**< notifiers, on the map and on keys */
+	size_t batched;		/**< notifications waiting in a batch */
+	uint32_t longest;	/**< the largest value in the histogram */
+	/**
+	 * What is counted depends on the map:
+	 * - hashtable: buckets by chain length
+	 * - skiplist: items by level
+	 * - trie: items by depth (nodes looked at to find them)
+	 * - map_u64: items by probe length (slots looked at to find them)
+	 *
+	 * The last entry counts everything that doesn't fit.
+	 */
+	uint32_t histogram[QB_MAP_STATS_HISTOGRAM_LEN];
+};
+
+/**
+ * Get the size and shape of a map.
+ *
+ * This walks the whole map, so it is meant for debugging and tuning
+ * rather than for calling on every operation. Keys and values are not
+ * included in mem_used as the map doesn't own them.
+ *
+ * @param m the map instance
+ * @param stats (out) the statistics
+ *
+ * @retval 0 success
+ * @retval -EINVAL stats is NULL
+ */
+int32_t qb_map_stats_get(qb_map_t *m, struct qb_map_stats *stats);
+
+/**
+ * This is an opaque data type representing a map with integer keys.
+ */
+typedef struct qb_map_u64 qb_map_u64_t;
+
+/**
+ * This is an opaque data type representing an integer map iterator.
+ */
+typedef struct qb_map_u64_iter qb_map_u64_iter_t;
+
+typedef void (*qb_map_u64_notify_fn)(uint32_t event,
+				     uint64_t key,
+				     void* old_value,
+				     void* value,
+				     void* user_data);
+
+/**
+ * Create an unsorted map with uint64_t keys.
+ *
+ * Use this instead of qb_hashtable_create() for node ids, pids,
+ * handles and the like: keys and values are kept in the table itself
+ * (open addressing) so there is no key string to format and no
+ * allocation per item. The table grows as needed.
+ *
+ * @param max_size number of items to size the table for
+ *
+ * @return the map instance
+ */
+qb_map_u64_t* qb_map_u64_create(size_t max_size);
+
+/**
+ * Insert a key and value, replacing the value if the key exists.
+ *
+ * @retval 0 success
+ * @retval -ENOMEM the table couldn't grow
+ * @retval -EBUSY the table would have to grow while an iterator
+ * is in use
+ */
+int32_t qb_map_u64_put(qb_map_u64_t *m, uint64_t key, const void* value);
+
+/**
+ * Gets the value corresponding to the given key.
+ *
+ * @retval NULL (if the key does not exist)
+ * @retval a pointer to the value
+ */
+void* qb_map_u64_get(qb_map_u64_t *m, uint64_t key);
+
+/**
+ * Removes a key/value pair from the map.
+ *
+ * @retval QB_TRUE removed
+ * @retval QB_FALSE no such key
+ */
+int32_t qb_map_u64_rm(qb_map_u64_t *m, uint64_t key);
+
+/**
+ * Get the number of items in the map.
+ */
+size_t qb_map_u64_count_get(qb_map_u64_t *m);
+
+/**
+ * Create an iterator.
+ *
+ * Items may be removed while iterating. Inserting new keys may fail
+ * with -EBUSY until the iterator is freed.
+ */
+qb_map_u64_iter_t* qb_map_u64_iter_create(qb_map_u64_t *m);
+
+/**
+ * Get the next item.
+ *
+ * @param i the iterator
+ * @param key (out) the next item's key
+ * @param value (out) the next item's value (may be NULL)
+ *
+ * @retval QB_TRUE an item was returned
+ * @retval QB_FALSE the end of the iteration
+ */
+int32_t qb_map_u64_iter_next(qb_map_u64_iter_t *i, uint64_t *key,
+			     void** value);
+
+/**
+ * Free the iterator.
+ */
+void qb_map_u64_iter_free(qb_map_u64_iter_t *i);
+
+/**
+ * Add a notifier to the map.
+ *
+ * Notifiers are called for all the keys in the map, with the same
+ * events as qb_map_notify_add() (QB_MAP_NOTIFY_INSERTED is supported).
+ *
+ * @retval 0 success
+ * @retval -errno failure
+ */
+int32_t qb_map_u64_notify_add(qb_map_u64_t *m, qb_map_u64_notify_fn fn,
+			      int32_t events, void *user_data);
+
+/**
+ * Delete a notifier from the map.
+ *
+ * @note the fn, events and user_data must match those you added.
+ *
+ * @retval 0 success
+ * @retval -ENOENT no such notifier
+ */
+int32_t qb_map_u64_notify_del(qb_map_u64_t *m, qb_map_u64_notify_fn fn,
+			      int32_t events, void *user_data);
+
+/**
+ * Get the size and shape of the map, see qb_map_stats_get().
+ *
+ * @retval 0 success
+ * @retval -EINVAL stats is NULL
+ */
+int32_t qb_map_u64_stats_get(qb_map_u64_t *m, struct qb_map_stats *stats);
+
+/**
+ * Destroy the map, removes all the items from the map.
+ */
+void qb_map_u64_destroy(qb_map_u64_t *m);
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
@@ -106,6 +106,17 @@ extern "C" {
  */
 #define QB_RB_FLAG_NO_SEMAPHORE		0x10
 
+/**
+ * Map an existing ring buffer read only, to look at it from the outside.
+ *
+ * The ring isn't referenced and nothing in it is changed, so the owner
+ * carries on as if we weren't there. Only qb_rb_position_get(),
+ * qb_rb_chunk_copy_at() and the query functions can be used, and name
+ * can also be the path of the header file.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_READ_ONLY		0x20
+
 struct qb_ringbuffer_s;
 typedef struct qb_ringbuffer_s qb_ringbuffer_t;
 
@@ -190,6 +201,35 @@ void *qb_rb_chunk_alloc(qb_ringbuffer_t * rb, size_t len);
  */
 int32_t qb_rb_chunk_commit(qb_ringbuffer_t * rb, size_t len);
 
+/**
+ * Grow or shrink the ring buffer while it is in use.
+ *
+ * The writer moves to a new ring of the given size (named after the
+ * original with a "-r<generation>" suffix) and leaves a marker chunk
+ * behind it in the old one. Once the reader has read everything before
+ * the marker, qb_rb_chunk_read() or qb_rb_chunk_peek() switches it to
+ * the new ring, the marker itself is never returned. The shared user
+ * data, owner and permissions are carried over.
+ *
+ * This is called on the writer's side, which has to be the one that
+ * created the ring. Whoever opens the ring by name afterwards starts
+ * in the oldest ring that hasn't been left yet and follows the
+ * markers from there.
+ *
+ * @param rb ringbuffer instance
+ * @param size the new size, as passed to qb_rb_open()
+ * @retval 0 done (or the ring already is that size)
+ * @retval -EAGAIN no room for the marker, try again once something
+ * has been read
+ * @retval -EPERM rb wasn't created with QB_RB_FLAG_CREATE
+ * @retval -ENOTSUP QB_RB_FLAG_OVERWRITE rings can't be resized
+ *
+ * @note a reader linked against an older libqb doesn't know the
+ * marker and gets -EBADMSG, and a QB_RB_FLAG_READ_ONLY observer stops
+ * at it the same way.
+ */
+int32_t qb_rb_resize(qb_ringbuffer_t * rb, size_t size);
+
 /**
  * Read (without reclaiming) the last chunk.
  *
@@ -259,6 +299,63 @@ ssize_t qb_rb_space_used(qb_ringbuffer_t * rb);
  */
 ssize_t qb_rb_chunks_used(qb_ringbuffer_t * rb);
 
+/**
+ * Get the current read and write positions.
+ *
+ * The positions are word offsets into the ring, only useful to pass
+ * to qb_rb_chunk_copy_at().
+ *
+ * @param rb ringbuffer instance
+ * @param read_pos (out) position of the oldest chunk (may be NULL)
+ * @param write_pos (out) position the next chunk will be written at
+ * (may be NULL)
+ * @return 0 or -errno
+ */
+int32_t qb_rb_position_get(qb_ringbuffer_t * rb, uint32_t *read_pos,
+			   uint32_t *write_pos);
+
+/**
+ * Copy the chunk at a position without consuming it.
+ *
+ * This is for following a ring from the outside (see
+ * QB_RB_FLAG_READ_ONLY): start at the read position and carry on
+ * from next_pos. The chunk header is checked before and after the
+ * copy, but if the writer can overwrite the ring a stale position may
+ * still land on a newer chunk, so the caller needs its own sequence
+ * numbers to detect being lapped.
+ *
+ * @param rb ringbuffer instance
+ * @param pos position of the chunk
+ * @param data_out (out) where to copy the chunk to, or NULL to only
+ * step over it
+ * @param len size of data_out
+ * @param next_pos (out) position of the next chunk (may be NULL)
+ * @retval >=0 the size of the chunk
+ * @retval -EAGAIN pos is the write position, no chunk there yet
+ * @retval -EBADMSG there isn't a valid chunk at pos (any more)
+ * @retval -ENOBUFS len is too small
+ */
+ssize_t qb_rb_chunk_copy_at(qb_ringbuffer_t * rb, uint32_t pos,
+			    void *data_out, size_t len, uint32_t *next_pos);
+
+/**
+ * Set the chunk size above which copies bypass the cache.
+ *
+ * qb_rb_chunk_write() (and shared memory IPC) writes chunks of at
+ * least this size with non-temporal stores, so a large message doesn't
+ * push the writer's own data out of its cache. qb_rb_chunk_read() and
+ * qb_rb_chunk_copy_at() prefetch such chunks ahead of the copy. The
+ * store instructions are picked at run time from what the CPU
+ * supports. This applies to every ring buffer in the process.
+ *
+ * @param size threshold in bytes (1MiB by default), 0 to always
+ * use memcpy()
+ * @retval 0 success
+ * @retval -ENOTSUP no streaming stores on this CPU, only the reads
+ * use the threshold
+ */
+int32_t qb_rb_copy_threshold_set(size_t size);
+
 /**
  * Write the contents of the Ring Buffer to file.
  * @param fd open file to write the ringbuffer data to.
@@ -105,6 +105,46 @@ extern "C" {
  * qb_util_stopwatch_free(sw);
  * @endcode
  *
+ * @par Published statistics
+ * A process can publish the counters of its ipc services, loops,
+ * logging and ring buffers in a shared memory file, so other processes
+ * can look at them without asking it. The daemon publishes and
+ * refreshes the records on a timer of its own choosing:
+ *
+ * @code
+ * static void
+ * stats_refresh(void *data)
+ * {
+ *      qb_stats_refresh();
+ *      qb_loop_timer_add(l, QB_LOOP_LOW, QB_TIME_NS_IN_SEC, NULL,
+ *                        stats_refresh, &stats_timer);
+ * }
+ *
+ * qb_stats_publish("mydaemon");
+ * stats_refresh(NULL);
+ * @endcode
+ *
+ * A reader, like the qb-stat tool, walks the records with
+ * qb_stats_open(), qb_stats_read() and qb_stats_close().
+ *
+ * @par Memory allocation
+ * The memory libqb uses for its own bookkeeping (loop jobs and timers,
+ * log thread records, map nodes, handle databases, ipc connections and
+ * their buffers) comes from an allocator that can be replaced with
+ * qb_util_allocator_set(). qb_util_pool_create() makes one that keeps
+ * freed blocks in power of two size classes for reuse:
+ *
+ * @code
+ * qb_util_allocator_set(qb_util_pool_create());
+ * qb_log_init("mydaemon", LOG_DAEMON, LOG_INFO);
+ * @endcode
+ *
+ * Memory libqb hands to the application to free, like the result of
+ * qb_ipcs_connection_stats_get_2(), still comes from malloc().
+ *
+ * qb_util_alloc_counting_set() and qb_util_alloc_count_get() count the
+ * allocations libqb makes, tests use them to check that a path doesn't
+ * allocate.
  */
 
 /**
@@ -289,6 +329,144 @@ uint64_t
 qb_util_stopwatch_time_split_get(qb_util_stopwatch_t *sw,
 				 uint32_t receint, uint32_t older);
 
+#define QB_STATS_NAME_MAX 48
+#define QB_STATS_LABEL_MAX 24
+#define QB_STATS_VALUES_MAX 16
+
+/**
+ * One published record, e.g. the counters of an ipc service.
+ */
+struct qb_stats_values {
+	char name[QB_STATS_NAME_MAX];
+	uint32_t count;
+	char labels[QB_STATS_VALUES_MAX][QB_STATS_LABEL_MAX];
+	uint64_t values[QB_STATS_VALUES_MAX];
+};
+
+typedef struct qb_stats_region qb_stats_region_t;
+
+/**
+ * Start publishing this process's statistics.
+ *
+ * The records live in a file called "qb-stats-<name>" next to the
+ * ring buffers (/dev/shm on Linux). Nothing is published until this
+ * is called and nothing is updated until qb_stats_refresh() is.
+ *
+ * @param name what readers pass to qb_stats_open()
+ * @return 0 (success), -EEXIST (already published) or -errno
+ */
+int32_t qb_stats_publish(const char *name);
+
+/**
+ * Stop publishing and remove the file.
+ */
+void qb_stats_withdraw(void);
+
+/**
+ * Copy the current counters into the published records.
+ *
+ * Each record is written under a sequence lock, readers never block
+ * the process and never see a half written record.
+ *
+ * @note The counters are read without taking the locks of the
+ * subsystems they belong to. Call this from the thread running the
+ * loop the ipc services are on.
+ */
+void qb_stats_refresh(void);
+
+/**
+ * Attach to the statistics another process publishes.
+ *
+ * @param name the name it passed to qb_stats_publish(), or a path
+ * @return the region, NULL with errno set on error
+ */
+qb_stats_region_t *qb_stats_open(const char *name);
+
+/**
+ * Read one record.
+ *
+ * @param r the region
+ * @param index the record, starting at 0
+ * @param v (out) a consistent copy of the record
+ * @return 0 (success), -ENOENT (no record at this index),
+ *         -ERANGE (past the last index) or -EAGAIN (kept changing)
+ */
+int32_t qb_stats_read(qb_stats_region_t *r, uint32_t index,
+		      struct qb_stats_values *v);
+
+/**
+ * The pid of the publishing process.
+ */
+pid_t qb_stats_pid_get(qb_stats_region_t *r);
+
+/**
+ * When the records were last refreshed, in nano seconds since epoch.
+ */
+uint64_t qb_stats_refreshed_get(qb_stats_region_t *r);
+
+/**
+ * Detach from the region.
+ */
+void qb_stats_close(qb_stats_region_t *r);
+
+/**
+ * Where libqb gets its memory from.
+ *
+ * All three functions are required, they behave like malloc(),
+ * realloc() and free() and are passed data as the first argument.
+ */
+struct qb_allocator {
+	void *(*malloc_fn)(void *data, size_t size);
+	void *(*realloc_fn)(void *data, void *ptr, size_t size);
+	void (*free_fn)(void *data, void *ptr);
+	void *data;
+};
+
+/**
+ * Replace the allocator libqb uses.
+ *
+ * @note Memory is freed with the allocator in use at the time, so
+ * call this before anything else in libqb, and don't change it while
+ * libqb objects exist.
+ *
+ * @param a the allocator (copied), NULL to go back to malloc()
+ * @return 0 (success) or -EINVAL
+ */
+int32_t qb_util_allocator_set(const struct qb_allocator *a);
+
+/**
+ * Create a size class pool allocator.
+ *
+ * Blocks of up to 4096 bytes are kept on a free list for their size
+ * class when they are freed and handed out again, bigger ones go to
+ * malloc(). Cached blocks are only given back by
+ * qb_util_pool_destroy(). The pool is thread safe.
+ *
+ * @return the allocator to pass to qb_util_allocator_set(), NULL
+ *         with errno set on error
+ */
+struct qb_allocator *qb_util_pool_create(void);
+
+/**
+ * Destroy a pool and the blocks it has cached.
+ *
+ * @note None of its blocks may be in use any more.
+ */
+void qb_util_pool_destroy(struct qb_allocator *a);
+
+/**
+ * Start (and zero) or stop counting libqb's allocations.
+ */
+void qb_util_alloc_counting_set(int32_t enabled);
+
+/**
+ * Get the number of allocations and frees since counting started.
+ *
+ * @param allocs (out) malloc, calloc and realloc calls
+ * @param frees (out) free calls
+ */
+void qb_util_alloc_count_get(int32_t *allocs, int32_t *frees);
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
@@ -26,6 +26,7 @@
 #include <qb/qbdefs.h>
 #include <qb/qbutil.h>
 #include <qb/qblist.h>
+#include "probes.h"
 
 #ifndef TIMER_HANDLE
 typedef void *timer_handle;
@@ -84,8 +85,7 @@ static inline int32_t timerlist_add_duration(struct timerlist *timerlist,
 {
 	struct timerlist_timer *timer;
 
-	timer =
-	    (struct timerlist_timer *)malloc(sizeof(struct timerlist_timer));
+	timer = qb_util_malloc(sizeof(struct timerlist_timer));
 	if (timer == 0) {
 		return -ENOMEM;
 	}
@@ -109,7 +109,7 @@ static inline void timerlist_del(struct timerlist *timerlist,
 	memset(timer->handle_addr, 0, sizeof(struct timerlist_timer *));
 	qb_list_del(&timer->list);
 	qb_list_init(&timer->list);
-	free(timer);
+	qb_util_free(timer);
 }
 
 static inline uint64_t timerlist_expire_time(struct timerlist
@@ -137,7 +137,7 @@ static inline void timerlist_post_dispatch(struct timerlist *timerlist,
 {
 	struct timerlist_timer *timer = (struct timerlist_timer *)_timer_handle;
 
-	free(timer);
+	qb_util_free(timer);
 }
 
 /*
@@ -206,6 +206,8 @@ static inline void timerlist_expire(struct timerlist *timerlist)
 		if (timer_from_list->expire_time < current_time) {
 
 			timerlist_pre_dispatch(timerlist, timer_from_list);
+			QB_PROBE3(timer__expire, timer_from_list->data,
+				  timer_from_list->expire_time, current_time);
 
 			timer_from_list->timer_fn(timer_from_list->data);
 
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <pthread.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qbatomic.h>
+#include "util_int.h"
+
+static void *
+_libc_malloc(void *data, size_t size)
+{
+	return malloc(size);
+}
+
+static void *
+_libc_realloc(void *data, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void
+_libc_free(void *data, void *ptr)
+{
+	free(ptr);
+}
+
+static struct qb_allocator allocator = {
+	.malloc_fn = _libc_malloc,
+	.realloc_fn = _libc_realloc,
+	.free_fn = _libc_free,
+	.data = NULL,
+};
+
+static int32_t counting = QB_FALSE;
+static int32_t count_allocs = 0;
+static int32_t count_frees = 0;
+
+int32_t
+qb_util_allocator_set(const struct qb_allocator *a)
+{
+	if (a == NULL) {
+		allocator.malloc_fn = _libc_malloc;
+		allocator.realloc_fn = _libc_realloc;
+		allocator.free_fn = _libc_free;
+		allocator.data = NULL;
+		return 0;
+	}
+	if (a->malloc_fn == NULL || a->realloc_fn == NULL ||
+	    a->free_fn == NULL) {
+		return -EINVAL;
+	}
+	memcpy(&allocator, a, sizeof(struct qb_allocator));
+	return 0;
+}
+
+void
+qb_util_alloc_counting_set(int32_t enabled)
+{
+	qb_atomic_int_set(&count_allocs, 0);
+	qb_atomic_int_set(&count_frees, 0);
+	qb_atomic_int_set(&counting, enabled);
+}
+
+void
+qb_util_alloc_count_get(int32_t *allocs, int32_t *frees)
+{
+	*allocs = qb_atomic_int_get(&count_allocs);
+	*frees = qb_atomic_int_get(&count_frees);
+}
+
+void *
+qb_util_malloc(size_t size)
+{
+	void *p;
+
+	if (counting) {
+		qb_atomic_int_inc(&count_allocs);
+	}
+	p = allocator.malloc_fn(allocator.data, size);
+	if (p == NULL) {
+		errno = ENOMEM;
+	}
+	return p;
+}
+
+void *
+qb_util_calloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p = qb_util_malloc(nmemb * size);
+	if (p) {
+		memset(p, 0, nmemb * size);
+	}
+	return p;
+}
+
+void *
+qb_util_realloc(void *ptr, size_t size)
+{
+	void *p;
+
+	if (counting) {
+		qb_atomic_int_inc(&count_allocs);
+	}
+	p = allocator.realloc_fn(allocator.data, ptr, size);
+	if (p == NULL && size > 0) {
+		errno = ENOMEM;
+	}
+	return p;
+}
+
+void
+qb_util_free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (counting) {
+		qb_atomic_int_inc(&count_frees);
+	}
+	allocator.free_fn(allocator.data, ptr);
+}
+
+/*
+ * Size class pool.
+ *
+ * Blocks up to QB_POOL_SIZE_MAX are rounded up to a power of two and
+ * kept on a per class free list when they are freed, bigger ones go
+ * straight to malloc. Each block has a small header in front that
+ * remembers its class.
+ */
+#define QB_POOL_CLASS_MIN_SHIFT 4
+#define QB_POOL_CLASSES 9
+#define QB_POOL_SIZE_MAX (1 << (QB_POOL_CLASS_MIN_SHIFT + QB_POOL_CLASSES - 1))
+#define QB_POOL_LARGE QB_POOL_CLASSES
+
+union qb_pool_block {
+	/* keeps the data that follows aligned for anything */
+	long double align;
+	struct {
+		uint32_t size_class;
+		union qb_pool_block *next;
+	} h;
+};
+
+struct qb_pool_class {
+	pthread_mutex_t lock;
+	union qb_pool_block *free_list;
+};
+
+struct qb_pool {
+	struct qb_allocator allocator;
+	struct qb_pool_class classes[QB_POOL_CLASSES];
+};
+
+static uint32_t
+_pool_class_get(size_t size)
+{
+	uint32_t c = 0;
+	size_t class_size = 1 << QB_POOL_CLASS_MIN_SHIFT;
+
+	if (size > QB_POOL_SIZE_MAX) {
+		return QB_POOL_LARGE;
+	}
+	while (class_size < size) {
+		class_size <<= 1;
+		c++;
+	}
+	return c;
+}
+
+static size_t
+_pool_class_size(uint32_t c)
+{
+	return (size_t)1 << (c + QB_POOL_CLASS_MIN_SHIFT);
+}
+
+static void *
+_pool_malloc(void *data, size_t size)
+{
+	struct qb_pool *pool = data;
+	struct qb_pool_class *pc;
+	union qb_pool_block *b = NULL;
+	uint32_t c = _pool_class_get(size);
+
+	if (c != QB_POOL_LARGE) {
+		pc = &pool->classes[c];
+		(void)pthread_mutex_lock(&pc->lock);
+		b = pc->free_list;
+		if (b) {
+			pc->free_list = b->h.next;
+		}
+		(void)pthread_mutex_unlock(&pc->lock);
+		size = _pool_class_size(c);
+	}
+	if (b == NULL) {
+		b = malloc(sizeof(union qb_pool_block) + size);
+		if (b == NULL) {
+			return NULL;
+		}
+	}
+	b->h.size_class = c;
+	b->h.next = NULL;
+	return b + 1;
+}
+
+static void
+_pool_free(void *data, void *ptr)
+{
+	struct qb_pool *pool = data;
+	struct qb_pool_class *pc;
+	union qb_pool_block *b;
+
+	if (ptr == NULL) {
+		return;
+	}
+	b = (union qb_pool_block *)ptr - 1;
+	if (b->h.size_class == QB_POOL_LARGE) {
+		free(b);
+		return;
+	}
+	pc = &pool->classes[b->h.size_class];
+	(void)pthread_mutex_lock(&pc->lock);
+	b->h.next = pc->free_list;
+	pc->free_list = b;
+	(void)pthread_mutex_unlock(&pc->lock);
+}
+
+static void *
+_pool_realloc(void *data, void *ptr, size_t size)
+{
+	union qb_pool_block *b;
+	size_t old_size;
+	void *p;
+
+	if (ptr == NULL) {
+		return _pool_malloc(data, size);
+	}
+	b = (union qb_pool_block *)ptr - 1;
+	if (b->h.size_class == QB_POOL_LARGE) {
+		if (_pool_class_get(size) == QB_POOL_LARGE) {
+			b = realloc(b, sizeof(union qb_pool_block) + size);
+			return b ? b + 1 : NULL;
+		}
+		old_size = QB_POOL_SIZE_MAX;
+	} else {
+		old_size = _pool_class_size(b->h.size_class);
+		if (size <= old_size && _pool_class_get(size) == b->h.size_class) {
+			return ptr;
+		}
+	}
+	p = _pool_malloc(data, size);
+	if (p == NULL) {
+		return NULL;
+	}
+	memcpy(p, ptr, QB_MIN(old_size, size));
+	_pool_free(data, ptr);
+	return p;
+}
+
+struct qb_allocator *
+qb_util_pool_create(void)
+{
+	struct qb_pool *pool;
+	uint32_t c;
+
+	pool = calloc(1, sizeof(struct qb_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	for (c = 0; c < QB_POOL_CLASSES; c++) {
+		(void)pthread_mutex_init(&pool->classes[c].lock, NULL);
+	}
+	pool->allocator.malloc_fn = _pool_malloc;
+	pool->allocator.realloc_fn = _pool_realloc;
+	pool->allocator.free_fn = _pool_free;
+	pool->allocator.data = pool;
+	return &pool->allocator;
+}
+
+void
+qb_util_pool_destroy(struct qb_allocator *a)
+{
+	struct qb_pool *pool;
+	union qb_pool_block *b;
+	uint32_t c;
+
+	if (a == NULL) {
+		return;
+	}
+	pool = a->data;
+	for (c = 0; c < QB_POOL_CLASSES; c++) {
+		while (pool->classes[c].free_list) {
+			b = pool->classes[c].free_list;
+			pool->classes[c].free_list = b->h.next;
+			free(b);
+		}
+		(void)pthread_mutex_destroy(&pool->classes[c].lock);
+	}
+	free(pool);
+}
@@ -22,6 +22,7 @@
 
 #include <qb/qbarray.h>
 #include <qb/qbutil.h>
+#include "util_int.h"
 
 #define MAX_ELEMENTS_PER_BIN 16
 #define MAX_BINS 4096
@@ -50,7 +51,7 @@ _grow_bin_array(struct qb_array * a, int32_t new_bin_size)
 {
 	int32_t b;
 
-	a->bin = realloc(a->bin, sizeof(void*) * new_bin_size);
+	a->bin = qb_util_realloc(a->bin, sizeof(void*) * new_bin_size);
 	if (a->bin == NULL) {
 		return -ENOMEM;
 	}
@@ -81,7 +82,7 @@ qb_array_create_2(size_t max_elements, size_t element_size,
 		errno = -EINVAL;
 		return NULL;
 	}
-	a = calloc(1, sizeof(struct qb_array));
+	a = qb_util_calloc(1, sizeof(struct qb_array));
 	if (a == NULL) {
 		return NULL;
 	}
@@ -91,7 +92,7 @@ qb_array_create_2(size_t max_elements, size_t element_size,
 	a->autogrow_elements = autogrow_elements;
 	a->bin = NULL;
 	if (_grow_bin_array(a, b) < 0) {
-		free(a);
+		qb_util_free(a);
 		return NULL;
 	}
 	a->grow_lock = qb_thread_lock_create(QB_THREAD_LOCK_SHORT);
@@ -137,7 +138,7 @@ qb_array_index(struct qb_array * a, int32_t idx, void **element_out)
 			}
 		}
 		if (a->bin[b] == NULL) {
-			a->bin[b] = calloc(MAX_ELEMENTS_PER_BIN, a->element_size);
+			a->bin[b] = qb_util_calloc(MAX_ELEMENTS_PER_BIN, a->element_size);
 			if (a->bin[b] == NULL) {
 				rc = -errno;
 				goto unlock_error;
@@ -222,9 +223,9 @@ qb_array_free(struct qb_array *a)
 {
 	int32_t i;
 	for (i = 0; i < a->num_bins; i++) {
-		free(a->bin[i]);
+		qb_util_free(a->bin[i]);
 	}
-	free(a->bin);
+	qb_util_free(a->bin);
 	(void)qb_thread_lock_destroy(a->grow_lock);
-	free(a);
+	qb_util_free(a);
 }
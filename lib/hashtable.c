@@ -131,11 +131,11 @@ hashtable_node_destroy(struct hash_table *t, struct hash_node *hash_node)
 	qb_list_for_each_safe(pos, next, &hash_node->notifier_head) {
 		tn = qb_list_entry(pos, struct qb_map_notifier, list);
 		qb_list_del(&tn->list);
-		free(tn);
+		qb_util_free(tn);
 	}
 
 	qb_list_del(&hash_node->list);
-	free(hash_node);
+	qb_util_free(hash_node);
 }
 
 static void
@@ -203,7 +203,7 @@ hashtable_put(struct qb_map *map, const char *key, const void *value)
 	}
 
 	if (hash_node == NULL) {
-		hash_node = calloc(1, sizeof(struct hash_node));
+		hash_node = qb_util_calloc(1, sizeof(struct hash_node));
 		if (hash_node == NULL) {
 			errno = ENOMEM;
 			return;
@@ -246,22 +246,22 @@ hashtable_notify(struct hash_table *t, struct hash_node *n,
 		tn = qb_list_entry(list, struct qb_map_notifier, list);
 
 		if (tn->events & event) {
-			tn->callback(event, (char *)key, old_value, value,
-				     tn->user_data);
+			qb_map_notifier_call(&t->map, tn, event, key,
+					     old_value, value);
 		}
 	}
 	qb_list_for_each(list, &t->notifier_head) {
 		tn = qb_list_entry(list, struct qb_map_notifier, list);
 
 		if (tn->events & event) {
-			tn->callback(event, (char *)key, old_value, value,
-				     tn->user_data);
+			qb_map_notifier_call(&t->map, tn, event, key,
+					     old_value, value);
 		}
 		if (((event & QB_MAP_NOTIFY_DELETED) ||
 		     (event & QB_MAP_NOTIFY_REPLACED)) &&
 		    (tn->events & QB_MAP_NOTIFY_FREE)) {
-			tn->callback(QB_MAP_NOTIFY_FREE, (char *)key,
-				     old_value, value, tn->user_data);
+			qb_map_notifier_call(&t->map, tn, QB_MAP_NOTIFY_FREE,
+					     key, old_value, value);
 		}
 	}
 }
@@ -307,7 +307,7 @@ hashtable_notify_add(qb_map_t * m, const char *key,
 		}
 	}
 
-	f = malloc(sizeof(struct qb_map_notifier));
+	f = qb_util_malloc(sizeof(struct qb_map_notifier));
 	if (f == NULL) {
 		return -errno;
 	}
@@ -356,11 +356,11 @@ hashtable_notify_del(qb_map_t * m, const char *key,
 			if (cmp_userdata && (f->user_data == user_data)) {
 				found = QB_TRUE;
 				qb_list_del(&f->list);
-				free(f);
+				qb_util_free(f);
 			} else if (!cmp_userdata) {
 				found = QB_TRUE;
 				qb_list_del(&f->list);
-				free(f);
+				qb_util_free(f);
 			}
 		}
 	}
@@ -381,7 +381,7 @@ hashtable_count_get(struct qb_map *map)
 static qb_map_iter_t *
 hashtable_iter_create(struct qb_map *map, const char *prefix)
 {
-	struct hashtable_iter *i = malloc(sizeof(struct hashtable_iter));
+	struct hashtable_iter *i = qb_util_malloc(sizeof(struct hashtable_iter));
 	if (i == NULL) {
 		return NULL;
 	}
@@ -435,10 +435,39 @@ hashtable_iter_next(qb_map_iter_t * it, void **value)
 	return hash_node->key;
 }
 
+static void
+hashtable_stats_get(struct qb_map *map, struct qb_map_stats *stats)
+{
+	struct hash_table *t = (struct hash_table *)map;
+	struct hash_node *n;
+	struct qb_list_head *list;
+	uint32_t len;
+	uint32_t b;
+
+	stats->count = t->count;
+	stats->slots = t->hash_buckets_len;
+	stats->notifiers = qb_map_notifiers_count(&t->notifier_head);
+	for (b = 0; b < t->hash_buckets_len; b++) {
+		len = 0;
+		qb_list_for_each(list, &t->hash_buckets[b].list_head) {
+			n = qb_list_entry(list, struct hash_node, list);
+			stats->notifiers +=
+				qb_map_notifiers_count(&n->notifier_head);
+			len++;
+		}
+		stats->nodes += len;
+		qb_map_stats_histogram_add(stats, len);
+	}
+	stats->mem_used = sizeof(struct hash_table) +
+		t->hash_buckets_len * sizeof(struct hash_bucket) +
+		stats->nodes * sizeof(struct hash_node) +
+		stats->notifiers * sizeof(struct qb_map_notifier);
+}
+
 static void
 hashtable_iter_free(qb_map_iter_t * i)
 {
-	free(i);
+	qb_util_free(i);
 }
 
 static void
@@ -457,10 +486,10 @@ hashtable_destroy(struct qb_map *map)
 	qb_list_for_each_safe(pos, next, &hash_table->notifier_head) {
 		tn = qb_list_entry(pos, struct qb_map_notifier, list);
 		qb_list_del(&tn->list);
-		free(tn);
+		qb_util_free(tn);
 	}
 
-	free(hash_table);
+	qb_util_free(hash_table);
 }
 
 static void
@@ -496,7 +525,7 @@ qb_hashtable_create(size_t max_size)
 	size = sizeof(struct hash_table) +
 	    (sizeof(struct hash_bucket) * (1 << order));
 
-	ht = calloc(1, size);
+	ht = qb_util_calloc(1, size);
 	if (ht == NULL) {
 		return NULL;
 	}
@@ -511,6 +540,8 @@ qb_hashtable_create(size_t max_size)
 	ht->map.destroy = hashtable_destroy;
 	ht->map.notify_add = hashtable_notify_add;
 	ht->map.notify_del = hashtable_notify_del;
+	ht->map.stats_get = hashtable_stats_get;
+	ht->map.batch = NULL;
 	ht->count = 0;
 	ht->order = order;
 	qb_list_init(&ht->notifier_head);
@@ -22,6 +22,7 @@
 
 #include <qb/qbhdb.h>
 #include <qb/qbatomic.h>
+#include "util_int.h"
 
 enum QB_HDB_HANDLE_STATE {
 	QB_HDB_HANDLE_STATE_EMPTY,
@@ -92,7 +93,7 @@ qb_hdb_handle_create(struct qb_hdb *hdb, int32_t instance_size,
 		qb_atomic_int_inc((int32_t *)&hdb->handle_count);
 	}
 
-	instance = malloc(instance_size);
+	instance = qb_util_malloc(instance_size);
 	if (instance == 0) {
 		return -ENOMEM;
 	}
@@ -184,7 +185,7 @@ qb_hdb_handle_put(struct qb_hdb * hdb, qb_handle_t handle_in)
 		if (hdb->destructor) {
 			hdb->destructor(entry->instance);
 		}
-		free(entry->instance);
+		qb_util_free(entry->instance);
 		memset(entry, 0, sizeof(struct qb_hdb_handle));
 	}
 	return (0);
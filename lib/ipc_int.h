@@ -25,6 +25,7 @@
 #include "os_base.h"
 
 #include <dirent.h>
+#include <pthread.h>
 #include <qb/qblist.h>
 #include <qb/qbloop.h>
 #include <qb/qbipcc.h>
@@ -34,6 +35,9 @@
 
 #define QB_IPC_MAX_WAIT_MS 2000
 
+/* size of the per connection priority request ring */
+#define QB_IPC_CONTROL_MSG_SIZE (8 * 1024)
+
 /*
 Client		Server
 SEND CONN REQ ->
@@ -42,9 +46,28 @@ SEND CONN REQ ->
 	<-	SEND ACCEPT(with details)/DENY
 */
 
+/* the client follows rings the server resizes (qb_rb_resize()) */
+#define QB_IPC_CONNECTION_FOLLOWS_RESIZE 0x01
+/*
+ * the client can pass large requests in a memfd, the server echoes
+ * it when it takes them (see qb_ipc_connection_response)
+ */
+#define QB_IPC_CONNECTION_LARGE_MSG 0x02
+/*
+ * the client tags its requests and the server echoes the tag in the
+ * response, so a shared connection can match answers that come back
+ * out of order (see qb_ipc_tag_get())
+ */
+#define QB_IPC_CONNECTION_REQUEST_TAGS 0x04
+
+/* memfds a server holds for requests it hasn't got to yet */
+#define QB_IPC_LARGE_FDS_MAX 64
+
 struct qb_ipc_connection_request {
 	struct qb_ipc_request_header hdr;
 	uint32_t max_msg_size;
+	/* in what used to be padding, older clients leave it zeroed */
+	uint32_t flags;
 } __attribute__ ((aligned(8)));
 
 struct qb_ipc_event_connection_request {
@@ -52,6 +75,16 @@ struct qb_ipc_event_connection_request {
 	intptr_t connection;
 } __attribute__ ((aligned(8)));
 
+/*
+ * Goes on the request ring in place of a message that is too big for
+ * it, the message itself is in a sealed memfd passed over the setup
+ * socket along with the notification byte.
+ */
+struct qb_ipc_large_request {
+	struct qb_ipc_request_header hdr;
+	uint64_t size;
+} __attribute__ ((aligned(8)));
+
 struct qb_ipc_connection_response {
 	struct qb_ipc_response_header hdr;
 	int32_t connection_type;
@@ -62,6 +95,25 @@ struct qb_ipc_connection_response {
 	char event[PATH_MAX];
 } __attribute__ ((aligned(8)));
 
+/*
+ * The QB_IPC_CONNECTION_* flags the server took up go in the last
+ * bytes of the event ring name, which older servers leave zeroed too.
+ */
+#define QB_IPC_SERVER_FLAGS_OFFSET (PATH_MAX - sizeof(uint32_t))
+
+void qb_ipc_server_flags_add(struct qb_ipc_connection_response *r,
+			     uint32_t flags);
+uint32_t qb_ipc_server_flags_get(struct qb_ipc_connection_response *r);
+
+/*
+ * A request tag lives in the padding after the id of the request and
+ * response headers, 0 means untagged.
+ */
+uint32_t qb_ipc_tag_get(const void *hdr);
+size_t qb_ipc_iov_tag(const struct iovec *iov, size_t iov_len,
+		      void *hdr, size_t hdr_size, uint32_t tag,
+		      struct iovec *out);
+
 struct qb_ipcc_connection;
 
 struct qb_ipc_one_way {
@@ -86,6 +138,7 @@ struct qb_ipcc_funcs {
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec *iov, size_t iov_len);
 	void (*disconnect)(struct qb_ipcc_connection* c);
 	int32_t (*fc_get)(struct qb_ipc_one_way *one_way);
+	void (*fc_set)(struct qb_ipc_one_way *one_way, int32_t fc_enable);
 };
 
 struct qb_ipcc_connection {
@@ -95,17 +148,53 @@ struct qb_ipcc_connection {
 	struct qb_ipc_one_way request;
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
+	struct qb_ipc_one_way control;
 	struct qb_ipcc_funcs funcs;
 	struct qb_ipc_request_header *receive_buf;
 	uint32_t fc_enable_max;
+	/* large messages passed by memfd, 0 == off */
+	int32_t large_msg_supported;
+	size_t large_msg_threshold;
+	/* the server echoes request tags */
+	int32_t request_tags;
 	int32_t is_connected;
 	void * context;
+	/* shared by several threads, see qb_ipcc_thread_safe_set() */
+	int32_t thread_safe;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t recv_lock;
+	uint64_t send_seq;
+	uint64_t recv_seq;
+	int32_t receiving;
+	struct qb_list_head waiters;
+};
+
+/*
+ * A thread blocked in qb_ipcc_sendv_recv() on a thread safe connection.
+ * When both ends do request tags the server echoes tag in the response
+ * header and that is what picks the waiter, whatever order the
+ * responses come in. Only with a server that doesn't (tag is 0) is the
+ * seq'th response on the ring taken to be this thread's.
+ */
+struct qb_ipcc_waiter {
+	struct qb_list_head list;
+	uint64_t seq;
+	uint32_t tag;
+	void *res_msg;
+	size_t res_len;
+	ssize_t res;
+	int32_t done;
+	pthread_cond_t cond;
 };
 
 int32_t qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 				   struct qb_ipc_connection_response *r);
 ssize_t qb_ipc_us_send(struct qb_ipc_one_way *one_way, const void *msg, size_t len);
 ssize_t qb_ipc_us_recv(struct qb_ipc_one_way *one_way, void *msg, size_t len, int32_t timeout);
+ssize_t qb_ipc_us_send_fd(struct qb_ipc_one_way *one_way, const void *msg,
+			  size_t len, int32_t fd);
+ssize_t qb_ipc_us_recv_fd(struct qb_ipc_one_way *one_way, void *msg,
+			  size_t len, int32_t *fd_out);
 int32_t qb_ipc_us_ready(struct qb_ipc_one_way *ow_data, struct qb_ipc_one_way *ow_conn,
 			int32_t ms_timeout, int32_t events);
 
@@ -118,6 +207,9 @@ struct qb_ipcs_service;
 struct qb_ipcs_connection;
 
 struct qb_ipcs_funcs {
+	/* the part of connect that may run off the loop thread */
+	int32_t (*prepare)(struct qb_ipcs_service *s, struct qb_ipcs_connection *c,
+		struct qb_ipc_connection_response *r);
 	int32_t (*connect)(struct qb_ipcs_service *s, struct qb_ipcs_connection *c,
 		struct qb_ipc_connection_response *r);
 	void (*disconnect)(struct qb_ipcs_connection *c);
@@ -128,6 +220,34 @@ struct qb_ipcs_funcs {
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec* iov, size_t iov_len);
 	void (*fc_set)(struct qb_ipc_one_way *one_way, int32_t fc_enable);
 	ssize_t (*q_len_get)(struct qb_ipc_one_way *one_way);
+	int32_t (*trim)(struct qb_ipc_one_way *one_way);
+	ssize_t (*resident_get)(struct qb_ipc_one_way *one_way);
+	int32_t (*resize)(struct qb_ipc_one_way *one_way, size_t size);
+};
+
+/* one entry per shm connection watched by the busy poll thread */
+struct qb_ipcs_poll_ring {
+	volatile uint32_t *request_pt;
+	volatile uint32_t *control_pt;
+	int32_t *polled;
+	uint32_t request_seen;
+	uint32_t control_seen;
+	int32_t armed;
+	struct qb_ipcs_connection *c;
+};
+
+enum qb_ipcs_busy_poll_state {
+	QB_IPCS_BUSY_POLL_OFF,
+	QB_IPCS_BUSY_POLL_IDLE,
+	QB_IPCS_BUSY_POLL_RUNNING,
+	QB_IPCS_BUSY_POLL_STOP,
+};
+
+struct qb_ipcs_class {
+	uint32_t weight;
+	/* connections with requests waiting, they share the quantum */
+	uint32_t backlogged;
+	struct qb_ipcs_class_stats stats;
 };
 
 struct qb_ipcs_service {
@@ -149,7 +269,52 @@ struct qb_ipcs_service {
 	struct qb_list_head list;
 	struct qb_ipcs_stats stats;
 
+	/* deficit round robin, disabled if fq_quantum == 0 */
+	uint32_t fq_quantum;
+	struct qb_ipcs_class classes[QB_IPCS_CLASSES_MAX];
+
+	/* new shm connections get a control ring */
+	int32_t priority_lane;
+
 	void *context;
+
+	/* deferred responses completed by other threads */
+	pthread_mutex_t async_lock;
+	struct qb_list_head async_done;
+	int32_t async_pipe[2];
+
+	/* busy polling of the shm rings, disabled if busy_poll_usec == 0 */
+	uint32_t busy_poll_usec;
+	int32_t busy_poll_state;
+	int32_t busy_poll_waiters;
+	int32_t notifications_are_hints;
+	pthread_t busy_poll_thread;
+	pthread_mutex_t busy_poll_lock;
+	pthread_cond_t busy_poll_cond;
+	struct qb_ipcs_poll_ring *busy_poll_rings;
+	uint32_t busy_poll_count;
+	uint32_t busy_poll_alloc;
+	/* connections whose rings moved, under async_lock */
+	struct qb_list_head busy_poll_ready;
+	int32_t busy_poll_doorbell;
+
+	/* giving back the ring pages of idle connections, off if 0 */
+	uint32_t idle_trim_ms;
+	int32_t idle_trim_fd;
+
+	/* new connections having their rings created by setup_thread */
+	int32_t setup_running;
+	pthread_t setup_thread;
+	pthread_mutex_t setup_lock;
+	pthread_cond_t setup_cond;
+	struct qb_list_head setup_queue;
+	struct qb_list_head setup_done;
+
+	/* published statistics, with what closed connections did */
+	struct qb_stats_provider *stats_provider;
+	uint64_t closed_requests;
+	uint64_t closed_responses;
+	uint64_t closed_events;
 };
 
 enum qb_ipcs_connection_state {
@@ -161,6 +326,24 @@ enum qb_ipcs_connection_state {
 
 #define CONNECTION_DESCRIPTION (16)
 
+struct qb_ipcs_pending {
+	struct qb_list_head list;
+	struct qb_ipcs_connection *c;
+	uint32_t flags;
+	void *request;
+	size_t request_size;
+	void *response;
+	size_t response_size;
+};
+
+struct qb_ipcs_event_entry {
+	struct qb_list_head list;
+	uint64_t key;
+	int32_t keyed;
+	size_t size;
+	void *data;
+};
+
 struct qb_ipcs_connection_auth {
 	uid_t uid;
 	gid_t gid;
@@ -178,6 +361,7 @@ struct qb_ipcs_connection {
 	struct qb_ipc_one_way request;
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
+	struct qb_ipc_one_way control;
 	struct qb_ipcs_service *service;
 	struct qb_list_head list;
 	struct qb_ipc_request_header *receive_buf;
@@ -185,6 +369,43 @@ struct qb_ipcs_connection {
 	int32_t fc_enabled;
 	int32_t poll_events;
 	int32_t outstanding_notifiers;
+	struct qb_ipc_request_header *msg_in_process;
+	struct qb_ipcs_pending *deferred;
+	/* an ordered deferred request, the ones after it wait for it */
+	struct qb_ipcs_pending *ordered_pending;
+	uint32_t class_id;
+	uint32_t weight;
+	int64_t deficit;
+	int32_t fq_backlogged;
+	/* events waiting for room in the event ring */
+	struct qb_list_head event_backlog;
+	uint32_t event_backlog_len;
+	uint32_t event_backlog_max;
+	/* memfds received ahead of their requests */
+	int32_t large_msg_ok;
+	int32_t *large_fds;
+	uint32_t large_fds_count;
+	int32_t notifications_ahead;
+	void *large_msg;
+	size_t large_msg_size;
+	/* index into busy_poll_rings, -1 if not watched */
+	int32_t busy_poll_slot;
+	/* on the service's busy_poll_ready queue, empty if not */
+	struct qb_list_head busy_poll_ready;
+	/* traffic as of the last idle trim check */
+	uint64_t idle_activity;
+	uint64_t idle_since;
+	int32_t idle_trimmed;
+	/* response ring size last set, 0 while it is the buffer size */
+	size_t ring_size;
+	/* the client understands resized rings */
+	int32_t follows_resize;
+	/* the client tags requests, and the tag of the one being answered */
+	int32_t request_tags;
+	uint32_t response_tag;
+	/* connection response while prepare runs on the setup thread */
+	struct qb_ipc_connection_response *setup_response;
+	int32_t setup_res;
 	char description[CONNECTION_DESCRIPTION];
 	struct qb_ipcs_connection_stats_2 stats;
 };
@@ -204,4 +425,9 @@ int32_t qb_ipcs_process_request(struct qb_ipcs_service *s,
 
 int32_t qb_ipc_us_sock_error_is_disconnected(int err);
 
+int32_t qb_ipcs_busy_poll_add(struct qb_ipcs_connection *c);
+
+int32_t qb_ipcs_setup_offload(struct qb_ipcs_connection *c);
+void qb_ipcs_us_setup_finish(struct qb_ipcs_connection *c);
+
 #endif /* QB_IPC_INT_H_DEFINED */
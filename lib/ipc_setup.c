@@ -58,6 +58,7 @@ struct ipc_auth_data {
 
 	size_t processed;
 	size_t len;
+	int32_t polled;
 
 #ifdef SO_PASSCRED
 	char *cmsg_cred;
@@ -66,6 +67,9 @@ struct ipc_auth_data {
 };
 
 
+/* connections accepted per wakeup of the listening socket */
+#define QB_IPCS_ACCEPT_BATCH 64
+
 static int32_t qb_ipcs_us_connection_acceptor(int fd, int revent, void *data);
 
 ssize_t
@@ -100,6 +104,114 @@ retry_send:
 	return processed;
 }
 
+/*
+ * Send a (small) message with a file descriptor attached.
+ */
+ssize_t
+qb_ipc_us_send_fd(struct qb_ipc_one_way *one_way, const void *msg, size_t len,
+		  int32_t fd)
+{
+	struct msghdr msg_send;
+	struct iovec iov_send;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t result;
+
+	memset(&msg_send, 0, sizeof(msg_send));
+	memset(&control, 0, sizeof(control));
+	iov_send.iov_base = (void *)msg;
+	iov_send.iov_len = len;
+	msg_send.msg_iov = &iov_send;
+	msg_send.msg_iovlen = 1;
+	msg_send.msg_control = control.buf;
+	msg_send.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg_send);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+	result = sendmsg(one_way->u.us.sock, &msg_send, MSG_NOSIGNAL);
+	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
+	if (result == -1) {
+		return -errno;
+	}
+	return result;
+}
+
+/*
+ * Receive whatever is available (up to len bytes) without blocking.
+ * A descriptor passed along with the data is returned in fd_out,
+ * which is -1 otherwise.
+ */
+ssize_t
+qb_ipc_us_recv_fd(struct qb_ipc_one_way *one_way, void *msg, size_t len,
+		  int32_t *fd_out)
+{
+	struct msghdr msg_recv;
+	struct iovec iov_recv;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[256];
+	} control;
+	ssize_t result;
+	int fd;
+	int32_t n_fds;
+	int32_t i;
+
+	*fd_out = -1;
+	memset(&msg_recv, 0, sizeof(msg_recv));
+	iov_recv.iov_base = msg;
+	iov_recv.iov_len = len;
+	msg_recv.msg_iov = &iov_recv;
+	msg_recv.msg_iovlen = 1;
+	msg_recv.msg_control = control.buf;
+	msg_recv.msg_controllen = sizeof(control.buf);
+
+	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+	result = recvmsg(one_way->u.us.sock, &msg_recv, MSG_NOSIGNAL
+#ifdef MSG_CMSG_CLOEXEC
+			 | MSG_CMSG_CLOEXEC
+#endif
+			 );
+	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
+	if (result == -1) {
+		if (errno == ECONNRESET || errno == EPIPE) {
+			return -ENOTCONN;
+		}
+		return -errno;
+	}
+	if (result == 0) {
+		return -ENOTCONN;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg_recv); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg_recv, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n_fds; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+			       sizeof(int));
+			if (*fd_out == -1) {
+				*fd_out = fd;
+			} else {
+				/* one per message, anything else is junk */
+				close(fd);
+			}
+		}
+	}
+	return result;
+}
+
 static ssize_t
 qb_ipc_us_recv_msghdr(struct ipc_auth_data *data)
 {
@@ -311,6 +423,59 @@ qb_ipcc_us_sock_close(int32_t sock)
 	close(sock);
 }
 
+void
+qb_ipc_server_flags_add(struct qb_ipc_connection_response *r, uint32_t flags)
+{
+	flags |= qb_ipc_server_flags_get(r);
+	memcpy(&r->event[QB_IPC_SERVER_FLAGS_OFFSET], &flags, sizeof(flags));
+}
+
+uint32_t
+qb_ipc_server_flags_get(struct qb_ipc_connection_response *r)
+{
+	uint32_t flags;
+
+	memcpy(&flags, &r->event[QB_IPC_SERVER_FLAGS_OFFSET], sizeof(flags));
+	return flags;
+}
+
+uint32_t
+qb_ipc_tag_get(const void *hdr)
+{
+	uint32_t tag;
+
+	memcpy(&tag, (const char *)hdr + sizeof(int32_t), sizeof(tag));
+	return tag;
+}
+
+/*
+ * Point out at the same data as iov, except for the header which is
+ * copied into hdr and tagged. out needs room for iov_len + 1 entries.
+ *
+ * @return the entries used in out, 0 if iov doesn't start with a
+ *         whole header
+ */
+size_t
+qb_ipc_iov_tag(const struct iovec *iov, size_t iov_len,
+	       void *hdr, size_t hdr_size, uint32_t tag, struct iovec *out)
+{
+	size_t i;
+
+	if (iov_len == 0 || iov[0].iov_len < hdr_size) {
+		return 0;
+	}
+	memcpy(hdr, iov[0].iov_base, hdr_size);
+	memcpy((char *)hdr + sizeof(int32_t), &tag, sizeof(tag));
+	out[0].iov_base = hdr;
+	out[0].iov_len = hdr_size;
+	out[1].iov_base = (char *)iov[0].iov_base + hdr_size;
+	out[1].iov_len = iov[0].iov_len - hdr_size;
+	for (i = 1; i < iov_len; i++) {
+		out[i + 1] = iov[i];
+	}
+	return iov_len + 1;
+}
+
 int32_t
 qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 			 struct qb_ipc_connection_response *r)
@@ -335,6 +500,11 @@ qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 	request.hdr.id = QB_IPC_MSG_AUTHENTICATE;
 	request.hdr.size = sizeof(request);
 	request.max_msg_size = c->setup.max_msg_size;
+	request.flags = QB_IPC_CONNECTION_FOLLOWS_RESIZE |
+			QB_IPC_CONNECTION_REQUEST_TAGS;
+#ifdef HAVE_MEMFD_CREATE
+	request.flags |= QB_IPC_CONNECTION_LARGE_MSG;
+#endif /* HAVE_MEMFD_CREATE */
 	res = qb_ipc_us_send(&c->setup, &request, request.hdr.size);
 	if (res < 0) {
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
@@ -355,6 +525,8 @@ qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 	if (r->hdr.error != 0) {
 		return r->hdr.error;
 	}
+	c->request_tags = ((qb_ipc_server_flags_get(r) &
+			    QB_IPC_CONNECTION_REQUEST_TAGS) != 0);
 	return 0;
 }
 
@@ -457,6 +629,82 @@ qb_ipcs_us_withdraw(struct qb_ipcs_service * s)
 	return 0;
 }
 
+static int32_t
+connection_setup_finish(struct qb_ipcs_connection *c, int32_t res,
+			struct qb_ipc_connection_response *response)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t res2 = 0;
+
+	if (res == 0 && s->funcs.connect) {
+		res = s->funcs.connect(s, c, response);
+	}
+	if (res == 0) {
+		/*
+		 * The connection is good, add it to the active connection list
+		 */
+		c->state = QB_IPCS_CONNECTION_ACTIVE;
+		qb_list_add(&c->list, &s->connections);
+	}
+
+	response->hdr.id = QB_IPC_MSG_AUTHENTICATE;
+	response->hdr.size = sizeof(struct qb_ipc_connection_response);
+	response->hdr.error = res;
+	if (res == 0) {
+		response->connection = (intptr_t) c;
+		response->connection_type = s->type;
+		response->max_msg_size = c->request.max_msg_size;
+		if (c->request_tags) {
+			qb_ipc_server_flags_add(response,
+						QB_IPC_CONNECTION_REQUEST_TAGS);
+		}
+		s->stats.active_connections++;
+	}
+
+	res2 = qb_ipc_us_send(&c->setup, response, response->hdr.size);
+	if (res == 0 && res2 != response->hdr.size) {
+		res = res2;
+	}
+
+	if (res == 0) {
+		qb_ipcs_connection_ref(c);
+		if (s->serv_fns.connection_created) {
+			s->serv_fns.connection_created(c);
+		}
+		if (c->state == QB_IPCS_CONNECTION_ACTIVE) {
+			c->state = QB_IPCS_CONNECTION_ESTABLISHED;
+			/* if not, it is woken through the socket */
+			(void)qb_ipcs_busy_poll_add(c);
+		}
+		qb_ipcs_connection_unref(c);
+	} else {
+		if (res == -EACCES) {
+			qb_util_log(LOG_ERR, "Invalid IPC credentials (%s).",
+				    c->description);
+		} else if (res == -EAGAIN) {
+			qb_util_log(LOG_WARNING, "Denied connection, is not ready (%s)",
+				    c->description);
+		} else {
+			errno = -res;
+			qb_util_perror(LOG_ERR,
+				       "Error in connection setup (%s)",
+				       c->description);
+		}
+		qb_ipcs_disconnect(c);
+	}
+	return res;
+}
+
+void
+qb_ipcs_us_setup_finish(struct qb_ipcs_connection *c)
+{
+	struct qb_ipc_connection_response *response = c->setup_response;
+
+	c->setup_response = NULL;
+	(void)connection_setup_finish(c, c->setup_res, response);
+	qb_util_free(response);
+}
+
 static int32_t
 handle_new_connection(struct qb_ipcs_service *s,
 		      int32_t auth_result,
@@ -466,19 +714,19 @@ handle_new_connection(struct qb_ipcs_service *s,
 	struct qb_ipcs_connection *c = NULL;
 	struct qb_ipc_connection_request *req = msg;
 	int32_t res = auth_result;
-	int32_t res2 = 0;
 	uint32_t max_buffer_size = QB_MAX(req->max_msg_size, s->max_buffer_size);
 	struct qb_ipc_connection_response response;
 
+	memset(&response, 0, sizeof(response));
 	c = qb_ipcs_connection_alloc(s);
 	if (c == NULL) {
 		qb_ipcc_us_sock_close(sock);
 		return -ENOMEM;
 	}
 
-	c->receive_buf = calloc(1, max_buffer_size);
+	c->receive_buf = qb_util_calloc(1, max_buffer_size);
 	if (c->receive_buf == NULL) {
-		free(c);
+		qb_util_free(c);
 		qb_ipcc_us_sock_close(sock);
 		return -ENOMEM;
 	}
@@ -486,6 +734,12 @@ handle_new_connection(struct qb_ipcs_service *s,
 	c->request.max_msg_size = max_buffer_size;
 	c->response.max_msg_size = max_buffer_size;
 	c->event.max_msg_size = max_buffer_size;
+	c->follows_resize = ((req->flags & QB_IPC_CONNECTION_FOLLOWS_RESIZE) != 0);
+	c->request_tags = ((req->flags & QB_IPC_CONNECTION_REQUEST_TAGS) != 0);
+#ifdef HAVE_MEMFD_CREATE
+	c->large_msg_ok = (s->type == QB_IPC_SHM &&
+			   (req->flags & QB_IPC_CONNECTION_LARGE_MSG) != 0);
+#endif /* HAVE_MEMFD_CREATE */
 	c->pid = ugp->pid;
 	c->auth.uid = c->euid = ugp->uid;
 	c->auth.gid = c->egid = ugp->gid;
@@ -505,60 +759,13 @@ handle_new_connection(struct qb_ipcs_service *s,
 	qb_util_log(LOG_DEBUG, "IPC credentials authenticated (%s)",
 		    c->description);
 
-	memset(&response, 0, sizeof(response));
-	if (s->funcs.connect) {
-		res = s->funcs.connect(s, c, &response);
-		if (res != 0) {
-			goto send_response;
-		}
+	if (qb_ipcs_setup_offload(c) == 0) {
+		/* qb_ipcs_us_setup_finish() takes it from here */
+		return 0;
 	}
-	/*
-	 * The connection is good, add it to the active connection list
-	 */
-	c->state = QB_IPCS_CONNECTION_ACTIVE;
-	qb_list_add(&c->list, &s->connections);
 
 send_response:
-	response.hdr.id = QB_IPC_MSG_AUTHENTICATE;
-	response.hdr.size = sizeof(response);
-	response.hdr.error = res;
-	if (res == 0) {
-		response.connection = (intptr_t) c;
-		response.connection_type = s->type;
-		response.max_msg_size = c->request.max_msg_size;
-		s->stats.active_connections++;
-	}
-
-	res2 = qb_ipc_us_send(&c->setup, &response, response.hdr.size);
-	if (res == 0 && res2 != response.hdr.size) {
-		res = res2;
-	}
-
-	if (res == 0) {
-		qb_ipcs_connection_ref(c);
-		if (s->serv_fns.connection_created) {
-			s->serv_fns.connection_created(c);
-		}
-		if (c->state == QB_IPCS_CONNECTION_ACTIVE) {
-			c->state = QB_IPCS_CONNECTION_ESTABLISHED;
-		}
-		qb_ipcs_connection_unref(c);
-	} else {
-		if (res == -EACCES) {
-			qb_util_log(LOG_ERR, "Invalid IPC credentials (%s).",
-				    c->description);
-		} else if (res == -EAGAIN) {
-			qb_util_log(LOG_WARNING, "Denied connection, is not ready (%s)",
-				    c->description);
-		} else {
-			errno = -res;
-			qb_util_perror(LOG_ERR,
-				       "Error in connection setup (%s)",
-				       c->description);
-		}
-		qb_ipcs_disconnect(c);
-	}
-	return res;
+	return connection_setup_finish(c, res, &response);
 }
 
 static void
@@ -686,7 +893,9 @@ cleanup_and_return:
 	setsockopt(data->sock, SOL_SOCKET, SO_PASSCRED, &off, sizeof(off));
 #endif
 
-	(void)data->s->poll_fns.dispatch_del(data->sock);
+	if (data->polled) {
+		(void)data->s->poll_fns.dispatch_del(data->sock);
+	}
 
 	if (res < 0) {
 		close(data->sock);
@@ -751,6 +960,14 @@ qb_ipcs_uc_recv_and_auth(int32_t sock, struct qb_ipcs_service *s)
 	setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
 #endif
 
+	/*
+	 * Clients send their request as soon as they are connected, so
+	 * it is usually here already. Only wait in the loop if it isn't.
+	 */
+	if (process_auth(sock, POLLIN, data) != 0) {
+		return;
+	}
+	data->polled = QB_TRUE;
 	res = s->poll_fns.dispatch_add(QB_LOOP_MED,
 					data->sock,
 					POLLIN | POLLPRI | POLLNVAL,
@@ -763,51 +980,83 @@ qb_ipcs_uc_recv_and_auth(int32_t sock, struct qb_ipcs_service *s)
 }
 
 static int32_t
-qb_ipcs_us_connection_acceptor(int fd, int revent, void *data)
+qb_ipcs_us_accept(struct qb_ipcs_service *s, int32_t fd)
 {
 	struct sockaddr_un un_addr;
 	int32_t new_fd;
-	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
 	int32_t res;
 	socklen_t addrlen = sizeof(struct sockaddr_un);
 
-	if (revent & (POLLNVAL | POLLHUP | POLLERR)) {
-		/*
-		 * handle shutdown more cleanly.
-		 */
-		return -1;
-	}
-
 retry_accept:
 	errno = 0;
+#ifdef HAVE_ACCEPT4
+	new_fd = accept4(fd, (struct sockaddr *)&un_addr, &addrlen,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	new_fd = accept(fd, (struct sockaddr *)&un_addr, &addrlen);
+#endif /* HAVE_ACCEPT4 */
 	if (new_fd == -1 && errno == EINTR) {
 		goto retry_accept;
 	}
 
+	if (new_fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return -EAGAIN;
+	}
 	if (new_fd == -1 && errno == EBADF) {
 		qb_util_perror(LOG_ERR,
 			       "Could not accept client connection from fd:%d",
 			       fd);
-		return -1;
+		return -EBADF;
 	}
 	if (new_fd == -1) {
+		res = -errno;
 		qb_util_perror(LOG_ERR, "Could not accept client connection");
-		/* This is an error, but -1 would indicate disconnect
-		 * from the poll loop
-		 */
-		return 0;
+		return res;
 	}
 
+#ifndef HAVE_ACCEPT4
 	res = qb_sys_fd_nonblock_cloexec_set(new_fd);
 	if (res < 0) {
 		close(new_fd);
-		/* This is an error, but -1 would indicate disconnect
-		 * from the poll loop
-		 */
-		return 0;
+		return res;
 	}
+#endif /* HAVE_ACCEPT4 */
 
 	qb_ipcs_uc_recv_and_auth(new_fd, s);
 	return 0;
 }
+
+static int32_t
+qb_ipcs_us_connection_acceptor(int fd, int revent, void *data)
+{
+	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
+	int32_t res = 0;
+	int32_t i;
+
+	if (revent & (POLLNVAL | POLLHUP | POLLERR)) {
+		/*
+		 * handle shutdown more cleanly.
+		 */
+		return -1;
+	}
+
+	/*
+	 * Take everyone that is waiting, up to a limit so a storm of
+	 * clients doesn't keep the rest of the loop waiting.
+	 */
+	qb_ipcs_ref(s);
+	for (i = 0; i < QB_IPCS_ACCEPT_BATCH && res == 0; i++) {
+		if (s->server_sock != fd) {
+			/* withdrawn by one of the callbacks */
+			break;
+		}
+		res = qb_ipcs_us_accept(s, fd);
+	}
+	qb_ipcs_unref(s);
+
+	/*
+	 * Other errors are errors, but -1 would indicate disconnect
+	 * from the poll loop
+	 */
+	return (res == -EBADF) ? -1 : 0;
+}
@@ -44,10 +44,16 @@ qb_ipcc_shm_disconnect(struct qb_ipcc_connection *c)
 		qb_rb_close(c->request.u.shm.rb);
 		qb_rb_close(c->response.u.shm.rb);
 		qb_rb_close(c->event.u.shm.rb);
+		if (c->control.u.shm.rb) {
+			qb_rb_close(c->control.u.shm.rb);
+		}
 	} else {
 		qb_rb_force_close(c->request.u.shm.rb);
 		qb_rb_force_close(c->response.u.shm.rb);
 		qb_rb_force_close(c->event.u.shm.rb);
+		if (c->control.u.shm.rb) {
+			qb_rb_force_close(c->control.u.shm.rb);
+		}
 	}
 }
 
@@ -82,7 +88,7 @@ qb_ipc_shm_sendv(struct qb_ipc_one_way *one_way,
 	pt = dest;
 
 	for (i = 0; i < iov_len; i++) {
-		memcpy(pt, iov[i].iov_base, iov[i].iov_len);
+		qb_rb_copy_in(pt, iov[i].iov_base, iov[i].iov_len);
 		pt += iov[i].iov_len;
 	}
 	res = qb_rb_chunk_commit(one_way->u.shm.rb, total_size);
@@ -157,16 +163,60 @@ qb_ipc_shm_q_len_get(struct qb_ipc_one_way *one_way)
 	return qb_rb_chunks_used(one_way->u.shm.rb);
 }
 
+static int32_t
+qb_ipc_shm_trim(struct qb_ipc_one_way *one_way)
+{
+	if (one_way->u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	return qb_rb_pages_release(one_way->u.shm.rb);
+}
+
+static int32_t
+qb_ipc_shm_resize(struct qb_ipc_one_way *one_way, size_t size)
+{
+	if (one_way->u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	return qb_rb_resize(one_way->u.shm.rb, size);
+}
+
+static ssize_t
+qb_ipc_shm_resident_get(struct qb_ipc_one_way *one_way)
+{
+	if (one_way->u.shm.rb == NULL) {
+		return 0;
+	}
+	return qb_rb_resident_get(one_way->u.shm.rb);
+}
+
+/*
+ * The priority ring name is passed behind the event ring name,
+ * servers without one leave it zeroed.
+ */
+static char *
+_control_name_get(struct qb_ipc_connection_response *r)
+{
+	size_t len = strnlen(r->event, PATH_MAX);
+
+	if (len + 1 >= PATH_MAX) {
+		return NULL;
+	}
+	return &r->event[len + 1];
+}
+
 int32_t
 qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		    struct qb_ipc_connection_response * response)
 {
 	int32_t res = 0;
+	char *control_name;
 
 	c->funcs.send = qb_ipc_shm_send;
 	c->funcs.sendv = qb_ipc_shm_sendv;
 	c->funcs.recv = qb_ipc_shm_recv;
 	c->funcs.fc_get = qb_ipc_shm_fc_get;
+	c->funcs.fc_set = qb_ipc_shm_fc_set;
 	c->funcs.disconnect = qb_ipcc_shm_disconnect;
 	c->needs_sock_for_poll = QB_TRUE;
 
@@ -202,8 +252,30 @@ qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		qb_util_perror(LOG_ERR, "qb_rb_open:EVENT");
 		goto cleanup_request_response;
 	}
+
+	control_name = _control_name_get(response);
+	if (control_name && control_name[0] != '\0') {
+		c->control.u.shm.rb = qb_rb_open(control_name,
+						 QB_IPC_CONTROL_MSG_SIZE,
+						 QB_RB_FLAG_SHARED_PROCESS, 0);
+		if (c->control.u.shm.rb == NULL) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "qb_rb_open:CONTROL");
+			goto cleanup_request_response_event;
+		}
+		c->control.type = QB_IPC_SHM;
+		c->control.max_msg_size = QB_IPC_CONTROL_MSG_SIZE;
+	}
+#ifdef HAVE_MEMFD_CREATE
+	c->large_msg_supported =
+		((qb_ipc_server_flags_get(response) &
+		  QB_IPC_CONNECTION_LARGE_MSG) != 0);
+#endif /* HAVE_MEMFD_CREATE */
 	return 0;
 
+cleanup_request_response_event:
+	qb_rb_close(c->event.u.shm.rb);
+
 cleanup_request_response:
 	qb_rb_close(c->response.u.shm.rb);
 
@@ -247,6 +319,10 @@ qb_ipcs_shm_disconnect(struct qb_ipcs_connection *c)
 			qb_rb_close(c->request.u.shm.rb);
 			c->request.u.shm.rb = NULL;
 		}
+		if (c->control.u.shm.rb) {
+			qb_rb_close(c->control.u.shm.rb);
+			c->control.u.shm.rb = NULL;
+		}
 	}
 }
 
@@ -281,17 +357,23 @@ qb_ipcs_shm_rb_open(struct qb_ipcs_connection *c,
 
 cleanup:
 	qb_rb_close(ow->u.shm.rb);
+	ow->u.shm.rb = NULL;
 	return res;
 }
 
+/*
+ * Create the rings. This touches nothing but the connection itself,
+ * so the service may run it on its setup thread.
+ */
 static int32_t
-qb_ipcs_shm_connect(struct qb_ipcs_service *s,
-		    struct qb_ipcs_connection *c,
-		    struct qb_ipc_connection_response *r)
+qb_ipcs_shm_rings_create(struct qb_ipcs_service *s,
+			 struct qb_ipcs_connection *c,
+			 struct qb_ipc_connection_response *r)
 {
 	int32_t res;
+	char *control_name;
 
-	qb_util_log(LOG_DEBUG, "connecting to client [%d]", c->pid);
+	qb_util_log(LOG_DEBUG, "creating rings for client [%d]", c->pid);
 
 	snprintf(r->request, NAME_MAX, "%s-request-%s",
 		 s->name, c->description);
@@ -318,15 +400,19 @@ qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 		goto cleanup_request_response;
 	}
 
-	res = s->poll_fns.dispatch_add(s->poll_priority,
-				       c->setup.u.us.sock,
-				       POLLIN | POLLPRI | POLLNVAL,
-				       c, qb_ipcs_dispatch_connection_request);
-	if (res != 0) {
-		qb_util_log(LOG_ERR,
-			    "Error adding socket to mainloop (%s).",
-			    c->description);
-		goto cleanup_request_response_event;
+	if (s->priority_lane) {
+		control_name = _control_name_get(r);
+		snprintf(control_name, QB_IPC_SERVER_FLAGS_OFFSET - strlen(r->event) - 1,
+			 "%s-control-%s", s->name, c->description);
+		c->control.max_msg_size = QB_IPC_CONTROL_MSG_SIZE;
+		res = qb_ipcs_shm_rb_open(c, &c->control, control_name);
+		if (res != 0) {
+			c->control.max_msg_size = 0;
+			goto cleanup_request_response_event;
+		}
+	}
+	if (c->large_msg_ok) {
+		qb_ipc_server_flags_add(r, QB_IPC_CONNECTION_LARGE_MSG);
 	}
 
 	r->hdr.error = 0;
@@ -334,12 +420,15 @@ qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 
 cleanup_request_response_event:
 	qb_rb_close(c->event.u.shm.rb);
+	c->event.u.shm.rb = NULL;
 
 cleanup_request_response:
 	qb_rb_close(c->response.u.shm.rb);
+	c->response.u.shm.rb = NULL;
 
 cleanup_request:
 	qb_rb_close(c->request.u.shm.rb);
+	c->request.u.shm.rb = NULL;
 
 cleanup:
 	r->hdr.error = res;
@@ -349,9 +438,50 @@ cleanup:
 	return res;
 }
 
+static int32_t
+qb_ipcs_shm_connect(struct qb_ipcs_service *s,
+		    struct qb_ipcs_connection *c,
+		    struct qb_ipc_connection_response *r)
+{
+	int32_t res;
+
+	qb_util_log(LOG_DEBUG, "connecting to client [%d]", c->pid);
+
+	if (c->request.u.shm.rb == NULL) {
+		res = qb_ipcs_shm_rings_create(s, c, r);
+		if (res != 0) {
+			return res;
+		}
+	}
+
+	res = s->poll_fns.dispatch_add(s->poll_priority,
+				       c->setup.u.us.sock,
+				       POLLIN | POLLPRI | POLLNVAL,
+				       c, qb_ipcs_dispatch_connection_request);
+	if (res != 0) {
+		qb_util_log(LOG_ERR,
+			    "Error adding socket to mainloop (%s).",
+			    c->description);
+		qb_rb_close(c->control.u.shm.rb);
+		c->control.u.shm.rb = NULL;
+		qb_rb_close(c->event.u.shm.rb);
+		c->event.u.shm.rb = NULL;
+		qb_rb_close(c->response.u.shm.rb);
+		c->response.u.shm.rb = NULL;
+		qb_rb_close(c->request.u.shm.rb);
+		c->request.u.shm.rb = NULL;
+		r->hdr.error = res;
+		return res;
+	}
+
+	r->hdr.error = 0;
+	return 0;
+}
+
 void
 qb_ipcs_shm_init(struct qb_ipcs_service *s)
 {
+	s->funcs.prepare = qb_ipcs_shm_rings_create;
 	s->funcs.connect = qb_ipcs_shm_connect;
 	s->funcs.disconnect = qb_ipcs_shm_disconnect;
 
@@ -363,6 +493,9 @@ qb_ipcs_shm_init(struct qb_ipcs_service *s)
 
 	s->funcs.fc_set = qb_ipc_shm_fc_set;
 	s->funcs.q_len_get = qb_ipc_shm_q_len_get;
+	s->funcs.trim = qb_ipc_shm_trim;
+	s->funcs.resident_get = qb_ipc_shm_resident_get;
+	s->funcs.resize = qb_ipc_shm_resize;
 
 	s->needs_sock_for_poll = QB_TRUE;
 }
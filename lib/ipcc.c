@@ -19,6 +19,9 @@
  * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "os_base.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "ipc_int.h"
 #include "util_int.h"
@@ -32,7 +35,7 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 	qb_ipcc_connection_t *c = NULL;
 	struct qb_ipc_connection_response response;
 
-	c = calloc(1, sizeof(struct qb_ipcc_connection));
+	c = qb_util_calloc(1, sizeof(struct qb_ipcc_connection));
 	if (c == NULL) {
 		return NULL;
 	}
@@ -52,7 +55,7 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 	c->response.max_msg_size = response.max_msg_size;
 	c->request.max_msg_size = response.max_msg_size;
 	c->event.max_msg_size = response.max_msg_size;
-	c->receive_buf = calloc(1, response.max_msg_size);
+	c->receive_buf = qb_util_calloc(1, response.max_msg_size);
 	c->fc_enable_max = 1;
 	if (c->receive_buf == NULL) {
 		res = -ENOMEM;
@@ -82,8 +85,8 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 
 disconnect_and_cleanup:
 	qb_ipcc_us_sock_close(c->setup.u.us.sock);
-	free(c->receive_buf);
-	free(c);
+	qb_util_free(c->receive_buf);
+	qb_util_free(c);
 	errno = -res;
 	return NULL;
 }
@@ -163,19 +166,143 @@ _response_sock_one_way_get(struct qb_ipcc_connection * c)
 	return &c->response;
 }
 
+/*
+ * The one way to send on. Priority messages skip flow control,
+ * the server always drains them first.
+ */
+static struct qb_ipc_one_way *
+_request_one_way_get(struct qb_ipcc_connection * c, uint32_t flags)
+{
+	if ((flags & QB_IPCC_SEND_PRIORITY) && c->control.max_msg_size > 0) {
+		return &c->control;
+	}
+	return &c->request;
+}
+
+/*
+ * The server sets the response ring's user word while a thread of its
+ * is polling our request rings, no need to wake it up then.
+ */
+static int32_t
+_server_polling(struct qb_ipcc_connection * c)
+{
+#ifdef HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS
+	if (c->funcs.fc_get == NULL) {
+		return QB_FALSE;
+	}
+	/* the request has to be visible before we look */
+	__sync_synchronize();
+	return (c->funcs.fc_get(&c->response) > 0);
+#else
+	return QB_FALSE;
+#endif /* HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS */
+}
+
+static int32_t
+_large_msg_wanted(struct qb_ipcc_connection * c, struct qb_ipc_one_way * ow,
+		  size_t msg_len)
+{
+	return (ow == &c->request && c->large_msg_threshold > 0 &&
+		msg_len > c->large_msg_threshold);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/*
+ * Copy the message into a sealed memfd and hand that to the server,
+ * only a small descriptor goes through the request ring.
+ */
+static ssize_t
+_sendv_large(struct qb_ipcc_connection * c, const struct iovec * iov,
+	     size_t iov_len, size_t total_size)
+{
+	struct qb_ipc_large_request lr;
+	ssize_t res = 0;
+	ssize_t res2;
+	size_t done;
+	size_t i;
+	int32_t fd;
+
+	fd = memfd_create("qb-ipc-large", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return -errno;
+	}
+	for (i = 0; i < iov_len; i++) {
+		for (done = 0; done < iov[i].iov_len; done += res) {
+			res = write(fd, (char *)iov[i].iov_base + done,
+				    iov[i].iov_len - done);
+			if (res < 0 && errno == EINTR) {
+				res = 0;
+			} else if (res < 0) {
+				res = -errno;
+				goto cleanup;
+			}
+		}
+	}
+#ifdef F_ADD_SEALS
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		res = -errno;
+		goto cleanup;
+	}
+#endif /* F_ADD_SEALS */
+
+	memset(&lr, 0, sizeof(lr));
+	if (iov_len > 0 &&
+	    iov[0].iov_len >= sizeof(struct qb_ipc_request_header)) {
+		/* the stub carries the request's tag */
+		lr.hdr = *(struct qb_ipc_request_header *)iov[0].iov_base;
+	}
+	lr.hdr.id = QB_IPC_MSG_LARGE;
+	lr.hdr.size = sizeof(struct qb_ipc_large_request);
+	lr.size = total_size;
+	res = c->funcs.send(&c->request, &lr, lr.hdr.size);
+	if (res < 0) {
+		goto cleanup;
+	}
+	do {
+		res2 = qb_ipc_us_send_fd(&c->setup, &lr, 1, fd);
+	} while (res2 == -EAGAIN);
+	if (res2 == -EPIPE) {
+		res2 = -ENOTCONN;
+	}
+	res = (res2 == 1) ? total_size : res2;
+
+cleanup:
+	close(fd);
+	return res;
+}
+#endif /* HAVE_MEMFD_CREATE */
+
 ssize_t
 qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
+{
+	return qb_ipcc_send_flags(c, msg_ptr, msg_len, 0);
+}
+
+static ssize_t _sendv_flags(struct qb_ipcc_connection * c,
+			    const struct iovec * iov, size_t iov_len,
+			    uint32_t flags);
+
+static ssize_t
+_send_flags(struct qb_ipcc_connection * c, const void *msg_ptr,
+	    size_t msg_len, uint32_t flags)
 {
 	ssize_t res;
 	ssize_t res2;
+	struct qb_ipc_one_way *ow;
 
-	if (c == NULL) {
-		return -EINVAL;
+	ow = _request_one_way_get(c, flags);
+	if (_large_msg_wanted(c, ow, msg_len)) {
+		struct iovec iov;
+
+		iov.iov_base = (void *)msg_ptr;
+		iov.iov_len = msg_len;
+		return _sendv_flags(c, &iov, 1, flags);
 	}
-	if (msg_len > c->request.max_msg_size) {
+	if (msg_len > ow->max_msg_size) {
 		return -EMSGSIZE;
 	}
-	if (c->funcs.fc_get) {
+	if (c->funcs.fc_get && ow == &c->request) {
 		res = c->funcs.fc_get(&c->request);
 		if (res < 0) {
 			return res;
@@ -188,8 +315,8 @@ qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 		}
 	}
 
-	res = c->funcs.send(&c->request, msg_ptr, msg_len);
-	if (res == msg_len && c->needs_sock_for_poll) {
+	res = c->funcs.send(ow, msg_ptr, msg_len);
+	if (res == msg_len && c->needs_sock_for_poll && !_server_polling(c)) {
 		do {
 			res2 = qb_ipc_us_send(&c->setup, msg_ptr, 1);
 		} while (res2 == -EAGAIN);
@@ -203,6 +330,24 @@ qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 	return _check_connection_state(c, res);
 }
 
+ssize_t
+qb_ipcc_send_flags(struct qb_ipcc_connection * c, const void *msg_ptr,
+		   size_t msg_len, uint32_t flags)
+{
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (!c->thread_safe) {
+		return _send_flags(c, msg_ptr, msg_len, flags);
+	}
+	(void)pthread_mutex_lock(&c->send_lock);
+	res = _send_flags(c, msg_ptr, msg_len, flags);
+	(void)pthread_mutex_unlock(&c->send_lock);
+	return res;
+}
+
 int32_t
 qb_ipcc_fc_enable_max_set(struct qb_ipcc_connection * c, uint32_t max)
 {
@@ -216,23 +361,29 @@ qb_ipcc_fc_enable_max_set(struct qb_ipcc_connection * c, uint32_t max)
 ssize_t
 qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 	      size_t iov_len)
+{
+	return qb_ipcc_sendv_flags(c, iov, iov_len, 0);
+}
+
+static ssize_t
+_sendv_flags(struct qb_ipcc_connection * c, const struct iovec * iov,
+	     size_t iov_len, uint32_t flags)
 {
 	int32_t total_size = 0;
 	int32_t i;
 	int32_t res;
 	int32_t res2;
+	struct qb_ipc_one_way *ow;
 
 	for (i = 0; i < iov_len; i++) {
 		total_size += iov[i].iov_len;
 	}
-	if (c == NULL) {
-		return -EINVAL;
-	}
-	if (total_size > c->request.max_msg_size) {
+	ow = _request_one_way_get(c, flags);
+	if (total_size > ow->max_msg_size && !_large_msg_wanted(c, ow, total_size)) {
 		return -EMSGSIZE;
 	}
 
-	if (c->funcs.fc_get) {
+	if (c->funcs.fc_get && ow == &c->request) {
 		res = c->funcs.fc_get(&c->request);
 		if (res < 0) {
 			return res;
@@ -245,8 +396,15 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 		}
 	}
 
-	res = c->funcs.sendv(&c->request, iov, iov_len);
-	if (res > 0 && c->needs_sock_for_poll) {
+#ifdef HAVE_MEMFD_CREATE
+	if (_large_msg_wanted(c, ow, total_size)) {
+		res = _sendv_large(c, iov, iov_len, total_size);
+		return _check_connection_state(c, res);
+	}
+#endif /* HAVE_MEMFD_CREATE */
+
+	res = c->funcs.sendv(ow, iov, iov_len);
+	if (res > 0 && c->needs_sock_for_poll && !_server_polling(c)) {
 		do {
 			res2 = qb_ipc_us_send(&c->setup, &res, 1);
 		} while (res2 == -EAGAIN);
@@ -260,6 +418,24 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 	return _check_connection_state(c, res);
 }
 
+ssize_t
+qb_ipcc_sendv_flags(struct qb_ipcc_connection * c, const struct iovec * iov,
+		    size_t iov_len, uint32_t flags)
+{
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (!c->thread_safe) {
+		return _sendv_flags(c, iov, iov_len, flags);
+	}
+	(void)pthread_mutex_lock(&c->send_lock);
+	res = _sendv_flags(c, iov, iov_len, flags);
+	(void)pthread_mutex_unlock(&c->send_lock);
+	return res;
+}
+
 ssize_t
 qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
 	     size_t msg_len, int32_t ms_timeout)
@@ -288,6 +464,237 @@ qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
 	return res;
 }
 
+/*
+ * Thread safe connections.
+ *
+ * Requests are numbered as they go onto the ring. The threads take
+ * turns at reading the response ring, whoever has the turn hands each
+ * response to the thread whose request it answers and wakes only that
+ * thread. The turn is passed on when its holder got its own answer.
+ *
+ * If the server echoes request tags the number goes along with the
+ * request and the response is matched on it, so requests the server
+ * completes out of order (deferred ones, the priority lane) still
+ * find their thread. Otherwise responses are taken to come back in
+ * the order the requests went out.
+ */
+#define QB_IPCC_TAGGED_IOV_MAX 8
+
+static struct qb_ipcc_waiter *
+_waiter_find(struct qb_ipcc_connection * c, const void *response,
+	     ssize_t size)
+{
+	struct qb_ipcc_waiter *w;
+	uint32_t tag = 0;
+	uint64_t seq;
+
+	if (c->request_tags &&
+	    size >= sizeof(struct qb_ipc_response_header)) {
+		tag = qb_ipc_tag_get(response);
+	}
+	if (tag != 0) {
+		qb_list_for_each_entry(w, &c->waiters, list) {
+			if (w->tag == tag) {
+				return w;
+			}
+		}
+		return NULL;
+	}
+	if (c->request_tags) {
+		/*
+		 * An untagged request, or sent outside of msg_process(),
+		 * give it to the oldest untagged waiter, failing that the
+		 * oldest one.
+		 */
+		qb_list_for_each_entry(w, &c->waiters, list) {
+			if (w->tag == 0) {
+				return w;
+			}
+		}
+		qb_list_for_each_entry(w, &c->waiters, list) {
+			return w;
+		}
+		return NULL;
+	}
+	seq = c->recv_seq++;
+	qb_list_for_each_entry(w, &c->waiters, list) {
+		if (w->seq == seq) {
+			return w;
+		}
+	}
+	return NULL;
+}
+
+static void
+_waiter_done(struct qb_ipcc_waiter *w, ssize_t res)
+{
+	qb_list_del(&w->list);
+	w->res = res;
+	w->done = QB_TRUE;
+	(void)pthread_cond_signal(&w->cond);
+}
+
+/* recv_lock held: give the receive turn to the next waiter */
+static void
+_receive_turn_pass(struct qb_ipcc_connection * c)
+{
+	struct qb_ipcc_waiter *w;
+
+	c->receiving = QB_FALSE;
+	if (!qb_list_empty(&c->waiters)) {
+		w = qb_list_first_entry(&c->waiters, struct qb_ipcc_waiter,
+					list);
+		(void)pthread_cond_signal(&w->cond);
+	}
+}
+
+/* recv_lock held and the receive turn taken */
+static ssize_t
+_receive_one(struct qb_ipcc_connection * c, int32_t ms_timeout)
+{
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+	ssize_t res;
+
+	(void)pthread_mutex_unlock(&c->recv_lock);
+	res = qb_ipcc_recv(c, c->receive_buf, c->response.max_msg_size,
+			   ms_timeout);
+	(void)pthread_mutex_lock(&c->recv_lock);
+
+	if (res >= 0) {
+		w = _waiter_find(c, c->receive_buf, res);
+		if (w == NULL) {
+			/* the thread gave up waiting for it */
+		} else if (res > w->res_len) {
+			_waiter_done(w, -ENOBUFS);
+		} else {
+			memcpy(w->res_msg, c->receive_buf, res);
+			_waiter_done(w, res);
+		}
+	} else if (res != -ETIMEDOUT && res != -EAGAIN) {
+		/* nobody is getting an answer */
+		qb_list_for_each_entry_safe(w, tmp, &c->waiters, list) {
+			_waiter_done(w, res);
+		}
+	}
+	return res;
+}
+
+static ssize_t
+_sendv_recv_shared(struct qb_ipcc_connection * c,
+		   const struct iovec * iov, uint32_t iov_len,
+		   void *res_msg, size_t res_len, int32_t ms_timeout)
+{
+	struct qb_ipcc_waiter w;
+	struct qb_ipc_request_header hdr;
+	struct iovec tagged_iov[QB_IPCC_TAGGED_IOV_MAX];
+	struct iovec *tagged = NULL;
+	size_t tagged_len = 0;
+	struct timespec ts;
+	uint64_t deadline = 0;
+	uint64_t now;
+	int32_t timeout_now;
+	int32_t receiver = QB_FALSE;
+	ssize_t res;
+
+	if (ms_timeout >= 0) {
+		deadline = qb_util_nano_current_get() +
+			   (uint64_t)ms_timeout * QB_TIME_NS_IN_MSEC;
+	}
+	w.res_msg = res_msg;
+	w.res_len = res_len;
+	w.res = 0;
+	w.done = QB_FALSE;
+	(void)pthread_cond_init(&w.cond, NULL);
+
+	/*
+	 * Be on the list before the request is, so whoever reads
+	 * the answer finds us.
+	 */
+	if (c->request_tags) {
+		tagged = tagged_iov;
+		if (iov_len + 1 > QB_IPCC_TAGGED_IOV_MAX) {
+			tagged = qb_util_malloc((iov_len + 1) *
+						sizeof(struct iovec));
+		}
+	}
+	(void)pthread_mutex_lock(&c->send_lock);
+	(void)pthread_mutex_lock(&c->recv_lock);
+	w.seq = c->send_seq;
+	w.tag = 0;
+	if (tagged) {
+		/* 0 is untagged */
+		w.tag = (uint32_t)(w.seq + 1) ? (uint32_t)(w.seq + 1) : 1;
+		tagged_len = qb_ipc_iov_tag(iov, iov_len, &hdr, sizeof(hdr),
+					    w.tag, tagged);
+		if (tagged_len == 0) {
+			w.tag = 0;
+		}
+	}
+	qb_list_add_tail(&w.list, &c->waiters);
+	(void)pthread_mutex_unlock(&c->recv_lock);
+
+	if (tagged_len > 0) {
+		res = _sendv_flags(c, tagged, tagged_len, 0);
+	} else {
+		res = _sendv_flags(c, iov, iov_len, 0);
+	}
+	if (tagged != NULL && tagged != tagged_iov) {
+		qb_util_free(tagged);
+	}
+
+	(void)pthread_mutex_lock(&c->recv_lock);
+	if (res < 0) {
+		qb_list_del(&w.list);
+		(void)pthread_mutex_unlock(&c->send_lock);
+		goto cleanup;
+	}
+	c->send_seq++;
+	(void)pthread_mutex_unlock(&c->send_lock);
+
+	while (!w.done) {
+		timeout_now = QB_IPC_MAX_WAIT_MS;
+		if (ms_timeout >= 0) {
+			now = qb_util_nano_current_get();
+			if (now >= deadline) {
+				res = -ETIMEDOUT;
+				break;
+			}
+			timeout_now = QB_MIN(timeout_now,
+					     (deadline - now +
+					      QB_TIME_NS_IN_MSEC - 1) /
+					     QB_TIME_NS_IN_MSEC);
+		}
+		if (!c->is_connected) {
+			res = -ENOTCONN;
+			break;
+		}
+		if (receiver || !c->receiving) {
+			c->receiving = QB_TRUE;
+			receiver = QB_TRUE;
+			res = _receive_one(c, timeout_now);
+		} else {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			qb_timespec_add_ms(&ts, timeout_now);
+			(void)pthread_cond_timedwait(&w.cond, &c->recv_lock,
+						     &ts);
+		}
+	}
+	if (w.done) {
+		res = w.res;
+	} else {
+		qb_list_del(&w.list);
+	}
+	if (receiver) {
+		_receive_turn_pass(c);
+	}
+
+cleanup:
+	(void)pthread_mutex_unlock(&c->recv_lock);
+	(void)pthread_cond_destroy(&w.cond);
+	return res;
+}
+
 ssize_t
 qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 		   const struct iovec * iov, uint32_t iov_len,
@@ -300,6 +707,10 @@ qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (c->thread_safe) {
+		return _sendv_recv_shared(c, iov, iov_len, res_msg, res_len,
+					  ms_timeout);
+	}
 
 	if (c->funcs.fc_get) {
 		res = c->funcs.fc_get(&c->request);
@@ -382,6 +793,11 @@ qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 		res = qb_ipc_us_recv(&c->setup, &one_byte, 1, -1);
 		if (res != 1) {
 			size = res;
+		} else if (c->funcs.fc_get && c->funcs.fc_set &&
+			   c->funcs.fc_get(&c->event) > 0) {
+			/* the server is holding events back, there's room now */
+			c->funcs.fc_set(&c->event, QB_FALSE);
+			(void)qb_ipc_us_send(&c->setup, &one_byte, 1);
 		}
 	}
 	return _check_connection_state(c, size);
@@ -404,8 +820,45 @@ qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 	if (c->funcs.disconnect) {
 		c->funcs.disconnect(c);
 	}
-	free(c->receive_buf);
-	free(c);
+	if (c->thread_safe) {
+		(void)pthread_mutex_destroy(&c->send_lock);
+		(void)pthread_mutex_destroy(&c->recv_lock);
+	}
+	qb_util_free(c->receive_buf);
+	qb_util_free(c);
+}
+
+int32_t
+qb_ipcc_thread_safe_set(qb_ipcc_connection_t * c, int32_t enable)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	enable = enable ? QB_TRUE : QB_FALSE;
+	if (enable == c->thread_safe) {
+		return 0;
+	}
+	if (enable) {
+		(void)pthread_mutex_init(&c->send_lock, NULL);
+		(void)pthread_mutex_init(&c->recv_lock, NULL);
+		qb_list_init(&c->waiters);
+		c->send_seq = 0;
+		c->recv_seq = 0;
+		c->receiving = QB_FALSE;
+		c->thread_safe = QB_TRUE;
+		return 0;
+	}
+
+	(void)pthread_mutex_lock(&c->recv_lock);
+	if (!qb_list_empty(&c->waiters)) {
+		(void)pthread_mutex_unlock(&c->recv_lock);
+		return -EBUSY;
+	}
+	(void)pthread_mutex_unlock(&c->recv_lock);
+	c->thread_safe = QB_FALSE;
+	(void)pthread_mutex_destroy(&c->send_lock);
+	(void)pthread_mutex_destroy(&c->recv_lock);
+	return 0;
 }
 
 void
@@ -440,6 +893,35 @@ qb_ipcc_is_connected(qb_ipcc_connection_t *c)
 	return c->is_connected;
 }
 
+int32_t
+qb_ipcc_priority_msg_size_get(qb_ipcc_connection_t * c)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	return c->control.max_msg_size;
+}
+
+int32_t
+qb_ipcc_large_msg_threshold_set(qb_ipcc_connection_t * c, size_t threshold)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (!c->large_msg_supported) {
+		return -ENOTSUP;
+	}
+	if (threshold == 0) {
+		c->large_msg_threshold = 0;
+		return 0;
+	}
+	if (threshold < sizeof(struct qb_ipc_large_request)) {
+		return -EINVAL;
+	}
+	c->large_msg_threshold = QB_MIN(threshold, c->request.max_msg_size);
+	return 0;
+}
+
 int32_t
 qb_ipcc_get_buffer_size(qb_ipcc_connection_t * c)
 {
@@ -19,28 +19,67 @@
  * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "os_base.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <sched.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif /* HAVE_SYS_TIMERFD_H */
 
 #include "util_int.h"
 #include "ipc_int.h"
+#include "ringbuffer_int.h"
+#include "probes.h"
 #include <qb/qbdefs.h>
 #include <qb/qbatomic.h>
 #include <qb/qbipcs.h>
 
 static void qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c,
 				    int32_t fc_enable);
+static void _large_msg_unmap(struct qb_ipcs_connection *c);
 static int32_t
 new_event_notification(struct qb_ipcs_connection * c);
+static void _async_done_drain(void *data);
+static void _busy_poll_ready(struct qb_ipcs_connection *c);
+static void _busy_poll_dispatch(struct qb_ipcs_service *s);
+static void _busy_poll_del(struct qb_ipcs_connection *c);
+static void _busy_poll_stop(struct qb_ipcs_service *s);
+static void _busy_poll_ready_flush(struct qb_ipcs_service *s);
+static int32_t _busy_poll_pending(struct qb_ipcs_connection *c);
+static void _setup_done_drain(struct qb_ipcs_service *s);
+static void _stats_fill(void *data, uint64_t *values);
+static void _setup_stop(struct qb_ipcs_service *s);
 
 static QB_LIST_DECLARE(qb_ipc_services);
 
+static const char * const stats_labels[] = {
+	"connections",
+	"closed",
+	"requests",
+	"responses",
+	"events",
+	"send_retries",
+	"recv_retries",
+	"flow_control",
+	"requests_queued",
+	"events_queued",
+	"events_backlog",
+	"events_coalesced",
+	"connecting",
+};
+#define QB_STATS_IPCS_COUNT (sizeof(stats_labels) / sizeof(stats_labels[0]))
+
 qb_ipcs_service_t *
 qb_ipcs_create(const char *name,
 	       int32_t service_id,
 	       enum qb_ipc_type type, struct qb_ipcs_service_handlers *handlers)
 {
 	struct qb_ipcs_service *s;
+	char stats_name[QB_STATS_NAME_MAX];
+	int32_t i;
 
-	s = calloc(1, sizeof(struct qb_ipcs_service));
+	s = qb_util_calloc(1, sizeof(struct qb_ipcs_service));
 	if (s == NULL) {
 		return NULL;
 	}
@@ -74,6 +113,32 @@ qb_ipcs_create(const char *name,
 	qb_list_init(&s->list);
 	qb_list_add(&s->list, &qb_ipc_services);
 
+	(void)pthread_mutex_init(&s->async_lock, NULL);
+	qb_list_init(&s->async_done);
+	qb_list_init(&s->busy_poll_ready);
+	s->async_pipe[0] = -1;
+	s->async_pipe[1] = -1;
+
+	s->busy_poll_state = QB_IPCS_BUSY_POLL_OFF;
+	(void)pthread_mutex_init(&s->busy_poll_lock, NULL);
+	(void)pthread_cond_init(&s->busy_poll_cond, NULL);
+	s->idle_trim_fd = -1;
+
+	(void)pthread_mutex_init(&s->setup_lock, NULL);
+	(void)pthread_cond_init(&s->setup_cond, NULL);
+	qb_list_init(&s->setup_queue);
+	qb_list_init(&s->setup_done);
+
+	snprintf(stats_name, QB_STATS_NAME_MAX, "ipcs-%.*s",
+		 (int)(QB_STATS_NAME_MAX - 6), s->name);
+	s->stats_provider = qb_stats_provider_add(stats_name, stats_labels,
+						  QB_STATS_IPCS_COUNT,
+						  _stats_fill, s);
+
+	for (i = 0; i < QB_IPCS_CLASSES_MAX; i++) {
+		s->classes[i].weight = 1;
+	}
+
 	return s;
 }
 
@@ -154,16 +219,26 @@ static int32_t
 _modify_dispatch_descriptor_(struct qb_ipcs_connection *c)
 {
 	qb_ipcs_dispatch_mod_fn disp_mod = c->service->poll_fns.dispatch_mod;
+	int32_t events = c->poll_events;
+
+	if (c->service->notifications_are_hints) {
+		/* requests may be waiting without a byte in the socket */
+		_busy_poll_ready(c);
+	}
+	if (c->ordered_pending) {
+		/* no new requests until the ordered deferred one completes */
+		events &= ~POLLIN;
+	}
 
 	if (c->service->type == QB_IPC_SOCKET) {
 		return disp_mod(c->service->poll_priority,
-				c->event.u.us.sock,
-				c->poll_events, c,
+				c->request.u.us.sock,
+				events, c,
 				qb_ipcs_dispatch_connection_request);
 	} else {
 		return disp_mod(c->service->poll_priority,
 				c->setup.u.us.sock,
-				c->poll_events, c,
+				events, c,
 				qb_ipcs_dispatch_connection_request);
 	}
 	return -EINVAL;
@@ -212,6 +287,103 @@ qb_ipcs_request_rate_limit(struct qb_ipcs_service *s,
 	}
 }
 
+int32_t
+qb_ipcs_fair_queuing_set(struct qb_ipcs_service *s, uint32_t quantum)
+{
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	s->fq_quantum = quantum;
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		c->deficit = 0;
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_class_weight_set(struct qb_ipcs_service *s, uint32_t class_id,
+			 uint32_t weight)
+{
+	if (s == NULL || class_id >= QB_IPCS_CLASSES_MAX || weight == 0) {
+		return -EINVAL;
+	}
+	s->classes[class_id].weight = weight;
+	return 0;
+}
+
+int32_t
+qb_ipcs_class_stats_get(struct qb_ipcs_service *s, uint32_t class_id,
+			struct qb_ipcs_class_stats *stats,
+			int32_t clear_after_read)
+{
+	struct qb_ipcs_class_stats *cs;
+
+	if (s == NULL || stats == NULL || class_id >= QB_IPCS_CLASSES_MAX) {
+		return -EINVAL;
+	}
+	cs = &s->classes[class_id].stats;
+	memcpy(stats, cs, sizeof(struct qb_ipcs_class_stats));
+	if (clear_after_read) {
+		cs->requests = 0;
+		cs->bytes = 0;
+		cs->throttled = 0;
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_priority_lane_set(struct qb_ipcs_service *s, int32_t enable)
+{
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (s->type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	s->priority_lane = enable;
+	return 0;
+}
+
+/*
+ * Keep count of the connections in each class that have requests
+ * waiting, idle ones don't get a slice of the class's share.
+ */
+static void
+_fq_backlogged_set(struct qb_ipcs_connection *c, int32_t backlogged)
+{
+	struct qb_ipcs_class *cls = &c->service->classes[c->class_id];
+
+	backlogged = backlogged ? QB_TRUE : QB_FALSE;
+	if (backlogged == c->fq_backlogged) {
+		return;
+	}
+	c->fq_backlogged = backlogged;
+	if (backlogged) {
+		cls->backlogged++;
+	} else {
+		cls->backlogged--;
+	}
+}
+
+/*
+ * The number of bytes a connection may process each time
+ * it is dispatched.
+ */
+static int64_t
+_fq_quantum_get(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_class *cls = &c->service->classes[c->class_id];
+	int64_t q;
+
+	q = (int64_t)c->service->fq_quantum * cls->weight * c->weight;
+	q /= QB_MAX(cls->backlogged, 1);
+	return QB_MAX(q, 1);
+}
+
 void
 qb_ipcs_ref(struct qb_ipcs_service *s)
 {
@@ -227,7 +399,20 @@ qb_ipcs_unref(struct qb_ipcs_service *s)
 	free_it = qb_atomic_int_dec_and_test(&s->ref_count);
 	if (free_it) {
 		qb_util_log(LOG_DEBUG, "%s() - destroying", __func__);
-		free(s);
+		if (s->async_pipe[0] >= 0) {
+			close(s->async_pipe[0]);
+			close(s->async_pipe[1]);
+		}
+		(void)pthread_mutex_destroy(&s->async_lock);
+		if (s->idle_trim_fd >= 0) {
+			close(s->idle_trim_fd);
+		}
+		(void)pthread_mutex_destroy(&s->busy_poll_lock);
+		(void)pthread_cond_destroy(&s->busy_poll_cond);
+		(void)pthread_mutex_destroy(&s->setup_lock);
+		(void)pthread_cond_destroy(&s->setup_cond);
+		qb_stats_provider_del(s->stats_provider);
+		qb_util_free(s);
 	}
 }
 
@@ -241,6 +426,8 @@ qb_ipcs_destroy(struct qb_ipcs_service *s)
 	if (s == NULL) {
 		return;
 	}
+	_busy_poll_stop(s);
+	_setup_stop(s);
 	qb_list_for_each_safe(pos, n, &s->connections) {
 		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
 		if (c == NULL) {
@@ -248,7 +435,14 @@ qb_ipcs_destroy(struct qb_ipcs_service *s)
 		}
 		qb_ipcs_disconnect(c);
 	}
+	_busy_poll_ready_flush(s);
 	(void)qb_ipcs_us_withdraw(s);
+	if (s->async_pipe[0] >= 0) {
+		(void)s->poll_fns.dispatch_del(s->async_pipe[0]);
+	}
+	if (s->idle_trim_fd >= 0) {
+		(void)s->poll_fns.dispatch_del(s->idle_trim_fd);
+	}
 
 	/* service destroyed, remove initial alloc ref */
 	qb_ipcs_unref(s);
@@ -281,17 +475,62 @@ _response_sock_one_way_get(struct qb_ipcs_connection * c)
 	return NULL;
 }
 
+#define QB_IPCS_TAGGED_IOV_MAX 8
+
+/*
+ * Echo the tag of the request being answered so a shared client
+ * connection can match the response even when it is out of order.
+ */
+static ssize_t
+_response_sendv_tagged(struct qb_ipcs_connection *c,
+		       const struct iovec *iov, size_t iov_len)
+{
+	struct qb_ipc_response_header hdr;
+	struct iovec tagged_iov[QB_IPCS_TAGGED_IOV_MAX];
+	struct iovec *tagged = tagged_iov;
+	size_t tagged_len;
+	ssize_t res;
+
+	if (iov_len + 1 > QB_IPCS_TAGGED_IOV_MAX) {
+		tagged = qb_util_malloc((iov_len + 1) * sizeof(struct iovec));
+		if (tagged == NULL) {
+			return -ENOMEM;
+		}
+	}
+	tagged_len = qb_ipc_iov_tag(iov, iov_len, &hdr, sizeof(hdr),
+				    c->response_tag, tagged);
+	if (tagged_len > 0) {
+		res = c->service->funcs.sendv(&c->response, tagged,
+					      tagged_len);
+	} else {
+		res = c->service->funcs.sendv(&c->response, iov, iov_len);
+	}
+	if (tagged != tagged_iov) {
+		qb_util_free(tagged);
+	}
+	return res;
+}
+
 ssize_t
 qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 		      size_t size)
 {
+	struct iovec iov;
 	ssize_t res;
 
 	if (c == NULL) {
 		return -EINVAL;
 	}
 	qb_ipcs_connection_ref(c);
-	res = c->service->funcs.send(&c->response, data, size);
+	if (c->response_tag != 0) {
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		res = _response_sendv_tagged(c, &iov, 1);
+	} else {
+		res = c->service->funcs.send(&c->response, data, size);
+	}
+	QB_PROBE3(ipc__response__send, (const char *)c->service->name,
+		  c->pid, res);
 	if (res == size) {
 		c->stats.responses++;
 	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
@@ -309,84 +548,1263 @@ qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 	return res;
 }
 
-ssize_t
-qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
-		       size_t iov_len)
+ssize_t
+qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
+		       size_t iov_len)
+{
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	qb_ipcs_connection_ref(c);
+	if (c->response_tag != 0) {
+		res = _response_sendv_tagged(c, iov, iov_len);
+	} else {
+		res = c->service->funcs.sendv(&c->response, iov, iov_len);
+	}
+	QB_PROBE3(ipc__response__send, (const char *)c->service->name,
+		  c->pid, res);
+	if (res > 0) {
+		c->stats.responses++;
+	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
+		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
+		if (ow) {
+			ssize_t res2 = qb_ipc_us_ready(ow, &c->setup, 0, POLLOUT);
+			if (res2 < 0) {
+				res = res2;
+			}
+		}
+		c->stats.send_retries++;
+	}
+	qb_ipcs_connection_unref(c);
+
+	return res;
+}
+
+/*
+ * deferred requests
+ */
+static int32_t
+_async_pipe_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		/* drain the wakeups */
+	}
+	_async_done_drain(data);
+	_setup_done_drain((struct qb_ipcs_service *)data);
+	_busy_poll_dispatch((struct qb_ipcs_service *)data);
+	return 0;
+}
+
+static int32_t
+_async_pipe_create(struct qb_ipcs_service *s)
+{
+	int32_t res;
+
+	if (s->async_pipe[0] >= 0) {
+		return 0;
+	}
+	if (pipe(s->async_pipe) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "Can't create async pipe");
+		return res;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(s->async_pipe[0]);
+	(void)qb_sys_fd_nonblock_cloexec_set(s->async_pipe[1]);
+
+	res = s->poll_fns.dispatch_add(s->poll_priority, s->async_pipe[0],
+				       POLLIN | POLLPRI | POLLNVAL,
+				       s, _async_pipe_dispatch);
+	if (res < 0) {
+		close(s->async_pipe[0]);
+		close(s->async_pipe[1]);
+		s->async_pipe[0] = -1;
+		s->async_pipe[1] = -1;
+	}
+	return res;
+}
+
+qb_ipcs_pending_t *
+qb_ipcs_request_defer(struct qb_ipcs_connection *c, uint32_t flags)
+{
+	struct qb_ipcs_pending *p;
+	struct qb_ipc_request_header *hdr;
+	int32_t res;
+
+	if (c == NULL || c->msg_in_process == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (c->deferred) {
+		errno = EBUSY;
+		return NULL;
+	}
+	res = _async_pipe_create(c->service);
+	if (res < 0) {
+		errno = -res;
+		return NULL;
+	}
+
+	p = qb_util_calloc(1, sizeof(struct qb_ipcs_pending));
+	if (p == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	hdr = c->msg_in_process;
+	p->flags = flags;
+	p->request_size = hdr->size;
+	/*
+	 * even an ordered request is copied, the worker may still be
+	 * looking at it after the client has gone and the rings with it.
+	 */
+	p->request = qb_util_malloc(hdr->size);
+	if (p->request == NULL) {
+		qb_util_free(p);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(p->request, hdr, hdr->size);
+	qb_list_init(&p->list);
+	qb_ipcs_connection_ref(c);
+	p->c = c;
+	c->deferred = p;
+
+	return p;
+}
+
+void *
+qb_ipcs_pending_request_get(struct qb_ipcs_pending *p, size_t *size)
+{
+	if (p == NULL) {
+		return NULL;
+	}
+	if (size) {
+		*size = p->request_size;
+	}
+	return p->request;
+}
+
+int32_t
+qb_ipcs_response_complete(struct qb_ipcs_pending *p,
+			  const void *data, size_t size)
+{
+	struct qb_ipcs_service *s;
+	char one = 1;
+
+	if (p == NULL || (data == NULL && size > 0)) {
+		return -EINVAL;
+	}
+	if (data) {
+		p->response = qb_util_malloc(size);
+		if (p->response == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(p->response, data, size);
+		p->response_size = size;
+	}
+
+	s = p->c->service;
+	(void)pthread_mutex_lock(&s->async_lock);
+	qb_list_add_tail(&p->list, &s->async_done);
+	(void)pthread_mutex_unlock(&s->async_lock);
+
+	if (write(s->async_pipe[1], &one, 1) == -1 && errno != EAGAIN) {
+		return -errno;
+	}
+	return 0;
+}
+
+static void
+_pending_free(struct qb_ipcs_pending *p)
+{
+	qb_util_free(p->request);
+	qb_util_free(p->response);
+	qb_util_free(p);
+}
+
+static ssize_t
+_pending_finish(struct qb_ipcs_pending *p)
+{
+	struct qb_ipcs_connection *c = p->c;
+	ssize_t res = 0;
+
+	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED && p->response) {
+		if (c->request_tags) {
+			c->response_tag = qb_ipc_tag_get(p->request);
+		}
+		res = qb_ipcs_response_send(c, p->response, p->response_size);
+		c->response_tag = 0;
+		if (res == -EAGAIN || res == -ETIMEDOUT || res == -ENOBUFS) {
+			return -EAGAIN;
+		}
+		if (res < 0) {
+			errno = -res;
+			qb_util_perror(LOG_WARNING, "deferred response (%s)",
+				       c->description);
+		}
+	}
+
+	if (c->ordered_pending == p) {
+		c->ordered_pending = NULL;
+		if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+			(void)_modify_dispatch_descriptor_(c);
+		}
+	}
+	qb_ipcs_connection_unref(c);
+	_pending_free(p);
+	return res;
+}
+
+static void
+_async_done_drain(void *data)
+{
+	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
+	struct qb_ipcs_pending *p;
+	struct qb_list_head done;
+	struct qb_list_head retry;
+	struct qb_list_head *pos;
+	struct qb_list_head *n;
+
+	qb_list_init(&done);
+	qb_list_init(&retry);
+
+	(void)pthread_mutex_lock(&s->async_lock);
+	qb_list_splice(&s->async_done, &done);
+	qb_list_init(&s->async_done);
+	(void)pthread_mutex_unlock(&s->async_lock);
+
+	qb_list_for_each_safe(pos, n, &done) {
+		p = qb_list_entry(pos, struct qb_ipcs_pending, list);
+		qb_list_del(&p->list);
+		if (_pending_finish(p) == -EAGAIN) {
+			qb_list_add_tail(&p->list, &retry);
+		}
+	}
+
+	if (!qb_list_empty(&retry)) {
+		/*
+		 * the client isn't keeping up, put them back in front
+		 * of anything completed meanwhile and try again later.
+		 */
+		(void)pthread_mutex_lock(&s->async_lock);
+		qb_list_splice(&retry, &s->async_done);
+		(void)pthread_mutex_unlock(&s->async_lock);
+		(void)s->poll_fns.job_add(QB_LOOP_LOW, s, _async_done_drain);
+	}
+}
+
+/*
+ * busy polling
+ *
+ * A thread watches the write pointer of every shm request ring and
+ * queues the connections whose rings moved for the loop thread,
+ * msg_process() still runs there. Only the first one queued wakes
+ * the loop, whatever comes in while it works through the queue is
+ * picked up on the same wakeup. While the thread is polling a connection the
+ * response ring's user word is set and the client doesn't bother
+ * writing to the socket, so those bytes become hints.
+ */
+static void
+_busy_poll_lock(struct qb_ipcs_service *s)
+{
+	/* get the poller to step aside */
+	qb_atomic_int_inc(&s->busy_poll_waiters);
+	(void)pthread_mutex_lock(&s->busy_poll_lock);
+	qb_atomic_int_add(&s->busy_poll_waiters, -1);
+}
+
+static void
+_busy_poll_doorbell_ring(struct qb_ipcs_service *s)
+{
+	char one = 1;
+
+	if (write(s->async_pipe[1], &one, 1) == -1) {
+		/* a full pipe wakes the loop just as well */
+	}
+}
+
+/*
+ * Queue a connection for _busy_poll_dispatch(), the queue holds a
+ * reference. Called from the poll thread as well as the loop thread.
+ */
+static void
+_busy_poll_ready(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t wake = QB_FALSE;
+
+	(void)pthread_mutex_lock(&s->async_lock);
+	if (qb_list_empty(&c->busy_poll_ready)) {
+		qb_ipcs_connection_ref(c);
+		qb_list_add_tail(&c->busy_poll_ready, &s->busy_poll_ready);
+	}
+	if (!s->busy_poll_doorbell) {
+		/* otherwise the loop is already on its way */
+		s->busy_poll_doorbell = QB_TRUE;
+		wake = QB_TRUE;
+	}
+	(void)pthread_mutex_unlock(&s->async_lock);
+
+	if (wake) {
+		_busy_poll_doorbell_ring(s);
+	}
+}
+
+static int32_t
+_busy_poll_scan(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_poll_ring *r;
+	uint32_t pt;
+	uint32_t i;
+	int32_t found;
+	int32_t moved = 0;
+
+	for (i = 0; i < s->busy_poll_count; i++) {
+		r = &s->busy_poll_rings[i];
+		if (!r->armed) {
+			/* anything before this still comes with a byte */
+			r->request_seen = *r->request_pt;
+			if (r->control_pt) {
+				r->control_seen = *r->control_pt;
+			}
+			qb_atomic_int_set(r->polled, QB_TRUE);
+			r->armed = QB_TRUE;
+			continue;
+		}
+		found = QB_FALSE;
+		pt = *r->request_pt;
+		if (pt != r->request_seen) {
+			r->request_seen = pt;
+			found = QB_TRUE;
+		}
+		if (r->control_pt) {
+			pt = *r->control_pt;
+			if (pt != r->control_seen) {
+				r->control_seen = pt;
+				found = QB_TRUE;
+			}
+		}
+		if (found) {
+			_busy_poll_ready(r->c);
+			moved++;
+		}
+	}
+	return moved;
+}
+
+/*
+ * Tell the clients to go back to sending bytes, unless one of them
+ * wrote a request meanwhile without one.
+ */
+static int32_t
+_busy_poll_disarm(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_poll_ring *r;
+	uint32_t i;
+	int32_t found = 0;
+
+	for (i = 0; i < s->busy_poll_count; i++) {
+		qb_atomic_int_set(s->busy_poll_rings[i].polled, QB_FALSE);
+	}
+#ifdef HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS
+	/* pairs with the one between the ring write and the flag read */
+	__sync_synchronize();
+#endif /* HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS */
+	for (i = 0; i < s->busy_poll_count; i++) {
+		r = &s->busy_poll_rings[i];
+		if (!r->armed) {
+			continue;
+		}
+		if (*r->request_pt != r->request_seen ||
+		    (r->control_pt && *r->control_pt != r->control_seen)) {
+			found++;
+		}
+	}
+	for (i = 0; i < s->busy_poll_count; i++) {
+		r = &s->busy_poll_rings[i];
+		if (found && r->armed) {
+			/* still busy, pick the changes up on the next scan */
+			qb_atomic_int_set(r->polled, QB_TRUE);
+		} else {
+			r->armed = QB_FALSE;
+		}
+	}
+	return found;
+}
+
+static void *
+_busy_poll_thread(void *data)
+{
+	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
+	uint64_t last_active = 0;
+	uint64_t now;
+
+	(void)pthread_mutex_lock(&s->busy_poll_lock);
+	while (s->busy_poll_state != QB_IPCS_BUSY_POLL_STOP) {
+		if (s->busy_poll_state == QB_IPCS_BUSY_POLL_IDLE) {
+			(void)pthread_cond_wait(&s->busy_poll_cond,
+						&s->busy_poll_lock);
+			last_active = qb_util_nano_current_get();
+			continue;
+		}
+
+		now = qb_util_nano_current_get();
+		if (_busy_poll_scan(s) > 0) {
+			last_active = now;
+		} else if (now - last_active >
+			   s->busy_poll_usec * QB_TIME_NS_IN_USEC) {
+			if (_busy_poll_disarm(s) > 0) {
+				last_active = now;
+			} else {
+				s->busy_poll_state = QB_IPCS_BUSY_POLL_IDLE;
+				continue;
+			}
+		}
+
+		(void)pthread_mutex_unlock(&s->busy_poll_lock);
+		while (qb_atomic_int_get(&s->busy_poll_waiters) > 0) {
+			sched_yield();
+		}
+		(void)pthread_mutex_lock(&s->busy_poll_lock);
+	}
+	(void)pthread_mutex_unlock(&s->busy_poll_lock);
+	return NULL;
+}
+
+static void
+_busy_poll_wake(struct qb_ipcs_service *s)
+{
+	if (qb_atomic_int_get(&s->busy_poll_state) != QB_IPCS_BUSY_POLL_IDLE) {
+		return;
+	}
+	_busy_poll_lock(s);
+	if (s->busy_poll_state == QB_IPCS_BUSY_POLL_IDLE) {
+		s->busy_poll_state = QB_IPCS_BUSY_POLL_RUNNING;
+		(void)pthread_cond_signal(&s->busy_poll_cond);
+	}
+	(void)pthread_mutex_unlock(&s->busy_poll_lock);
+}
+
+int32_t
+qb_ipcs_busy_poll_add(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+	struct qb_ipcs_poll_ring *rings;
+	struct qb_ipcs_poll_ring *r;
+	uint32_t alloc;
+
+	if (s->busy_poll_state == QB_IPCS_BUSY_POLL_OFF ||
+	    c->busy_poll_slot >= 0 || c->request.u.shm.rb == NULL) {
+		return 0;
+	}
+
+	_busy_poll_lock(s);
+	if (s->busy_poll_count == s->busy_poll_alloc) {
+		alloc = QB_MAX(16, s->busy_poll_alloc * 2);
+		rings = qb_util_realloc(s->busy_poll_rings,
+				alloc * sizeof(struct qb_ipcs_poll_ring));
+		if (rings == NULL) {
+			/* it keeps getting woken up through the socket */
+			(void)pthread_mutex_unlock(&s->busy_poll_lock);
+			return -ENOMEM;
+		}
+		s->busy_poll_rings = rings;
+		s->busy_poll_alloc = alloc;
+	}
+	r = &s->busy_poll_rings[s->busy_poll_count];
+	memset(r, 0, sizeof(struct qb_ipcs_poll_ring));
+	r->request_pt = &c->request.u.shm.rb->shared_hdr->write_pt;
+	if (c->control.max_msg_size > 0 && c->control.u.shm.rb) {
+		r->control_pt = &c->control.u.shm.rb->shared_hdr->write_pt;
+	}
+	r->polled = qb_rb_shared_user_data_get(c->response.u.shm.rb);
+	r->c = c;
+	c->busy_poll_slot = s->busy_poll_count++;
+	(void)pthread_mutex_unlock(&s->busy_poll_lock);
+	return 0;
+}
+
+static void
+_busy_poll_del(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t slot = c->busy_poll_slot;
+
+	if (slot < 0) {
+		return;
+	}
+
+	_busy_poll_lock(s);
+	qb_atomic_int_set(s->busy_poll_rings[slot].polled, QB_FALSE);
+	s->busy_poll_count--;
+	if (slot != s->busy_poll_count) {
+		/* keep the array packed */
+		s->busy_poll_rings[slot] = s->busy_poll_rings[s->busy_poll_count];
+		s->busy_poll_rings[slot].c->busy_poll_slot = slot;
+	}
+	c->busy_poll_slot = -1;
+	(void)pthread_mutex_unlock(&s->busy_poll_lock);
+}
+
+static void
+_busy_poll_stop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+	uint32_t i;
+
+	if (s->busy_poll_state == QB_IPCS_BUSY_POLL_OFF) {
+		return;
+	}
+
+	_busy_poll_lock(s);
+	s->busy_poll_state = QB_IPCS_BUSY_POLL_STOP;
+	(void)pthread_cond_signal(&s->busy_poll_cond);
+	(void)pthread_mutex_unlock(&s->busy_poll_lock);
+	(void)pthread_join(s->busy_poll_thread, NULL);
+
+	for (i = 0; i < s->busy_poll_count; i++) {
+		qb_atomic_int_set(s->busy_poll_rings[i].polled, QB_FALSE);
+		s->busy_poll_rings[i].c->busy_poll_slot = -1;
+	}
+	qb_util_free(s->busy_poll_rings);
+	s->busy_poll_rings = NULL;
+	s->busy_poll_count = 0;
+	s->busy_poll_alloc = 0;
+	s->busy_poll_usec = 0;
+	s->busy_poll_state = QB_IPCS_BUSY_POLL_OFF;
+
+	/* pick up whatever went unannounced */
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		if (_busy_poll_pending(c)) {
+			_busy_poll_ready(c);
+		}
+	}
+}
+
+/*
+ * Is there anything on the rings that dispatch would take now?
+ */
+static int32_t
+_busy_poll_pending(struct qb_ipcs_connection *c)
+{
+	if (c->state != QB_IPCS_CONNECTION_ESTABLISHED) {
+		return QB_FALSE;
+	}
+	if (c->control.max_msg_size > 0 &&
+	    c->service->funcs.q_len_get(&c->control) > 0) {
+		return QB_TRUE;
+	}
+	if (c->fc_enabled || c->ordered_pending) {
+		/* the doorbell rings again once that's over */
+		return QB_FALSE;
+	}
+	return (c->service->funcs.q_len_get(&c->request) > 0);
+}
+
+/* connections dispatched per wakeup before the loop gets a turn */
+#define QB_IPCS_BUSY_POLL_BUDGET 64
+
+static struct qb_ipcs_connection *
+_busy_poll_ready_pop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c = NULL;
+
+	(void)pthread_mutex_lock(&s->async_lock);
+	if (qb_list_empty(&s->busy_poll_ready)) {
+		/* the next one in has to ring again */
+		s->busy_poll_doorbell = QB_FALSE;
+	} else {
+		c = qb_list_first_entry(&s->busy_poll_ready,
+					struct qb_ipcs_connection,
+					busy_poll_ready);
+		/* off the queue first, so it can come straight back */
+		qb_list_del(&c->busy_poll_ready);
+		qb_list_init(&c->busy_poll_ready);
+	}
+	(void)pthread_mutex_unlock(&s->async_lock);
+	return c;
+}
+
+static void
+_busy_poll_dispatch(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c;
+	uint32_t budget;
+
+	for (budget = QB_IPCS_BUSY_POLL_BUDGET; budget > 0; budget--) {
+		c = _busy_poll_ready_pop(s);
+		if (c == NULL) {
+			return;
+		}
+		if (_busy_poll_pending(c)) {
+			(void)qb_ipcs_dispatch_connection_request(c->setup.u.us.sock,
+								  POLLIN, c);
+		}
+		qb_ipcs_connection_unref(c);
+	}
+	/* let the rest of the loop have a go, the doorbell is still up */
+	_busy_poll_doorbell_ring(s);
+}
+
+/*
+ * Drop whatever is still queued, the loop isn't going to get to it.
+ */
+static void
+_busy_poll_ready_flush(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c;
+
+	while ((c = _busy_poll_ready_pop(s)) != NULL) {
+		qb_ipcs_connection_unref(c);
+	}
+}
+
+int32_t
+qb_ipcs_busy_poll_set(struct qb_ipcs_service *s, uint32_t idle_usec)
+{
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+	int32_t res;
+
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (s->type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	if (s->poll_fns.dispatch_add == NULL) {
+		return -EINVAL;
+	}
+
+	if (idle_usec == 0) {
+		_busy_poll_stop(s);
+		return 0;
+	}
+	if (s->busy_poll_state != QB_IPCS_BUSY_POLL_OFF) {
+		_busy_poll_lock(s);
+		s->busy_poll_usec = idle_usec;
+		(void)pthread_mutex_unlock(&s->busy_poll_lock);
+		return 0;
+	}
+
+	res = _async_pipe_create(s);
+	if (res < 0) {
+		return res;
+	}
+	s->busy_poll_usec = idle_usec;
+	s->busy_poll_state = QB_IPCS_BUSY_POLL_IDLE;
+	res = pthread_create(&s->busy_poll_thread, NULL, _busy_poll_thread, s);
+	if (res != 0) {
+		s->busy_poll_usec = 0;
+		s->busy_poll_state = QB_IPCS_BUSY_POLL_OFF;
+		return -res;
+	}
+	/* from now on a client may leave out the byte */
+	s->notifications_are_hints = QB_TRUE;
+
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+			(void)qb_ipcs_busy_poll_add(c);
+		}
+	}
+	return 0;
+}
+
+/*
+ * idle trimming
+ */
+static int32_t
+_idle_trim_connection(struct qb_ipcs_connection *c)
+{
+	int32_t res;
+
+	/* only the rings we write, the client writes the others */
+	res = c->service->funcs.trim(&c->response);
+	if (res < 0) {
+		return res;
+	}
+	if (c->event_backlog_len > 0) {
+		return -EBUSY;
+	}
+	return c->service->funcs.trim(&c->event);
+}
+
+static int32_t
+_idle_trim_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+	uint64_t expirations;
+	uint64_t activity;
+	uint64_t now;
+	int32_t res;
+
+	if (read(fd, &expirations, sizeof(expirations)) == -1) {
+		/* nothing to do about it, the timer keeps going */
+	}
+	if (s->funcs.trim == NULL) {
+		return 0;
+	}
+
+	now = qb_util_nano_current_get();
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		if (c->state != QB_IPCS_CONNECTION_ESTABLISHED) {
+			continue;
+		}
+		activity = c->stats.requests + c->stats.responses +
+			c->stats.events;
+		if (c->idle_since == 0 || activity != c->idle_activity) {
+			c->idle_activity = activity;
+			c->idle_since = now;
+			c->idle_trimmed = QB_FALSE;
+			continue;
+		}
+		if (c->idle_trimmed ||
+		    now - c->idle_since < s->idle_trim_ms * QB_TIME_NS_IN_MSEC) {
+			continue;
+		}
+		res = _idle_trim_connection(c);
+		if (res == 0) {
+			qb_util_log(LOG_TRACE, "trimmed idle connection (%s)",
+				    c->description);
+			c->idle_trimmed = QB_TRUE;
+		} else if (res != -EBUSY) {
+			errno = -res;
+			qb_util_perror(LOG_DEBUG, "can't trim (%s)",
+				       c->description);
+			c->idle_trimmed = QB_TRUE;
+		}
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_idle_trim_set(struct qb_ipcs_service *s, uint32_t idle_ms)
+{
+#ifdef HAVE_TIMERFD_CREATE
+	struct itimerspec its;
+	int32_t res;
+
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (s->type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	if (s->poll_fns.dispatch_add == NULL) {
+		return -EINVAL;
+	}
+
+	if (s->idle_trim_fd < 0 && idle_ms > 0) {
+		s->idle_trim_fd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->idle_trim_fd < 0) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "timerfd_create");
+			return res;
+		}
+		res = s->poll_fns.dispatch_add(QB_LOOP_LOW, s->idle_trim_fd,
+					       POLLIN, s, _idle_trim_dispatch);
+		if (res < 0) {
+			close(s->idle_trim_fd);
+			s->idle_trim_fd = -1;
+			return res;
+		}
+	}
+	if (s->idle_trim_fd < 0) {
+		return 0;
+	}
+
+	/* look every quiet period, so it takes between one and two */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = idle_ms / QB_TIME_MS_IN_SEC;
+	its.it_value.tv_nsec = (idle_ms % QB_TIME_MS_IN_SEC) * QB_TIME_NS_IN_MSEC;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(s->idle_trim_fd, 0, &its, NULL) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "timerfd_settime");
+		return res;
+	}
+	s->idle_trim_ms = idle_ms;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif /* HAVE_TIMERFD_CREATE */
+}
+
+/*
+ * connection setup
+ *
+ * Creating a connection's rings means creating, sizing and zeroing
+ * four files, which adds up when a few hundred clients reconnect at
+ * once. It is done on a setup thread while the loop goes on accepting
+ * and serving, the loop thread picks the connection up again through
+ * the async pipe to register it and answer the client.
+ */
+static void *
+_setup_thread(void *data)
+{
+	struct qb_ipcs_service *s = data;
+	struct qb_ipcs_connection *c;
+	char one = 1;
+
+	(void)pthread_mutex_lock(&s->setup_lock);
+	while (s->setup_running) {
+		if (qb_list_empty(&s->setup_queue)) {
+			(void)pthread_cond_wait(&s->setup_cond, &s->setup_lock);
+			continue;
+		}
+		c = qb_list_first_entry(&s->setup_queue,
+					struct qb_ipcs_connection, list);
+		qb_list_del(&c->list);
+		(void)pthread_mutex_unlock(&s->setup_lock);
+
+		c->setup_res = s->funcs.prepare(s, c, c->setup_response);
+
+		(void)pthread_mutex_lock(&s->setup_lock);
+		qb_list_add_tail(&c->list, &s->setup_done);
+		if (write(s->async_pipe[1], &one, 1) == -1 && errno != EAGAIN) {
+			qb_util_perror(LOG_WARNING, "setup wakeup");
+		}
+	}
+	(void)pthread_mutex_unlock(&s->setup_lock);
+	return NULL;
+}
+
+static struct qb_ipcs_connection *
+_setup_pop(struct qb_ipcs_service *s, struct qb_list_head *head)
+{
+	struct qb_ipcs_connection *c = NULL;
+
+	(void)pthread_mutex_lock(&s->setup_lock);
+	if (!qb_list_empty(head)) {
+		c = qb_list_first_entry(head, struct qb_ipcs_connection, list);
+		qb_list_del(&c->list);
+		qb_list_init(&c->list);
+	}
+	(void)pthread_mutex_unlock(&s->setup_lock);
+	return c;
+}
+
+static void
+_setup_done_drain(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c;
+
+	while ((c = _setup_pop(s, &s->setup_done)) != NULL) {
+		qb_ipcs_us_setup_finish(c);
+	}
+}
+
+static void
+_setup_discard(struct qb_ipcs_connection *c)
+{
+	qb_util_free(c->setup_response);
+	c->setup_response = NULL;
+	/* lets disconnect close the socket and whatever rings there are */
+	c->state = QB_IPCS_CONNECTION_ACTIVE;
+	qb_ipcs_disconnect(c);
+}
+
+static void
+_setup_stop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_connection *c;
+
+	if (!s->setup_running) {
+		return;
+	}
+	(void)pthread_mutex_lock(&s->setup_lock);
+	s->setup_running = QB_FALSE;
+	(void)pthread_cond_signal(&s->setup_cond);
+	(void)pthread_mutex_unlock(&s->setup_lock);
+	(void)pthread_join(s->setup_thread, NULL);
+
+	while ((c = _setup_pop(s, &s->setup_queue)) != NULL) {
+		_setup_discard(c);
+	}
+	while ((c = _setup_pop(s, &s->setup_done)) != NULL) {
+		_setup_discard(c);
+	}
+}
+
+/*
+ * Hand a new connection to the setup thread, qb_ipcs_us_setup_finish()
+ * gets called on the loop thread once its rings exist. Anything but 0
+ * means the caller has to connect it the usual way.
+ */
+int32_t
+qb_ipcs_setup_offload(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t res;
+
+	if (s->funcs.prepare == NULL) {
+		return -ENOTSUP;
+	}
+	if (!s->setup_running) {
+		res = _async_pipe_create(s);
+		if (res < 0) {
+			return res;
+		}
+		s->setup_running = QB_TRUE;
+		res = pthread_create(&s->setup_thread, NULL, _setup_thread, s);
+		if (res != 0) {
+			s->setup_running = QB_FALSE;
+			return -res;
+		}
+	}
+
+	c->setup_response =
+	    qb_util_calloc(1, sizeof(struct qb_ipc_connection_response));
+	if (c->setup_response == NULL) {
+		return -ENOMEM;
+	}
+	(void)pthread_mutex_lock(&s->setup_lock);
+	qb_list_add_tail(&c->list, &s->setup_queue);
+	(void)pthread_cond_signal(&s->setup_cond);
+	(void)pthread_mutex_unlock(&s->setup_lock);
+	return 0;
+}
+
+static int32_t
+resend_event_notifications(struct qb_ipcs_connection *c)
+{
+	ssize_t res = 0;
+
+	if (!c->service->needs_sock_for_poll) {
+		return res;
+	}
+
+	if (c->outstanding_notifiers > 0) {
+		res = qb_ipc_us_send(&c->setup, c->receive_buf,
+				     c->outstanding_notifiers);
+	}
+	if (res > 0) {
+		c->outstanding_notifiers -= res;
+	}
+
+	assert(c->outstanding_notifiers >= 0);
+	if (c->outstanding_notifiers == 0) {
+		c->poll_events = POLLIN | POLLPRI | POLLNVAL;
+		(void)_modify_dispatch_descriptor_(c);
+	}
+	return res;
+}
+
+static int32_t
+new_event_notification(struct qb_ipcs_connection * c)
+{
+	ssize_t res = 0;
+
+	if (!c->service->needs_sock_for_poll) {
+		return res;
+	}
+
+	assert(c->outstanding_notifiers >= 0);
+	if (c->outstanding_notifiers > 0) {
+		c->outstanding_notifiers++;
+		res = resend_event_notifications(c);
+	} else {
+		res = qb_ipc_us_send(&c->setup, &c->outstanding_notifiers, 1);
+		if (res == -EAGAIN) {
+			/*
+			 * notify the client later, when we can.
+			 */
+			c->outstanding_notifiers++;
+			c->poll_events = POLLOUT | POLLIN | POLLPRI | POLLNVAL;
+			(void)_modify_dispatch_descriptor_(c);
+		}
+	}
+	return res;
+}
+
+static void
+_event_entry_free(struct qb_ipcs_event_entry *e)
+{
+	qb_list_del(&e->list);
+	qb_util_free(e->data);
+	qb_util_free(e);
+}
+
+/*
+ * For shm the event ring's flag asks the client to poke us
+ * (with a byte on the setup socket) once it has read something.
+ */
+static void
+_event_backlog_waiting_set(struct qb_ipcs_connection *c, int32_t waiting)
+{
+	if (c->service->needs_sock_for_poll && c->service->funcs.fc_set) {
+		c->service->funcs.fc_set(&c->event, waiting);
+	}
+}
+
+/*
+ * Send as much of the backlog as the client has room for.
+ */
+static int32_t
+_event_backlog_flush(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_event_entry *e;
+	int32_t waiting = QB_FALSE;
+	ssize_t res;
+	ssize_t resn;
+
+	while (!qb_list_empty(&c->event_backlog)) {
+		e = qb_list_first_entry(&c->event_backlog,
+					struct qb_ipcs_event_entry, list);
+		res = c->service->funcs.send(&c->event, e->data, e->size);
+		QB_PROBE3(ipc__event__send, (const char *)c->service->name,
+			  c->pid, res);
+		if (res == -EAGAIN || res == -ETIMEDOUT) {
+			if (waiting) {
+				return -EAGAIN;
+			}
+			/*
+			 * ask to be told when there is room, then try
+			 * once more in case the client just made some.
+			 */
+			_event_backlog_waiting_set(c, QB_TRUE);
+			waiting = QB_TRUE;
+			continue;
+		}
+		if (res == e->size) {
+			c->stats.events++;
+			resn = new_event_notification(c);
+			if (resn < 0 && resn != -EAGAIN && resn != -ENOBUFS) {
+				errno = -resn;
+				qb_util_perror(LOG_WARNING,
+					       "new_event_notification (%s)",
+					       c->description);
+			}
+		} else {
+			errno = -res;
+			qb_util_perror(LOG_WARNING,
+				       "dropping backlogged event (%s)",
+				       c->description);
+		}
+		_event_entry_free(e);
+		c->event_backlog_len--;
+	}
+	if (waiting) {
+		_event_backlog_waiting_set(c, QB_FALSE);
+	}
+	return 0;
+}
+
+static ssize_t
+_event_backlog_add(struct qb_ipcs_connection *c, int32_t keyed, uint64_t key,
+		   const struct iovec *iov, size_t iov_len, size_t size)
+{
+	struct qb_ipcs_event_entry *e;
+	struct qb_list_head *pos;
+	char *data;
+	size_t done = 0;
+	size_t i;
+
+	if (!keyed && c->event_backlog_len >= c->event_backlog_max) {
+		return -EAGAIN;
+	}
+	data = qb_util_malloc(size);
+	if (data == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < iov_len; i++) {
+		memcpy(&data[done], iov[i].iov_base, iov[i].iov_len);
+		done += iov[i].iov_len;
+	}
+
+	if (keyed) {
+		qb_list_for_each(pos, &c->event_backlog) {
+			e = qb_list_entry(pos, struct qb_ipcs_event_entry, list);
+			if (e->keyed && e->key == key) {
+				/* superseded, but it keeps its place */
+				qb_util_free(e->data);
+				e->data = data;
+				e->size = size;
+				c->stats.events_coalesced++;
+				return size;
+			}
+		}
+		if (c->event_backlog_len >= c->event_backlog_max) {
+			qb_util_free(data);
+			return -EAGAIN;
+		}
+	}
+
+	e = qb_util_calloc(1, sizeof(struct qb_ipcs_event_entry));
+	if (e == NULL) {
+		qb_util_free(data);
+		return -ENOMEM;
+	}
+	e->key = key;
+	e->keyed = keyed;
+	e->size = size;
+	e->data = data;
+	qb_list_add_tail(&e->list, &c->event_backlog);
+	c->event_backlog_len++;
+	return size;
+}
+
+static ssize_t
+_event_send_backlogged(struct qb_ipcs_connection *c, int32_t keyed,
+		       uint64_t key, const struct iovec *iov, size_t iov_len)
+{
+	ssize_t res;
+	ssize_t resn;
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+	if (size > c->event.max_msg_size) {
+		return -EMSGSIZE;
+	}
+
+	qb_ipcs_connection_ref(c);
+	/* nothing can overtake what is already queued */
+	if (_event_backlog_flush(c) == 0) {
+		res = c->service->funcs.sendv(&c->event, iov, iov_len);
+		QB_PROBE3(ipc__event__send, (const char *)c->service->name,
+			  c->pid, res);
+		if (res > 0) {
+			c->stats.events++;
+			resn = new_event_notification(c);
+			if (resn < 0 && resn != -EAGAIN && resn != -ENOBUFS) {
+				errno = -resn;
+				qb_util_perror(LOG_WARNING,
+					       "new_event_notification (%s)",
+					       c->description);
+				res = resn;
+			}
+			goto done;
+		} else if (res != -EAGAIN && res != -ETIMEDOUT) {
+			goto done;
+		}
+	}
+
+	res = _event_backlog_add(c, keyed, key, iov, iov_len, size);
+	if (res == -EAGAIN) {
+		c->stats.send_retries++;
+	} else if (res > 0) {
+		(void)_event_backlog_flush(c);
+	}
+
+done:
+	qb_ipcs_connection_unref(c);
+	return res;
+}
+
+int32_t
+qb_ipcs_event_backlog_set(struct qb_ipcs_connection *c, uint32_t max_events)
 {
-	ssize_t res;
+	struct qb_ipcs_event_entry *e;
 
 	if (c == NULL) {
 		return -EINVAL;
 	}
-	qb_ipcs_connection_ref(c);
-	res = c->service->funcs.sendv(&c->response, iov, iov_len);
-	if (res > 0) {
-		c->stats.responses++;
-	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
-		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
-		if (ow) {
-			ssize_t res2 = qb_ipc_us_ready(ow, &c->setup, 0, POLLOUT);
-			if (res2 < 0) {
-				res = res2;
-			}
+	c->event_backlog_max = max_events;
+	if (max_events == 0) {
+		while (!qb_list_empty(&c->event_backlog)) {
+			e = qb_list_first_entry(&c->event_backlog,
+						struct qb_ipcs_event_entry, list);
+			_event_entry_free(e);
+		}
+		c->event_backlog_len = 0;
+		if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+			_event_backlog_waiting_set(c, QB_FALSE);
 		}
-		c->stats.send_retries++;
 	}
-	qb_ipcs_connection_unref(c);
-
-	return res;
+	return 0;
 }
 
-static int32_t
-resend_event_notifications(struct qb_ipcs_connection *c)
+int32_t
+qb_ipcs_connection_ring_size_set(struct qb_ipcs_connection *c, size_t size)
 {
-	ssize_t res = 0;
+	size_t old_size;
+	int32_t polled;
+	int32_t res;
+	int32_t res2;
 
-	if (!c->service->needs_sock_for_poll) {
-		return res;
+	if (c == NULL) {
+		return -EINVAL;
 	}
-
-	if (c->outstanding_notifiers > 0) {
-		res = qb_ipc_us_send(&c->setup, c->receive_buf,
-				     c->outstanding_notifiers);
+	if (c->service->funcs.resize == NULL || !c->follows_resize) {
+		return -ENOTSUP;
 	}
-	if (res > 0) {
-		c->outstanding_notifiers -= res;
+	if (c->state != QB_IPCS_CONNECTION_ESTABLISHED) {
+		return -ENOTCONN;
+	}
+	if (size < c->response.max_msg_size) {
+		return -EINVAL;
 	}
 
-	assert(c->outstanding_notifiers >= 0);
-	if (c->outstanding_notifiers == 0) {
-		c->poll_events = POLLIN | POLLPRI | POLLNVAL;
-		(void)_modify_dispatch_descriptor_(c);
+	old_size = c->ring_size ? c->ring_size : c->response.max_msg_size;
+
+	/* the busy poll flag lives in the response ring */
+	polled = (c->busy_poll_slot >= 0);
+	_busy_poll_del(c);
+	res = c->service->funcs.resize(&c->response, size);
+	if (res == 0) {
+		res = c->service->funcs.resize(&c->event, size);
+		if (res == 0) {
+			c->ring_size = size;
+		} else {
+			/* put the response ring back so the two stay the same */
+			res2 = c->service->funcs.resize(&c->response, old_size);
+			if (res2 != 0) {
+				errno = -res2;
+				qb_util_perror(LOG_WARNING,
+					       "conn (%s) response ring left at %zu bytes",
+					       c->description, size);
+				c->ring_size = size;
+			}
+		}
 	}
-	return res;
+	if (polled) {
+		res2 = qb_ipcs_busy_poll_add(c);
+		if (res2 != 0) {
+			errno = -res2;
+			qb_util_perror(LOG_WARNING,
+				       "conn (%s) no longer busy polled",
+				       c->description);
+			if (res == 0) {
+				res = res2;
+			}
+		}
+	}
+	if (res != 0) {
+		return res;
+	}
+	/* there may be room for what was held back now */
+	(void)_event_backlog_flush(c);
+	return 0;
 }
 
-static int32_t
-new_event_notification(struct qb_ipcs_connection * c)
+ssize_t
+qb_ipcs_event_send_keyed(struct qb_ipcs_connection *c, uint64_t key,
+			 const void *data, size_t size)
 {
-	ssize_t res = 0;
+	struct iovec iov;
 
-	if (!c->service->needs_sock_for_poll) {
-		return res;
+	if (c == NULL) {
+		return -EINVAL;
 	}
-
-	assert(c->outstanding_notifiers >= 0);
-	if (c->outstanding_notifiers > 0) {
-		c->outstanding_notifiers++;
-		res = resend_event_notifications(c);
-	} else {
-		res = qb_ipc_us_send(&c->setup, &c->outstanding_notifiers, 1);
-		if (res == -EAGAIN) {
-			/*
-			 * notify the client later, when we can.
-			 */
-			c->outstanding_notifiers++;
-			c->poll_events = POLLOUT | POLLIN | POLLPRI | POLLNVAL;
-			(void)_modify_dispatch_descriptor_(c);
-		}
+	if (c->event_backlog_max == 0) {
+		return qb_ipcs_event_send(c, data, size);
 	}
-	return res;
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+	return _event_send_backlogged(c, QB_TRUE, key, &iov, 1);
 }
 
 ssize_t
@@ -399,10 +1817,18 @@ qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 		return -EINVAL;
 	} else if (size > c->event.max_msg_size) {
 		return -EMSGSIZE;
+	} else if (c->event_backlog_max > 0) {
+		struct iovec iov;
+
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		return _event_send_backlogged(c, QB_FALSE, 0, &iov, 1);
 	}
 
 	qb_ipcs_connection_ref(c);
 	res = c->service->funcs.send(&c->event, data, size);
+	QB_PROBE3(ipc__event__send, (const char *)c->service->name,
+		  c->pid, res);
 	if (res == size) {
 		c->stats.events++;
 		resn = new_event_notification(c);
@@ -441,10 +1867,14 @@ qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 
 	if (c == NULL) {
 		return -EINVAL;
+	} else if (c->event_backlog_max > 0) {
+		return _event_send_backlogged(c, QB_FALSE, 0, iov, iov_len);
 	}
 	qb_ipcs_connection_ref(c);
 
 	res = c->service->funcs.sendv(&c->event, iov, iov_len);
+	QB_PROBE3(ipc__event__send, (const char *)c->service->name,
+		  c->pid, res);
 	if (res > 0) {
 		c->stats.events++;
 		resn = new_event_notification(c);
@@ -521,7 +1951,7 @@ struct qb_ipcs_connection *
 qb_ipcs_connection_alloc(struct qb_ipcs_service *s)
 {
 	struct qb_ipcs_connection *c =
-	    calloc(1, sizeof(struct qb_ipcs_connection));
+	    qb_util_calloc(1, sizeof(struct qb_ipcs_connection));
 
 	if (c == NULL) {
 		return NULL;
@@ -535,11 +1965,18 @@ qb_ipcs_connection_alloc(struct qb_ipcs_service *s)
 	c->fc_enabled = QB_FALSE;
 	c->state = QB_IPCS_CONNECTION_INACTIVE;
 	c->poll_events = POLLIN | POLLPRI | POLLNVAL;
+	c->class_id = 0;
+	c->weight = 1;
+	c->busy_poll_slot = -1;
+	qb_list_init(&c->busy_poll_ready);
+	s->classes[0].stats.connections++;
+	qb_list_init(&c->event_backlog);
 
 	c->setup.type = s->type;
 	c->request.type = s->type;
 	c->response.type = s->type;
 	c->event.type = s->type;
+	c->control.type = s->type;
 	(void)strlcpy(c->description, "not set yet", CONNECTION_DESCRIPTION);
 
 	/* initial alloc ref */
@@ -581,14 +2018,24 @@ qb_ipcs_connection_unref(struct qb_ipcs_connection *c)
 	free_it = qb_atomic_int_dec_and_test(&c->refcount);
 	if (free_it) {
 		qb_list_del(&c->list);
+		c->service->closed_requests += c->stats.requests;
+		c->service->closed_responses += c->stats.responses;
+		c->service->closed_events += c->stats.events;
 		if (c->service->serv_fns.connection_destroyed) {
 			c->service->serv_fns.connection_destroyed(c);
 		}
 		c->service->funcs.disconnect(c);
+		c->service->classes[c->class_id].stats.connections--;
+		(void)qb_ipcs_event_backlog_set(c, 0);
 		/* Let go of the connection's reference to the service */
 		qb_ipcs_unref(c->service);
-		free(c->receive_buf);
-		free(c);
+		_large_msg_unmap(c);
+		while (c->large_fds_count > 0) {
+			close(c->large_fds[--c->large_fds_count]);
+		}
+		qb_util_free(c->large_fds);
+		qb_util_free(c->receive_buf);
+		qb_util_free(c);
 	}
 }
 
@@ -617,6 +2064,8 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 		return;
 	}
 	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+		_busy_poll_del(c);
+		_fq_backlogged_set(c, QB_FALSE);
 		c->service->funcs.disconnect(c);
 		c->state = QB_IPCS_CONNECTION_SHUTTING_DOWN;
 		c->service->stats.active_connections--;
@@ -663,21 +2112,232 @@ qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c, int32_t fc_enable)
 	}
 }
 
+/*
+ * A client's memfds are only read along with the notifications of
+ * requests being processed, so there are never many of them here
+ * unless the client sends them without requests.
+ */
+static int32_t
+_large_fd_push(struct qb_ipcs_connection *c, int32_t fd)
+{
+	int32_t *fds;
+
+	if (!c->large_msg_ok || c->large_fds_count >= QB_IPC_LARGE_FDS_MAX) {
+		close(fd);
+		qb_util_log(LOG_WARNING, "unexpected memfd from client (%s)",
+			    c->description);
+		return -EMFILE;
+	}
+	fds = qb_util_realloc(c->large_fds,
+			      (c->large_fds_count + 1) * sizeof(int32_t));
+	if (fds == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	fds[c->large_fds_count++] = fd;
+	c->large_fds = fds;
+	return 0;
+}
+
+static int32_t
+_large_fd_pop(struct qb_ipcs_connection *c)
+{
+	int32_t fd;
+
+	if (c->large_fds_count == 0) {
+		return -1;
+	}
+	fd = c->large_fds[0];
+	c->large_fds_count--;
+	memmove(&c->large_fds[0], &c->large_fds[1],
+		c->large_fds_count * sizeof(int32_t));
+	return fd;
+}
+
+/*
+ * Read notification bytes from the setup socket, keeping hold of
+ * any memfds sent along with them.
+ */
+static ssize_t
+_notifications_recv(struct qb_ipcs_connection *c, char *buf, size_t len,
+		    int32_t timeout)
+{
+	size_t processed = 0;
+	ssize_t res;
+	int32_t res2;
+	int32_t fd;
+
+	while (processed < len) {
+		res = qb_ipc_us_recv_fd(&c->setup, &buf[processed],
+					len - processed, &fd);
+		if (res == -EAGAIN && (processed > 0 || timeout == -1)) {
+			res = qb_ipc_us_ready(&c->setup, NULL, timeout, POLLIN);
+			if (res == 0 || res == -EAGAIN) {
+				continue;
+			}
+			return res;
+		} else if (res < 0) {
+			return res;
+		}
+		if (fd >= 0) {
+			res2 = _large_fd_push(c, fd);
+			if (res2 < 0) {
+				return res2;
+			}
+		}
+		processed += res;
+	}
+	return processed;
+}
+
+/*
+ * Take up to max notification bytes that are already there, for when
+ * they're only hints.
+ */
+static ssize_t
+_notifications_drain(struct qb_ipcs_connection *c, char *buf, size_t max)
+{
+	size_t processed = 0;
+	ssize_t res;
+	int32_t res2;
+	int32_t fd;
+
+	while (processed < max) {
+		if (c->large_fds_count >= QB_IPC_LARGE_FDS_MAX) {
+			/* the rest can wait until some of those are used */
+			break;
+		}
+		res = qb_ipc_us_recv_fd(&c->setup, buf, max - processed, &fd);
+		if (res == -EAGAIN) {
+			break;
+		} else if (res < 0) {
+			return res;
+		}
+		if (fd >= 0) {
+			res2 = _large_fd_push(c, fd);
+			if (res2 < 0) {
+				return res2;
+			}
+		}
+		processed += res;
+	}
+	return processed;
+}
+
+/*
+ * Swap a large request descriptor for the message in the memfd
+ * that came with it.
+ */
+static int32_t
+_large_msg_map(struct qb_ipcs_connection *c, struct qb_ipc_large_request *lr,
+	       struct qb_ipc_request_header **hdr_out)
+{
+	struct qb_ipc_request_header *hdr;
+	struct stat st;
+	char byte;
+	ssize_t res;
+	int32_t fd;
+#ifdef F_GET_SEALS
+	int32_t seals;
+#endif /* F_GET_SEALS */
+
+	if (lr->hdr.size < sizeof(struct qb_ipc_large_request) ||
+	    lr->size < sizeof(struct qb_ipc_request_header) ||
+	    lr->size > INT32_MAX) {
+		return -EINVAL;
+	}
+	while ((fd = _large_fd_pop(c)) < 0) {
+		/* the notification byte trails the descriptor */
+		res = _notifications_recv(c, &byte, 1, 0);
+		if (res == -EAGAIN) {
+			return res;
+		} else if (res < 0) {
+			/* not the request's fault, the connection is done for */
+			return -ENOTCONN;
+		}
+		c->notifications_ahead++;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		res = -errno;
+		goto cleanup;
+	}
+	if (st.st_size < lr->size) {
+		res = -EINVAL;
+		goto cleanup;
+	}
+#ifdef F_GET_SEALS
+	/* the client must not be able to change it under our feet */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 ||
+	    (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+	    (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		res = -EPERM;
+		goto cleanup;
+	}
+#endif /* F_GET_SEALS */
+
+	hdr = mmap(NULL, lr->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		res = -errno;
+		goto cleanup;
+	}
+	if (hdr->size != lr->size) {
+		munmap(hdr, lr->size);
+		res = -EINVAL;
+		goto cleanup;
+	}
+	c->large_msg = hdr;
+	c->large_msg_size = lr->size;
+	*hdr_out = hdr;
+	res = 0;
+
+cleanup:
+	close(fd);
+	return res;
+}
+
+/*
+ * The request never gets to msg_process, so answer it here or the
+ * client would wait for a response forever.
+ */
+static void
+_large_msg_error_send(struct qb_ipcs_connection *c, int32_t error)
+{
+	struct qb_ipc_response_header response;
+
+	response.id = QB_IPC_MSG_LARGE;
+	response.size = sizeof(response);
+	response.error = error;
+	(void)qb_ipcs_response_send(c, &response, response.size);
+}
+
+static void
+_large_msg_unmap(struct qb_ipcs_connection *c)
+{
+	if (c->large_msg) {
+		munmap(c->large_msg, c->large_msg_size);
+		c->large_msg = NULL;
+		c->large_msg_size = 0;
+	}
+}
+
 static int32_t
-_process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
+_process_request_(struct qb_ipcs_connection *c, struct qb_ipc_one_way *ow,
+		  int32_t ms_timeout)
 {
 	int32_t res = 0;
 	ssize_t size;
 	struct qb_ipc_request_header *hdr;
 
 	if (c->service->funcs.peek && c->service->funcs.reclaim) {
-		size = c->service->funcs.peek(&c->request, (void **)&hdr,
+		size = c->service->funcs.peek(ow, (void **)&hdr,
 					      ms_timeout);
 	} else {
 		hdr = c->receive_buf;
-		size = c->service->funcs.recv(&c->request,
+		size = c->service->funcs.recv(ow,
 					      hdr,
-					      c->request.max_msg_size,
+					      ow->max_msg_size,
 					      ms_timeout);
 	}
 	if (size < 0) {
@@ -696,21 +2356,74 @@ _process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
 		res = -ESHUTDOWN;
 		goto cleanup;
 	} else {
+		if (c->request_tags) {
+			c->response_tag = qb_ipc_tag_get(hdr);
+		}
+		if (hdr->id == QB_IPC_MSG_LARGE) {
+			if (c->large_msg_ok) {
+				res = _large_msg_map(c,
+						     (struct qb_ipc_large_request *)hdr,
+						     &hdr);
+			} else {
+				res = -ENOTSUP;
+			}
+			if (res == -EAGAIN) {
+				/* leave it on the ring until the memfd turns up */
+				goto cleanup;
+			} else if (res == -ENOTCONN) {
+				goto reclaim;
+			} else if (res < 0) {
+				errno = -res;
+				qb_util_perror(LOG_WARNING,
+					       "bad large request (%s)",
+					       c->description);
+				_large_msg_error_send(c, res);
+				res = size;
+				goto reclaim;
+			}
+			size = c->large_msg_size;
+		}
 		c->stats.requests++;
+		c->service->classes[c->class_id].stats.requests++;
+		c->service->classes[c->class_id].stats.bytes += size;
+		c->msg_in_process = hdr;
+		QB_PROBE4(ipc__request__start,
+			  (const char *)c->service->name, c->pid,
+			  hdr->id, size);
 		res = c->service->serv_fns.msg_process(c, hdr, hdr->size);
-		/* 0 == good, negative == backoff */
-		if (res < 0) {
+		QB_PROBE4(ipc__request__done,
+			  (const char *)c->service->name, c->pid,
+			  hdr->id, res);
+		c->msg_in_process = NULL;
+		if (c->deferred) {
+			if (res != QB_IPCS_MSG_PENDING) {
+				qb_util_log(LOG_WARNING,
+					    "request deferred but msg_process returned %d (%s)",
+					    res, c->description);
+			}
+			if (c->deferred->flags & QB_IPCS_DEFER_ORDERED) {
+				/* no more requests until this one completes */
+				c->ordered_pending = c->deferred;
+				(void)_modify_dispatch_descriptor_(c);
+			}
+			c->deferred = NULL;
+			res = size;
+		} else if (res < 0) {
+			/* 0 == good, negative == backoff */
 			res = -ENOBUFS;
 		} else {
 			res = size;
 		}
 	}
 
+reclaim:
 	if (c && c->service->funcs.peek && c->service->funcs.reclaim) {
-		c->service->funcs.reclaim(&c->request);
+		c->service->funcs.reclaim(ow);
 	}
+	_large_msg_unmap(c);
 
 cleanup:
+	c->response_tag = 0;
 	return res;
 }
 
@@ -726,7 +2439,10 @@ _request_q_len_get(struct qb_ipcs_connection *c)
 		if (q_len <= 0) {
 			return q_len;
 		}
-		if (c->service->poll_priority == QB_LOOP_MED) {
+		if (c->service->fq_quantum > 0) {
+			/* the deficit decides how many we take */
+			q_len = QB_MIN(q_len, MAX_RECV_MSGS);
+		} else if (c->service->poll_priority == QB_LOOP_MED) {
 			q_len = QB_MIN(q_len, 5);
 		} else if (c->service->poll_priority == QB_LOOP_LOW) {
 			q_len = 1;
@@ -739,15 +2455,48 @@ _request_q_len_get(struct qb_ipcs_connection *c)
 	return q_len;
 }
 
+/*
+ * Drain the priority lane, this happens before anything else and
+ * regardless of flow control.
+ */
+static int32_t
+_process_control_requests_(struct qb_ipcs_connection *c, int32_t *recvd)
+{
+	ssize_t avail;
+	int32_t res = 0;
+
+	if (c->control.max_msg_size == 0 || c->service->funcs.q_len_get == NULL) {
+		return 0;
+	}
+	avail = QB_MIN(c->service->funcs.q_len_get(&c->control), MAX_RECV_MSGS);
+	while (avail > 0 && c->ordered_pending == NULL) {
+		res = _process_request_(c, &c->control, 0);
+		if (res == -ESHUTDOWN) {
+			return res;
+		}
+		if (res > 0 || res == -ENOBUFS || res == -EINVAL) {
+			(*recvd)++;
+		}
+		if (res <= 0) {
+			break;
+		}
+		avail--;
+	}
+	return 0;
+}
+
 int32_t
 qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 {
 	struct qb_ipcs_connection *c = (struct qb_ipcs_connection *)data;
-	char bytes[MAX_RECV_MSGS];
+	char bytes[2 * MAX_RECV_MSGS];
 	int32_t res = 0;
 	int32_t res2;
 	int32_t recvd = 0;
+	int32_t ahead;
 	ssize_t avail;
+	int32_t fq = (c->service->fq_quantum > 0);
+	int32_t waiting;
 
 	if (revents & POLLNVAL) {
 		qb_util_log(LOG_DEBUG, "NVAL conn (%s)", c->description);
@@ -760,6 +2509,10 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 		goto dispatch_cleanup;
 	}
 
+	if (c->event_backlog_len > 0) {
+		(void)_event_backlog_flush(c);
+	}
+
 	if (revents & POLLOUT) {
 		/* try resend events now that fd can write */
 		res = resend_event_notifications(c);
@@ -775,31 +2528,60 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 			goto dispatch_cleanup;
 		}
 	}
-	if (c->fc_enabled) {
-		res = 0;
+	res = _process_control_requests_(c, &recvd);
+	if (res == -ESHUTDOWN) {
 		goto dispatch_cleanup;
 	}
+	if (c->fc_enabled || c->ordered_pending) {
+		res = 0;
+		goto notifications_consume;
+	}
 	avail = _request_q_len_get(c);
 
+	if (c->service->needs_sock_for_poll && avail == 0 && recvd > 0) {
+		/* only priority requests this time */
+		res = 0;
+		goto notifications_consume;
+	}
 	if (c->service->needs_sock_for_poll && avail == 0) {
-		res2 = qb_ipc_us_recv(&c->setup, bytes, 1, 0);
+		if (c->service->notifications_are_hints) {
+			res2 = _notifications_drain(c, bytes, sizeof(bytes));
+			if (res2 >= 0 &&
+			    c->large_fds_count >= QB_IPC_LARGE_FDS_MAX) {
+				/* memfds without any requests to go with them */
+				res2 = -EMFILE;
+			}
+		} else {
+			res2 = _notifications_recv(c, bytes, 1, 0);
+		}
 		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
 			errno = -res2;
 			qb_util_perror(LOG_WARNING, "conn (%s) disconnected",
 				       c->description);
 			res = -ESHUTDOWN;
 			goto dispatch_cleanup;
-		} else {
+		} else if (c->service->notifications_are_hints) {
+			/* a request may have come in behind one of those */
+			if (_busy_poll_pending(c)) {
+				_busy_poll_ready(c);
+			}
+		} else if (c->event_backlog_max == 0) {
+			/* with a backlog this is the client making room */
 			qb_util_log(LOG_WARNING,
 				    "conn (%s) Nothing in q but got POLLIN on fd:%d (res2:%d)",
 				    c->description, fd, res2);
-			res = 0;
-			goto dispatch_cleanup;
 		}
+		res = 0;
+		goto dispatch_cleanup;
+	}
+
+	if (fq) {
+		_fq_backlogged_set(c, QB_TRUE);
+		c->deficit += _fq_quantum_get(c);
 	}
 
 	do {
-		res = _process_request_(c, IPC_REQUEST_TIMEOUT);
+		res = _process_request_(c, &c->request, IPC_REQUEST_TIMEOUT);
 
 		if (res == -ESHUTDOWN) {
 			goto dispatch_cleanup;
@@ -810,11 +2592,42 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 		}
 		if (res > 0) {
 			avail--;
+			if (fq) {
+				c->deficit -= res;
+			}
 		}
-	} while (avail > 0 && res > 0 && !c->fc_enabled);
+	} while (avail > 0 && res > 0 && !c->fc_enabled && c->ordered_pending == NULL &&
+		 (!fq || c->deficit > 0));
+
+	if (fq) {
+		waiting = (_request_q_len_get(c) > 0);
+		/* one that is held back doesn't compete for the class's share */
+		_fq_backlogged_set(c, waiting && !c->fc_enabled &&
+				   c->ordered_pending == NULL);
+		if (res > 0 && waiting) {
+			if (c->deficit <= 0) {
+				c->service->classes[c->class_id].stats.throttled++;
+			}
+		} else if (c->deficit > 0) {
+			/* an idle connection doesn't get to save up credit */
+			c->deficit = 0;
+		}
+	}
 
+notifications_consume:
+	if (c->service->needs_sock_for_poll && recvd > 0) {
+		/* some may have been read already while looking for a memfd */
+		ahead = QB_MIN(recvd, c->notifications_ahead);
+		c->notifications_ahead -= ahead;
+		recvd -= ahead;
+	}
 	if (c->service->needs_sock_for_poll && recvd > 0) {
-		res2 = qb_ipc_us_recv(&c->setup, bytes, recvd, -1);
+		if (c->service->notifications_are_hints) {
+			/* the client leaves them out while we poll */
+			res2 = _notifications_drain(c, bytes, recvd);
+		} else {
+			res2 = _notifications_recv(c, bytes, recvd, -1);
+		}
 		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
 			errno = -res2;
 			qb_util_perror(LOG_ERR, "error receiving from setup sock (%s)", c->description);
@@ -823,6 +2636,15 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 			goto dispatch_cleanup;
 		}
 	}
+	if (c->service->notifications_are_hints) {
+		if (c->service->busy_poll_state != QB_IPCS_BUSY_POLL_OFF) {
+			_busy_poll_wake(c->service);
+		}
+		if (res != -EAGAIN && _busy_poll_pending(c)) {
+			/* nothing else is going to come for those */
+			_busy_poll_ready(c);
+		}
+	}
 
 	res = QB_MIN(0, res);
 	if (res == -EAGAIN || res == -ETIMEDOUT || res == -ENOBUFS) {
@@ -911,6 +2733,14 @@ qb_ipcs_connection_stats_get_2(qb_ipcs_connection_t *c,
 	} else {
 		stats->event_q_length = 0;
 	}
+	stats->event_backlog_length = c->event_backlog_len;
+	if (c->service->funcs.resident_get) {
+		stats->resident_bytes =
+			QB_MAX(c->service->funcs.resident_get(&c->request), 0) +
+			QB_MAX(c->service->funcs.resident_get(&c->response), 0) +
+			QB_MAX(c->service->funcs.resident_get(&c->event), 0) +
+			QB_MAX(c->service->funcs.resident_get(&c->control), 0);
+	}
 	if (clear_after_read) {
 		memset(&c->stats, 0, sizeof(struct qb_ipcs_connection_stats_2));
 		c->stats.client_pid = c->pid;
@@ -932,6 +2762,72 @@ qb_ipcs_stats_get(struct qb_ipcs_service * s,
 	return 0;
 }
 
+/*
+ * Published statistics, totals over the service's connections.
+ * Runs from qb_stats_refresh() on the service's loop thread.
+ */
+static void
+_stats_fill(void *data, uint64_t *values)
+{
+	struct qb_ipcs_service *s = data;
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+	ssize_t q_len;
+
+	values[0] = s->stats.active_connections;
+	values[1] = s->stats.closed_connections;
+	values[2] = s->closed_requests;
+	values[3] = s->closed_responses;
+	values[4] = s->closed_events;
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		values[2] += c->stats.requests;
+		values[3] += c->stats.responses;
+		values[4] += c->stats.events;
+		values[5] += c->stats.send_retries;
+		values[6] += c->stats.recv_retries;
+		values[7] += c->stats.flow_control_count;
+		if (s->funcs.q_len_get) {
+			q_len = s->funcs.q_len_get(&c->request);
+			values[8] += QB_MAX(q_len, 0);
+			q_len = s->funcs.q_len_get(&c->event);
+			values[9] += QB_MAX(q_len, 0);
+		}
+		values[10] += c->event_backlog_len;
+		values[11] += c->stats.events_coalesced;
+	}
+	if (s->setup_running) {
+		(void)pthread_mutex_lock(&s->setup_lock);
+		qb_list_for_each(pos, &s->setup_queue) {
+			values[12]++;
+		}
+		qb_list_for_each(pos, &s->setup_done) {
+			values[12]++;
+		}
+		(void)pthread_mutex_unlock(&s->setup_lock);
+	}
+}
+
+int32_t
+qb_ipcs_connection_class_set(qb_ipcs_connection_t *c, uint32_t class_id,
+			     uint32_t weight)
+{
+	struct qb_ipcs_service *s;
+
+	if (c == NULL || class_id >= QB_IPCS_CLASSES_MAX || weight == 0) {
+		return -EINVAL;
+	}
+	s = c->service;
+	/* it joins the new class's backlog next time it's dispatched */
+	_fq_backlogged_set(c, QB_FALSE);
+	s->classes[c->class_id].stats.connections--;
+	s->classes[class_id].stats.connections++;
+	c->class_id = class_id;
+	c->weight = weight;
+	c->deficit = 0;
+	return 0;
+}
+
 void
 qb_ipcs_connection_auth_set(qb_ipcs_connection_t *c, uid_t uid,
 			    gid_t gid, mode_t mode)
@@ -36,13 +36,28 @@
 #include <qb/qblog.h>
 #include <qb/qbutil.h>
 #include <qb/qbarray.h>
+#include <qb/qbatomic.h>
 #include "log_int.h"
 #include "util_int.h"
+#include "probes.h"
 #include <regex.h>
 
 static struct qb_log_target conf[QB_LOG_TARGET_MAX];
 static uint32_t conf_active_max = 0;
 static int32_t in_logger = QB_FALSE;
+static struct qb_stats_provider *log_stats = NULL;
+
+static const char * const log_stats_labels[] = {
+	"thread_queued",
+	"thread_dropped",
+	"thread_memory",
+	"targets_enabled",
+	"repeats_coalesced",
+};
+static uint64_t log_repeats_coalesced = 0;
+/* writes out the repeat counts of targets that aren't threaded */
+static qb_loop_t *coalesce_loop = NULL;
+static qb_loop_timer_handle coalesce_timer;
 static int32_t logger_inited = QB_FALSE;
 static pthread_rwlock_t _listlock;
 static qb_log_filter_fn _custom_filter_fn = NULL;
@@ -53,9 +68,28 @@ static QB_LIST_DECLARE(callsite_sections);
 struct callsite_section {
 	struct qb_log_callsite *start;
 	struct qb_log_callsite *stop;
+	int32_t pending;
+	int32_t pending_slot;
 	struct qb_list_head list;
 };
 
+/*
+ * Sections found when walking the loaded objects at qb_log_init() don't
+ * get the filters applied until one of their callsites is used.
+ *
+ * Their ranges are copied in here, so that a filtered out callsite can
+ * be ruled out without taking _listlock. Slots are only changed with
+ * _listlock held for writing, readers just look.
+ */
+#define CALLSITE_PENDING_MAX 64
+static struct callsite_pending_range {
+	struct qb_log_callsite *start;
+	struct qb_log_callsite *stop;
+} callsite_pending[CALLSITE_PENDING_MAX];
+static int32_t callsite_pending_used = 0;
+
+static int32_t _log_section_maybe_pending(struct qb_log_callsite *cs);
+static void _log_section_activate(struct qb_log_callsite *cs);
 static int32_t _log_target_enable(struct qb_log_target *t);
 static void _log_target_disable(struct qb_log_target *t);
 static void _log_filter_apply(struct callsite_section *sect,
@@ -183,6 +217,151 @@ cs_format(char *str, struct qb_log_callsite *cs, va_list ap)
 	}
 }
 
+#define QB_LOG_REPEAT_FORMAT "last message repeated %u times"
+
+static uint32_t
+_log_msg_hash(const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	for (; *str; str++) {
+		hash ^= (uint8_t)*str;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+_log_target_vlog(struct qb_log_target *t, struct qb_log_callsite *cs,
+		 time_t timestamp, ...)
+{
+	va_list ap;
+
+	va_start(ap, timestamp);
+	t->vlogger(t->pos, cs, timestamp, ap);
+	va_end(ap);
+}
+
+/*
+ * Log "last message repeated N times" if the target has been
+ * counting repeats, repeat_lock must be held.
+ */
+static void
+_log_target_repeat_flush(struct qb_log_target *t, time_t timestamp)
+{
+	struct qb_log_callsite *cs = t->repeat_cs;
+	struct qb_log_callsite *rcs;
+	char str[QB_LOG_MAX_LEN];
+	int32_t new_dcs;
+	uint32_t count = t->repeat_count;
+
+	if (count == 0) {
+		return;
+	}
+	t->repeat_count = 0;
+	rcs = qb_log_dcs_get(&new_dcs, cs->function, cs->filename,
+			     QB_LOG_REPEAT_FORMAT, cs->priority,
+			     cs->lineno, cs->tags);
+	if (rcs == NULL) {
+		return;
+	}
+	if (t->vlogger) {
+		_log_target_vlog(t, rcs, timestamp, count);
+	} else if (t->logger) {
+		snprintf(str, QB_LOG_MAX_LEN, QB_LOG_REPEAT_FORMAT, count);
+		t->logger(t->pos, rcs, timestamp, str);
+	}
+}
+
+/*
+ * Decide whether a message is the same as the last one the target
+ * logged and should only be counted.
+ */
+static int32_t
+_log_target_repeated(struct qb_log_target *t, struct qb_log_callsite *cs,
+		     time_t timestamp, uint32_t hash)
+{
+	(void)pthread_mutex_lock(&t->repeat_lock);
+	if (t->coalesce && t->repeat_cs == cs && t->repeat_hash == hash &&
+	    timestamp >= t->repeat_start &&
+	    timestamp - t->repeat_start < t->coalesce) {
+		t->repeat_count++;
+		log_repeats_coalesced++;
+		(void)pthread_mutex_unlock(&t->repeat_lock);
+		return QB_TRUE;
+	}
+	_log_target_repeat_flush(t, timestamp);
+	t->repeat_cs = cs;
+	t->repeat_hash = hash;
+	t->repeat_start = timestamp;
+	(void)pthread_mutex_unlock(&t->repeat_lock);
+	return QB_FALSE;
+}
+
+/*
+ * Write out the count once the message has stopped repeating for
+ * the whole period, rather than waiting for the next one.
+ *
+ * @return non zero if a count is still to be written
+ */
+static int32_t
+_log_target_repeat_expire(struct qb_log_target *t, time_t now)
+{
+	int32_t pending;
+
+	(void)pthread_mutex_lock(&t->repeat_lock);
+	if (t->repeat_count > 0 &&
+	    (now < t->repeat_start ||
+	     now - t->repeat_start >= t->coalesce)) {
+		_log_target_repeat_flush(t, now);
+		t->repeat_cs = NULL;
+	}
+	pending = (t->repeat_count > 0);
+	(void)pthread_mutex_unlock(&t->repeat_lock);
+	return pending;
+}
+
+static void
+_log_coalesce_timer(void *data)
+{
+	struct qb_log_target *t;
+	int32_t pos;
+
+	for (pos = 0; pos <= conf_active_max; pos++) {
+		t = &conf[pos];
+		if (t->state == QB_LOG_STATE_ENABLED && !t->threaded &&
+		    t->repeat_count > 0) {
+			in_logger = QB_TRUE;
+			(void)_log_target_repeat_expire(t, time(NULL));
+			in_logger = QB_FALSE;
+		}
+	}
+	if (coalesce_loop) {
+		(void)qb_loop_timer_add(coalesce_loop, QB_LOOP_LOW,
+					QB_TIME_NS_IN_SEC, NULL,
+					_log_coalesce_timer, &coalesce_timer);
+	}
+}
+
+int32_t
+qb_log_coalesce_loop_set(qb_loop_t *l)
+{
+	int32_t rc = 0;
+
+	if (coalesce_loop) {
+		(void)qb_loop_timer_del(coalesce_loop, coalesce_timer);
+	}
+	coalesce_loop = l;
+	if (l) {
+		rc = qb_loop_timer_add(l, QB_LOOP_LOW, QB_TIME_NS_IN_SEC, NULL,
+				       _log_coalesce_timer, &coalesce_timer);
+		if (rc != 0) {
+			coalesce_loop = NULL;
+		}
+	}
+	return rc;
+}
+
 void
 qb_log_real_va_(struct qb_log_callsite *cs, va_list ap)
 {
@@ -191,6 +370,8 @@ qb_log_real_va_(struct qb_log_callsite *cs, va_list ap)
 	struct timespec tv;
 	int32_t pos;
 	int32_t formatted = QB_FALSE;
+	int32_t hashed = QB_FALSE;
+	uint32_t hash = 0;
 	char buf[QB_LOG_MAX_LEN];
 	char *str = buf;
 	va_list ap_copy;
@@ -198,7 +379,14 @@ qb_log_real_va_(struct qb_log_callsite *cs, va_list ap)
 	if (in_logger || cs == NULL) {
 		return;
 	}
+	if (cs->targets == 0 &&
+	    qb_atomic_int_get(&callsite_pending_used) > 0 &&
+	    _log_section_maybe_pending(cs)) {
+		_log_section_activate(cs);
+	}
 	in_logger = QB_TRUE;
+	QB_PROBE5(log__emit, cs->priority, cs->function, cs->filename,
+		  cs->lineno, cs->format);
 
 	if (old_internal_log_fn &&
 	    qb_bit_is_set(cs->tags, QB_LOG_TAG_LIBQB_MSG_BIT)) {
@@ -229,8 +417,22 @@ qb_log_real_va_(struct qb_log_callsite *cs, va_list ap)
 						formatted = QB_TRUE;
 					}
 				}
-
-			} else if (t->vlogger) {
+				continue;
+			}
+			if (t->coalesce || t->repeat_count) {
+				if (formatted == QB_FALSE) {
+					cs_format(str, cs, ap);
+					formatted = QB_TRUE;
+				}
+				if (hashed == QB_FALSE) {
+					hash = _log_msg_hash(str);
+					hashed = QB_TRUE;
+				}
+				if (_log_target_repeated(t, cs, tv.tv_sec, hash)) {
+					continue;
+				}
+			}
+			if (t->vlogger) {
 				va_copy(ap_copy, ap);
 				t->vlogger(t->pos, cs, tv.tv_sec, ap_copy);
 				va_end(ap_copy);
@@ -267,18 +469,54 @@ qb_log_thread_log_write(struct qb_log_callsite *cs,
 			time_t timestamp, const char *buffer)
 {
 	struct qb_log_target *t;
+	int32_t hashed = QB_FALSE;
+	uint32_t hash = 0;
 	int32_t pos;
 
 	for (pos = 0; pos <= conf_active_max; pos++) {
 		t = &conf[pos];
 		if ((t->state == QB_LOG_STATE_ENABLED) && t->threaded
 		    && qb_bit_is_set(cs->targets, t->pos)) {
+			if (t->coalesce || t->repeat_count) {
+				if (hashed == QB_FALSE) {
+					hash = _log_msg_hash(buffer);
+					hashed = QB_TRUE;
+				}
+				if (_log_target_repeated(t, cs, timestamp,
+							 hash)) {
+					continue;
+				}
+			}
 			qb_do_extended(buffer, t->extended,
 				t->logger(t->pos, cs, timestamp, buffer));
 		}
 	}
 }
 
+int32_t
+qb_log_thread_log_flush(void)
+{
+	struct qb_log_target *t;
+	int32_t pending = QB_FALSE;
+	int32_t pos;
+
+	for (pos = 0; pos <= conf_active_max; pos++) {
+		t = &conf[pos];
+		if (t->state != QB_LOG_STATE_ENABLED || !t->threaded) {
+			continue;
+		}
+		if (t->repeat_count > 0 &&
+		    _log_target_repeat_expire(t, time(NULL))) {
+			/* come back for it */
+			pending = QB_TRUE;
+		}
+		if (t->flush && t->flush(t->pos)) {
+			pending = QB_TRUE;
+		}
+	}
+	return pending;
+}
+
 struct qb_log_callsite*
 qb_log_callsite_get(const char *function,
 		    const char *filename,
@@ -380,16 +618,123 @@ qb_log_from_external_source(const char *function,
 	va_end(ap);
 }
 
-int32_t
-qb_log_callsites_register(struct qb_log_callsite *_start,
-			  struct qb_log_callsite *_stop)
+/*
+ * Apply all the current filters to a section, _listlock must be
+ * held for writing.
+ */
+static void
+_log_section_filters_apply(struct callsite_section *sect)
 {
-	struct callsite_section *sect;
-	struct qb_log_callsite *cs;
 	struct qb_log_target *t;
 	struct qb_log_filter *flt;
 	int32_t pos;
 
+	for (pos = 0; pos <= conf_active_max; pos++) {
+		t = &conf[pos];
+		if (t->state != QB_LOG_STATE_ENABLED) {
+			continue;
+		}
+		qb_list_for_each_entry(flt, &t->filter_head, list) {
+			_log_filter_apply(sect, t->pos, flt->conf,
+					  flt->type, flt->text, flt->regex,
+					  flt->high_priority, flt->low_priority);
+		}
+	}
+	qb_list_for_each_entry(flt, &tags_head, list) {
+		_log_filter_apply(sect, flt->new_value, flt->conf,
+				  flt->type, flt->text, flt->regex,
+				  flt->high_priority, flt->low_priority);
+	}
+}
+
+static void
+_log_section_custom_filter_apply(struct callsite_section *sect)
+{
+	struct qb_log_callsite *cs;
+
+	if (_custom_filter_fn == NULL) {
+		return;
+	}
+	for (cs = sect->start; cs < sect->stop; cs++) {
+		if (cs->lineno > 0) {
+			_custom_filter_fn(cs);
+		}
+	}
+}
+
+/*
+ * Give a section a pending slot, _listlock must be held for writing.
+ * Without a free one it is caught up with the filters straight away.
+ */
+static int32_t
+_log_section_pending_add(struct callsite_section *sect)
+{
+	struct callsite_pending_range *r;
+	int32_t i;
+
+	for (i = 0; i < CALLSITE_PENDING_MAX; i++) {
+		if (callsite_pending[i].start == NULL) {
+			break;
+		}
+	}
+	if (i == CALLSITE_PENDING_MAX) {
+		return -ENOSPC;
+	}
+	r = &callsite_pending[i];
+	/* a reader that sees the start also sees the stop */
+	qb_atomic_pointer_set(&r->stop, sect->stop);
+	qb_atomic_pointer_set(&r->start, sect->start);
+	if (i >= callsite_pending_used) {
+		qb_atomic_int_set(&callsite_pending_used, i + 1);
+	}
+	sect->pending = QB_TRUE;
+	sect->pending_slot = i;
+	return 0;
+}
+
+static void
+_log_section_pending_del(struct callsite_section *sect)
+{
+	int32_t used = callsite_pending_used;
+
+	qb_atomic_pointer_set(&callsite_pending[sect->pending_slot].start,
+			      NULL);
+	sect->pending = QB_FALSE;
+	while (used > 0 && callsite_pending[used - 1].start == NULL) {
+		used--;
+	}
+	qb_atomic_int_set(&callsite_pending_used, used);
+}
+
+/*
+ * Could the callsite be in a pending section? Doesn't take _listlock,
+ * a yes is checked again under it.
+ */
+static int32_t
+_log_section_maybe_pending(struct qb_log_callsite *cs)
+{
+	struct callsite_pending_range *r;
+	struct qb_log_callsite *start;
+	int32_t used = qb_atomic_int_get(&callsite_pending_used);
+	int32_t i;
+
+	for (i = 0; i < used; i++) {
+		r = &callsite_pending[i];
+		start = qb_atomic_pointer_get(&r->start);
+		if (start && cs >= start &&
+		    cs < (struct qb_log_callsite *)qb_atomic_pointer_get(&r->stop)) {
+			return QB_TRUE;
+		}
+	}
+	return QB_FALSE;
+}
+
+static int32_t
+_log_callsites_add(struct qb_log_callsite *_start,
+		   struct qb_log_callsite *_stop, int32_t lazy)
+{
+	struct callsite_section *sect;
+
 	if (_start == NULL || _stop == NULL) {
 		return -EINVAL;
 	}
@@ -413,37 +758,61 @@ qb_log_callsites_register(struct qb_log_callsite *_start,
 
 	pthread_rwlock_wrlock(&_listlock);
 	qb_list_add(&sect->list, &callsite_sections);
+	if (lazy && _log_section_pending_add(sect) == 0) {
+		pthread_rwlock_unlock(&_listlock);
+		return 0;
+	}
 
 	/*
 	 * Now apply the filters on these new callsites
 	 */
-	for (pos = 0; pos <= conf_active_max; pos++) {
-		t = &conf[pos];
-		if (t->state != QB_LOG_STATE_ENABLED) {
-			continue;
-		}
-		qb_list_for_each_entry(flt, &t->filter_head, list) {
-			_log_filter_apply(sect, t->pos, flt->conf,
-					  flt->type, flt->text, flt->regex,
-					  flt->high_priority, flt->low_priority);
+	_log_section_filters_apply(sect);
+	pthread_rwlock_unlock(&_listlock);
+	_log_section_custom_filter_apply(sect);
+	/* qb_log_callsites_dump_sect(sect); */
+
+	return 0;
+}
+
+int32_t
+qb_log_callsites_register(struct qb_log_callsite *_start,
+			  struct qb_log_callsite *_stop)
+{
+	return _log_callsites_add(_start, _stop, QB_FALSE);
+}
+
+static struct callsite_section *
+_log_section_pending_find(struct qb_log_callsite *cs)
+{
+	struct callsite_section *sect;
+
+	qb_list_for_each_entry(sect, &callsite_sections, list) {
+		if (sect->pending && cs >= sect->start && cs < sect->stop) {
+			return sect;
 		}
 	}
-	qb_list_for_each_entry(flt, &tags_head, list) {
-		_log_filter_apply(sect, flt->new_value, flt->conf,
-				  flt->type, flt->text, flt->regex,
-				  flt->high_priority, flt->low_priority);
+	return NULL;
+}
+
+/*
+ * First use of a callsite in a pending section, catch its section
+ * up with the filters.
+ */
+static void
+_log_section_activate(struct qb_log_callsite *cs)
+{
+	struct callsite_section *sect;
+
+	pthread_rwlock_wrlock(&_listlock);
+	sect = _log_section_pending_find(cs);
+	if (sect) {
+		_log_section_pending_del(sect);
+		_log_section_filters_apply(sect);
 	}
 	pthread_rwlock_unlock(&_listlock);
-	if (_custom_filter_fn) {
-		for (cs = sect->start; cs < sect->stop; cs++) {
-			if (cs->lineno > 0) {
-				_custom_filter_fn(cs);
-			}
-		}
+	if (sect) {
+		_log_section_custom_filter_apply(sect);
 	}
-	/* qb_log_callsites_dump_sect(sect); */
-
-	return 0;
 }
 
 static void
@@ -451,7 +820,8 @@ qb_log_callsites_dump_sect(struct callsite_section *sect)
 {
 	struct qb_log_callsite *cs;
 
-	printf(" start %p - stop %p\n", sect->start, sect->stop);
+	printf(" start %p - stop %p%s\n", sect->start, sect->stop,
+	       sect->pending ? " (not used yet)" : "");
 	printf("filename    lineno targets         tags\n");
 	for (cs = sect->start; cs < sect->stop; cs++) {
 		if (cs->lineno > 0) {
@@ -700,6 +1070,9 @@ qb_log_filter_ctl2(int32_t t, enum qb_log_filter_conf c,
 		regex = new_flt->regex;
 	}
 	qb_list_for_each_entry(sect, &callsite_sections, list) {
+		if (sect->pending) {
+			continue;
+		}
 		_log_filter_apply(sect, t, c, type, text, regex, high_priority, low_priority);
 	}
 	pthread_rwlock_unlock(&_listlock);
@@ -710,7 +1083,6 @@ int32_t
 qb_log_filter_fn_set(qb_log_filter_fn fn)
 {
 	struct callsite_section *sect;
-	struct qb_log_callsite *cs;
 
 	if (!logger_inited) {
 		return -EINVAL;
@@ -721,11 +1093,10 @@ qb_log_filter_fn_set(qb_log_filter_fn fn)
 	}
 
 	qb_list_for_each_entry(sect, &callsite_sections, list) {
-		for (cs = sect->start; cs < sect->stop; cs++) {
-			if (cs->lineno > 0) {
-				_custom_filter_fn(cs);
-			}
+		if (sect->pending) {
+			continue;
 		}
+		_log_section_custom_filter_apply(sect);
 	}
 	return 0;
 }
@@ -739,6 +1110,170 @@ qb_log_filter_ctl(int32_t t, enum qb_log_filter_conf c,
 }
 
 #ifdef QB_HAVE_ATTRIBUTE_SECTION
+#ifdef ElfW
+/*
+ * Find the __verbose section of every loaded object from its dynamic
+ * symbol table, dlopen()ing each one just to call dlsym() is slow with
+ * a lot of libraries and takes the loader lock again from within
+ * dl_iterate_phdr().
+ */
+struct so_dynamic {
+	const ElfW(Sym) *symtab;
+	const char *strtab;
+	const uint32_t *hash;
+	const uint32_t *gnu_hash;
+};
+
+static const void *
+_so_dynamic_ptr(struct dl_phdr_info *info, ElfW(Addr) ptr)
+{
+	/* glibc relocates these in place, other loaders and the vdso don't */
+	if (ptr < info->dlpi_addr) {
+		ptr += info->dlpi_addr;
+	}
+	return (const void *)ptr;
+}
+
+static uint32_t
+_so_sysv_hash(const char *name)
+{
+	uint32_t h = 0;
+	uint32_t g;
+
+	for (; *name; name++) {
+		h = (h << 4) + (unsigned char)*name;
+		g = h & 0xf0000000;
+		if (g) {
+			h ^= g >> 24;
+		}
+		h &= ~g;
+	}
+	return h;
+}
+
+static uint32_t
+_so_gnu_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	for (; *name; name++) {
+		h = (h << 5) + h + (unsigned char)*name;
+	}
+	return h;
+}
+
+static const ElfW(Sym) *
+_so_symbol_find(struct so_dynamic *d, const char *name)
+{
+	const ElfW(Sym) *sym;
+	const uint32_t *buckets;
+	const uint32_t *chain;
+	uint32_t nbuckets;
+	uint32_t h;
+	uint32_t i;
+
+	if (d->gnu_hash) {
+		uint32_t symoffset = d->gnu_hash[1];
+		uint32_t bloom_size = d->gnu_hash[2];
+		uint32_t h2;
+
+		nbuckets = d->gnu_hash[0];
+		buckets = (const uint32_t *)((const ElfW(Addr) *)
+					     &d->gnu_hash[4] + bloom_size);
+		chain = buckets + nbuckets;
+		h = _so_gnu_hash(name);
+		i = buckets[h % nbuckets];
+		if (i < symoffset) {
+			return NULL;
+		}
+		do {
+			sym = &d->symtab[i];
+			h2 = chain[i - symoffset];
+			if ((h | 1) == (h2 | 1) &&
+			    strcmp(d->strtab + sym->st_name, name) == 0) {
+				return sym;
+			}
+			i++;
+		} while ((h2 & 1) == 0);
+		return NULL;
+	}
+	if (d->hash) {
+		nbuckets = d->hash[0];
+		buckets = &d->hash[2];
+		chain = buckets + nbuckets;
+		for (i = buckets[_so_sysv_hash(name) % nbuckets]; i != 0;
+		     i = chain[i]) {
+			sym = &d->symtab[i];
+			if (strcmp(d->strtab + sym->st_name, name) == 0) {
+				return sym;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int32_t
+_log_so_walk_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct so_dynamic d;
+	const ElfW(Dyn) *dyn = NULL;
+	const ElfW(Sym) *start;
+	const ElfW(Sym) *stop;
+	int32_t i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		if (info->dlpi_phdr[i].p_type == PT_DYNAMIC) {
+			dyn = (const ElfW(Dyn) *)(info->dlpi_addr +
+						  info->dlpi_phdr[i].p_vaddr);
+			break;
+		}
+	}
+	if (dyn == NULL) {
+		return 0;
+	}
+
+	memset(&d, 0, sizeof(d));
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		switch (dyn->d_tag) {
+		case DT_SYMTAB:
+			d.symtab = _so_dynamic_ptr(info, dyn->d_un.d_ptr);
+			break;
+		case DT_STRTAB:
+			d.strtab = _so_dynamic_ptr(info, dyn->d_un.d_ptr);
+			break;
+		case DT_HASH:
+			d.hash = _so_dynamic_ptr(info, dyn->d_un.d_ptr);
+			break;
+#ifdef DT_GNU_HASH
+		case DT_GNU_HASH:
+			d.gnu_hash = _so_dynamic_ptr(info, dyn->d_un.d_ptr);
+			break;
+#endif /* DT_GNU_HASH */
+		default:
+			break;
+		}
+	}
+	if (d.symtab == NULL || d.strtab == NULL ||
+	    (d.hash == NULL && d.gnu_hash == NULL)) {
+		return 0;
+	}
+
+	start = _so_symbol_find(&d, "__start___verbose");
+	if (start == NULL || start->st_shndx == SHN_UNDEF) {
+		return 0;
+	}
+	stop = _so_symbol_find(&d, "__stop___verbose");
+	if (stop == NULL || stop->st_shndx == SHN_UNDEF) {
+		return 0;
+	}
+	(void)_log_callsites_add((struct qb_log_callsite *)(info->dlpi_addr +
+							    start->st_value),
+				 (struct qb_log_callsite *)(info->dlpi_addr +
+							    stop->st_value),
+				 QB_TRUE);
+	return 0;
+}
+#else
 static int32_t
 _log_so_walk_callback(struct dl_phdr_info *info, size_t size, void *data)
 {
@@ -777,6 +1312,7 @@ done:
 	}
 	return 0;
 }
+#endif /* ElfW */
 #endif /* QB_HAVE_ATTRIBUTE_SECTION */
 
 static void
@@ -799,6 +1335,20 @@ _log_target_state_set(struct qb_log_target *t, enum qb_log_target_state s)
 	}
 }
 
+static void
+_log_stats_fill(void *data, uint64_t *values)
+{
+	int32_t pos;
+
+	qb_log_thread_stats_get(&values[0], &values[1], &values[2]);
+	for (pos = 0; pos <= conf_active_max; pos++) {
+		if (conf[pos].state == QB_LOG_STATE_ENABLED) {
+			values[3]++;
+		}
+	}
+	values[4] = log_repeats_coalesced;
+}
+
 void
 qb_log_init(const char *name, int32_t facility, uint8_t priority)
 {
@@ -813,6 +1363,10 @@ qb_log_init(const char *name, int32_t facility, uint8_t priority)
 		conf[i].debug = QB_FALSE;
 		conf[i].file_sync = QB_FALSE;
 		conf[i].extended = QB_TRUE;
+		conf[i].coalesce = 0;
+		conf[i].repeat_count = 0;
+		conf[i].repeat_cs = NULL;
+		(void)pthread_mutex_init(&conf[i].repeat_lock, NULL);
 		conf[i].state = QB_LOG_STATE_UNUSED;
 		(void)strlcpy(conf[i].name, name, PATH_MAX);
 		conf[i].facility = facility;
@@ -834,6 +1388,11 @@ qb_log_init(const char *name, int32_t facility, uint8_t priority)
 	_log_target_state_set(&conf[QB_LOG_SYSLOG], QB_LOG_STATE_ENABLED);
 	(void)qb_log_filter_ctl(QB_LOG_SYSLOG, QB_LOG_FILTER_ADD,
 				QB_LOG_FILTER_FILE, "*", priority);
+
+	log_stats = qb_stats_provider_add("log", log_stats_labels,
+					  sizeof(log_stats_labels) /
+					  sizeof(log_stats_labels[0]),
+					  _log_stats_fill, NULL);
 }
 
 void
@@ -852,6 +1411,9 @@ qb_log_fini(void)
 		return;
 	}
 	logger_inited = QB_FALSE;
+	qb_stats_provider_del(log_stats);
+	log_stats = NULL;
+	(void)qb_log_coalesce_loop_set(NULL);
 	qb_log_thread_stop();
 	pthread_rwlock_destroy(&_listlock);
 
@@ -864,6 +1426,9 @@ qb_log_fini(void)
 			_log_free_filter(flt);
 		}
 	}
+	for (pos = 0; pos < QB_LOG_TARGET_MAX; pos++) {
+		(void)pthread_mutex_destroy(&conf[pos].repeat_lock);
+	}
 	qb_log_format_fini();
 	qb_log_dcs_fini();
 	qb_list_for_each_safe(iter, next, &callsite_sections) {
@@ -871,6 +1436,8 @@ qb_log_fini(void)
 		qb_list_del(iter);
 		free(s);
 	}
+	memset(callsite_pending, 0, sizeof(callsite_pending));
+	qb_atomic_int_set(&callsite_pending_used, 0);
 	qb_list_for_each_safe(iter, next, &tags_head) {
 		flt = qb_list_entry(iter, struct qb_log_filter, list);
 		qb_list_del(iter);
@@ -897,6 +1464,12 @@ qb_log_target_free(struct qb_log_target *t)
 	(void)qb_log_filter_ctl(t->pos, QB_LOG_FILTER_CLEAR_ALL,
 				QB_LOG_FILTER_FILE, NULL, 0);
 	t->debug = QB_FALSE;
+	t->flush = NULL;
+	(void)pthread_mutex_lock(&t->repeat_lock);
+	t->coalesce = 0;
+	t->repeat_count = 0;
+	t->repeat_cs = NULL;
+	(void)pthread_mutex_unlock(&t->repeat_lock);
 	t->filename[0] = '\0';
 	qb_log_format_set(t->pos, NULL);
 	_log_target_state_set(t, QB_LOG_STATE_UNUSED);
@@ -973,12 +1546,15 @@ qb_log_custom_close(int32_t t)
 
 	target = qb_log_target_get(t);
 
+	/* the log thread may be writing to or flushing the target */
+	qb_log_thread_targets_lock();
 	if (target->close) {
 		in_logger = QB_TRUE;
 		target->close(t);
 		in_logger = QB_FALSE;
 	}
 	qb_log_target_free(target);
+	qb_log_thread_targets_unlock();
 }
 
 static int32_t
@@ -1009,6 +1585,12 @@ _log_target_disable(struct qb_log_target *t)
 	if (t->state != QB_LOG_STATE_ENABLED) {
 		return;
 	}
+	(void)pthread_mutex_lock(&t->repeat_lock);
+	in_logger = QB_TRUE;
+	_log_target_repeat_flush(t, time(NULL));
+	in_logger = QB_FALSE;
+	t->repeat_cs = NULL;
+	(void)pthread_mutex_unlock(&t->repeat_lock);
 	_log_target_state_set(t, QB_LOG_STATE_DISABLED);
 	if (t->close) {
 		in_logger = QB_TRUE;
@@ -1035,7 +1617,9 @@ qb_log_ctl(int32_t t, enum qb_log_conf c, int32_t arg)
 		if (arg) {
 			rc = _log_target_enable(&conf[t]);
 		} else {
+			qb_log_thread_targets_lock();
 			_log_target_disable(&conf[t]);
+			qb_log_thread_targets_unlock();
 		}
 		break;
 	case QB_LOG_CONF_STATE_GET:
@@ -1054,7 +1638,7 @@ qb_log_ctl(int32_t t, enum qb_log_conf c, int32_t arg)
 		conf[t].priority_bump = arg;
 		break;
 	case QB_LOG_CONF_SIZE:
-		if (t == QB_LOG_BLACKBOX) {
+		if (t == QB_LOG_BLACKBOX || conf[t].flush) {
 			if (arg <= 0) {
 				return -EINVAL;
 			}
@@ -1070,6 +1654,14 @@ qb_log_ctl(int32_t t, enum qb_log_conf c, int32_t arg)
 	case QB_LOG_CONF_EXTENDED:
 		conf[t].extended = arg;
 		break;
+	case QB_LOG_CONF_COALESCE:
+		if (arg < 0) {
+			return -EINVAL;
+		}
+		(void)pthread_mutex_lock(&conf[t].repeat_lock);
+		conf[t].coalesce = arg;
+		(void)pthread_mutex_unlock(&conf[t].repeat_lock);
+		break;
 
 	default:
 		rc = -EINVAL;
@@ -19,15 +19,63 @@
  * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "os_base.h"
+#include <sched.h>
+#include <signal.h>
 
 #include <qb/qbrb.h>
 #include "util_int.h"
 #include "log_int.h"
+#include "ringbuffer_int.h"
 
 #define BB_MIN_ENTRY_SIZE (4 * sizeof(uint32_t) +\
 			   sizeof(uint8_t) +\
 			   2 * sizeof(char) + sizeof(time_t))
 
+/*
+ * Kept in the ring's shared user data so that qb_log_blackbox_follow()
+ * can tell which records are still in the ring. The offsets are in
+ * words since the ring was created and gen is odd while the writer
+ * is updating them (or reclaiming old records).
+ */
+struct qb_log_blackbox_shared {
+	uint32_t gen;
+	uint32_t pid;
+	uint64_t written;
+	uint64_t reclaimed;
+	uint64_t records;
+};
+
+static inline void
+_blackbox_barrier(void)
+{
+#ifdef HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS
+	__sync_synchronize();
+#endif /* HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS */
+}
+
+static uint32_t
+_blackbox_distance(qb_ringbuffer_t *rb, uint32_t from, uint32_t to)
+{
+	return (to + rb->shared_hdr->word_size - from) %
+		rb->shared_hdr->word_size;
+}
+
+static qb_ringbuffer_t *
+_blackbox_rb_open(struct qb_log_target *t)
+{
+	qb_ringbuffer_t *rb;
+	struct qb_log_blackbox_shared *sh;
+
+	rb = qb_rb_open(t->filename, t->size,
+			QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE,
+			sizeof(struct qb_log_blackbox_shared));
+	if (rb) {
+		sh = qb_rb_shared_user_data_get(rb);
+		sh->pid = getpid();
+	}
+	return rb;
+}
+
 
 static void
 _blackbox_reload(int32_t target)
@@ -38,8 +86,7 @@ _blackbox_reload(int32_t target)
 		return;
 	}
 	qb_rb_close(t->instance);
-	t->instance = qb_rb_open(t->filename, t->size,
-				 QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	t->instance = _blackbox_rb_open(t);
 }
 
 /* <u32> file lineno
@@ -60,18 +107,30 @@ _blackbox_vlogger(int32_t target,
 	char *chunk;
 	char *msg_len_pt;
 	uint32_t msg_len;
+	uint32_t pos;
+	uint32_t new_pos;
+	struct qb_log_blackbox_shared *sh;
 	struct qb_log_target *t = qb_log_target_get(target);
 
 	if (t->instance == NULL) {
 		return;
 	}
+	sh = qb_rb_shared_user_data_get(t->instance);
 
 	fn_size = strlen(cs->function) + 1;
 
 	actual_size = 4 * sizeof(uint32_t) + sizeof(uint8_t) + fn_size + sizeof(time_t);
 	max_size = actual_size + QB_LOG_MAX_LEN;
 
+	/* the allocation may reclaim the oldest records */
+	(void)qb_rb_position_get(t->instance, &pos, NULL);
+	sh->gen++;
+	_blackbox_barrier();
 	chunk = qb_rb_chunk_alloc(t->instance, max_size);
+	(void)qb_rb_position_get(t->instance, &new_pos, NULL);
+	sh->reclaimed += _blackbox_distance(t->instance, pos, new_pos);
+	_blackbox_barrier();
+	sh->gen++;
 
 	if (chunk == NULL) {
 		/* something bad has happened. abort blackbox logging */
@@ -124,7 +183,16 @@ _blackbox_vlogger(int32_t target,
 	 */
 	memcpy(msg_len_pt, &msg_len, sizeof(uint32_t));
 
+	(void)qb_rb_position_get(t->instance, NULL, &pos);
 	(void)qb_rb_chunk_commit(t->instance, actual_size);
+	(void)qb_rb_position_get(t->instance, NULL, &new_pos);
+
+	sh->gen++;
+	_blackbox_barrier();
+	sh->written += _blackbox_distance(t->instance, pos, new_pos);
+	sh->records++;
+	_blackbox_barrier();
+	sh->gen++;
 }
 
 static void
@@ -146,8 +214,7 @@ qb_log_blackbox_open(struct qb_log_target *t)
 	}
 	snprintf(t->filename, PATH_MAX, "%s-%d-blackbox", t->name, getpid());
 
-	t->instance = qb_rb_open(t->filename, t->size,
-				 QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	t->instance = _blackbox_rb_open(t);
 	if (t->instance == NULL) {
 		return -errno;
 	}
@@ -180,6 +247,92 @@ qb_log_blackbox_write_to_file(const char *filename)
 	return written_size;
 }
 
+static int32_t
+_blackbox_chunk_print(const char *chunk, ssize_t bytes_read)
+{
+	const char *ptr;
+	uint32_t lineno;
+	uint32_t tags;
+	uint8_t priority;
+	uint32_t fn_size;
+	const char *function;
+	uint32_t len;
+	time_t timestamp;
+	uint32_t msg_len;
+	struct tm *tm;
+	char time_buf[64];
+	char message[QB_LOG_MAX_LEN];
+
+	if (bytes_read < BB_MIN_ENTRY_SIZE) {
+		printf("ERROR Corrupt file: blackbox header too small.\n");
+		return -1;
+	}
+	ptr = chunk;
+
+	/* lineno */
+	memcpy(&lineno, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+
+	/* tags */
+	memcpy(&tags, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+
+	/* priority */
+	memcpy(&priority, ptr, sizeof(uint8_t));
+	ptr += sizeof(uint8_t);
+
+	/* function size & name */
+	memcpy(&fn_size, ptr, sizeof(uint32_t));
+	if ((fn_size + BB_MIN_ENTRY_SIZE) > bytes_read) {
+		printf("ERROR Corrupt file: fn_size way too big %d\n", fn_size);
+		return -1;
+	}
+	if (fn_size <= 0) {
+		printf("ERROR Corrupt file: fn_size negative %d\n", fn_size);
+		return -1;
+	}
+	ptr += sizeof(uint32_t);
+
+	function = ptr;
+	ptr += fn_size;
+
+	/* timestamp size & content */
+	memcpy(&timestamp, ptr, sizeof(time_t));
+	ptr += sizeof(time_t);
+	tm = localtime(&timestamp);
+	if (tm) {
+		(void)strftime(time_buf,
+			       sizeof(time_buf), "%b %d %T",
+			       tm);
+	} else {
+		snprintf(time_buf, sizeof(time_buf), "%ld",
+			 (long int)timestamp);
+	}
+	/* message length */
+	memcpy(&msg_len, ptr, sizeof(uint32_t));
+	if (msg_len > QB_LOG_MAX_LEN || msg_len <= 0) {
+		printf("ERROR Corrupt file: msg_len out of bounds %d\n", msg_len);
+		return -1;
+	}
+
+	ptr += sizeof(uint32_t);
+
+	/* message content */
+	len = qb_vsnprintf_deserialize(message, QB_LOG_MAX_LEN, ptr);
+	assert(len > 0);
+	message[len] = '\0';
+	len--;
+	while (len > 0 && (message[len] == '\n' || message[len] == '\0')) {
+		message[len] = '\0';
+		len--;
+	}
+
+	printf("%-7s %s %s(%u):%u: %s\n",
+	       qb_log_priority2str(priority),
+	       time_buf, function, lineno, tags, message);
+	return 0;
+}
+
 void
 qb_log_blackbox_print_from_file(const char *bb_filename)
 {
@@ -188,7 +341,6 @@ qb_log_blackbox_print_from_file(const char *bb_filename)
 	int max_size = 2 * QB_LOG_MAX_LEN;
 	char *chunk;
 	int fd;
-	char time_buf[64];
 
 	fd = open(bb_filename, 0);
 	if (fd < 0) {
@@ -203,95 +355,137 @@ qb_log_blackbox_print_from_file(const char *bb_filename)
 	chunk = malloc(max_size);
 
 	do {
-		char *ptr;
-		uint32_t lineno;
-		uint32_t tags;
-		uint8_t priority;
-		uint32_t fn_size;
-		char *function;
-		uint32_t len;
-		time_t timestamp;
-		uint32_t msg_len;
-		struct tm *tm;
-		char message[QB_LOG_MAX_LEN];
-
 		bytes_read = qb_rb_chunk_read(instance, chunk, max_size, 0);
-
-		if (bytes_read >= 0 && bytes_read < BB_MIN_ENTRY_SIZE) {
-			printf("ERROR Corrupt file: blackbox header too small.\n");
-			goto cleanup;
-		} else if (bytes_read < 0) {
+		if (bytes_read < 0) {
 			errno = -bytes_read;
 			perror("ERROR: qb_rb_chunk_read failed");
 			goto cleanup;
 		}
-		ptr = chunk;
-
-		/* lineno */
-		memcpy(&lineno, ptr, sizeof(uint32_t));
-		ptr += sizeof(uint32_t);
-
-		/* tags */
-		memcpy(&tags, ptr, sizeof(uint32_t));
-		ptr += sizeof(uint32_t);
-
-		/* priority */
-		memcpy(&priority, ptr, sizeof(uint8_t));
-		ptr += sizeof(uint8_t);
-
-		/* function size & name */
-		memcpy(&fn_size, ptr, sizeof(uint32_t));
-		if ((fn_size + BB_MIN_ENTRY_SIZE) > bytes_read) {
-			printf("ERROR Corrupt file: fn_size way too big %d\n", fn_size);
+		if (_blackbox_chunk_print(chunk, bytes_read) != 0) {
 			goto cleanup;
 		}
-		if (fn_size <= 0) {
-			printf("ERROR Corrupt file: fn_size negative %d\n", fn_size);
-			goto cleanup;
+	} while (bytes_read > BB_MIN_ENTRY_SIZE);
+
+cleanup:
+	qb_rb_close(instance);
+	free(chunk);
+}
+
+/*
+ * Find the oldest record still in the ring and work out its sequence
+ * number from how many records the writer has committed in total.
+ */
+static void
+_blackbox_follow_sync(qb_ringbuffer_t *rb, struct qb_log_blackbox_shared *sh,
+		      uint64_t *offset, uint64_t *seq)
+{
+	uint32_t word_size = rb->shared_hdr->word_size;
+	uint32_t gen;
+	uint32_t pos;
+	uint32_t end;
+	uint64_t records;
+	uint64_t in_ring;
+	ssize_t res;
+
+	for (;;) {
+		gen = sh->gen;
+		_blackbox_barrier();
+		if (gen & 1) {
+			sched_yield();
+			continue;
 		}
-		ptr += sizeof(uint32_t);
-
-		function = ptr;
-		ptr += fn_size;
-
-		/* timestamp size & content */
-		memcpy(&timestamp, ptr, sizeof(time_t));
-		ptr += sizeof(time_t);
-		tm = localtime(&timestamp);
-		if (tm) {
-			(void)strftime(time_buf,
-				       sizeof(time_buf), "%b %d %T",
-				       tm);
-		} else {
-			snprintf(time_buf, sizeof(time_buf), "%ld",
-				 (long int)timestamp);
+		*offset = sh->reclaimed;
+		records = sh->records;
+		pos = *offset % word_size;
+		end = sh->written % word_size;
+		in_ring = 0;
+		res = 0;
+		while (pos != end && res >= 0) {
+			res = qb_rb_chunk_copy_at(rb, pos, NULL, 0, &pos);
+			in_ring++;
 		}
-		/* message length */
-		memcpy(&msg_len, ptr, sizeof(uint32_t));
-		if (msg_len > QB_LOG_MAX_LEN || msg_len <= 0) {
-			printf("ERROR Corrupt file: msg_len out of bounds %d\n", msg_len);
-			goto cleanup;
+		_blackbox_barrier();
+		if (res >= 0 && gen == sh->gen) {
+			break;
 		}
+	}
+	*seq = records - in_ring;
+}
 
-		ptr += sizeof(uint32_t);
+int32_t
+qb_log_blackbox_follow(const char *name, int32_t ms_poll)
+{
+	qb_ringbuffer_t *rb;
+	struct qb_log_blackbox_shared *sh;
+	int max_size = 2 * QB_LOG_MAX_LEN;
+	char *chunk;
+	uint64_t offset;
+	uint64_t seq;
+	uint64_t new_seq;
+	uint32_t gen;
+	uint32_t pos;
+	uint32_t next_pos;
+	ssize_t bytes_read;
 
-		/* message content */
-		len = qb_vsnprintf_deserialize(message, QB_LOG_MAX_LEN, ptr);
-		assert(len > 0);
-		message[len] = '\0';
-		len--;
-		while (len > 0 && (message[len] == '\n' || message[len] == '\0')) {
-			message[len] = '\0';
-			len--;
-		}
+	rb = qb_rb_open(name, 0, QB_RB_FLAG_READ_ONLY, 0);
+	if (rb == NULL) {
+		return -errno;
+	}
+	if (qb_rb_shared_user_data_size_get(rb) <
+	    sizeof(struct qb_log_blackbox_shared)) {
+		/* written by a libqb without the follow support */
+		qb_rb_close(rb);
+		return -ENOTSUP;
+	}
+	sh = qb_rb_shared_user_data_get(rb);
+	chunk = malloc(max_size);
+	if (chunk == NULL) {
+		qb_rb_close(rb);
+		return -ENOMEM;
+	}
 
-		printf("%-7s %s %s(%u):%u: %s\n",
-		       qb_log_priority2str(priority),
-		       time_buf, function, lineno, tags, message);
+	_blackbox_follow_sync(rb, sh, &offset, &seq);
+	for (;;) {
+		gen = sh->gen;
+		_blackbox_barrier();
+		if ((gen & 1) == 0 && offset < sh->reclaimed) {
+			/* lapped, the writer has reclaimed what we were after */
+			_blackbox_follow_sync(rb, sh, &offset, &new_seq);
+			printf("--- %" PRIu64 " records lost ---\n",
+			       new_seq - seq);
+			seq = new_seq;
+			continue;
+		}
+		if ((gen & 1) || offset >= sh->written) {
+			fflush(stdout);
+			if (qb_rb_refcount_get(rb) <= 0 ||
+			    (kill(sh->pid, 0) == -1 && errno == ESRCH)) {
+				/* the writer has closed the blackbox or died */
+				break;
+			}
+			usleep(ms_poll * 1000);
+			continue;
+		}
 
-	} while (bytes_read > BB_MIN_ENTRY_SIZE);
+		pos = offset % rb->shared_hdr->word_size;
+		bytes_read = qb_rb_chunk_copy_at(rb, pos, chunk, max_size,
+						 &next_pos);
+		_blackbox_barrier();
+		if (gen != sh->gen || bytes_read == -EAGAIN) {
+			continue;
+		}
+		if (bytes_read < 0) {
+			errno = -bytes_read;
+			qb_util_perror(LOG_ERR, "qb_rb_chunk_copy_at");
+			_blackbox_follow_sync(rb, sh, &offset, &seq);
+			continue;
+		}
+		offset += _blackbox_distance(rb, pos, next_pos);
+		seq++;
+		(void)_blackbox_chunk_print(chunk, bytes_read);
+	}
 
-cleanup:
-	qb_rb_close(instance);
+	qb_rb_close(rb);
 	free(chunk);
+	return 0;
 }
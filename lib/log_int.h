@@ -21,6 +21,7 @@
 #ifndef _QB_LOG_INT_H_
 #define _QB_LOG_INT_H_
 
+#include <pthread.h>
 #include <qb/qblist.h>
 #include <qb/qblog.h>
 #include <qb/qbrb.h>
@@ -42,12 +43,22 @@ struct qb_log_target {
 	size_t size;
 	char *format;
 	int32_t threaded;
+	/* seconds identical messages are counted instead of logged */
+	uint32_t coalesce;
+	pthread_mutex_t repeat_lock;
+	struct qb_log_callsite *repeat_cs;
+	uint32_t repeat_hash;
+	uint32_t repeat_count;
+	time_t repeat_start;
 	void *instance;
 
 	qb_log_reload_fn reload;
 	qb_log_close_fn close;
 	qb_log_logger_fn logger;
 	qb_log_vlogger_fn vlogger;
+	/* send what the target has buffered, returns non zero if
+	 * something is still left */
+	int32_t (*flush)(int32_t t);
 };
 
 struct qb_log_filter {
@@ -110,12 +121,17 @@ int32_t qb_log_stderr_open(struct qb_log_target *t);
 int32_t qb_log_blackbox_open(struct qb_log_target *t);
 
 void qb_log_thread_stop(void);
+void qb_log_thread_stats_get(uint64_t *queued, uint64_t *dropped,
+			     uint64_t *memory);
 void qb_log_thread_log_post(struct qb_log_callsite *cs,
 			    time_t current_time,
 			    const char *buffer);
 void qb_log_thread_log_write(struct qb_log_callsite *cs,
 			    time_t current_time,
 			    const char *buffer);
+int32_t qb_log_thread_log_flush(void);
+void qb_log_thread_targets_lock(void);
+void qb_log_thread_targets_unlock(void);
 
 void qb_log_dcs_init(void);
 void qb_log_dcs_fini(void);
@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/un.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include "log_int.h"
+#include "util_int.h"
+
+/*
+ * Records are formatted into one buffer, each ending with a newline,
+ * and sent from there in as few system calls as possible: one
+ * datagram per record with sendmmsg() for UDP, or as much of the
+ * buffer as the socket takes for a stream. What doesn't fit in the
+ * buffer (QB_LOG_CONF_SIZE) while the collector is slow or away is
+ * dropped and counted.
+ */
+#define QB_LOG_NET_SIZE_DEFAULT		(64 * 1024)
+#define QB_LOG_NET_BATCH_MAX		64
+#define QB_LOG_NET_BACKOFF_MIN_MS	100
+#define QB_LOG_NET_BACKOFF_MAX_MS	10000
+
+enum qb_log_net_type {
+	QB_LOG_NET_UDP,
+	QB_LOG_NET_TCP,
+	QB_LOG_NET_UNIX,
+};
+
+enum qb_log_net_state {
+	QB_LOG_NET_DISCONNECTED,
+	QB_LOG_NET_CONNECTING,
+	QB_LOG_NET_CONNECTED,
+};
+
+struct qb_log_net {
+	enum qb_log_net_type type;
+	enum qb_log_net_state state;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int32_t fd;
+	uint64_t next_connect;
+	uint32_t backoff_ms;
+	pthread_mutex_t lock;
+	char *buf;
+	size_t len;
+	size_t size;
+	/* the first record in buf has been partly sent */
+	int32_t partial;
+	struct qb_log_net_stats stats;
+};
+
+static int32_t
+_net_address_parse(struct qb_log_net *net, const char *address)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai;
+	struct sockaddr_un *un;
+	char host[NI_MAXHOST];
+	const char *port;
+	size_t host_len;
+	int32_t rc;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		un = (struct sockaddr_un *)&net->addr;
+		un->sun_family = AF_UNIX;
+		if (strlcpy(un->sun_path, address + 5,
+			    sizeof(un->sun_path)) >= sizeof(un->sun_path)) {
+			return -ENAMETOOLONG;
+		}
+		net->addr_len = sizeof(struct sockaddr_un);
+		net->type = QB_LOG_NET_UNIX;
+		return 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	if (strncmp(address, "udp:", 4) == 0) {
+		hints.ai_socktype = SOCK_DGRAM;
+		net->type = QB_LOG_NET_UDP;
+	} else if (strncmp(address, "tcp:", 4) == 0) {
+		hints.ai_socktype = SOCK_STREAM;
+		net->type = QB_LOG_NET_TCP;
+	} else {
+		return -EINVAL;
+	}
+	address += 4;
+	port = strrchr(address, ':');
+	if (port == NULL || port == address) {
+		return -EINVAL;
+	}
+	host_len = port - address;
+	port++;
+	if (address[0] == '[' && address[host_len - 1] == ']') {
+		address++;
+		host_len -= 2;
+	}
+	if (host_len >= sizeof(host)) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(host, address, host_len);
+	host[host_len] = '\0';
+
+	rc = getaddrinfo(host, port, &hints, &ai);
+	if (rc != 0) {
+		qb_util_log(LOG_ERR, "couldn't resolve %s:%s: %s",
+			    host, port, gai_strerror(rc));
+		return -EADDRNOTAVAIL;
+	}
+	memcpy(&net->addr, ai->ai_addr, ai->ai_addrlen);
+	net->addr_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+static void
+_net_disconnect(struct qb_log_net *net)
+{
+	char *end;
+
+	if (net->fd >= 0) {
+		close(net->fd);
+		net->fd = -1;
+	}
+	net->state = QB_LOG_NET_DISCONNECTED;
+	if (net->partial) {
+		/* the rest of a half sent record is no use on a new stream */
+		end = memchr(net->buf, '\n', net->len);
+		memmove(net->buf, end + 1, net->len - (end + 1 - net->buf));
+		net->len -= end + 1 - net->buf;
+		net->partial = QB_FALSE;
+		net->stats.records_dropped++;
+	}
+}
+
+static void
+_net_connect_failed(struct qb_log_net *net)
+{
+	_net_disconnect(net);
+	net->stats.connect_failures++;
+	net->next_connect = qb_util_nano_current_get() +
+		(uint64_t)net->backoff_ms * QB_TIME_NS_IN_MSEC;
+	net->backoff_ms = QB_MIN(net->backoff_ms * 2,
+				 QB_LOG_NET_BACKOFF_MAX_MS);
+}
+
+static void
+_net_connected(struct qb_log_net *net)
+{
+	net->state = QB_LOG_NET_CONNECTED;
+	net->backoff_ms = QB_LOG_NET_BACKOFF_MIN_MS;
+	net->stats.connects++;
+}
+
+/*
+ * Never blocks: a TCP connect carries on in the background and is
+ * picked up by the next flush.
+ */
+static int32_t
+_net_connect(struct qb_log_net *net)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int32_t err;
+
+	if (net->state == QB_LOG_NET_CONNECTED) {
+		return 0;
+	}
+	if (net->state == QB_LOG_NET_CONNECTING) {
+		pfd.fd = net->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) == 0) {
+			return -EINPROGRESS;
+		}
+		len = sizeof(err);
+		if (getsockopt(net->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 ||
+		    err != 0) {
+			_net_connect_failed(net);
+			return -ENOTCONN;
+		}
+		_net_connected(net);
+		return 0;
+	}
+
+	if (qb_util_nano_current_get() < net->next_connect) {
+		return -EAGAIN;
+	}
+	net->fd = socket(net->addr.ss_family,
+			 net->type == QB_LOG_NET_UDP ? SOCK_DGRAM : SOCK_STREAM,
+			 0);
+	if (net->fd < 0) {
+		_net_connect_failed(net);
+		return -errno;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(net->fd);
+	if (connect(net->fd, (struct sockaddr *)&net->addr,
+		    net->addr_len) == 0) {
+		_net_connected(net);
+		return 0;
+	}
+	if (errno == EINPROGRESS) {
+		net->state = QB_LOG_NET_CONNECTING;
+		return -EINPROGRESS;
+	}
+	_net_connect_failed(net);
+	return -ENOTCONN;
+}
+
+static size_t
+_net_records_count(const char *buf, size_t len)
+{
+	size_t count = 0;
+	const char *end = buf + len;
+
+	while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+		count++;
+		buf++;
+	}
+	return count;
+}
+
+/*
+ * Send from the start of the buffer, return how many bytes went.
+ */
+static size_t
+_net_send_stream(struct qb_log_net *net, int32_t *broken)
+{
+	size_t sent = 0;
+	ssize_t res;
+
+	while (sent < net->len) {
+		res = send(net->fd, net->buf + sent, net->len - sent,
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				qb_util_perror(LOG_DEBUG, "log target send");
+				*broken = QB_TRUE;
+			}
+			break;
+		}
+		sent += res;
+		net->stats.frames_sent++;
+	}
+	return sent;
+}
+
+static size_t
+_net_send_datagrams(struct qb_log_net *net)
+{
+	struct iovec iov[QB_LOG_NET_BATCH_MAX];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[QB_LOG_NET_BATCH_MAX];
+#endif /* HAVE_SENDMMSG */
+	size_t done = 0;
+	size_t offset;
+	char *end;
+	int32_t n;
+	int32_t i;
+	int res;
+
+	while (done < net->len) {
+		/* one datagram per record, without the newline */
+		offset = done;
+		for (n = 0; n < QB_LOG_NET_BATCH_MAX && offset < net->len; n++) {
+			end = memchr(net->buf + offset, '\n', net->len - offset);
+			iov[n].iov_base = net->buf + offset;
+			iov[n].iov_len = end - (net->buf + offset);
+			offset += iov[n].iov_len + 1;
+		}
+#ifdef HAVE_SENDMMSG
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (i = 0; i < n; i++) {
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		res = sendmmsg(net->fd, msgs, n, MSG_DONTWAIT);
+#else
+		for (res = 0; res < n; res++) {
+			if (send(net->fd, iov[res].iov_base, iov[res].iov_len,
+				 MSG_DONTWAIT) < 0) {
+				if (res == 0) {
+					res = -1;
+				}
+				break;
+			}
+		}
+#endif /* HAVE_SENDMMSG */
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			/*
+			 * Most likely nobody listening (ECONNREFUSED),
+			 * a datagram isn't worth keeping for later.
+			 */
+			done = offset;
+			net->stats.records_dropped += n;
+			continue;
+		}
+		net->stats.frames_sent++;
+		net->stats.records_sent += res;
+		for (i = 0; i < res; i++) {
+			done += iov[i].iov_len + 1;
+		}
+		if (res < n) {
+			break;
+		}
+	}
+	return done;
+}
+
+static int32_t
+_net_flush_locked(struct qb_log_net *net)
+{
+	int32_t broken = QB_FALSE;
+	size_t sent;
+
+	if (net->len == 0) {
+		return 0;
+	}
+	if (_net_connect(net) != 0) {
+		return QB_TRUE;
+	}
+	if (net->type == QB_LOG_NET_UDP) {
+		sent = _net_send_datagrams(net);
+	} else {
+		sent = _net_send_stream(net, &broken);
+		net->stats.records_sent += _net_records_count(net->buf, sent);
+		if (sent > 0) {
+			net->partial = (net->buf[sent - 1] != '\n');
+		}
+	}
+	if (sent > 0) {
+		memmove(net->buf, net->buf + sent, net->len - sent);
+		net->len -= sent;
+	}
+	if (broken) {
+		_net_disconnect(net);
+	}
+	return net->len > 0;
+}
+
+static int32_t
+_net_flush(int32_t t)
+{
+	struct qb_log_net *net = qb_log_target_get(t)->instance;
+	int32_t pending;
+
+	if (net == NULL) {
+		return 0;
+	}
+	(void)pthread_mutex_lock(&net->lock);
+	pending = _net_flush_locked(net);
+	(void)pthread_mutex_unlock(&net->lock);
+	return pending;
+}
+
+static void
+_net_logger(int32_t t,
+	    struct qb_log_callsite *cs, time_t timestamp, const char *msg)
+{
+	char output_buffer[QB_LOG_MAX_LEN];
+	struct qb_log_target *target = qb_log_target_get(t);
+	struct qb_log_net *net = target->instance;
+	size_t len;
+	char *p;
+
+	if (net == NULL) {
+		return;
+	}
+	output_buffer[0] = '\0';
+	qb_log_target_format(t, cs, timestamp, msg, output_buffer);
+	len = strlen(output_buffer);
+	/* newlines separate the records */
+	for (p = output_buffer; (p = memchr(p, '\n', len - (p - output_buffer)));) {
+		*p = ' ';
+	}
+
+	(void)pthread_mutex_lock(&net->lock);
+	if (net->len + len + 1 > net->size) {
+		net->stats.records_dropped++;
+	} else {
+		memcpy(net->buf + net->len, output_buffer, len);
+		net->buf[net->len + len] = '\n';
+		net->len += len + 1;
+	}
+	if (!target->threaded) {
+		(void)_net_flush_locked(net);
+	}
+	(void)pthread_mutex_unlock(&net->lock);
+}
+
+static void
+_net_close(int32_t t)
+{
+	struct qb_log_target *target = qb_log_target_get(t);
+	struct qb_log_net *net = target->instance;
+
+	if (net == NULL) {
+		return;
+	}
+	(void)pthread_mutex_lock(&net->lock);
+	target->instance = NULL;
+	/* one last go, without waiting for the backoff */
+	net->next_connect = 0;
+	(void)_net_flush_locked(net);
+	net->stats.records_dropped += _net_records_count(net->buf, net->len);
+	_net_disconnect(net);
+	(void)pthread_mutex_unlock(&net->lock);
+
+	(void)pthread_mutex_destroy(&net->lock);
+	qb_util_free(net->buf);
+	qb_util_free(net);
+}
+
+static void
+_net_reload(int32_t t)
+{
+	struct qb_log_target *target = qb_log_target_get(t);
+	struct qb_log_net *net = target->instance;
+	char *buf;
+
+	if (net == NULL) {
+		return;
+	}
+	(void)pthread_mutex_lock(&net->lock);
+	if (target->size > 0 && target->size != net->size &&
+	    target->size >= net->len) {
+		buf = qb_util_realloc(net->buf, target->size);
+		if (buf) {
+			net->buf = buf;
+			net->size = target->size;
+		}
+	}
+	_net_disconnect(net);
+	net->next_connect = 0;
+	net->backoff_ms = QB_LOG_NET_BACKOFF_MIN_MS;
+	(void)pthread_mutex_unlock(&net->lock);
+}
+
+int32_t
+qb_log_net_open(const char *address)
+{
+	struct qb_log_target *t;
+	struct qb_log_net *net;
+	int32_t rc;
+
+	if (address == NULL) {
+		return -EINVAL;
+	}
+	net = qb_util_calloc(1, sizeof(struct qb_log_net));
+	if (net == NULL) {
+		return -ENOMEM;
+	}
+	net->fd = -1;
+	net->backoff_ms = QB_LOG_NET_BACKOFF_MIN_MS;
+	rc = _net_address_parse(net, address);
+	if (rc < 0) {
+		qb_util_free(net);
+		return rc;
+	}
+	net->size = QB_LOG_NET_SIZE_DEFAULT;
+	net->buf = qb_util_malloc(net->size);
+	if (net->buf == NULL) {
+		qb_util_free(net);
+		return -ENOMEM;
+	}
+	(void)pthread_mutex_init(&net->lock, NULL);
+
+	t = qb_log_target_alloc();
+	if (t == NULL) {
+		rc = -errno;
+		(void)pthread_mutex_destroy(&net->lock);
+		qb_util_free(net->buf);
+		qb_util_free(net);
+		return rc;
+	}
+	t->instance = net;
+	t->size = net->size;
+	(void)strlcpy(t->filename, address, PATH_MAX);
+
+	t->logger = _net_logger;
+	t->flush = _net_flush;
+	t->reload = _net_reload;
+	t->close = _net_close;
+	return t->pos;
+}
+
+void
+qb_log_net_close(int32_t t)
+{
+	qb_log_custom_close(t);
+}
+
+int32_t
+qb_log_net_stats_get(int32_t t, struct qb_log_net_stats *stats)
+{
+	struct qb_log_target *target;
+	struct qb_log_net *net;
+
+	if (t < 0 || t >= QB_LOG_TARGET_MAX || stats == NULL) {
+		return -EINVAL;
+	}
+	target = qb_log_target_get(t);
+	if (target->logger != _net_logger || target->instance == NULL) {
+		return -EBADF;
+	}
+	net = target->instance;
+	(void)pthread_mutex_lock(&net->lock);
+	memcpy(stats, &net->stats, sizeof(struct qb_log_net_stats));
+	stats->bytes_pending = net->len;
+	(void)pthread_mutex_unlock(&net->lock);
+	return 0;
+}
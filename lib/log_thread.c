@@ -27,6 +27,7 @@
 #include <qb/qblist.h>
 #include <qb/qbutil.h>
 #include "log_int.h"
+#include "util_int.h"
 
 static int wthread_active = QB_FALSE;
 
@@ -34,12 +35,22 @@ static int wthread_should_exit = QB_FALSE;
 
 static qb_thread_lock_t *logt_wthread_lock = NULL;
 
+/*
+ * Held while the thread is in the targets, closing one waits on it
+ * so the target's state isn't freed under the thread's feet.
+ */
+static pthread_mutex_t logt_targets_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static QB_LIST_DECLARE(logt_print_finished_records);
 
 static int logt_memory_used = 0;
 
 static int logt_dropped_messages = 0;
 
+static uint64_t logt_queued_total = 0;
+
+static uint64_t logt_dropped_total = 0;
+
 static sem_t logt_thread_start;
 
 static sem_t logt_print_finished;
@@ -54,12 +65,40 @@ static struct sched_param logt_sched_param;
 
 static pthread_t logt_thread_id = 0;
 
+/*
+ * How long the thread waits before trying again when a target
+ * couldn't send everything it has buffered.
+ */
+#define QB_LOG_THREAD_FLUSH_RETRY_MS 100
+
+static int
+_logt_wait(int32_t flush_pending)
+{
+#ifdef HAVE_SEM_TIMEDWAIT
+	struct timespec ts;
+
+	if (flush_pending) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += QB_LOG_THREAD_FLUSH_RETRY_MS *
+			      (long)QB_TIME_NS_IN_MSEC;
+		if (ts.tv_nsec >= (long)QB_TIME_NS_IN_SEC) {
+			ts.tv_sec++;
+			ts.tv_nsec -= (long)QB_TIME_NS_IN_SEC;
+		}
+		return sem_timedwait(&logt_print_finished, &ts);
+	}
+#endif /* HAVE_SEM_TIMEDWAIT */
+	return sem_wait(&logt_print_finished);
+}
+
 static void *qb_logt_worker_thread(void *data) __attribute__ ((noreturn));
 static void *
 qb_logt_worker_thread(void *data)
 {
 	struct qb_log_record *rec;
+	int32_t flush_pending = QB_FALSE;
 	int dropped = 0;
+	int value;
 	int res;
 
 	/*
@@ -68,9 +107,14 @@ qb_logt_worker_thread(void *data)
 	sem_post(&logt_thread_start);
 	for (;;) {
 retry_sem_wait:
-		res = sem_wait(&logt_print_finished);
+		res = _logt_wait(flush_pending);
 		if (res == -1 && errno == EINTR) {
 			goto retry_sem_wait;
+		} else if (res == -1 && errno == ETIMEDOUT) {
+			(void)pthread_mutex_lock(&logt_targets_lock);
+			flush_pending = qb_log_thread_log_flush();
+			(void)pthread_mutex_unlock(&logt_targets_lock);
+			goto retry_sem_wait;
 		} else if (res == -1) {
 			/*
 			 * This case shouldn't happen
@@ -80,11 +124,13 @@ retry_sem_wait:
 
 		(void)qb_thread_lock(logt_wthread_lock);
 		if (wthread_should_exit) {
-			int value = -1;
-
+			value = -1;
 			(void)sem_getvalue(&logt_print_finished, &value);
 			if (value == 0) {
 				(void)qb_thread_unlock(logt_wthread_lock);
+				(void)pthread_mutex_lock(&logt_targets_lock);
+				(void)qb_log_thread_log_flush();
+				(void)pthread_mutex_unlock(&logt_targets_lock);
 				pthread_exit(NULL);
 			}
 		}
@@ -102,12 +148,35 @@ retry_sem_wait:
 			printf("%d messages lost\n", dropped);
 		}
 
+		(void)pthread_mutex_lock(&logt_targets_lock);
 		qb_log_thread_log_write(rec->cs, rec->timestamp, rec->buffer);
-		free(rec->buffer);
-		free(rec);
+		qb_util_free(rec->buffer);
+		qb_util_free(rec);
+
+		/*
+		 * Targets that batch send once the queue has drained.
+		 */
+		value = -1;
+		(void)sem_getvalue(&logt_print_finished, &value);
+		if (value == 0) {
+			flush_pending = qb_log_thread_log_flush();
+		}
+		(void)pthread_mutex_unlock(&logt_targets_lock);
 	}
 }
 
+void
+qb_log_thread_targets_lock(void)
+{
+	(void)pthread_mutex_lock(&logt_targets_lock);
+}
+
+void
+qb_log_thread_targets_unlock(void)
+{
+	(void)pthread_mutex_unlock(&logt_targets_lock);
+}
+
 int32_t
 qb_log_thread_priority_set(int32_t policy, int32_t priority)
 {
@@ -195,7 +264,7 @@ qb_log_thread_log_post(struct qb_log_callsite *cs,
 	size_t buf_size;
 	size_t total_size;
 
-	rec = malloc(sizeof(struct qb_log_record));
+	rec = qb_util_malloc(sizeof(struct qb_log_record));
 	if (rec == NULL) {
 		return;
 	}
@@ -204,7 +273,7 @@ qb_log_thread_log_post(struct qb_log_callsite *cs,
 	total_size = sizeof(struct qb_log_record) + buf_size;
 
 	rec->cs = cs;
-	rec->buffer = malloc(buf_size);
+	rec->buffer = qb_util_malloc(buf_size);
 	if (rec->buffer == NULL) {
 		goto free_record;
 	}
@@ -216,15 +285,17 @@ qb_log_thread_log_post(struct qb_log_callsite *cs,
 	(void)qb_thread_lock(logt_wthread_lock);
 	logt_memory_used += total_size;
 	if (logt_memory_used > 512000) {
-		free(rec->buffer);
-		free(rec);
+		qb_util_free(rec->buffer);
+		qb_util_free(rec);
 		logt_memory_used = logt_memory_used - total_size;
 		logt_dropped_messages += 1;
+		logt_dropped_total++;
 		(void)qb_thread_unlock(logt_wthread_lock);
 		return;
 
 	} else {
 		qb_list_add_tail(&rec->list, &logt_print_finished_records);
+		logt_queued_total++;
 	}
 	(void)qb_thread_unlock(logt_wthread_lock);
 
@@ -232,7 +303,23 @@ qb_log_thread_log_post(struct qb_log_callsite *cs,
 	return;
 
 free_record:
-	free(rec);
+	qb_util_free(rec);
+}
+
+void
+qb_log_thread_stats_get(uint64_t *queued, uint64_t *dropped, uint64_t *memory)
+{
+	if (logt_wthread_lock == NULL) {
+		*queued = logt_queued_total;
+		*dropped = logt_dropped_total;
+		*memory = 0;
+		return;
+	}
+	(void)qb_thread_lock(logt_wthread_lock);
+	*queued = logt_queued_total;
+	*dropped = logt_dropped_total;
+	*memory = QB_MAX(logt_memory_used, 0);
+	(void)qb_thread_unlock(logt_wthread_lock);
 }
 
 void
@@ -265,9 +352,10 @@ qb_log_thread_stop(void)
 
 			qb_log_thread_log_write(rec->cs, rec->timestamp,
 						rec->buffer);
-			free(rec->buffer);
-			free(rec);
+			qb_util_free(rec->buffer);
+			qb_util_free(rec);
 		}
+		(void)qb_log_thread_log_flush();
 	} else {
 		wthread_should_exit = QB_TRUE;
 		sem_post(&logt_print_finished);
@@ -23,15 +23,75 @@
 #include <qb/qbdefs.h>
 #include <qb/qblist.h>
 #include <qb/qbloop.h>
+#include <qb/qbatomic.h>
 #include "loop_int.h"
 #include "util_int.h"
+#include "probes.h"
 
 static struct qb_loop *default_intance = NULL;
+static int32_t loop_stats_id = 0;
+
+static const char * const stats_labels[] = {
+	"iterations",
+	"fd_dispatched",
+	"jobs_dispatched",
+	"timers_dispatched",
+	"signals_dispatched",
+	"jobs_pending",
+	"stalls",
+};
+#define QB_STATS_LOOP_COUNT (sizeof(stats_labels) / sizeof(stats_labels[0]))
 
 static void
+qb_loop_dispatch_timed(struct qb_loop_level *level, struct qb_loop_item *job)
+{
+	struct qb_loop *l = level->l;
+	struct qb_loop_stall stall;
+	struct qb_loop_stall *rec;
+	uint64_t start;
+	uint64_t stop;
+
+	/*
+	 * describe before dispatching, the item may be freed by it.
+	 */
+	memset(&stall, 0, sizeof(struct qb_loop_stall));
+	stall.type = (enum qb_loop_source_type)job->type;
+	stall.p = level->priority;
+	stall.fd = -1;
+	if (job->source->describe) {
+		job->source->describe(job, &stall);
+	}
+
+	start = qb_util_nano_current_get();
+	job->source->dispatch_and_take_back(job, level->priority);
+	stop = qb_util_nano_current_get();
+
+	if ((stop - start) < l->stall_threshold || l->stalls == NULL) {
+		return;
+	}
+	l->stalls_total++;
+	stall.duration = stop - start;
+	stall.last_seen = stop;
+	stall.count = 1;
+
+	rec = &l->stalls[l->stall_head];
+	memcpy(rec, &stall, sizeof(struct qb_loop_stall));
+	l->stall_head = (l->stall_head + 1) % QB_LOOP_STALLS_MAX;
+	if (l->stall_count < QB_LOOP_STALLS_MAX) {
+		l->stall_count++;
+	}
+
+	qb_util_log(LOG_INFO,
+		    "slow dispatch: fn:%p type:%d fd:%d duration:%"PRIu64" ms",
+		    stall.dispatch_fn, stall.type, stall.fd,
+		    stall.duration / QB_TIME_NS_IN_MSEC);
+}
+
+static int32_t
 qb_loop_run_level(struct qb_loop_level *level)
 {
 	struct qb_loop_item *job;
+	enum qb_loop_type type;
 	int32_t processed = 0;
 
 Ill_have_another:
@@ -40,16 +100,25 @@ Ill_have_another:
 		job = qb_list_first_entry(&level->job_head, struct qb_loop_item, list);
 		qb_list_del(&job->list);
 		qb_list_init(&job->list);
-		job->source->dispatch_and_take_back(job, level->priority);
+		level->l->dispatched[job->type]++;
+		type = job->type;
+		QB_PROBE3(loop__dispatch__start, job, type, level->priority);
+		if (level->l->stall_threshold == 0) {
+			job->source->dispatch_and_take_back(job, level->priority);
+		} else {
+			qb_loop_dispatch_timed(level, job);
+		}
+		QB_PROBE3(loop__dispatch__done, job, type, level->priority);
 		level->todo--;
 		processed++;
 		if (level->l->stop_requested) {
-			return;
+			return processed;
 		}
 		if (processed < level->to_process) {
 			goto Ill_have_another;
 		}
 	}
+	return processed;
 }
 
 void
@@ -80,10 +149,28 @@ qb_loop_default_get(void)
 	return default_intance;
 }
 
+static void
+_stats_fill(void *data, uint64_t *values)
+{
+	struct qb_loop *l = data;
+	int32_t p;
+
+	values[0] = l->iterations;
+	values[1] = l->dispatched[QB_LOOP_FD];
+	values[2] = l->dispatched[QB_LOOP_JOB];
+	values[3] = l->dispatched[QB_LOOP_TIMER];
+	values[4] = l->dispatched[QB_LOOP_SIG];
+	for (p = QB_LOOP_LOW; p <= QB_LOOP_HIGH; p++) {
+		values[5] += QB_MAX(l->level[p].todo, 0);
+	}
+	values[6] = l->stalls_total;
+}
+
 struct qb_loop *
 qb_loop_create(void)
 {
-	struct qb_loop *l = malloc(sizeof(struct qb_loop));
+	struct qb_loop *l = qb_util_malloc(sizeof(struct qb_loop));
+	char stats_name[QB_STATS_NAME_MAX];
 	int32_t p;
 
 	if (l == NULL) {
@@ -100,11 +187,26 @@ qb_loop_create(void)
 	}
 
 	l->stop_requested = QB_FALSE;
+	l->p_stop = QB_LOOP_LOW;
+	l->remaining_todo = 0;
+	l->embedded = QB_FALSE;
+	l->stall_threshold = 0;
+	l->stalls = NULL;
+	l->stall_head = 0;
+	l->stall_count = 0;
+	l->stalls_total = 0;
+	l->iterations = 0;
+	memset(l->dispatched, 0, sizeof(l->dispatched));
 	l->timer_source = qb_loop_timer_create(l);
 	l->job_source = qb_loop_jobs_create(l);
 	l->fd_source = qb_loop_poll_create(l);
 	l->signal_source = qb_loop_signals_create(l);
 
+	snprintf(stats_name, QB_STATS_NAME_MAX, "loop-%d",
+		 qb_atomic_int_exchange_and_add(&loop_stats_id, 1));
+	l->stats = qb_stats_provider_add(stats_name, stats_labels,
+					 QB_STATS_LOOP_COUNT, _stats_fill, l);
+
 	if (default_intance == NULL) {
 		default_intance = l;
 	}
@@ -118,11 +220,13 @@ qb_loop_destroy(struct qb_loop *l)
 	qb_loop_jobs_destroy(l);
 	qb_loop_poll_destroy(l);
 	qb_loop_signals_destroy(l);
+	qb_stats_provider_del(l->stats);
 
 	if (default_intance == l) {
 		default_intance = NULL;
 	}
-	free(l);
+	qb_util_free(l->stalls);
+	qb_util_free(l);
 }
 
 void
@@ -135,84 +239,242 @@ qb_loop_stop(struct qb_loop *l)
 	}
 }
 
-void
-qb_loop_run(struct qb_loop *lp)
+static int32_t
+qb_loop_run_iteration(struct qb_loop *l, int32_t max_timeout)
 {
 	int32_t p;
-	int32_t p_stop = QB_LOOP_LOW;
 	int32_t rc;
-	int32_t remaining_todo = 0;
 	int32_t job_todo;
 	int32_t timer_todo;
 	int32_t ms_timeout;
-	struct qb_loop *l = lp;
+	int32_t dispatched = 0;
 
-	if (l == NULL) {
-		l = default_intance;
+	l->iterations++;
+	if (l->p_stop == QB_LOOP_LOW) {
+		l->p_stop = QB_LOOP_HIGH;
+	} else {
+		l->p_stop--;
 	}
-	l->stop_requested = QB_FALSE;
 
-	do {
-		if (p_stop == QB_LOOP_LOW) {
-			p_stop = QB_LOOP_HIGH;
+	job_todo = 0;
+	if (l->job_source && l->job_source->poll) {
+		rc = l->job_source->poll(l->job_source, 0);
+		if (rc > 0) {
+			job_todo = rc;
+		} else if (rc == -1) {
+			errno = -rc;
+			qb_util_perror(LOG_WARNING, "job->poll");
+		}
+	}
+	timer_todo = 0;
+	if (l->timer_source && l->timer_source->poll) {
+		rc = l->timer_source->poll(l->timer_source, 0);
+		if (rc > 0) {
+			timer_todo = rc;
+		} else if (rc == -1) {
+			errno = -rc;
+			qb_util_perror(LOG_WARNING, "timer->poll");
+		}
+	}
+	if (l->remaining_todo > 0 || timer_todo > 0) {
+		/*
+		 * if there are remaining todos or timer todos then don't wait.
+		 */
+		ms_timeout = 0;
+	} else if (job_todo > 0) {
+		/*
+		 * if we only have jobs to do (not timers or old todos)
+		 * then set a non-zero timeout. Jobs can spin out of
+		 * control if someone keeps adding them.
+		 */
+		ms_timeout = 50;
+	} else {
+		if (l->timer_source) {
+			ms_timeout = qb_loop_timer_msec_duration_to_expire(l->timer_source);
 		} else {
-			p_stop--;
+			ms_timeout = -1;
 		}
+	}
+	if (max_timeout >= 0 &&
+	    (ms_timeout < 0 || ms_timeout > max_timeout)) {
+		ms_timeout = max_timeout;
+	}
+	rc = l->fd_source->poll(l->fd_source, ms_timeout);
+	if (rc < 0) {
+		errno = -rc;
+		qb_util_perror(LOG_WARNING, "fd->poll");
+	}
 
-		job_todo = 0;
-		if (l->job_source && l->job_source->poll) {
-			rc = l->job_source->poll(l->job_source, 0);
-			if (rc > 0) {
-				job_todo = rc;
-			} else if (rc == -1) {
-				errno = -rc;
-				qb_util_perror(LOG_WARNING, "job->poll");
+	l->remaining_todo = 0;
+	for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
+		if (p >= l->p_stop) {
+			dispatched += qb_loop_run_level(&l->level[p]);
+			if (l->stop_requested) {
+				return dispatched;
 			}
 		}
-		timer_todo = 0;
-		if (l->timer_source && l->timer_source->poll) {
-			rc = l->timer_source->poll(l->timer_source, 0);
-			if (rc > 0) {
-				timer_todo = rc;
-			} else if (rc == -1) {
-				errno = -rc;
-				qb_util_perror(LOG_WARNING, "timer->poll");
-			}
-		}
-		if (remaining_todo > 0 || timer_todo > 0) {
-			/*
-			 * if there are remaining todos or timer todos then don't wait.
-			 */
+		l->remaining_todo += l->level[p].todo;
+	}
+	if (rc < 0 && dispatched == 0) {
+		return rc;
+	}
+	return dispatched;
+}
+
+void
+qb_loop_wakeup_update(struct qb_loop *l)
+{
+	int32_t p;
+	int32_t ms_timeout = -1;
+
+	for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
+		if (l->level[p].todo > 0 ||
+		    !qb_list_empty(&l->level[p].wait_head)) {
 			ms_timeout = 0;
-		} else if (job_todo > 0) {
-			/*
-			 * if we only have jobs to do (not timers or old todos)
-			 * then set a non-zero timeout. Jobs can spin out of
-			 * control if someone keeps adding them.
-			 */
-			ms_timeout = 50;
-		} else {
-			if (l->timer_source) {
-				ms_timeout = qb_loop_timer_msec_duration_to_expire(l->timer_source);
-			} else {
-				ms_timeout = -1;
-			}
+			break;
 		}
-		rc = l->fd_source->poll(l->fd_source, ms_timeout);
-		if (rc < 0) {
-			errno = -rc;
-			qb_util_perror(LOG_WARNING, "fd->poll");
+	}
+	if (ms_timeout != 0 && l->timer_source) {
+		ms_timeout = qb_loop_timer_msec_duration_to_expire(l->timer_source);
+	}
+	qb_loop_poll_wakeup_set(l->fd_source, ms_timeout);
+}
+
+void
+qb_loop_run(struct qb_loop *lp)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = default_intance;
+	}
+	l->stop_requested = QB_FALSE;
+	l->p_stop = QB_LOOP_LOW;
+	l->remaining_todo = 0;
+
+	do {
+		(void)qb_loop_run_iteration(l, -1);
+	} while (!l->stop_requested);
+}
+
+int32_t
+qb_loop_run_once(struct qb_loop *lp, int32_t ms_timeout)
+{
+	int32_t res;
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = default_intance;
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	l->stop_requested = QB_FALSE;
+
+	res = qb_loop_run_iteration(l, ms_timeout);
+	if (l->embedded) {
+		qb_loop_wakeup_update(l);
+	}
+	return res;
+}
+
+int32_t
+qb_loop_fd_get(struct qb_loop *lp)
+{
+	int32_t fd;
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = default_intance;
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	fd = qb_loop_poll_embed_fd_get(l->fd_source);
+	if (fd >= 0 && !l->embedded) {
+		l->embedded = QB_TRUE;
+		qb_loop_wakeup_update(l);
+	}
+	return fd;
+}
+
+int32_t
+qb_loop_watchdog_set(struct qb_loop *lp, uint64_t threshold_ns)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = default_intance;
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	if (threshold_ns > 0 && l->stalls == NULL) {
+		l->stalls = qb_util_calloc(QB_LOOP_STALLS_MAX,
+				   sizeof(struct qb_loop_stall));
+		if (l->stalls == NULL) {
+			return -ENOMEM;
 		}
+	}
+	l->stall_threshold = threshold_ns;
+	return 0;
+}
+
+static int
+_stall_cmp_(const void *a, const void *b)
+{
+	const struct qb_loop_stall *sa = a;
+	const struct qb_loop_stall *sb = b;
 
-		remaining_todo = 0;
-		for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
-			if (p >= p_stop) {
-				qb_loop_run_level(&l->level[p]);
-				if (l->stop_requested) {
-					return;
-				}
+	if (sa->duration == sb->duration) {
+		return 0;
+	}
+	return (sa->duration < sb->duration) ? 1 : -1;
+}
+
+int32_t
+qb_loop_stalls_get(struct qb_loop *lp, struct qb_loop_stall *stalls,
+		   int32_t max)
+{
+	struct qb_loop_stall merged[QB_LOOP_STALLS_MAX];
+	struct qb_loop_stall *rec;
+	struct qb_loop *l = lp;
+	int32_t num_merged = 0;
+	uint32_t i;
+	int32_t m;
+
+	if (l == NULL) {
+		l = default_intance;
+	}
+	if (l == NULL || stalls == NULL || max < 0) {
+		return -EINVAL;
+	}
+	if (l->stalls == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < l->stall_count; i++) {
+		rec = &l->stalls[i];
+		for (m = 0; m < num_merged; m++) {
+			if (merged[m].dispatch_fn == rec->dispatch_fn &&
+			    merged[m].type == rec->type &&
+			    merged[m].fd == rec->fd) {
+				break;
 			}
-			remaining_todo += l->level[p].todo;
 		}
-	} while (!l->stop_requested);
+		if (m == num_merged) {
+			memcpy(&merged[m], rec, sizeof(struct qb_loop_stall));
+			num_merged++;
+			continue;
+		}
+		merged[m].count++;
+		merged[m].duration = QB_MAX(merged[m].duration, rec->duration);
+		merged[m].last_seen = QB_MAX(merged[m].last_seen,
+					     rec->last_seen);
+	}
+	qsort(merged, num_merged, sizeof(struct qb_loop_stall), _stall_cmp_);
+
+	num_merged = QB_MIN(num_merged, max);
+	memcpy(stalls, merged, num_merged * sizeof(struct qb_loop_stall));
+	return num_merged;
 }
@@ -55,8 +55,11 @@ struct qb_loop_source {
 	void (*dispatch_and_take_back)(struct qb_loop_item *i,
 			 enum qb_loop_priority p);
 	int32_t (*poll)(struct qb_loop_source* s, int32_t ms_timeout);
+	void (*describe)(struct qb_loop_item *i, struct qb_loop_stall *stall);
 };
 
+#define QB_LOOP_STALLS_MAX 64
+
 struct qb_loop {
 	struct qb_loop_level level[3];
 	int32_t stop_requested;
@@ -64,6 +67,17 @@ struct qb_loop {
 	struct qb_loop_source * job_source;
 	struct qb_loop_source * fd_source;
 	struct qb_loop_source * signal_source;
+	int32_t p_stop;
+	int32_t remaining_todo;
+	int32_t embedded;
+	uint64_t stall_threshold;
+	struct qb_loop_stall *stalls;
+	uint32_t stall_head;
+	uint32_t stall_count;
+	uint64_t stalls_total;
+	uint64_t iterations;
+	uint64_t dispatched[QB_LOOP_SIG + 1];
+	struct qb_stats_provider *stats;
 };
 
 struct qb_loop *
@@ -91,6 +105,13 @@ void qb_loop_signals_destroy(struct qb_loop *l);
 
 int32_t qb_loop_timer_msec_duration_to_expire(struct qb_loop_source *timer_source);
 
+int32_t qb_loop_poll_embed_fd_get(struct qb_loop_source *fd_source);
+
+void qb_loop_poll_wakeup_set(struct qb_loop_source *fd_source,
+			     int32_t ms_timeout);
+
+void qb_loop_wakeup_update(struct qb_loop *l);
+
 void qb_loop_level_item_add(struct qb_loop_level *level,
 			    struct qb_loop_item *job);
 
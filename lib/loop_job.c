@@ -37,13 +37,21 @@ job_dispatch(struct qb_loop_item *item, enum qb_loop_priority p)
 	struct qb_loop_job *job = qb_list_entry(item, struct qb_loop_job, item);
 
 	job->dispatch_fn(job->item.user_data);
-	free(job);
+	qb_util_free(job);
 
 	/*
 	 * this is a one-shot so don't re-add
 	 */
 }
 
+static void
+job_describe(struct qb_loop_item *item, struct qb_loop_stall *stall)
+{
+	struct qb_loop_job *job = qb_list_entry(item, struct qb_loop_job, item);
+
+	stall->dispatch_fn = (void *)job->dispatch_fn;
+}
+
 static int32_t
 get_more_jobs(struct qb_loop_source *s, int32_t ms_timeout)
 {
@@ -70,13 +78,14 @@ get_more_jobs(struct qb_loop_source *s, int32_t ms_timeout)
 struct qb_loop_source *
 qb_loop_jobs_create(struct qb_loop *l)
 {
-	struct qb_loop_source *s = malloc(sizeof(struct qb_loop_source));
+	struct qb_loop_source *s = qb_util_malloc(sizeof(struct qb_loop_source));
 	if (s == NULL) {
 		return NULL;
 	}
 	s->l = l;
 	s->dispatch_and_take_back = job_dispatch;
 	s->poll = get_more_jobs;
+	s->describe = job_describe;
 
 	return s;
 }
@@ -84,7 +93,7 @@ qb_loop_jobs_create(struct qb_loop *l)
 void
 qb_loop_jobs_destroy(struct qb_loop *l)
 {
-	free(l->job_source);
+	qb_util_free(l->job_source);
 }
 
 int32_t
@@ -104,7 +113,7 @@ qb_loop_job_add(struct qb_loop *lp,
 	if (p < QB_LOOP_LOW || p > QB_LOOP_HIGH) {
 		return -EINVAL;
 	}
-	job = malloc(sizeof(struct qb_loop_job));
+	job = qb_util_malloc(sizeof(struct qb_loop_job));
 	if (job == NULL) {
 		return -ENOMEM;
 	}
@@ -117,6 +126,9 @@ qb_loop_job_add(struct qb_loop *lp,
 	qb_list_init(&job->item.list);
 	qb_list_add_tail(&job->item.list, &l->level[p].wait_head);
 
+	if (l->embedded) {
+		qb_loop_wakeup_update(l);
+	}
 	return 0;
 }
 
@@ -145,7 +157,7 @@ qb_loop_job_del(struct qb_loop *lp,
 		    job->item.user_data == data &&
 		    job->item.type == QB_LOOP_JOB) {
 			qb_list_del(&job->item.list);
-			free(job);
+			qb_util_free(job);
 			return 0;
 		}
 	}
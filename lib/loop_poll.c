@@ -26,6 +26,10 @@
 
 #include <signal.h>
 
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif /* HAVE_SYS_TIMERFD_H */
+
 #if defined(__DARWIN_NSIG)
 #define QB_MAX_NUM_SIGNALS __DARWIN_NSIG
 #else
@@ -38,11 +42,6 @@
 
 #include "loop_poll_int.h"
 
-/*
- * Define this to log slow (>10ms) jobs.
- */
-#undef DEBUG_DISPATCH_TIME
-
 /* logs, std(in|out|err), pipe */
 #define POLL_FDS_USED_MISC 50
 
@@ -94,13 +93,6 @@ _poll_dispatch_and_take_back_(struct qb_loop_item *item,
 {
 	struct qb_poll_entry *pe = (struct qb_poll_entry *)item;
 	int32_t res;
-#ifdef DEBUG_DISPATCH_TIME
-	uint64_t start;
-	uint64_t stop;
-	int32_t log_warn = QB_FALSE;
-
-	start = qb_util_nano_current_get();
-#endif /* DEBUG_DISPATCH_TIME */
 
 	assert(pe->state == QB_POLL_ENTRY_JOBLIST);
 	assert(pe->item.type == QB_LOOP_FD);
@@ -114,27 +106,15 @@ _poll_dispatch_and_take_back_(struct qb_loop_item *item,
 		pe->state = QB_POLL_ENTRY_ACTIVE;
 		pe->ufd.revents = 0;
 	}
-#ifdef DEBUG_DISPATCH_TIME
-	if (pe->state == QB_POLL_ENTRY_ACTIVE) {
-		pe->runs++;
-		if ((pe->runs % 50) == 0) {
-			log_warn = QB_TRUE;
-		}
-		stop = qb_util_nano_current_get();
-		if ((stop - start) > (10 * QB_TIME_NS_IN_MSEC)) {
-			log_warn = QB_TRUE;
-		}
+}
 
-		if (log_warn && pe->item.type == QB_LOOP_FD) {
-			qb_util_log(LOG_INFO,
-				    "[fd:%d] dispatch:%p runs:%d duration:%d ms",
-				    pe->ufd.fd, pe->poll_dispatch_fn,
-				    pe->runs,
-				    (int32_t) ((stop -
-						start) / QB_TIME_NS_IN_MSEC));
-		}
-	}
-#endif /* DEBUG_DISPATCH_TIME */
+static void
+_poll_describe_(struct qb_loop_item *item, struct qb_loop_stall *stall)
+{
+	struct qb_poll_entry *pe = (struct qb_poll_entry *)item;
+
+	stall->dispatch_fn = (void *)pe->poll_dispatch_fn;
+	stall->fd = pe->ufd.fd;
 }
 
 void
@@ -196,17 +176,19 @@ qb_poll_fds_usage_check_(struct qb_poll_source *s)
 struct qb_loop_source *
 qb_loop_poll_create(struct qb_loop *l)
 {
-	struct qb_poll_source *s = malloc(sizeof(struct qb_poll_source));
+	struct qb_poll_source *s = qb_util_malloc(sizeof(struct qb_poll_source));
 	if (s == NULL) {
 		return NULL;
 	}
 	s->s.l = l;
 	s->s.dispatch_and_take_back = _poll_dispatch_and_take_back_;
+	s->s.describe = _poll_describe_;
 
 	s->poll_entries = qb_array_create_2(16, sizeof(struct qb_poll_entry), 16);
 	s->poll_entry_count = 0;
 	s->low_fds_event_fn = NULL;
 	s->not_enough_fds = QB_FALSE;
+	s->wakeup_fd = -1;
 
 #ifdef USE_EPOLL
 	(void)qb_epoll_init(s);
@@ -227,9 +209,12 @@ qb_loop_poll_destroy(struct qb_loop *l)
 	struct qb_poll_source *s = (struct qb_poll_source *)l->fd_source;
 	qb_array_free(s->poll_entries);
 
+	if (s->wakeup_fd >= 0) {
+		close(s->wakeup_fd);
+	}
 	s->driver.fini(s);
 
-	free(s);
+	qb_util_free(s);
 }
 
 int32_t
@@ -264,7 +249,7 @@ _get_empty_array_position_(struct qb_poll_source *s)
 #ifdef USE_POLL
 		struct pollfd *ufds;
 		int32_t new_size = (s->poll_entry_count + 1) * sizeof(struct pollfd);
-		ufds = realloc(s->ufds, new_size);
+		ufds = qb_util_realloc(s->ufds, new_size);
 		if (ufds == NULL) {
 			return -ENOMEM;
 		}
@@ -312,7 +297,6 @@ _poll_add_(struct qb_loop *l,
 	pe->item.user_data = data;
 	pe->item.source = (struct qb_loop_source *)l->fd_source;
 	pe->p = p;
-	pe->runs = 0;
 	res = s->driver.add(s, pe, fd, events);
 	if (res == 0) {
 		*pe_pt = pe;
@@ -447,6 +431,95 @@ qb_loop_poll_del(struct qb_loop * lp, int32_t fd)
 	return -EBADF;
 }
 
+#if (defined(USE_EPOLL) || defined(USE_KQUEUE)) && defined(HAVE_TIMERFD_CREATE)
+#define USE_WAKEUP_TIMERFD 1
+#endif
+
+#ifdef USE_WAKEUP_TIMERFD
+static int32_t
+_qb_wakeup_add_to_jobs_(struct qb_loop *l, struct qb_poll_entry *pe)
+{
+	uint64_t expirations;
+	ssize_t res;
+
+	/*
+	 * Only drain it, the pending work is picked up by the
+	 * job and timer sources.
+	 */
+	res = read(pe->ufd.fd, &expirations, sizeof(expirations));
+	if (res == -1 && errno != EAGAIN) {
+		qb_util_perror(LOG_WARNING, "failed to read wakeup timer");
+	}
+	pe->ufd.revents = 0;
+	return 0;
+}
+#endif /* USE_WAKEUP_TIMERFD */
+
+int32_t
+qb_loop_poll_embed_fd_get(struct qb_loop_source *src)
+{
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+	struct qb_poll_source *s = (struct qb_poll_source *)src;
+#ifdef USE_WAKEUP_TIMERFD
+	struct qb_poll_entry *pe;
+	int32_t res;
+
+	if (s->wakeup_fd < 0) {
+		/*
+		 * Jobs and timers don't have a file descriptor of their own,
+		 * so arm a timerfd in the poll set to make the
+		 * epoll fd readable when they are due.
+		 */
+		s->wakeup_fd = timerfd_create(CLOCK_MONOTONIC,
+					      TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->wakeup_fd < 0) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "timerfd_create");
+			return res;
+		}
+		res = _poll_add_(src->l, QB_LOOP_HIGH,
+				 s->wakeup_fd, POLLIN, NULL, &pe);
+		if (res != 0) {
+			close(s->wakeup_fd);
+			s->wakeup_fd = -1;
+			return res;
+		}
+		pe->poll_dispatch_fn = NULL;
+		pe->item.type = QB_LOOP_FD;
+		pe->add_to_jobs = _qb_wakeup_add_to_jobs_;
+	}
+#endif /* USE_WAKEUP_TIMERFD */
+	return s->epollfd;
+#else
+	return -ENOTSUP;
+#endif /* USE_EPOLL || USE_KQUEUE */
+}
+
+void
+qb_loop_poll_wakeup_set(struct qb_loop_source *src, int32_t ms_timeout)
+{
+#ifdef USE_WAKEUP_TIMERFD
+	struct qb_poll_source *s = (struct qb_poll_source *)src;
+	struct itimerspec its;
+
+	if (s->wakeup_fd < 0) {
+		return;
+	}
+	memset(&its, 0, sizeof(struct itimerspec));
+	if (ms_timeout == 0) {
+		/* a zero it_value would disarm it */
+		its.it_value.tv_nsec = 1;
+	} else if (ms_timeout > 0) {
+		its.it_value.tv_sec = ms_timeout / QB_TIME_MS_IN_SEC;
+		its.it_value.tv_nsec =
+		    (ms_timeout % QB_TIME_MS_IN_SEC) * QB_TIME_NS_IN_MSEC;
+	}
+	if (timerfd_settime(s->wakeup_fd, 0, &its, NULL) == -1) {
+		qb_util_perror(LOG_WARNING, "timerfd_settime");
+	}
+#endif /* USE_WAKEUP_TIMERFD */
+}
+
 static int32_t pipe_fds[2] = { -1, -1 };
 
 struct qb_signal_source {
@@ -494,7 +567,15 @@ _signal_dispatch_and_take_back_(struct qb_loop_item *item,
 		(void)qb_loop_signal_del(sig->cloned_from->item.source->l,
 					 sig->cloned_from);
 	}
-	free(sig);
+	qb_util_free(sig);
+}
+
+static void
+_signal_describe_(struct qb_loop_item *item, struct qb_loop_stall *stall)
+{
+	struct qb_loop_sig *sig = (struct qb_loop_sig *)item;
+
+	stall->dispatch_fn = (void *)sig->dispatch_fn;
 }
 
 struct qb_loop_source *
@@ -502,14 +583,16 @@ qb_loop_signals_create(struct qb_loop *l)
 {
 	int32_t res = 0;
 	struct qb_poll_entry *pe;
-	struct qb_signal_source *s = calloc(1, sizeof(struct qb_signal_source));
+	struct qb_signal_source *s;
 
+	s = qb_util_calloc(1, sizeof(struct qb_signal_source));
 	if (s == NULL) {
 		return NULL;
 	}
 	s->s.l = l;
 	s->s.dispatch_and_take_back = _signal_dispatch_and_take_back_;
 	s->s.poll = NULL;
+	s->s.describe = _signal_describe_;
 	qb_list_init(&s->sig_head);
 	sigemptyset(&s->signal_superset);
 
@@ -539,7 +622,7 @@ qb_loop_signals_create(struct qb_loop *l)
 
 error_exit:
 	errno = -res;
-	free(s);
+	qb_util_free(s);
 	if (pipe_fds[0] >= 0) {
 		close(pipe_fds[0]);
 	}
@@ -566,10 +649,10 @@ qb_loop_signals_destroy(struct qb_loop *l)
 	qb_list_for_each_safe(list, n, &s->sig_head) {
 		item = qb_list_entry(list, struct qb_loop_item, list);
 		qb_list_del(&item->list);
-		free(item);
+		qb_util_free(item);
 	}
 
-	free(l->signal_source);
+	qb_util_free(l->signal_source);
 }
 
 static int32_t
@@ -596,7 +679,7 @@ _qb_signal_add_to_jobs_(struct qb_loop *l, struct qb_poll_entry *pe)
 		item = qb_list_entry(list, struct qb_loop_item, list);
 		sig = (struct qb_loop_sig *)item;
 		if (sig->signal == the_signal) {
-			new_sig_job = calloc(1, sizeof(struct qb_loop_sig));
+			new_sig_job = qb_util_calloc(1, sizeof(struct qb_loop_sig));
 			if (new_sig_job == NULL) {
 				return jobs_added;
 			}
@@ -670,7 +753,7 @@ qb_loop_signal_add(qb_loop_t * lp,
 		return -EINVAL;
 	}
 	s = (struct qb_signal_source *)l->signal_source;
-	sig = calloc(1, sizeof(struct qb_loop_sig));
+	sig = qb_util_calloc(1, sizeof(struct qb_loop_sig));
 	if (sig == NULL) {
 		return -errno;
 	}
@@ -756,7 +839,7 @@ qb_loop_signal_del(qb_loop_t * lp, qb_loop_signal_handle handle)
 		if (sig_clone->cloned_from == sig) {
 			qb_util_log(LOG_TRACE, "deleting sig in WAITLIST");
 			qb_list_del(&sig_clone->item.list);
-			free(sig_clone);
+			qb_util_free(sig_clone);
 			break;
 		}
 	}
@@ -774,7 +857,7 @@ qb_loop_signal_del(qb_loop_t * lp, qb_loop_signal_handle handle)
 	}
 
 	qb_list_del(&sig->item.list);
-	free(sig);
+	qb_util_free(sig);
 	_adjust_sigactions_(s);
 	return 0;
 }
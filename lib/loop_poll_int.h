@@ -47,7 +47,6 @@ struct qb_poll_entry {
 	uint32_t install_pos;
 	struct pollfd ufd;
 	qb_poll_add_to_jobs_fn add_to_jobs;
-	uint32_t runs;
 	enum qb_poll_entry_state state;
 	uint32_t check;
 };
@@ -73,6 +72,7 @@ struct qb_poll_source {
 #else
 	struct pollfd *ufds;
 #endif /* HAVE_EPOLL */
+	int32_t wakeup_fd;
 	struct qb_loop_driver driver;
 };
 
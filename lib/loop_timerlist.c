@@ -57,6 +57,14 @@ timer_dispatch(struct qb_loop_item *item, enum qb_loop_priority p)
 	timer->state = QB_POLL_ENTRY_EMPTY;
 }
 
+static void
+timer_describe(struct qb_loop_item *item, struct qb_loop_stall *stall)
+{
+	struct qb_loop_timer *timer = (struct qb_loop_timer *)item;
+
+	stall->dispatch_fn = (void *)timer->dispatch_fn;
+}
+
 static int32_t expired_timers;
 static void
 make_job_from_tmo(void *data)
@@ -93,13 +101,16 @@ qb_loop_timer_msec_duration_to_expire(struct qb_loop_source * timer_source)
 struct qb_loop_source *
 qb_loop_timer_create(struct qb_loop *l)
 {
-	struct qb_timer_source *my_src = malloc(sizeof(struct qb_timer_source));
+	struct qb_timer_source *my_src;
+
+	my_src = qb_util_malloc(sizeof(struct qb_timer_source));
 	if (my_src == NULL) {
 		return NULL;
 	}
 	my_src->s.l = l;
 	my_src->s.dispatch_and_take_back = timer_dispatch;
 	my_src->s.poll = expire_the_timers;
+	my_src->s.describe = timer_describe;
 
 	timerlist_init(&my_src->timerlist);
 	my_src->timers = qb_array_create_2(16, sizeof(struct qb_loop_timer), 16);
@@ -114,7 +125,7 @@ qb_loop_timer_destroy(struct qb_loop *l)
 	struct qb_timer_source *my_src =
 	    (struct qb_timer_source *)l->timer_source;
 	qb_array_free(my_src->timers);
-	free(l->timer_source);
+	qb_util_free(l->timer_source);
 }
 
 static int32_t
@@ -181,6 +192,7 @@ qb_loop_timer_add(struct qb_loop * lp,
 	struct qb_loop_timer *t;
 	struct qb_timer_source *my_src;
 	int32_t i;
+	int32_t res;
 	struct qb_loop *l = lp;
 
 	if (l == NULL) {
@@ -213,9 +225,13 @@ qb_loop_timer_add(struct qb_loop * lp,
 	if (timer_handle_out) {
 		*timer_handle_out = (((uint64_t) (t->check)) << 32) | t->install_pos;
 	}
-	return timerlist_add_duration(&my_src->timerlist,
-				      make_job_from_tmo, t,
-				      nsec_duration, &t->timerlist_handle);
+	res = timerlist_add_duration(&my_src->timerlist,
+				     make_job_from_tmo, t,
+				     nsec_duration, &t->timerlist_handle);
+	if (res == 0 && l->embedded) {
+		qb_loop_wakeup_update(l);
+	}
+	return res;
 }
 
 int32_t
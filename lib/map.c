@@ -20,9 +20,228 @@
  */
 
 #include "os_base.h"
+#include <qb/qbdefs.h>
 #include <qb/qbmap.h>
+#include <qb/qbloop.h>
+#include "util_int.h"
 #include "map_int.h"
 
+/*
+ * Batched notifications.
+ *
+ * While a map is batching, each notifier call is queued as an entry
+ * holding a copy of the key and the notifier's callback and user_data
+ * (the notifier itself may be gone by the time the batch is
+ * delivered, e.g. a per key notifier of a deleted item).
+ *
+ * With QB_MAP_BATCH_DEDUP the entries are also looked up by key so a
+ * later change to the same key for the same notifier is folded into
+ * the earlier entry.
+ */
+struct qb_map_batch_entry {
+	struct qb_list_head list;
+	/* the next entry with the same key (dedup only) */
+	struct qb_map_batch_entry *key_next;
+	qb_map_notify_fn callback;
+	void *user_data;
+	int32_t events;
+	uint32_t event;
+	char *key;
+	void *old_value;
+	void *value;
+};
+
+struct qb_map_batch {
+	uint32_t flags;
+	struct qb_list_head entries;
+	size_t count;
+	qb_map_t *keys;
+	qb_loop_t *loop;
+	enum qb_loop_priority priority;
+	int32_t job_queued;
+};
+
+static void batch_job(void *data);
+
+static void
+batch_entry_free(struct qb_map_batch_entry *e)
+{
+	qb_list_del(&e->list);
+	qb_util_free(e->key);
+	qb_util_free(e);
+}
+
+/*
+ * Fold a change into an earlier entry for the same key.
+ *
+ * @retval 1 folded in
+ * @retval 0 can't be folded
+ * @retval -1 the two cancel out, drop the earlier entry
+ */
+static int32_t
+batch_entry_fold(struct qb_map_batch_entry *e, uint32_t event,
+		 void *value)
+{
+	uint32_t folded = 0;
+
+	if (e->event == QB_MAP_NOTIFY_INSERTED) {
+		if (event == QB_MAP_NOTIFY_DELETED) {
+			return -1;
+		}
+		if (event == QB_MAP_NOTIFY_REPLACED) {
+			folded = QB_MAP_NOTIFY_INSERTED;
+		}
+	} else if (e->event == QB_MAP_NOTIFY_REPLACED) {
+		if (event == QB_MAP_NOTIFY_REPLACED ||
+		    event == QB_MAP_NOTIFY_DELETED) {
+			folded = event;
+		}
+	} else if (e->event == QB_MAP_NOTIFY_DELETED) {
+		if (event == QB_MAP_NOTIFY_INSERTED) {
+			folded = QB_MAP_NOTIFY_REPLACED;
+		}
+	}
+	if (folded == 0 || (e->events & folded) == 0) {
+		return 0;
+	}
+	e->event = folded;
+	e->value = value;
+	return 1;
+}
+
+static int32_t
+batch_dedup(struct qb_map_batch *b, struct qb_map_notifier *tn,
+	    uint32_t event, const char *key, void *value)
+{
+	struct qb_map_batch_entry *head;
+	struct qb_map_batch_entry *e;
+	struct qb_map_batch_entry *prev = NULL;
+	int32_t rc;
+
+	head = qb_map_get(b->keys, key);
+	for (e = head; e; prev = e, e = e->key_next) {
+		if (e->callback != tn->callback ||
+		    e->user_data != tn->user_data ||
+		    e->events != tn->events) {
+			continue;
+		}
+		rc = batch_entry_fold(e, event, value);
+		if (rc == 0) {
+			return QB_FALSE;
+		}
+		if (rc < 0) {
+			if (prev) {
+				prev->key_next = e->key_next;
+			} else if (e->key_next) {
+				qb_map_put(b->keys, e->key_next->key,
+					   e->key_next);
+			} else {
+				(void)qb_map_rm(b->keys, key);
+			}
+			batch_entry_free(e);
+			b->count--;
+		}
+		return QB_TRUE;
+	}
+	return QB_FALSE;
+}
+
+static int32_t
+batch_queue(struct qb_map *map, struct qb_map_notifier *tn,
+	    uint32_t event, const char *key, void *old_value, void *value)
+{
+	struct qb_map_batch *b = map->batch;
+	struct qb_map_batch_entry *e;
+	struct qb_map_batch_entry *head;
+	int32_t dedup = QB_FALSE;
+	size_t len;
+
+	if ((b->flags & QB_MAP_BATCH_DEDUP) && event != QB_MAP_NOTIFY_FREE &&
+	    key != NULL) {
+		if (b->keys == NULL) {
+			b->keys = qb_hashtable_create(256);
+		}
+		if (b->keys) {
+			dedup = QB_TRUE;
+			if (batch_dedup(b, tn, event, key, value)) {
+				return 0;
+			}
+		}
+	}
+
+	e = qb_util_calloc(1, sizeof(struct qb_map_batch_entry));
+	if (e == NULL) {
+		return -ENOMEM;
+	}
+	if (key) {
+		/* batch_entry_free() hands it back to the same allocator */
+		len = strlen(key) + 1;
+		e->key = qb_util_malloc(len);
+		if (e->key == NULL) {
+			qb_util_free(e);
+			return -ENOMEM;
+		}
+		memcpy(e->key, key, len);
+	}
+	e->callback = tn->callback;
+	e->user_data = tn->user_data;
+	e->events = tn->events;
+	e->event = event;
+	e->old_value = old_value;
+	e->value = value;
+	qb_list_init(&e->list);
+	qb_list_add_tail(&e->list, &b->entries);
+	b->count++;
+
+	if (dedup && e->key) {
+		head = qb_map_get(b->keys, e->key);
+		if (head) {
+			e->key_next = head->key_next;
+			head->key_next = e;
+		} else {
+			qb_map_put(b->keys, e->key, e);
+		}
+	}
+
+	if (b->loop && !b->job_queued) {
+		if (qb_loop_job_add(b->loop, b->priority, map,
+				    batch_job) == 0) {
+			b->job_queued = QB_TRUE;
+		}
+	}
+	return 0;
+}
+
+void
+qb_map_notifier_call(struct qb_map *map, struct qb_map_notifier *tn,
+		     uint32_t event, const char *key,
+		     void *old_value, void *value)
+{
+	if (map->batch &&
+	    batch_queue(map, tn, event, key, old_value, value) == 0) {
+		return;
+	}
+	tn->callback(event, (char *)key, old_value, value, tn->user_data);
+}
+
+static void
+batch_purge(struct qb_map_batch *b, qb_map_notify_fn fn, int32_t events,
+	    int32_t cmp_userdata, void *user_data)
+{
+	struct qb_map_batch_entry *e;
+	struct qb_list_head *list;
+	struct qb_list_head *next;
+
+	qb_list_for_each_safe(list, next, &b->entries) {
+		e = qb_list_entry(list, struct qb_map_batch_entry, list);
+		if (e->callback == fn && e->events == events &&
+		    (!cmp_userdata || e->user_data == user_data)) {
+			/* still delivered, but to nobody */
+			e->callback = NULL;
+		}
+	}
+}
+
 void
 qb_map_put(struct qb_map *map, const char *key, const void *value)
 {
@@ -106,26 +325,177 @@ int32_t
 qb_map_notify_del(qb_map_t * m, const char *key, qb_map_notify_fn fn,
 		  int32_t events)
 {
-	if (m->notify_del) {
-		return m->notify_del(m, key, fn, events, QB_FALSE, NULL);
-	} else {
+	int32_t rc;
+
+	if (m->notify_del == NULL) {
 		return -ENOSYS;
 	}
+	rc = m->notify_del(m, key, fn, events, QB_FALSE, NULL);
+	if (rc == 0 && m->batch) {
+		batch_purge(m->batch, fn, events, QB_FALSE, NULL);
+	}
+	return rc;
 }
 
 int32_t
 qb_map_notify_del_2(qb_map_t * m, const char *key, qb_map_notify_fn fn,
 		    int32_t events, void *user_data)
 {
-	if (m->notify_del) {
-		return m->notify_del(m, key, fn, events, QB_TRUE, user_data);
-	} else {
+	int32_t rc;
+
+	if (m->notify_del == NULL) {
+		return -ENOSYS;
+	}
+	rc = m->notify_del(m, key, fn, events, QB_TRUE, user_data);
+	if (rc == 0 && m->batch) {
+		batch_purge(m->batch, fn, events, QB_TRUE, user_data);
+	}
+	return rc;
+}
+
+int32_t
+qb_map_notify_batch_start(qb_map_t *m, uint32_t flags)
+{
+	struct qb_map_batch *b;
+
+	if (m->batch) {
+		return -EEXIST;
+	}
+	b = qb_util_calloc(1, sizeof(struct qb_map_batch));
+	if (b == NULL) {
+		return -ENOMEM;
+	}
+	b->flags = flags;
+	qb_list_init(&b->entries);
+	m->batch = b;
+	return 0;
+}
+
+int32_t
+qb_map_notify_batch_loop_set(qb_map_t *m, qb_loop_t *l,
+			     enum qb_loop_priority p)
+{
+	struct qb_map_batch *b = m->batch;
+
+	if (b == NULL) {
+		return -EINVAL;
+	}
+	if (b->job_queued) {
+		(void)qb_loop_job_del(b->loop, b->priority, m, batch_job);
+		b->job_queued = QB_FALSE;
+	}
+	b->loop = l;
+	b->priority = p;
+	if (l && b->count > 0) {
+		if (qb_loop_job_add(l, p, m, batch_job) == 0) {
+			b->job_queued = QB_TRUE;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Take the whole batch and deliver it, anything the callbacks
+ * change goes into a new one.
+ */
+static void
+batch_deliver(struct qb_map_batch *b)
+{
+	struct qb_map_batch_entry *e;
+	struct qb_list_head entries;
+	struct qb_list_head *list;
+	struct qb_list_head *next;
+
+	if (b->count == 0) {
+		return;
+	}
+	qb_list_init(&entries);
+	qb_list_splice(&b->entries, &entries);
+	qb_list_init(&b->entries);
+	b->count = 0;
+	if (b->keys) {
+		qb_map_destroy(b->keys);
+		b->keys = NULL;
+	}
+
+	qb_list_for_each_safe(list, next, &entries) {
+		e = qb_list_entry(list, struct qb_map_batch_entry, list);
+		if (e->callback) {
+			e->callback(e->event, e->key, e->old_value, e->value,
+				    e->user_data);
+		}
+		batch_entry_free(e);
+	}
+}
+
+void
+qb_map_notify_batch_flush(qb_map_t *m)
+{
+	if (m->batch == NULL) {
+		return;
+	}
+	m->batch->job_queued = QB_FALSE;
+	batch_deliver(m->batch);
+}
+
+static void
+batch_job(void *data)
+{
+	qb_map_notify_batch_flush((qb_map_t *)data);
+}
+
+int32_t
+qb_map_notify_batch_commit(qb_map_t *m)
+{
+	struct qb_map_batch *b = m->batch;
+
+	if (b == NULL) {
+		return -EINVAL;
+	}
+	(void)qb_map_notify_batch_loop_set(m, NULL, QB_LOOP_MED);
+	/* from here on the callbacks' own changes are delivered directly */
+	m->batch = NULL;
+	batch_deliver(b);
+	qb_util_free(b);
+	return 0;
+}
+
+size_t
+qb_map_notifiers_count(struct qb_list_head *head)
+{
+	struct qb_list_head *list;
+	size_t count = 0;
+
+	qb_list_for_each(list, head) {
+		count++;
+	}
+	return count;
+}
+
+int32_t
+qb_map_stats_get(qb_map_t *m, struct qb_map_stats *stats)
+{
+	if (stats == NULL) {
+		return -EINVAL;
+	}
+	memset(stats, 0, sizeof(struct qb_map_stats));
+	if (m->stats_get == NULL) {
 		return -ENOSYS;
 	}
+	m->stats_get(m, stats);
+	if (m->batch) {
+		stats->batched = m->batch->count;
+		stats->mem_used += sizeof(struct qb_map_batch) +
+			m->batch->count * sizeof(struct qb_map_batch_entry);
+	}
+	return 0;
 }
 
 void
 qb_map_destroy(struct qb_map *map)
 {
+	if (map->batch) {
+		(void)qb_map_notify_batch_commit(map);
+	}
 	map->destroy(map);
 }
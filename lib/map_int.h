@@ -24,6 +24,7 @@
 #include <qb/qblist.h>
 
 struct qb_map;
+struct qb_map_batch;
 
 typedef void (*qb_map_put_func)(struct qb_map *map, const char* key,
 				const void* value);
@@ -35,6 +36,8 @@ typedef qb_map_iter_t* (*qb_map_iter_create_func)(struct qb_map *map,
 						  const char* prefix);
 typedef const char* (*qb_map_iter_next_func)(qb_map_iter_t* i, void** value);
 typedef void (*qb_map_iter_free_func)(qb_map_iter_t* i);
+typedef void (*qb_map_stats_get_func)(struct qb_map *map,
+				      struct qb_map_stats *stats);
 
 typedef int32_t (*qb_map_notify_add_func)(qb_map_t* m, const char* key,
 					  qb_map_notify_fn fn, int32_t events,
@@ -57,6 +60,8 @@ struct qb_map {
 	qb_map_iter_free_func iter_free;
 	qb_map_notify_add_func notify_add;
 	qb_map_notify_del_func notify_del;
+	qb_map_stats_get_func stats_get;
+	struct qb_map_batch *batch;
 };
 
 struct qb_map_iter {
@@ -71,5 +76,27 @@ struct qb_map_notifier {
 	int32_t refcount;
 };
 
+/*
+ * Call a notifier, or queue the call if the map is batching
+ * notifications.
+ */
+/*
+ * Count something of the given size into a qb_map_stats histogram.
+ */
+static inline void
+qb_map_stats_histogram_add(struct qb_map_stats *stats, uint32_t size)
+{
+	if (size > stats->longest) {
+		stats->longest = size;
+	}
+	stats->histogram[QB_MIN(size, QB_MAP_STATS_HISTOGRAM_LEN - 1)]++;
+}
+
+size_t qb_map_notifiers_count(struct qb_list_head *head);
+
+void qb_map_notifier_call(struct qb_map *map, struct qb_map_notifier *tn,
+			  uint32_t event, const char *key,
+			  void *old_value, void *value);
+
 
 #endif /* _QB_MAP_INT_H_ */
@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+
+#include <qb/qbdefs.h>
+#include <qb/qbmap.h>
+#include <qb/qblist.h>
+#include "util_int.h"
+
+/*
+ * Open addressing with linear probing. Next to the slots there is one
+ * control byte per slot: empty, deleted or 7 bits of the key's hash,
+ * so most of a probe only touches the control bytes and a miss rarely
+ * has to look at a key.
+ *
+ * Removing leaves a "deleted" marker behind rather than moving other
+ * entries, which is what makes removing while iterating safe.
+ */
+#define U64_CTRL_EMPTY		0x80
+#define U64_CTRL_DELETED	0xfe
+#define U64_SIZE_MIN		8
+
+struct u64_slot {
+	uint64_t key;
+	void *value;
+};
+
+struct u64_notifier {
+	struct qb_list_head list;
+	qb_map_u64_notify_fn callback;
+	int32_t events;
+	void *user_data;
+};
+
+struct qb_map_u64 {
+	uint8_t *ctrl;
+	struct u64_slot *slots;
+	size_t size;
+	size_t count;
+	size_t deleted;
+	int32_t iterators;
+	struct qb_list_head notifier_head;
+};
+
+struct qb_map_u64_iter {
+	struct qb_map_u64 *m;
+	size_t pos;
+};
+
+/*
+ * The murmur3 finalizer, sequential keys end up spread over the table.
+ */
+static inline uint64_t
+u64_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline uint8_t
+u64_ctrl_tag(uint64_t hash)
+{
+	return (uint8_t)(hash >> 57);
+}
+
+static void
+u64_notify(struct qb_map_u64 *m, uint32_t event, uint64_t key,
+	   void *old_value, void *value)
+{
+	struct qb_list_head *list;
+	struct u64_notifier *n;
+
+	qb_list_for_each(list, &m->notifier_head) {
+		n = qb_list_entry(list, struct u64_notifier, list);
+
+		if (n->events & event) {
+			n->callback(event, key, old_value, value,
+				    n->user_data);
+		}
+		if (((event & QB_MAP_NOTIFY_DELETED) ||
+		     (event & QB_MAP_NOTIFY_REPLACED)) &&
+		    (n->events & QB_MAP_NOTIFY_FREE)) {
+			n->callback(QB_MAP_NOTIFY_FREE, key,
+				    old_value, value, n->user_data);
+		}
+	}
+}
+
+static int32_t
+u64_table_alloc(struct qb_map_u64 *m, size_t size)
+{
+	char *mem;
+
+	mem = qb_util_malloc(size * (sizeof(struct u64_slot) + 1));
+	if (mem == NULL) {
+		return -ENOMEM;
+	}
+	m->slots = (struct u64_slot *)mem;
+	m->ctrl = (uint8_t *)(mem + size * sizeof(struct u64_slot));
+	memset(m->ctrl, U64_CTRL_EMPTY, size);
+	m->size = size;
+	m->deleted = 0;
+	return 0;
+}
+
+/*
+ * Find the slot of key, or if it isn't there the slot it should go
+ * into (preferring the first deleted one on the way).
+ */
+static size_t
+u64_find(struct qb_map_u64 *m, uint64_t key, uint64_t hash, int32_t *found)
+{
+	size_t mask = m->size - 1;
+	size_t i = hash & mask;
+	size_t first_free = m->size;
+	uint8_t tag = u64_ctrl_tag(hash);
+	uint8_t c;
+
+	for (;;) {
+		c = m->ctrl[i];
+		if (c == tag && m->slots[i].key == key) {
+			*found = QB_TRUE;
+			return i;
+		}
+		if (c == U64_CTRL_EMPTY) {
+			*found = QB_FALSE;
+			return first_free != m->size ? first_free : i;
+		}
+		if (c == U64_CTRL_DELETED && first_free == m->size) {
+			first_free = i;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+static int32_t
+u64_resize(struct qb_map_u64 *m, size_t size)
+{
+	uint8_t *old_ctrl = m->ctrl;
+	struct u64_slot *old_slots = m->slots;
+	size_t old_size = m->size;
+	uint64_t hash;
+	int32_t found;
+	size_t i;
+	size_t j;
+
+	if (u64_table_alloc(m, size) != 0) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < old_size; i++) {
+		if (old_ctrl[i] & 0x80) {
+			continue;
+		}
+		hash = u64_hash(old_slots[i].key);
+		j = u64_find(m, old_slots[i].key, hash, &found);
+		m->ctrl[j] = u64_ctrl_tag(hash);
+		m->slots[j] = old_slots[i];
+	}
+	qb_util_free(old_slots);
+	return 0;
+}
+
+qb_map_u64_t *
+qb_map_u64_create(size_t max_size)
+{
+	struct qb_map_u64 *m;
+	size_t size = U64_SIZE_MIN;
+
+	/* keep the load at or below 3/4 */
+	while (size * 3 / 4 < max_size) {
+		size <<= 1;
+	}
+	m = qb_util_calloc(1, sizeof(struct qb_map_u64));
+	if (m == NULL) {
+		return NULL;
+	}
+	if (u64_table_alloc(m, size) != 0) {
+		qb_util_free(m);
+		return NULL;
+	}
+	qb_list_init(&m->notifier_head);
+	return m;
+}
+
+int32_t
+qb_map_u64_put(qb_map_u64_t *m, uint64_t key, const void *value)
+{
+	uint64_t hash = u64_hash(key);
+	void *old_value;
+	int32_t found;
+	size_t i;
+
+	i = u64_find(m, key, hash, &found);
+	if (found) {
+		old_value = m->slots[i].value;
+		m->slots[i].value = (void *)value;
+		u64_notify(m, QB_MAP_NOTIFY_REPLACED, key,
+			   old_value, (void *)value);
+		return 0;
+	}
+
+	if ((m->count + m->deleted + 1) > m->size * 3 / 4) {
+		if (m->iterators > 0) {
+			/* moving entries would upset the iterators */
+			return -EBUSY;
+		}
+		/* only grow if it is really filling up, otherwise
+		 * rebuilding drops the deleted markers */
+		if (u64_resize(m, (m->count + 1) > m->size / 2 ?
+			       m->size * 2 : m->size) != 0) {
+			return -ENOMEM;
+		}
+		i = u64_find(m, key, hash, &found);
+	}
+	if (m->ctrl[i] == U64_CTRL_DELETED) {
+		m->deleted--;
+	}
+	m->ctrl[i] = u64_ctrl_tag(hash);
+	m->slots[i].key = key;
+	m->slots[i].value = (void *)value;
+	m->count++;
+	u64_notify(m, QB_MAP_NOTIFY_INSERTED, key, NULL, (void *)value);
+	return 0;
+}
+
+void *
+qb_map_u64_get(qb_map_u64_t *m, uint64_t key)
+{
+	int32_t found;
+	size_t i;
+
+	i = u64_find(m, key, u64_hash(key), &found);
+	if (found) {
+		return m->slots[i].value;
+	}
+	return NULL;
+}
+
+int32_t
+qb_map_u64_rm(qb_map_u64_t *m, uint64_t key)
+{
+	void *old_value;
+	int32_t found;
+	size_t i;
+
+	i = u64_find(m, key, u64_hash(key), &found);
+	if (!found) {
+		return QB_FALSE;
+	}
+	old_value = m->slots[i].value;
+	m->ctrl[i] = U64_CTRL_DELETED;
+	m->count--;
+	m->deleted++;
+	u64_notify(m, QB_MAP_NOTIFY_DELETED, key, old_value, NULL);
+	return QB_TRUE;
+}
+
+size_t
+qb_map_u64_count_get(qb_map_u64_t *m)
+{
+	return m->count;
+}
+
+qb_map_u64_iter_t *
+qb_map_u64_iter_create(qb_map_u64_t *m)
+{
+	struct qb_map_u64_iter *i;
+
+	i = qb_util_malloc(sizeof(struct qb_map_u64_iter));
+	if (i == NULL) {
+		return NULL;
+	}
+	i->m = m;
+	i->pos = 0;
+	m->iterators++;
+	return i;
+}
+
+int32_t
+qb_map_u64_iter_next(qb_map_u64_iter_t *i, uint64_t *key, void **value)
+{
+	struct qb_map_u64 *m = i->m;
+
+	for (; i->pos < m->size; i->pos++) {
+		if ((m->ctrl[i->pos] & 0x80) == 0) {
+			*key = m->slots[i->pos].key;
+			if (value) {
+				*value = m->slots[i->pos].value;
+			}
+			i->pos++;
+			return QB_TRUE;
+		}
+	}
+	return QB_FALSE;
+}
+
+void
+qb_map_u64_iter_free(qb_map_u64_iter_t *i)
+{
+	i->m->iterators--;
+	qb_util_free(i);
+}
+
+int32_t
+qb_map_u64_notify_add(qb_map_u64_t *m, qb_map_u64_notify_fn fn,
+		      int32_t events, void *user_data)
+{
+	struct u64_notifier *n;
+	struct qb_list_head *list;
+
+	if (fn == NULL) {
+		return -EINVAL;
+	}
+	qb_list_for_each(list, &m->notifier_head) {
+		n = qb_list_entry(list, struct u64_notifier, list);
+
+		if (events & QB_MAP_NOTIFY_FREE &&
+		    n->events == events) {
+			/* only one free notifier */
+			return -EEXIST;
+		}
+		if (n->events == events &&
+		    n->user_data == user_data &&
+		    n->callback == fn) {
+			return -EEXIST;
+		}
+	}
+
+	n = qb_util_malloc(sizeof(struct u64_notifier));
+	if (n == NULL) {
+		return -errno;
+	}
+	n->events = events;
+	n->user_data = user_data;
+	n->callback = fn;
+	qb_list_init(&n->list);
+
+	if (events & QB_MAP_NOTIFY_FREE) {
+		qb_list_add_tail(&n->list, &m->notifier_head);
+	} else {
+		qb_list_add(&n->list, &m->notifier_head);
+	}
+	return 0;
+}
+
+int32_t
+qb_map_u64_notify_del(qb_map_u64_t *m, qb_map_u64_notify_fn fn,
+		      int32_t events, void *user_data)
+{
+	struct u64_notifier *n;
+	struct qb_list_head *list;
+	struct qb_list_head *next;
+
+	qb_list_for_each_safe(list, next, &m->notifier_head) {
+		n = qb_list_entry(list, struct u64_notifier, list);
+
+		if (n->events == events && n->callback == fn &&
+		    n->user_data == user_data) {
+			qb_list_del(&n->list);
+			qb_util_free(n);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int32_t
+qb_map_u64_stats_get(qb_map_u64_t *m, struct qb_map_stats *stats)
+{
+	struct qb_list_head *list;
+	size_t home;
+	size_t i;
+
+	if (stats == NULL) {
+		return -EINVAL;
+	}
+	memset(stats, 0, sizeof(struct qb_map_stats));
+	stats->count = m->count;
+	stats->nodes = m->count;
+	stats->slots = m->size;
+	qb_list_for_each(list, &m->notifier_head) {
+		stats->notifiers++;
+	}
+	for (i = 0; i < m->size; i++) {
+		if (m->ctrl[i] & 0x80) {
+			continue;
+		}
+		/* how many slots a lookup of this key looks at */
+		home = u64_hash(m->slots[i].key) & (m->size - 1);
+		stats->histogram[QB_MIN(((i - home) & (m->size - 1)) + 1,
+					QB_MAP_STATS_HISTOGRAM_LEN - 1)]++;
+		stats->longest = QB_MAX(stats->longest,
+					((i - home) & (m->size - 1)) + 1);
+	}
+	stats->mem_used = sizeof(struct qb_map_u64) +
+		m->size * (sizeof(struct u64_slot) + 1) +
+		stats->notifiers * sizeof(struct u64_notifier);
+	return 0;
+}
+
+void
+qb_map_u64_destroy(qb_map_u64_t *m)
+{
+	struct qb_list_head *list;
+	struct qb_list_head *next;
+	struct u64_notifier *n;
+	size_t i;
+
+	for (i = 0; i < m->size; i++) {
+		if ((m->ctrl[i] & 0x80) == 0) {
+			m->ctrl[i] = U64_CTRL_DELETED;
+			m->count--;
+			u64_notify(m, QB_MAP_NOTIFY_DELETED, m->slots[i].key,
+				   m->slots[i].value, NULL);
+		}
+	}
+	qb_list_for_each_safe(list, next, &m->notifier_head) {
+		n = qb_list_entry(list, struct u64_notifier, list);
+		qb_list_del(&n->list);
+		qb_util_free(n);
+	}
+	qb_util_free(m->slots);
+	qb_util_free(m);
+}
@@ -21,6 +21,7 @@
 #include "ringbuffer_int.h"
 #include <qb/qbdefs.h>
 #include "atomic_int.h"
+#include "probes.h"
 
 #define QB_RB_FILE_HEADER_VERSION 1
 
@@ -87,6 +88,7 @@ do {							\
 #define QB_RB_CHUNK_MAGIC		0xA1A1A1A1
 #define QB_RB_CHUNK_MAGIC_DEAD		0xD0D0D0D0
 #define QB_RB_CHUNK_MAGIC_ALLOC		0xA110CED0
+#define QB_RB_CHUNK_MAGIC_FORWARD	0xF0F0F0F0
 #define QB_RB_CHUNK_SIZE_GET(rb, pointer) rb->shared_data[pointer]
 #define QB_RB_CHUNK_MAGIC_GET(rb, pointer) \
 	qb_atomic_int_get_ex((int32_t*)&rb->shared_data[(pointer + 1) % rb->shared_hdr->word_size], \
@@ -111,9 +113,158 @@ do {							\
 	}						\
 } while (0)
 
+/*
+ * The last chunk in a ring that has been resized: the writer carries
+ * on in the ring of that generation, which is opened with that size.
+ */
+struct qb_rb_forward {
+	uint32_t generation;
+	uint32_t reserved;
+	uint64_t size;
+};
+
 static void print_header(struct qb_ringbuffer_s * rb);
 static int _rb_chunk_reclaim(struct qb_ringbuffer_s * rb);
 
+/*
+ * Process wide totals for the published statistics.
+ */
+static int32_t rb_stats_registered = 0;
+static int32_t rb_stats_open = 0;
+static int32_t rb_stats_mapped_kb = 0;
+static int32_t rb_stats_full = 0;
+
+static const char * const rb_stats_labels[] = {
+	"open",
+	"mapped_kb",
+	"full",
+};
+
+static void
+_rb_stats_fill(void *data, uint64_t *values)
+{
+	values[0] = (uint32_t)qb_atomic_int_get(&rb_stats_open);
+	values[1] = (uint32_t)qb_atomic_int_get(&rb_stats_mapped_kb);
+	values[2] = (uint32_t)qb_atomic_int_get(&rb_stats_full);
+}
+
+static void
+_rb_stats_opened(struct qb_ringbuffer_s * rb)
+{
+	if (qb_atomic_int_compare_and_exchange(&rb_stats_registered, 0, 1)) {
+		(void)qb_stats_provider_add("rb", rb_stats_labels,
+					    sizeof(rb_stats_labels) /
+					    sizeof(rb_stats_labels[0]),
+					    _rb_stats_fill, NULL);
+	}
+	qb_atomic_int_inc(&rb_stats_open);
+	qb_atomic_int_add(&rb_stats_mapped_kb,
+			  (rb->shared_hdr->word_size * sizeof(uint32_t)) / 1024);
+}
+
+static void
+_rb_stats_closed(struct qb_ringbuffer_s * rb)
+{
+	(void)qb_atomic_int_dec_and_test(&rb_stats_open);
+	qb_atomic_int_add(&rb_stats_mapped_kb,
+			  -(int32_t)((rb->shared_hdr->word_size *
+				      sizeof(uint32_t)) / 1024));
+}
+
+static int32_t
+_rb_file_open_read_only(const char *name)
+{
+	char path[PATH_MAX];
+	int32_t fd;
+
+	if (strchr(name, '/')) {
+		return open(name, O_RDONLY);
+	}
+#if defined(QB_LINUX) || defined(QB_CYGWIN)
+	snprintf(path, PATH_MAX, "/dev/shm/qb-%s-header", name);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		return fd;
+	}
+#endif
+	snprintf(path, PATH_MAX, LOCALSTATEDIR "/run/qb-%s-header", name);
+	return open(path, O_RDONLY);
+}
+
+/*
+ * Map someone else's ring without taking part in it: no semaphore,
+ * no reference and nothing in it is ever written to.
+ */
+static qb_ringbuffer_t *
+_rb_open_read_only(const char *name, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb;
+	struct stat st;
+	int32_t fd_hdr;
+	int32_t fd_data;
+	int32_t error;
+	void *shm_addr;
+
+	fd_hdr = _rb_file_open_read_only(name);
+	if (fd_hdr < 0) {
+		return NULL;
+	}
+	if (fstat(fd_hdr, &st) == -1) {
+		error = -errno;
+		close(fd_hdr);
+		errno = -error;
+		return NULL;
+	}
+	if (st.st_size < sizeof(struct qb_ringbuffer_shared_s)) {
+		close(fd_hdr);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rb = calloc(1, sizeof(struct qb_ringbuffer_s));
+	if (rb == NULL) {
+		close(fd_hdr);
+		return NULL;
+	}
+	rb->flags = flags;
+	rb->shared_size = st.st_size;
+	rb->shared_hdr = mmap(0, rb->shared_size, PROT_READ, MAP_SHARED,
+			      fd_hdr, 0);
+	error = -errno;
+	close(fd_hdr);
+	if (rb->shared_hdr == MAP_FAILED) {
+		qb_util_perror(LOG_ERR, "couldn't mmap %s header", name);
+		goto cleanup;
+	}
+
+	fd_data = open(rb->shared_hdr->data_path, O_RDONLY);
+	if (fd_data < 0) {
+		error = -errno;
+		qb_util_perror(LOG_ERR, "couldn't open %s",
+			       rb->shared_hdr->data_path);
+		goto cleanup_hdr;
+	}
+	/* this function closes fd_data */
+	error = qb_sys_circular_mmap_prot(fd_data, &shm_addr,
+					  rb->shared_hdr->word_size *
+					  sizeof(uint32_t), PROT_READ);
+	if (error != 0) {
+		qb_util_log(LOG_ERR, "couldn't create circular mmap on %s",
+			    rb->shared_hdr->data_path);
+		goto cleanup_hdr;
+	}
+	rb->shared_data = shm_addr;
+	qb_atomic_init();
+	return rb;
+
+cleanup_hdr:
+	munmap(rb->shared_hdr, rb->shared_size);
+cleanup:
+	free(rb);
+	errno = -error;
+	return NULL;
+}
+
 qb_ringbuffer_t *
 qb_rb_open(const char *name, size_t size, uint32_t flags,
 	   size_t shared_user_data_size)
@@ -138,6 +289,14 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	void *shm_addr;
 	long page_size = sysconf(_SC_PAGESIZE);
 
+	if (flags & QB_RB_FLAG_READ_ONLY) {
+		if (flags & QB_RB_FLAG_CREATE) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return _rb_open_read_only(name, flags);
+	}
+
 #ifdef QB_ARCH_HPPA
 	page_size = QB_MAX(page_size, 0x00400000); /* align to page colour */
 #elif defined(QB_FORCE_SHM_ALIGN)
@@ -162,6 +321,8 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	if (rb == NULL) {
 		return NULL;
 	}
+	rb->shared_size = shared_size;
+	(void)strlcpy(rb->name, name, NAME_MAX);
 
 	/*
 	 * Create a shared_hdr memory segment for the header.
@@ -255,6 +416,7 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	}
 
 	close(fd_hdr);
+	_rb_stats_opened(rb);
 	return rb;
 
 cleanup_data:
@@ -280,6 +442,73 @@ cleanup_hdr:
 	return NULL;
 }
 
+/*
+ * A resized ring lives on under the name it was opened with, plus the
+ * generation.
+ */
+static int32_t
+_rb_generation_name(struct qb_ringbuffer_s * rb, uint32_t generation,
+		    char *name)
+{
+	int32_t len;
+
+	if (generation == 0) {
+		len = strlcpy(name, rb->name, NAME_MAX);
+	} else {
+		len = snprintf(name, NAME_MAX, "%s-r%u", rb->name, generation);
+	}
+	if (len >= NAME_MAX) {
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+/*
+ * The reader removes the rings it leaves behind, but it may never get
+ * to the ones the creator is still responsible for.
+ */
+static void
+_rb_generations_unlink(struct qb_ringbuffer_s * rb)
+{
+	char path[PATH_MAX];
+	char name[NAME_MAX];
+	const char *dir_end = strrchr(rb->shared_hdr->hdr_path, '/');
+	int32_t dir_len;
+	uint32_t g;
+
+	if (dir_end == NULL) {
+		return;
+	}
+	dir_len = dir_end - rb->shared_hdr->hdr_path;
+	for (g = rb->generation_linked; g < rb->generation; g++) {
+		if (_rb_generation_name(rb, g, name) != 0) {
+			continue;
+		}
+		snprintf(path, PATH_MAX, "%.*s/qb-%s-data", dir_len,
+			 rb->shared_hdr->hdr_path, name);
+		(void)unlink(path);
+		snprintf(path, PATH_MAX, "%.*s/qb-%s-header", dir_len,
+			 rb->shared_hdr->hdr_path, name);
+		(void)unlink(path);
+	}
+}
+
+/*
+ * Leave the ring that's mapped now for the one next has open.
+ */
+static void
+_rb_switch(struct qb_ringbuffer_s * rb, struct qb_ringbuffer_s * next)
+{
+	(void)qb_atomic_int_dec_and_test(&rb->shared_hdr->ref_count);
+	_rb_stats_closed(rb);
+	munmap(rb->shared_data, (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
+	munmap(rb->shared_hdr, rb->shared_size);
+
+	rb->shared_hdr = next->shared_hdr;
+	rb->shared_data = next->shared_data;
+	rb->sem_id = next->sem_id;
+	free(next);
+}
 
 void
 qb_rb_close(struct qb_ringbuffer_s * rb)
@@ -289,11 +518,20 @@ qb_rb_close(struct qb_ringbuffer_s * rb)
 	}
 	qb_enter();
 
+	if (rb->flags & QB_RB_FLAG_READ_ONLY) {
+		munmap(rb->shared_data,
+		       (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
+		munmap(rb->shared_hdr, rb->shared_size);
+		free(rb);
+		return;
+	}
+
 	(void)qb_atomic_int_dec_and_test(&rb->shared_hdr->ref_count);
 	if (rb->flags & QB_RB_FLAG_CREATE) {
 		if (rb->notifier.destroy_fn) {
 			(void)rb->notifier.destroy_fn(rb->notifier.instance);
 		}
+		_rb_generations_unlink(rb);
 		unlink(rb->shared_hdr->data_path);
 		unlink(rb->shared_hdr->hdr_path);
 		qb_util_log(LOG_DEBUG,
@@ -303,6 +541,7 @@ qb_rb_close(struct qb_ringbuffer_s * rb)
 		qb_util_log(LOG_DEBUG,
 			    "Closing ringbuffer: %s", rb->shared_hdr->hdr_path);
 	}
+	_rb_stats_closed(rb);
 	munmap(rb->shared_data, (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
 	munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
 	free(rb);
@@ -319,6 +558,7 @@ qb_rb_force_close(struct qb_ringbuffer_s * rb)
 	if (rb->notifier.destroy_fn) {
 		(void)rb->notifier.destroy_fn(rb->notifier.instance);
 	}
+	_rb_generations_unlink(rb);
 
         errno = 0;
 	unlink(rb->shared_hdr->data_path);
@@ -331,11 +571,86 @@ qb_rb_force_close(struct qb_ringbuffer_s * rb)
 	qb_util_perror(LOG_DEBUG,
 		    "Force free'ing ringbuffer: %s",
 		    rb->shared_hdr->hdr_path);
+	_rb_stats_closed(rb);
 	munmap(rb->shared_data, (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
 	munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
 	free(rb);
 }
 
+/*
+ * Give the pages of an empty ring back. Only the writer can do this,
+ * a reader has no way of telling that a write isn't under way.
+ */
+int32_t
+qb_rb_pages_release(struct qb_ringbuffer_s * rb)
+{
+	size_t len;
+
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (qb_rb_space_used(rb) != 0 ||
+	    (rb->notifier.q_len_fn &&
+	     rb->notifier.q_len_fn(rb->notifier.instance) > 0)) {
+		return -EBUSY;
+	}
+	len = rb->shared_hdr->word_size * sizeof(uint32_t);
+#ifdef MADV_REMOVE
+	/* both views are of the same file, so this frees them both */
+	if (madvise(rb->shared_data, len, MADV_REMOVE) == 0) {
+		return 0;
+	}
+#endif /* MADV_REMOVE */
+	/* at least they stop counting against this process */
+	if (madvise(rb->shared_data, len << 1, MADV_DONTNEED) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Bytes of the ring actually in memory.
+ */
+ssize_t
+qb_rb_resident_get(struct qb_ringbuffer_s * rb)
+{
+#ifdef HAVE_MINCORE
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t len;
+	size_t pages;
+	size_t i;
+	unsigned char *vec;
+	ssize_t resident = 0;
+
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (page_size <= 0) {
+		return -EINVAL;
+	}
+	len = rb->shared_hdr->word_size * sizeof(uint32_t);
+	pages = (len + page_size - 1) / page_size;
+	vec = malloc(pages);
+	if (vec == NULL) {
+		return -ENOMEM;
+	}
+	if (mincore((void *)rb->shared_data, len, (void *)vec) == -1) {
+		resident = -errno;
+		free(vec);
+		return resident;
+	}
+	for (i = 0; i < pages; i++) {
+		if (vec[i] & 1) {
+			resident += page_size;
+		}
+	}
+	free(vec);
+	return resident;
+#else
+	return -ENOTSUP;
+#endif /* HAVE_MINCORE */
+}
+
 char *
 qb_rb_name_get(struct qb_ringbuffer_s * rb)
 {
@@ -354,6 +669,12 @@ qb_rb_shared_user_data_get(struct qb_ringbuffer_s * rb)
 	return rb->shared_hdr->user_data;
 }
 
+size_t
+qb_rb_shared_user_data_size_get(struct qb_ringbuffer_s * rb)
+{
+	return rb->shared_size - sizeof(struct qb_ringbuffer_shared_s);
+}
+
 int32_t
 qb_rb_refcount_get(struct qb_ringbuffer_s * rb)
 {
@@ -446,6 +767,10 @@ qb_rb_chunk_alloc(struct qb_ringbuffer_s * rb, size_t len)
 		errno = EINVAL;
 		return NULL;
 	}
+	if (rb->flags & QB_RB_FLAG_READ_ONLY) {
+		errno = EPERM;
+		return NULL;
+	}
 	/*
 	 * Reclaim data if we are over writing and we need space
 	 */
@@ -459,6 +784,7 @@ qb_rb_chunk_alloc(struct qb_ringbuffer_s * rb, size_t len)
 		}
 	} else {
 		if (qb_rb_space_free(rb) < (len + QB_RB_CHUNK_MARGIN)) {
+			qb_atomic_int_inc(&rb_stats_full);
 			errno = EAGAIN;
 			return NULL;
 		}
@@ -479,9 +805,9 @@ qb_rb_chunk_alloc(struct qb_ringbuffer_s * rb, size_t len)
 }
 
 static uint32_t
-qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer)
+_rb_chunk_step_size(struct qb_ringbuffer_s * rb, uint32_t pointer,
+		    uint32_t chunk_size)
 {
-	uint32_t chunk_size = QB_RB_CHUNK_SIZE_GET(rb, pointer);
 	/*
 	 * skip over the chunk header
 	 */
@@ -500,14 +826,18 @@ qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer)
 	return pointer;
 }
 
-int32_t
-qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
+static uint32_t
+qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer)
+{
+	return _rb_chunk_step_size(rb, pointer,
+				   QB_RB_CHUNK_SIZE_GET(rb, pointer));
+}
+
+static int32_t
+_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len, uint32_t magic)
 {
 	uint32_t old_write_pt;
 
-	if (rb == NULL) {
-		return -EINVAL;
-	}
 	/*
 	 * commit the magic & chunk_size
 	 */
@@ -518,7 +848,9 @@ qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
 	 * commit the new write pointer
 	 */
 	rb->shared_hdr->write_pt = qb_rb_chunk_step(rb, old_write_pt);
-	QB_RB_CHUNK_MAGIC_SET(rb, old_write_pt, QB_RB_CHUNK_MAGIC);
+	QB_RB_CHUNK_MAGIC_SET(rb, old_write_pt, magic);
+	QB_PROBE3(rb__commit, (const char *)rb->shared_hdr->hdr_path,
+		  len, old_write_pt);
 
 	DEBUG_PRINTF("commit [%zd] read: %u, write: %u -> %u (%u)\n",
 		     (rb->notifier.q_len_fn ?
@@ -537,6 +869,18 @@ qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
 	return 0;
 }
 
+int32_t
+qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
+{
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (rb->flags & QB_RB_FLAG_READ_ONLY) {
+		return -EPERM;
+	}
+	return _rb_chunk_commit(rb, len, QB_RB_CHUNK_MAGIC);
+}
+
 ssize_t
 qb_rb_chunk_write(struct qb_ringbuffer_s * rb, const void *data, size_t len)
 {
@@ -551,7 +895,7 @@ qb_rb_chunk_write(struct qb_ringbuffer_s * rb, const void *data, size_t len)
 		return -errno;
 	}
 
-	memcpy(dest, data, len);
+	qb_rb_copy_in(dest, data, len);
 
 	res = qb_rb_chunk_commit(rb, len);
 	if (res < 0) {
@@ -561,6 +905,156 @@ qb_rb_chunk_write(struct qb_ringbuffer_s * rb, const void *data, size_t len)
 	return len;
 }
 
+int32_t
+qb_rb_resize(struct qb_ringbuffer_s * rb, size_t size)
+{
+	struct qb_ringbuffer_s *next;
+	struct qb_rb_forward fwd;
+	void *chunk;
+	char name[NAME_MAX];
+	struct stat st;
+	size_t user_data_size;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int32_t res;
+
+	if (rb == NULL || size == 0) {
+		return -EINVAL;
+	}
+	if ((rb->flags & QB_RB_FLAG_CREATE) == 0 ||
+	    (rb->flags & QB_RB_FLAG_READ_ONLY)) {
+		return -EPERM;
+	}
+	if (rb->flags & QB_RB_FLAG_OVERWRITE) {
+		/* the marker could be overwritten before it's read */
+		return -ENOTSUP;
+	}
+#ifdef QB_ARCH_HPPA
+	page_size = QB_MAX(page_size, 0x00400000);
+#elif defined(QB_FORCE_SHM_ALIGN)
+	page_size = QB_MAX(page_size, 16 * 1024);
+#endif /* QB_FORCE_SHM_ALIGN */
+	if (QB_ROUNDUP(size + QB_RB_CHUNK_MARGIN + 1, page_size) ==
+	    rb->shared_hdr->word_size * sizeof(uint32_t)) {
+		return 0;
+	}
+	if (qb_rb_space_free(rb) <
+	    sizeof(struct qb_rb_forward) + QB_RB_CHUNK_MARGIN) {
+		return -EAGAIN;
+	}
+	res = _rb_generation_name(rb, rb->generation + 1, name);
+	if (res != 0) {
+		return res;
+	}
+
+	user_data_size = qb_rb_shared_user_data_size_get(rb);
+	next = qb_rb_open_2(name, size, rb->flags | QB_RB_FLAG_NO_SEMAPHORE,
+			    user_data_size, NULL);
+	if (next == NULL) {
+		return -errno;
+	}
+	memcpy(next->shared_hdr->user_data, rb->shared_hdr->user_data,
+	       user_data_size);
+	if (rb->notifier.instance == rb) {
+		res = qb_rb_sem_create(next, rb->flags);
+		if (res < 0) {
+			goto cleanup;
+		}
+	}
+	/* whoever could open the old ring has to be able to follow */
+	if (stat(rb->shared_hdr->hdr_path, &st) == 0) {
+		res = qb_rb_chown(next, st.st_uid, st.st_gid);
+		if (res == 0) {
+			res = qb_rb_chmod(next, st.st_mode & 07777);
+		}
+		if (res < 0) {
+			goto cleanup;
+		}
+	}
+
+	chunk = qb_rb_chunk_alloc(rb, sizeof(struct qb_rb_forward));
+	if (chunk == NULL) {
+		res = -errno;
+		goto cleanup;
+	}
+	fwd.generation = rb->generation + 1;
+	fwd.reserved = 0;
+	fwd.size = size;
+	/* chunks are only word aligned */
+	memcpy(chunk, &fwd, sizeof(fwd));
+	res = _rb_chunk_commit(rb, sizeof(struct qb_rb_forward),
+			       QB_RB_CHUNK_MAGIC_FORWARD);
+	if (res < 0) {
+		/* it's in the ring, the reader finds it on its next read */
+		errno = -res;
+		qb_util_perror(LOG_WARNING, "couldn't post the resize of %s",
+			       rb->shared_hdr->hdr_path);
+	}
+	qb_util_log(LOG_DEBUG, "resizing %s to %zu bytes",
+		    rb->shared_hdr->hdr_path, size);
+
+	if (qb_atomic_int_get(&rb->shared_hdr->ref_count) > 1) {
+		/* the reader got this far, so removed what came before */
+		rb->generation_linked = rb->generation;
+	}
+	/* the reader is still to come, it removes the old ring */
+	_rb_switch(rb, next);
+	rb->generation++;
+	return 0;
+
+cleanup:
+	qb_rb_close(next);
+	return res;
+}
+
+/*
+ * The writer has resized the ring, everything before the marker has
+ * been read so carry on in the new ring and remove this one.
+ */
+static int32_t
+_rb_forward_follow(struct qb_ringbuffer_s * rb, uint32_t read_pt)
+{
+	struct qb_ringbuffer_s *next;
+	struct qb_rb_forward fwd;
+	char name[NAME_MAX];
+	int32_t res;
+
+	memcpy(&fwd, QB_RB_CHUNK_DATA_GET(rb, read_pt), sizeof(fwd));
+	res = _rb_generation_name(rb, fwd.generation, name);
+	if (res != 0) {
+		return res;
+	}
+	next = qb_rb_open_2(name, fwd.size,
+			    (rb->flags & ~QB_RB_FLAG_CREATE) |
+			    QB_RB_FLAG_NO_SEMAPHORE,
+			    qb_rb_shared_user_data_size_get(rb), NULL);
+	if (next == NULL) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't follow %s to %s",
+			       rb->shared_hdr->hdr_path, name);
+		return res;
+	}
+	if (rb->notifier.instance == rb &&
+	    (rb->flags & QB_RB_FLAG_SHARED_PROCESS)) {
+		res = qb_rb_sem_create(next, rb->flags & ~QB_RB_FLAG_CREATE);
+		if (res < 0) {
+			qb_rb_close(next);
+			return res;
+		}
+	}
+	QB_PROBE3(rb__forward, (const char *)rb->shared_hdr->hdr_path,
+		  (size_t)fwd.size, fwd.generation);
+
+	/* the writer is done with it */
+	if (rb->notifier.instance == rb && rb->notifier.destroy_fn) {
+		(void)rb->notifier.destroy_fn(rb->notifier.instance);
+	}
+	(void)unlink(rb->shared_hdr->data_path);
+	(void)unlink(rb->shared_hdr->hdr_path);
+	_rb_switch(rb, next);
+	rb->generation = fwd.generation;
+	return 0;
+}
+
 static int
 _rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
 {
@@ -592,6 +1086,8 @@ _rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
 	 * header.
 	 */
 	rb->shared_hdr->read_pt = new_read_pt;
+	QB_PROBE3(rb__reclaim, (const char *)rb->shared_hdr->hdr_path,
+		  old_chunk_size, old_read_pt);
 
 	if (rb->notifier.reclaim_fn) {
 		rc = rb->notifier.reclaim_fn(rb->notifier.instance,
@@ -615,7 +1111,7 @@ _rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
 void
 qb_rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
 {
-	if (rb == NULL) {
+	if (rb == NULL || (rb->flags & QB_RB_FLAG_READ_ONLY)) {
 		return;
 	}
 	_rb_chunk_reclaim(rb);
@@ -632,6 +1128,7 @@ qb_rb_chunk_peek(struct qb_ringbuffer_s * rb, void **data_out, int32_t timeout)
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+peek_again:
 	if (rb->notifier.timedwait_fn) {
 		res = rb->notifier.timedwait_fn(rb->notifier.instance, timeout);
 	}
@@ -646,6 +1143,14 @@ qb_rb_chunk_peek(struct qb_ringbuffer_s * rb, void **data_out, int32_t timeout)
 	}
 	read_pt = rb->shared_hdr->read_pt;
 	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, read_pt);
+	if (chunk_magic == QB_RB_CHUNK_MAGIC_FORWARD &&
+	    !(rb->flags & QB_RB_FLAG_READ_ONLY)) {
+		res = _rb_forward_follow(rb, read_pt);
+		if (res < 0) {
+			return res;
+		}
+		goto peek_again;
+	}
 	if (chunk_magic != QB_RB_CHUNK_MAGIC) {
 		if (rb->notifier.post_fn) {
 			(void)rb->notifier.post_fn(rb->notifier.instance, res);
@@ -654,6 +1159,8 @@ qb_rb_chunk_peek(struct qb_ringbuffer_s * rb, void **data_out, int32_t timeout)
 	}
 	chunk_size = QB_RB_CHUNK_SIZE_GET(rb, read_pt);
 	*data_out = QB_RB_CHUNK_DATA_GET(rb, read_pt);
+	QB_PROBE3(rb__read, (const char *)rb->shared_hdr->hdr_path,
+		  chunk_size, read_pt);
 	return chunk_size;
 }
 
@@ -669,6 +1176,10 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->flags & QB_RB_FLAG_READ_ONLY) {
+		return -EPERM;
+	}
+read_again:
 	if (rb->notifier.timedwait_fn) {
 		res = rb->notifier.timedwait_fn(rb->notifier.instance, timeout);
 	}
@@ -683,6 +1194,13 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 	read_pt = rb->shared_hdr->read_pt;
 	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, read_pt);
 
+	if (chunk_magic == QB_RB_CHUNK_MAGIC_FORWARD) {
+		res = _rb_forward_follow(rb, read_pt);
+		if (res < 0) {
+			return res;
+		}
+		goto read_again;
+	}
 	if (chunk_magic != QB_RB_CHUNK_MAGIC) {
 		if (rb->notifier.timedwait_fn == NULL) {
 			return -ETIMEDOUT;
@@ -707,15 +1225,92 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 		return -ENOBUFS;
 	}
 
-	memcpy(data_out,
-	       QB_RB_CHUNK_DATA_GET(rb, read_pt),
-	       chunk_size);
+	qb_rb_copy_out(data_out,
+		       QB_RB_CHUNK_DATA_GET(rb, read_pt),
+		       chunk_size);
+	QB_PROBE3(rb__read, (const char *)rb->shared_hdr->hdr_path,
+		  chunk_size, read_pt);
 
 	_rb_chunk_reclaim(rb);
 
 	return chunk_size;
 }
 
+int32_t
+qb_rb_position_get(struct qb_ringbuffer_s * rb, uint32_t *read_pos,
+		   uint32_t *write_pos)
+{
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (read_pos) {
+		*read_pos = qb_atomic_int_get((int32_t *)&rb->shared_hdr->read_pt);
+	}
+	if (write_pos) {
+		*write_pos = qb_atomic_int_get((int32_t *)&rb->shared_hdr->write_pt);
+	}
+	return 0;
+}
+
+ssize_t
+qb_rb_chunk_copy_at(struct qb_ringbuffer_s * rb, uint32_t pos,
+		    void *data_out, size_t len, uint32_t *next_pos)
+{
+	uint32_t word_size;
+	uint32_t chunk_size;
+	uint32_t chunk_magic;
+
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	word_size = rb->shared_hdr->word_size;
+	if (pos >= word_size) {
+		return -EINVAL;
+	}
+	if (pos ==
+	    (uint32_t)qb_atomic_int_get((int32_t *)&rb->shared_hdr->write_pt)) {
+		return -EAGAIN;
+	}
+
+	/*
+	 * Nothing stops the writer reusing this chunk while we look at
+	 * it, so check the header is still the same after the copy.
+	 */
+	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, pos);
+	if (chunk_magic == QB_RB_CHUNK_MAGIC_ALLOC) {
+		/* committed, but the magic isn't set yet */
+		return -EAGAIN;
+	}
+	chunk_size = QB_RB_CHUNK_SIZE_GET(rb, pos);
+	if (chunk_magic != QB_RB_CHUNK_MAGIC ||
+	    chunk_size > word_size * sizeof(uint32_t) - QB_RB_CHUNK_MARGIN) {
+#ifdef EBADMSG
+		return -EBADMSG;
+#else
+		return -EINVAL;
+#endif
+	}
+	if (data_out) {
+		if (len < chunk_size) {
+			return -ENOBUFS;
+		}
+		qb_rb_copy_out(data_out, QB_RB_CHUNK_DATA_GET(rb, pos),
+			       chunk_size);
+	}
+	if (QB_RB_CHUNK_MAGIC_GET(rb, pos) != QB_RB_CHUNK_MAGIC ||
+	    QB_RB_CHUNK_SIZE_GET(rb, pos) != chunk_size) {
+#ifdef EBADMSG
+		return -EBADMSG;
+#else
+		return -EINVAL;
+#endif
+	}
+	if (next_pos) {
+		*next_pos = _rb_chunk_step_size(rb, pos, chunk_size);
+	}
+	return chunk_size;
+}
+
 static void
 print_header(struct qb_ringbuffer_s * rb)
 {
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ringbuffer_int.h"
+#include <qb/qbdefs.h>
+
+#ifdef HAVE_STREAM_COPY
+#include <immintrin.h>
+#endif /* HAVE_STREAM_COPY */
+
+/*
+ * Copying large chunks in and out of the shared mapping.
+ *
+ * A writer never looks at a chunk again once it is written, so big
+ * chunks are written with non-temporal stores that go around the
+ * writer's cache instead of evicting its working set. On the way out
+ * the chunk is prefetched (also non-temporally) a block ahead of the
+ * copy. Smaller chunks, and CPUs without streaming stores, use memcpy().
+ */
+#define RB_COPY_THRESHOLD_DEFAULT	(1024 * 1024)
+#define RB_COPY_BLOCK			4096
+#define RB_COPY_LINE			64
+
+typedef void (*rb_copy_fn)(void *dest, const void *src, size_t len);
+
+static size_t copy_threshold = RB_COPY_THRESHOLD_DEFAULT;
+static rb_copy_fn copy_in_fn = NULL;
+static int32_t copy_resolved = QB_FALSE;
+
+#ifdef HAVE_STREAM_COPY
+__attribute__((target("avx")))
+static void
+copy_in_avx(void *dest, const void *src, size_t len)
+{
+	char *d = (char *)dest;
+	const char *s = (const char *)src;
+	size_t head = QB_MIN((-(uintptr_t)d) & 31, len);
+	__m256i a, b, c, e;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+	for (; len >= 128; len -= 128, d += 128, s += 128) {
+		a = _mm256_loadu_si256((const __m256i *)s);
+		b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	/* the stores must be visible before the chunk is committed */
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+
+__attribute__((target("sse2")))
+static void
+copy_in_sse2(void *dest, const void *src, size_t len)
+{
+	char *d = (char *)dest;
+	const char *s = (const char *)src;
+	size_t head = QB_MIN((-(uintptr_t)d) & 15, len);
+	__m128i a, b, c, e;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		a = _mm_loadu_si128((const __m128i *)s);
+		b = _mm_loadu_si128((const __m128i *)(s + 16));
+		c = _mm_loadu_si128((const __m128i *)(s + 32));
+		e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+#endif /* HAVE_STREAM_COPY */
+
+static void
+copy_resolve(void)
+{
+#ifdef HAVE_STREAM_COPY
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) {
+		copy_in_fn = copy_in_avx;
+	} else if (__builtin_cpu_supports("sse2")) {
+		copy_in_fn = copy_in_sse2;
+	}
+#endif /* HAVE_STREAM_COPY */
+	copy_resolved = QB_TRUE;
+}
+
+void
+qb_rb_copy_in(void *dest, const void *src, size_t len)
+{
+	if (copy_threshold == 0 || len < copy_threshold) {
+		memcpy(dest, src, len);
+		return;
+	}
+	if (!copy_resolved) {
+		copy_resolve();
+	}
+	if (copy_in_fn) {
+		copy_in_fn(dest, src, len);
+	} else {
+		memcpy(dest, src, len);
+	}
+}
+
+void
+qb_rb_copy_out(void *dest, const void *src, size_t len)
+{
+	char *d = (char *)dest;
+	const char *s = (const char *)src;
+	size_t block;
+	size_t i;
+
+	if (copy_threshold == 0 || len < copy_threshold) {
+		memcpy(dest, src, len);
+		return;
+	}
+	for (; len > 0; len -= block, d += block, s += block) {
+		block = QB_MIN(len, RB_COPY_BLOCK);
+		/* the next block, while this one is being copied */
+		for (i = 0; i < RB_COPY_BLOCK && block + i < len;
+		     i += RB_COPY_LINE) {
+			__builtin_prefetch(s + block + i, 0, 0);
+		}
+		memcpy(d, s, block);
+	}
+}
+
+int32_t
+qb_rb_copy_threshold_set(size_t size)
+{
+	if (!copy_resolved) {
+		copy_resolve();
+	}
+	copy_threshold = size;
+	if (copy_in_fn == NULL) {
+		return -ENOTSUP;
+	}
+	return 0;
+}
@@ -75,12 +75,30 @@ struct qb_ringbuffer_s {
 	int32_t sem_id;
 	struct qb_ringbuffer_shared_s *shared_hdr;
 	uint32_t *shared_data;
+	size_t shared_size;
+
+	/* what it was opened as, qb_rb_resize() names its rings after it */
+	char name[NAME_MAX];
+	uint32_t generation;
+	/* older generations the reader may not have removed yet */
+	uint32_t generation_linked;
 
 	struct qb_rb_notifier notifier;
 };
 
 void qb_rb_force_close(qb_ringbuffer_t * rb);
 
+int32_t qb_rb_pages_release(qb_ringbuffer_t * rb);
+ssize_t qb_rb_resident_get(qb_ringbuffer_t * rb);
+size_t qb_rb_shared_user_data_size_get(qb_ringbuffer_t * rb);
+
+/*
+ * memcpy() into and out of the shared mapping, large chunks take a
+ * path that keeps them out of the cache (see ringbuffer_copy.c).
+ */
+void qb_rb_copy_in(void *dest, const void *src, size_t len);
+void qb_rb_copy_out(void *dest, const void *src, size_t len);
+
 qb_ringbuffer_t *qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 			      size_t shared_user_data_size,
 			      struct qb_rb_notifier *notifier);
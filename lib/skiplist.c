@@ -24,6 +24,7 @@
 #include <qb/qbdefs.h>
 #include <qb/qbmap.h>
 #include "map_int.h"
+#include "util_int.h"
 
 #define SKIPLIST_LEVEL_MAX 8
 #define SKIPLIST_LEVEL_MIN 0
@@ -102,7 +103,7 @@ static struct skiplist_node *
 skiplist_node_new(const int8_t level, const char *key, const void *value)
 {
 	struct skiplist_node *new_node = (struct skiplist_node *)
-	    (malloc(sizeof(struct skiplist_node)));
+	    (qb_util_malloc(sizeof(struct skiplist_node)));
 
 	if (!new_node)
 		return NULL;
@@ -115,10 +116,10 @@ skiplist_node_new(const int8_t level, const char *key, const void *value)
 
 	/* A level 0 node still needs to hold 1 forward pointer, etc. */
 	new_node->forward = (struct skiplist_node **)
-	    (calloc(level + 1, sizeof(struct skiplist_node *)));
+	    (qb_util_calloc(level + 1, sizeof(struct skiplist_node *)));
 
 	if (new_node->forward == NULL) {
-		free(new_node);
+		qb_util_free(new_node);
 		return NULL;
 	}
 
@@ -195,8 +196,8 @@ skiplist_notify(struct skiplist *l, struct skiplist_node *n,
 		tn = qb_list_entry(list, struct qb_map_notifier, list);
 
 		if (tn->events & event) {
-			tn->callback(event, key, old_value, value,
-				     tn->user_data);
+			qb_map_notifier_call(&l->map, tn, event, key,
+					     old_value, value);
 		}
 	}
 	/* global callbacks
@@ -205,14 +206,14 @@ skiplist_notify(struct skiplist *l, struct skiplist_node *n,
 		tn = qb_list_entry(list, struct qb_map_notifier, list);
 
 		if (tn->events & event) {
-			tn->callback(event, key, old_value, value,
-				     tn->user_data);
+			qb_map_notifier_call(&l->map, tn, event, key,
+					     old_value, value);
 		}
 		if (((event & QB_MAP_NOTIFY_DELETED) ||
 		     (event & QB_MAP_NOTIFY_REPLACED)) &&
 		    (tn->events & QB_MAP_NOTIFY_FREE)) {
-			tn->callback(QB_MAP_NOTIFY_FREE, (char *)key,
-				     old_value, value, tn->user_data);
+			qb_map_notifier_call(&l->map, tn, QB_MAP_NOTIFY_FREE,
+					     key, old_value, value);
 		}
 	}
 
@@ -232,11 +233,11 @@ skiplist_node_destroy(struct skiplist_node *node, struct skiplist *list)
 	qb_list_for_each_safe(pos, next, &node->notifier_head) {
 		tn = qb_list_entry(pos, struct qb_map_notifier, list);
 		qb_list_del(&tn->list);
-		free(tn);
+		qb_util_free(tn);
 	}
 
-	free(node->forward);
-	free(node);
+	qb_util_free(node->forward);
+	qb_util_free(node);
 }
 
 static void
@@ -282,7 +283,7 @@ skiplist_notify_add(qb_map_t * m, const char *key,
 			}
 		}
 
-		f = malloc(sizeof(struct qb_map_notifier));
+		f = qb_util_malloc(sizeof(struct qb_map_notifier));
 		if (f == NULL) {
 			return -errno;
 		}
@@ -331,11 +332,11 @@ skiplist_notify_del(qb_map_t * m, const char *key,
 			if (cmp_userdata && (f->user_data == user_data)) {
 				found = QB_TRUE;
 				qb_list_del(&f->list);
-				free(f);
+				qb_util_free(f);
 			} else if (!cmp_userdata) {
 				found = QB_TRUE;
 				qb_list_del(&f->list);
-				free(f);
+				qb_util_free(f);
 			}
 		}
 	}
@@ -359,7 +360,7 @@ skiplist_destroy(struct qb_map *map)
 		skiplist_node_destroy(cur_node, list);
 	}
 	skiplist_node_destroy(list->header, list);
-	free(list);
+	qb_util_free(list);
 }
 
 static void
@@ -497,7 +498,7 @@ skiplist_get(struct qb_map *map, const char *key)
 static qb_map_iter_t *
 skiplist_iter_create(struct qb_map *map, const char *prefix)
 {
-	struct skiplist_iter *i = malloc(sizeof(struct skiplist_iter));
+	struct skiplist_iter *i = qb_util_malloc(sizeof(struct skiplist_iter));
 	struct skiplist *list = (struct skiplist *)map;
 	if (i == NULL) {
 		return NULL;
@@ -531,7 +532,7 @@ skiplist_iter_next(qb_map_iter_t * i, void **value)
 static void
 skiplist_iter_free(qb_map_iter_t * i)
 {
-	free(i);
+	qb_util_free(i);
 }
 
 static size_t
@@ -541,10 +542,31 @@ skiplist_count_get(struct qb_map *map)
 	return list->length;
 }
 
+static void
+skiplist_stats_get(struct qb_map *map, struct qb_map_stats *stats)
+{
+	struct skiplist *sl = (struct skiplist *)map;
+	struct skiplist_node *n;
+
+	stats->count = sl->length;
+	stats->slots = sl->level + 1;
+	for (n = sl->header; n; n = n->forward[SKIPLIST_LEVEL_MIN]) {
+		stats->nodes++;
+		stats->notifiers += qb_map_notifiers_count(&n->notifier_head);
+		stats->mem_used += sizeof(struct skiplist_node) +
+			(n->level + 1) * sizeof(struct skiplist_node *);
+		if (n != sl->header && n->refcount > 0) {
+			qb_map_stats_histogram_add(stats, n->level);
+		}
+	}
+	stats->mem_used += sizeof(struct skiplist) +
+		stats->notifiers * sizeof(struct qb_map_notifier);
+}
+
 qb_map_t *
 qb_skiplist_create(void)
 {
-	struct skiplist *sl = malloc(sizeof(struct skiplist));
+	struct skiplist *sl = qb_util_malloc(sizeof(struct skiplist));
 	if (sl == NULL) {
 		return NULL;
 	}
@@ -561,6 +583,8 @@ qb_skiplist_create(void)
 	sl->map.destroy = skiplist_destroy;
 	sl->map.notify_add = skiplist_notify_add;
 	sl->map.notify_del = skiplist_notify_del;
+	sl->map.stats_get = skiplist_stats_get;
+	sl->map.batch = NULL;
 	sl->level = SKIPLIST_LEVEL_MIN;
 	sl->length = 0;
 	sl->header = skiplist_header_node_new();
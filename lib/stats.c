@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <pthread.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <qb/qbdefs.h>
+#include <qb/qblist.h>
+#include <qb/qbutil.h>
+#include "util_int.h"
+
+#define QB_STATS_MAGIC 0x71627374
+#define QB_STATS_VERSION 1
+#define QB_STATS_RECORDS_MAX 256
+#define QB_STATS_READ_TRIES 1000
+
+/*
+ * The region is a header followed by QB_STATS_RECORDS_MAX records.
+ * Each record has a sequence number that is odd while it is being
+ * written, readers copy the record and try again if the number was
+ * odd or changed under them.
+ */
+struct qb_stats_record {
+	uint32_t seq;
+	uint32_t in_use;
+	struct qb_stats_values v;
+};
+
+struct qb_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t records_max;
+	uint32_t record_size;
+	int32_t pid;
+	uint32_t padding;
+	uint64_t refreshed;
+	struct qb_stats_record records[];
+};
+
+struct qb_stats_provider {
+	struct qb_list_head list;
+	char name[QB_STATS_NAME_MAX];
+	const char * const *labels;
+	uint32_t count;
+	qb_stats_fill_fn fill;
+	void *data;
+	struct qb_stats_record *rec;
+};
+
+struct qb_stats_region {
+	struct qb_stats_header *hdr;
+	size_t size;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static QB_LIST_DECLARE(stats_providers);
+static struct qb_stats_header *stats_hdr = NULL;
+static size_t stats_size = 0;
+static char stats_path[PATH_MAX];
+
+static inline void
+_stats_barrier(void)
+{
+#ifdef HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS
+	__sync_synchronize();
+#endif /* HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS */
+}
+
+static void
+_write_begin(struct qb_stats_record *rec)
+{
+	rec->seq++;
+	_stats_barrier();
+}
+
+static void
+_write_end(struct qb_stats_record *rec)
+{
+	_stats_barrier();
+	rec->seq++;
+}
+
+/* stats_lock held */
+static void
+_provider_attach(struct qb_stats_provider *p)
+{
+	struct qb_stats_record *rec = NULL;
+	uint32_t i;
+
+	for (i = 0; i < stats_hdr->records_max; i++) {
+		if (!stats_hdr->records[i].in_use) {
+			rec = &stats_hdr->records[i];
+			break;
+		}
+	}
+	if (rec == NULL) {
+		qb_util_log(LOG_WARNING, "no room to publish %s", p->name);
+		return;
+	}
+
+	_write_begin(rec);
+	rec->in_use = QB_TRUE;
+	memset(&rec->v, 0, sizeof(rec->v));
+	(void)strlcpy(rec->v.name, p->name, QB_STATS_NAME_MAX);
+	rec->v.count = p->count;
+	for (i = 0; i < p->count; i++) {
+		(void)strlcpy(rec->v.labels[i], p->labels[i],
+			      QB_STATS_LABEL_MAX);
+	}
+	_write_end(rec);
+	p->rec = rec;
+}
+
+/* stats_lock held */
+static void
+_provider_detach(struct qb_stats_provider *p)
+{
+	if (p->rec == NULL) {
+		return;
+	}
+	_write_begin(p->rec);
+	p->rec->in_use = QB_FALSE;
+	_write_end(p->rec);
+	p->rec = NULL;
+}
+
+struct qb_stats_provider *
+qb_stats_provider_add(const char *name, const char * const *labels,
+		      uint32_t count, qb_stats_fill_fn fill, void *data)
+{
+	struct qb_stats_provider *p;
+
+	p = calloc(1, sizeof(struct qb_stats_provider));
+	if (p == NULL) {
+		return NULL;
+	}
+	(void)strlcpy(p->name, name, QB_STATS_NAME_MAX);
+	p->labels = labels;
+	p->count = QB_MIN(count, QB_STATS_VALUES_MAX);
+	p->fill = fill;
+	p->data = data;
+	qb_list_init(&p->list);
+
+	(void)pthread_mutex_lock(&stats_lock);
+	qb_list_add_tail(&p->list, &stats_providers);
+	if (stats_hdr) {
+		_provider_attach(p);
+	}
+	(void)pthread_mutex_unlock(&stats_lock);
+	return p;
+}
+
+void
+qb_stats_provider_del(struct qb_stats_provider *p)
+{
+	if (p == NULL) {
+		return;
+	}
+	(void)pthread_mutex_lock(&stats_lock);
+	qb_list_del(&p->list);
+	if (stats_hdr) {
+		_provider_detach(p);
+	}
+	(void)pthread_mutex_unlock(&stats_lock);
+	free(p);
+}
+
+int32_t
+qb_stats_publish(const char *name)
+{
+	struct qb_stats_provider *p;
+	struct qb_stats_header *hdr;
+	char filename[PATH_MAX];
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size;
+	int32_t fd;
+	int32_t res = 0;
+
+	if (name == NULL || page_size <= 0) {
+		return -EINVAL;
+	}
+	size = sizeof(struct qb_stats_header) +
+	       QB_STATS_RECORDS_MAX * sizeof(struct qb_stats_record);
+	size = ((size + page_size - 1) / page_size) * page_size;
+
+	(void)pthread_mutex_lock(&stats_lock);
+	if (stats_hdr) {
+		res = -EEXIST;
+		goto unlock;
+	}
+
+	if (strchr(name, '/')) {
+		(void)strlcpy(filename, name, PATH_MAX);
+	} else {
+		snprintf(filename, PATH_MAX, "qb-stats-%s", name);
+	}
+	fd = qb_sys_mmap_file_open(stats_path, filename, size,
+				   O_CREAT | O_TRUNC | O_RDWR);
+	if (fd < 0) {
+		res = fd;
+		goto unlock;
+	}
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't mmap %s", stats_path);
+		unlink(stats_path);
+		goto unlock;
+	}
+
+	hdr->version = QB_STATS_VERSION;
+	hdr->records_max = QB_STATS_RECORDS_MAX;
+	hdr->record_size = sizeof(struct qb_stats_record);
+	hdr->pid = getpid();
+	_stats_barrier();
+	/* readers check this last */
+	hdr->magic = QB_STATS_MAGIC;
+
+	stats_hdr = hdr;
+	stats_size = size;
+	qb_list_for_each_entry(p, &stats_providers, list) {
+		_provider_attach(p);
+	}
+	qb_util_log(LOG_DEBUG, "publishing statistics in %s", stats_path);
+
+unlock:
+	(void)pthread_mutex_unlock(&stats_lock);
+	return res;
+}
+
+void
+qb_stats_withdraw(void)
+{
+	struct qb_stats_provider *p;
+
+	(void)pthread_mutex_lock(&stats_lock);
+	if (stats_hdr == NULL) {
+		(void)pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+	qb_list_for_each_entry(p, &stats_providers, list) {
+		p->rec = NULL;
+	}
+	unlink(stats_path);
+	munmap(stats_hdr, stats_size);
+	stats_hdr = NULL;
+	stats_size = 0;
+	(void)pthread_mutex_unlock(&stats_lock);
+}
+
+void
+qb_stats_refresh(void)
+{
+	struct qb_stats_provider *p;
+	uint64_t values[QB_STATS_VALUES_MAX];
+
+	(void)pthread_mutex_lock(&stats_lock);
+	if (stats_hdr == NULL) {
+		(void)pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+	qb_list_for_each_entry(p, &stats_providers, list) {
+		if (p->rec == NULL) {
+			continue;
+		}
+		memset(values, 0, sizeof(values));
+		p->fill(p->data, values);
+
+		_write_begin(p->rec);
+		memcpy(p->rec->v.values, values, p->count * sizeof(uint64_t));
+		_write_end(p->rec);
+	}
+	stats_hdr->refreshed = qb_util_nano_from_epoch_get();
+	(void)pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * reading
+ */
+static int32_t
+_stats_file_open(const char *name)
+{
+	char path[PATH_MAX];
+	int32_t fd;
+
+	if (strchr(name, '/')) {
+		return open(name, O_RDONLY);
+	}
+#if defined(QB_LINUX) || defined(QB_CYGWIN)
+	snprintf(path, PATH_MAX, "/dev/shm/qb-stats-%s", name);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		return fd;
+	}
+#endif
+	snprintf(path, PATH_MAX, LOCALSTATEDIR "/run/qb-stats-%s", name);
+	fd = open(path, O_RDONLY);
+	return fd;
+}
+
+qb_stats_region_t *
+qb_stats_open(const char *name)
+{
+	struct qb_stats_region *r;
+	struct stat st;
+	int32_t fd;
+	int32_t res;
+
+	if (name == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	fd = _stats_file_open(name);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		goto close_fd;
+	}
+	if (st.st_size < sizeof(struct qb_stats_header)) {
+		errno = EINVAL;
+		goto close_fd;
+	}
+
+	r = calloc(1, sizeof(struct qb_stats_region));
+	if (r == NULL) {
+		goto close_fd;
+	}
+	r->size = st.st_size;
+	r->hdr = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (r->hdr == MAP_FAILED) {
+		res = errno;
+		free(r);
+		errno = res;
+		goto close_fd;
+	}
+	close(fd);
+
+	if (r->hdr->magic != QB_STATS_MAGIC ||
+	    r->hdr->version != QB_STATS_VERSION ||
+	    r->hdr->record_size != sizeof(struct qb_stats_record) ||
+	    sizeof(struct qb_stats_header) +
+	    (size_t)r->hdr->records_max * r->hdr->record_size > r->size) {
+		qb_stats_close(r);
+		errno = EPROTO;
+		return NULL;
+	}
+	return r;
+
+close_fd:
+	res = errno;
+	close(fd);
+	errno = res;
+	return NULL;
+}
+
+int32_t
+qb_stats_read(qb_stats_region_t *r, uint32_t index,
+	      struct qb_stats_values *v)
+{
+	volatile struct qb_stats_record *rec;
+	uint32_t seq;
+	uint32_t in_use;
+	int32_t i;
+
+	if (r == NULL || v == NULL) {
+		return -EINVAL;
+	}
+	if (index >= r->hdr->records_max) {
+		return -ERANGE;
+	}
+	rec = &r->hdr->records[index];
+
+	for (i = 0; i < QB_STATS_READ_TRIES; i++) {
+		seq = rec->seq;
+		if (seq & 1) {
+			continue;
+		}
+		_stats_barrier();
+		in_use = rec->in_use;
+		memcpy(v, (void *)&rec->v, sizeof(struct qb_stats_values));
+		_stats_barrier();
+		if (rec->seq != seq) {
+			continue;
+		}
+		if (!in_use) {
+			return -ENOENT;
+		}
+		v->count = QB_MIN(v->count, QB_STATS_VALUES_MAX);
+		v->name[QB_STATS_NAME_MAX - 1] = '\0';
+		for (i = 0; i < v->count; i++) {
+			v->labels[i][QB_STATS_LABEL_MAX - 1] = '\0';
+		}
+		return 0;
+	}
+	return -EAGAIN;
+}
+
+pid_t
+qb_stats_pid_get(qb_stats_region_t *r)
+{
+	if (r == NULL) {
+		return -EINVAL;
+	}
+	return r->hdr->pid;
+}
+
+uint64_t
+qb_stats_refreshed_get(qb_stats_region_t *r)
+{
+	if (r == NULL) {
+		return 0;
+	}
+	return r->hdr->refreshed;
+}
+
+void
+qb_stats_close(qb_stats_region_t *r)
+{
+	if (r == NULL) {
+		return;
+	}
+	munmap(r->hdr, r->size);
+	free(r);
+}
@@ -25,6 +25,7 @@
 #include <qb/qblist.h>
 #include <qb/qbmap.h>
 #include "map_int.h"
+#include "util_int.h"
 
 struct trie_iter {
 	struct qb_map_iter i;
@@ -33,17 +34,52 @@ struct trie_iter {
 	struct trie_node *root;
 };
 
+/*
+ * Each node is one block from the trie's arena, the notifier list head
+ * and short segments are kept in the node itself. The children are in
+ * a second block whose size depends on the node's class: the small
+ * classes keep a sorted array of (index, child) pairs, the largest one
+ * is indexed directly by the character.
+ */
+#define TRIE_SEGMENT_INLINE	16
+
+#define TRIE_CLASS_NONE		0
+#define TRIE_CLASS_DENSE	3
+#define TRIE_CHILDREN_DENSE	256
+
+static const uint16_t trie_class_size[] = { 0, 4, 16, TRIE_CHILDREN_DENSE };
+
 struct trie_node {
-	uint32_t idx;
-	char *segment;
-	uint32_t num_segments;
+	struct trie_node *parent;
+	struct trie_node **children;
 	char *key;
 	void *value;
-	struct trie_node **children;
-	uint32_t num_children;
+	struct qb_list_head notifier_head;
+	uint32_t num_segments;
+	uint32_t segment_size;
 	uint32_t refcount;
-	struct trie_node *parent;
-	struct qb_list_head *notifier_head;
+	uint16_t num_children;
+	uint8_t children_class;
+	uint8_t idx;
+	union {
+		char chars[TRIE_SEGMENT_INLINE];
+		char *ptr;
+	} segment;
+};
+
+/*
+ * The arena hands out blocks in multiples of TRIE_ARENA_ALIGN from
+ * chunks that double in size as the trie grows; freed blocks go on a
+ * free list per size and everything is released with the trie.
+ */
+#define TRIE_ARENA_ALIGN	16
+#define TRIE_ARENA_MAX		2048
+#define TRIE_ARENA_CLASSES	(TRIE_ARENA_MAX / TRIE_ARENA_ALIGN)
+#define TRIE_CHUNK_MIN		4096
+#define TRIE_CHUNK_MAX		(256 * 1024)
+
+struct trie_chunk {
+	struct trie_chunk *next;
 };
 
 struct trie {
@@ -51,22 +87,334 @@ struct trie {
 
 	size_t length;
 	uint32_t num_nodes;
-	uint32_t mem_used;
+	size_t mem_used;
 	struct trie_node *header;
+
+	struct trie_chunk *chunks;
+	char *chunk_pos;
+	size_t chunk_left;
+	size_t chunk_size;
+	void *free_blocks[TRIE_ARENA_CLASSES];
 };
 
-static void trie_notify(struct trie_node *n, uint32_t event, const char *key,
-			void *old_value, void *value);
+static void trie_notify(struct trie *t, struct trie_node *n, uint32_t event,
+			const char *key, void *old_value, void *value);
 static struct trie_node *trie_new_node(struct trie *t, struct trie_node *parent);
-static void trie_destroy_node(struct trie_node *node);
+static void trie_destroy_node(struct trie *t, struct trie_node *node);
 
 /*
  * characters are stored in reverse to make accessing the
  * more common case (non-control chars) more space efficient.
  */
-#define TRIE_CHAR2INDEX(ch) (126 - ch)
+#define TRIE_CHAR2INDEX(ch) ((uint8_t)(126 - (ch)))
 #define TRIE_INDEX2CHAR(idx) (126 - idx)
 
+static void *
+trie_alloc(struct trie *t, size_t size)
+{
+	struct trie_chunk *c;
+	size_t left;
+	void *p;
+
+	if (size > TRIE_ARENA_MAX) {
+		p = qb_util_malloc(size);
+		if (p) {
+			t->mem_used += size;
+		}
+		return p;
+	}
+	size = (size + TRIE_ARENA_ALIGN - 1) & ~(size_t)(TRIE_ARENA_ALIGN - 1);
+	p = t->free_blocks[size / TRIE_ARENA_ALIGN - 1];
+	if (p) {
+		t->free_blocks[size / TRIE_ARENA_ALIGN - 1] = *(void **)p;
+		return p;
+	}
+
+	if (size > t->chunk_left) {
+		c = qb_util_malloc(t->chunk_size);
+		if (c == NULL) {
+			return NULL;
+		}
+		/* keep what is left of the old chunk for smaller blocks */
+		left = t->chunk_left;
+		if (left >= TRIE_ARENA_ALIGN) {
+			*(void **)t->chunk_pos =
+				t->free_blocks[left / TRIE_ARENA_ALIGN - 1];
+			t->free_blocks[left / TRIE_ARENA_ALIGN - 1] =
+				t->chunk_pos;
+		}
+		c->next = t->chunks;
+		t->chunks = c;
+		t->chunk_pos = (char *)c + TRIE_ARENA_ALIGN;
+		t->chunk_left = t->chunk_size - TRIE_ARENA_ALIGN;
+		t->mem_used += t->chunk_size;
+		if (t->chunk_size < TRIE_CHUNK_MAX) {
+			t->chunk_size *= 2;
+		}
+	}
+	p = t->chunk_pos;
+	t->chunk_pos += size;
+	t->chunk_left -= size;
+	return p;
+}
+
+static void
+trie_free(struct trie *t, void *p, size_t size)
+{
+	if (p == NULL) {
+		return;
+	}
+	if (size > TRIE_ARENA_MAX) {
+		qb_util_free(p);
+		t->mem_used -= size;
+		return;
+	}
+	size = (size + TRIE_ARENA_ALIGN - 1) & ~(size_t)(TRIE_ARENA_ALIGN - 1);
+	*(void **)p = t->free_blocks[size / TRIE_ARENA_ALIGN - 1];
+	t->free_blocks[size / TRIE_ARENA_ALIGN - 1] = p;
+}
+
+static char *
+trie_segment(struct trie_node *n)
+{
+	if (n->segment_size > TRIE_SEGMENT_INLINE) {
+		return n->segment.ptr;
+	}
+	return n->segment.chars;
+}
+
+static int32_t
+trie_segment_reserve(struct trie *t, struct trie_node *n, uint32_t size)
+{
+	uint32_t new_size;
+	char *seg;
+
+	if (size <= n->segment_size) {
+		return 0;
+	}
+	new_size = QB_MAX(size, n->segment_size * 2);
+	seg = trie_alloc(t, new_size);
+	if (seg == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(seg, trie_segment(n), n->num_segments);
+	if (n->segment_size > TRIE_SEGMENT_INLINE) {
+		trie_free(t, n->segment.ptr, n->segment_size);
+	}
+	n->segment.ptr = seg;
+	n->segment_size = new_size;
+	return 0;
+}
+
+/*
+ * Drop the first count chars of the segment.
+ */
+static void
+trie_segment_consume(struct trie *t, struct trie_node *n, uint32_t count)
+{
+	char *seg = trie_segment(n);
+
+	n->num_segments -= count;
+	if (n->segment_size > TRIE_SEGMENT_INLINE &&
+	    n->num_segments <= TRIE_SEGMENT_INLINE) {
+		/* short enough to go back into the node */
+		memcpy(n->segment.chars, seg + count, n->num_segments);
+		trie_free(t, seg, n->segment_size);
+		n->segment_size = TRIE_SEGMENT_INLINE;
+	} else {
+		memmove(seg, seg + count, n->num_segments);
+	}
+}
+
+static size_t
+trie_children_block_size(uint8_t children_class)
+{
+	size_t size = trie_class_size[children_class];
+
+	if (children_class == TRIE_CLASS_DENSE) {
+		return size * sizeof(struct trie_node *);
+	}
+	/* the child pointers followed by their indexes */
+	return size * (sizeof(struct trie_node *) + sizeof(uint8_t));
+}
+
+static uint8_t *
+trie_children_idx(struct trie_node *n)
+{
+	return (uint8_t *)&n->children[trie_class_size[n->children_class]];
+}
+
+static struct trie_node *
+trie_child_get(struct trie_node *n, uint8_t idx)
+{
+	uint8_t *keys;
+	int i;
+
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		return n->children[idx];
+	}
+	keys = trie_children_idx(n);
+	for (i = 0; i < n->num_children; i++) {
+		if (keys[i] >= idx) {
+			return keys[i] == idx ? n->children[i] : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The child with the largest index (the first in key order).
+ */
+static struct trie_node *
+trie_child_last(struct trie_node *n)
+{
+	int i;
+
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		for (i = TRIE_CHILDREN_DENSE - 1; i >= 0; i--) {
+			if (n->children[i]) {
+				return n->children[i];
+			}
+		}
+		return NULL;
+	}
+	if (n->num_children == 0) {
+		return NULL;
+	}
+	return n->children[n->num_children - 1];
+}
+
+/*
+ * The child with the largest index below idx (the next in key order).
+ */
+static struct trie_node *
+trie_child_before(struct trie_node *n, uint8_t idx)
+{
+	uint8_t *keys;
+	int i;
+
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		for (i = idx - 1; i >= 0; i--) {
+			if (n->children[i]) {
+				return n->children[i];
+			}
+		}
+		return NULL;
+	}
+	keys = trie_children_idx(n);
+	for (i = n->num_children - 1; i >= 0; i--) {
+		if (keys[i] < idx) {
+			return n->children[i];
+		}
+	}
+	return NULL;
+}
+
+static int32_t
+trie_children_grow(struct trie *t, struct trie_node *n)
+{
+	uint8_t new_class = n->children_class + 1;
+	struct trie_node **children;
+	uint8_t *keys;
+	uint8_t *new_keys;
+	int i;
+
+	children = trie_alloc(t, trie_children_block_size(new_class));
+	if (children == NULL) {
+		return -ENOMEM;
+	}
+	keys = trie_children_idx(n);
+	if (new_class == TRIE_CLASS_DENSE) {
+		memset(children, 0, trie_children_block_size(new_class));
+		for (i = 0; i < n->num_children; i++) {
+			children[keys[i]] = n->children[i];
+		}
+	} else {
+		new_keys = (uint8_t *)&children[trie_class_size[new_class]];
+		for (i = 0; i < n->num_children; i++) {
+			children[i] = n->children[i];
+			new_keys[i] = keys[i];
+		}
+	}
+	trie_free(t, n->children, trie_children_block_size(n->children_class));
+	n->children = children;
+	n->children_class = new_class;
+	return 0;
+}
+
+static int32_t
+trie_child_add(struct trie *t, struct trie_node *n, uint8_t idx,
+	       struct trie_node *child)
+{
+	uint8_t *keys;
+	int i;
+
+	if (n->children_class != TRIE_CLASS_DENSE &&
+	    n->num_children == trie_class_size[n->children_class]) {
+		if (trie_children_grow(t, n) != 0) {
+			return -ENOMEM;
+		}
+	}
+	n->num_children++;
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		n->children[idx] = child;
+		return 0;
+	}
+	keys = trie_children_idx(n);
+	for (i = n->num_children - 1; i > 0 && keys[i - 1] > idx; i--) {
+		n->children[i] = n->children[i - 1];
+		keys[i] = keys[i - 1];
+	}
+	n->children[i] = child;
+	keys[i] = idx;
+	return 0;
+}
+
+static void
+trie_child_replace(struct trie_node *n, uint8_t idx, struct trie_node *child)
+{
+	uint8_t *keys;
+	int i;
+
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		n->children[idx] = child;
+		return;
+	}
+	keys = trie_children_idx(n);
+	for (i = 0; i < n->num_children; i++) {
+		if (keys[i] == idx) {
+			n->children[i] = child;
+			return;
+		}
+	}
+}
+
+static void
+trie_child_del(struct trie *t, struct trie_node *n, uint8_t idx)
+{
+	uint8_t *keys;
+	int i;
+
+	if (n->children_class == TRIE_CLASS_DENSE) {
+		n->children[idx] = NULL;
+	} else {
+		keys = trie_children_idx(n);
+		for (i = 0; i < n->num_children && keys[i] != idx; i++) {
+			/* find it */
+		}
+		for (; i < n->num_children - 1; i++) {
+			n->children[i] = n->children[i + 1];
+			keys[i] = keys[i + 1];
+		}
+	}
+	n->num_children--;
+	if (n->num_children == 0) {
+		trie_free(t, n->children,
+			  trie_children_block_size(n->children_class));
+		n->children = NULL;
+		n->children_class = TRIE_CLASS_NONE;
+	}
+}
 
 static int32_t
 trie_node_alive(struct trie_node *node)
@@ -84,19 +432,11 @@ trie_node_next(struct trie_node *node, struct trie_node *root, int all)
 	struct trie_node *c = node;
 	struct trie_node *n;
 	struct trie_node *p;
-	int i;
 
 keep_going:
-	n = NULL;
-
 	/* child/outward
 	 */
-	for (i = c->num_children - 1; i >= 0; i--) {
-		if (c->children[i]) {
-			n = c->children[i];
-			break;
-		}
-	}
+	n = trie_child_last(c);
 	if (n) {
 		if (all || trie_node_alive(n)) {
 			return n;
@@ -112,12 +452,7 @@ keep_going:
 	}
 	p = c;
 	do {
-		for (i = p->idx - 1; i >= 0; i--) {
-			if (p->parent->children[i]) {
-				n = p->parent->children[i];
-				break;
-			}
-		}
+		n = trie_child_before(p->parent, p->idx);
 		if (n == NULL) {
 			p = p->parent;
 		}
@@ -141,83 +476,54 @@ static struct trie_node *
 new_child_node(struct trie *t, struct trie_node * parent, char ch)
 {
 	struct trie_node *new_node;
-	int old_max_idx;
-	int i;
-	int idx = TRIE_CHAR2INDEX(ch);
-
-	if (idx >= parent->num_children) {
-		old_max_idx = parent->num_children;
-		parent->num_children = QB_MAX(idx + 1, 30);
-		t->mem_used += (sizeof(struct trie_node*) * (parent->num_children - old_max_idx));
-		parent->children = realloc(parent->children,
-				(parent->num_children * sizeof(struct trie_node*)));
-		if (parent->children == NULL) {
-			return NULL;
-		}
-		for (i = old_max_idx; i < parent->num_children; i++) {
-			parent->children[i] = NULL;
-		}
-	}
+	uint8_t idx = TRIE_CHAR2INDEX(ch);
+
 	new_node = trie_new_node(t, parent);
 	if (new_node == NULL) {
 		return NULL;
 	}
 	new_node->idx = idx;
-	parent->children[idx] = new_node;
+	if (trie_child_add(t, parent, idx, new_node) != 0) {
+		trie_destroy_node(t, new_node);
+		return NULL;
+	}
 	return new_node;
 }
 
-
+/*
+ * Split cur_node's segment before seg_cnt, returning the node for the
+ * first part.
+ *
+ * A new node takes cur_node's place under the parent with the first
+ * seg_cnt chars, and cur_node moves below it. That way the value,
+ * notifiers and children stay where they are and a node never moves
+ * under a notifier or an iterator.
+ */
 static struct trie_node *
 trie_node_split(struct trie *t, struct trie_node *cur_node, int seg_cnt)
 {
 	struct trie_node *split_node;
-	struct trie_node ** children = cur_node->children;
-	uint32_t num_children = cur_node->num_children;
-	struct qb_list_head *tmp;
-	int i;
-	int s;
+	char *seg = trie_segment(cur_node);
+	uint8_t idx = TRIE_CHAR2INDEX(seg[seg_cnt]);
 
-	cur_node->children = NULL;
-	cur_node->num_children = 0;
-	split_node = new_child_node(t, cur_node, cur_node->segment[seg_cnt]);
+	split_node = trie_new_node(t, cur_node->parent);
 	if (split_node == NULL) {
 		return NULL;
 	}
-	split_node->children = children;
-	split_node->num_children = num_children;
-	for (i = 0; i < split_node->num_children; i++) {
-		if (split_node->children[i]) {
-			split_node->children[i]->parent = split_node;
-		}
-	}
-	split_node->value = cur_node->value;
-	split_node->key = cur_node->key;
-	split_node->refcount = cur_node->refcount;
-	cur_node->value = NULL;
-	cur_node->key = NULL;
-	cur_node->refcount = 0;
-	/* move notifier list to split */
-	tmp = split_node->notifier_head;
-	split_node->notifier_head = cur_node->notifier_head;
-	cur_node->notifier_head = tmp;
-	qb_list_init(cur_node->notifier_head);
-
-	if (seg_cnt < cur_node->num_segments) {
-		split_node->num_segments = cur_node->num_segments - seg_cnt - 1;
-		split_node->segment = malloc(split_node->num_segments * sizeof(char));
-		if (split_node->segment == NULL) {
-			trie_destroy_node(split_node);
-			return NULL;
-		}
-		for (i = (seg_cnt + 1); i < cur_node->num_segments; i++) {
-			s = i - seg_cnt - 1;
-			split_node->segment[s] = cur_node->segment[i];
-			cur_node->segment[i] = '\0';
-		}
-		cur_node->num_segments = seg_cnt;
+	if (trie_segment_reserve(t, split_node, seg_cnt) != 0 ||
+	    trie_child_add(t, split_node, idx, cur_node) != 0) {
+		trie_destroy_node(t, split_node);
+		return NULL;
 	}
-	return cur_node;
+	memcpy(trie_segment(split_node), seg, seg_cnt);
+	split_node->num_segments = seg_cnt;
+	split_node->idx = cur_node->idx;
+	trie_child_replace(cur_node->parent, cur_node->idx, split_node);
+
+	cur_node->parent = split_node;
+	cur_node->idx = idx;
+	trie_segment_consume(t, cur_node, seg_cnt + 1);
+	return split_node;
 }
 
 static struct trie_node *
@@ -225,15 +531,16 @@ trie_insert(struct trie *t, const char *key)
 {
 	struct trie_node *cur_node = t->header;
 	struct trie_node *new_node;
+	struct trie_node *child;
 	char *cur = (char *)key;
-	int idx = TRIE_CHAR2INDEX(key[0]);
+	uint8_t idx = TRIE_CHAR2INDEX(key[0]);
 	int seg_cnt = 0;
 
 	do {
 		new_node = NULL;
 		if (cur_node->num_segments > 0 &&
 		    seg_cnt < cur_node->num_segments) {
-			if (cur_node->segment[seg_cnt] == *cur) {
+			if (trie_segment(cur_node)[seg_cnt] == *cur) {
 				/* we found the char in the segment */
 				seg_cnt++;
 			} else {
@@ -246,10 +553,9 @@ trie_insert(struct trie *t, const char *key)
 					return NULL;
 				}
 			}
-		} else if (idx < cur_node->num_children &&
-		    cur_node->children[idx]) {
+		} else if ((child = trie_child_get(cur_node, idx))) {
 			/* the char can be found on the next node */
-			new_node = cur_node->children[idx];
+			new_node = child;
 		} else if (cur_node == t->header) {
 			/* the root node is empty so make it on the next node */
 			new_node = new_child_node(t, cur_node, *cur);
@@ -257,13 +563,15 @@ trie_insert(struct trie *t, const char *key)
 				return NULL;
 			}
 		} else if (cur_node->value == NULL &&
-			   qb_list_empty(cur_node->notifier_head) &&
+			   qb_list_empty(&cur_node->notifier_head) &&
 			   cur_node->num_children == 0 &&
 			   seg_cnt == cur_node->num_segments) {
 			/* we are on a leaf (with no value) so just add it as a segment */
-			cur_node->segment = realloc(cur_node->segment, cur_node->num_segments + 1);
-			cur_node->segment[cur_node->num_segments] = *cur;
-			t->mem_used += sizeof(char);
+			if (trie_segment_reserve(t, cur_node,
+						 cur_node->num_segments + 1) != 0) {
+				return NULL;
+			}
+			trie_segment(cur_node)[cur_node->num_segments] = *cur;
 			cur_node->num_segments++;
 			seg_cnt++;
 		} else if (seg_cnt == cur_node->num_segments) {
@@ -292,15 +600,8 @@ trie_insert(struct trie *t, const char *key)
 
 	if (cur_node->num_segments > 0 &&
 	    seg_cnt < cur_node->num_segments) {
-		/* we need to split */
+		/* the key ends inside the segment */
 		cur_node = trie_node_split(t, cur_node, seg_cnt);
-		if (cur_node == NULL) {
-			return NULL;
-		}
-		new_node = new_child_node(t, cur_node, *cur);
-		if (new_node == NULL) {
-			return NULL;
-		}
 	}
 
 	return cur_node;
@@ -310,23 +611,23 @@ static struct trie_node *
 trie_lookup(struct trie *t, const char *key, int exact_match)
 {
 	struct trie_node *cur_node = t->header;
+	struct trie_node *child;
 	char *cur = (char *)key;
-	int idx = TRIE_CHAR2INDEX(key[0]);
+	uint8_t idx = TRIE_CHAR2INDEX(key[0]);
 	int seg_cnt = 0;
 
 	do {
 		if (cur_node->num_segments > 0 &&
 		    seg_cnt < cur_node->num_segments) {
-			if (cur_node->segment[seg_cnt] == *cur) {
+			if (trie_segment(cur_node)[seg_cnt] == *cur) {
 				/* we found the char in the segment */
 				seg_cnt++;
 			} else {
 				return NULL;
 			}
-		} else if (idx < cur_node->num_children &&
-		    cur_node->children[idx]) {
+		} else if ((child = trie_child_get(cur_node, idx))) {
 			/* the char can be found on the next node */
-			cur_node = cur_node->children[idx];
+			cur_node = child;
 			seg_cnt = 0;
 		} else {
 			return NULL;
@@ -347,36 +648,20 @@ trie_lookup(struct trie *t, const char *key, int exact_match)
 static void
 trie_node_release(struct trie *t, struct trie_node *node)
 {
-	int i;
-	int empty = QB_FALSE;
-
 	if (node->key == NULL &&
 	    node->parent != NULL &&
-	    qb_list_empty(node->notifier_head)) {
+	    qb_list_empty(&node->notifier_head)) {
 		struct trie_node *p = node->parent;
 
-		if (node->num_children == 0) {
-			empty = QB_TRUE;
-		} else {
-			empty = QB_TRUE;
-			for (i = node->num_children - 1; i >= 0; i--) {
-				if (node->children[i]) {
-					empty = QB_FALSE;
-					break;
-				}
-			}
-		}
-		if (!empty) {
+		if (node->num_children > 0) {
 			return;
 		}
 
 		/*
 		 * unlink the node from the parent
 		 */
-		p->children[node->idx] = NULL;
-		trie_destroy_node(node);
-		t->num_nodes--;
-		t->mem_used -= sizeof(struct trie_node);
+		trie_child_del(t, p, node->idx);
+		trie_destroy_node(t, node);
 
 		trie_node_release(t, p);
 	}
@@ -388,7 +673,7 @@ trie_node_destroy(struct trie *t, struct trie_node *n)
 	if (n->value == NULL) {
 		return;
 	}
-	trie_notify(n, QB_MAP_NOTIFY_DELETED, n->key, n->value, NULL);
+	trie_notify(t, n, QB_MAP_NOTIFY_DELETED, n->key, n->value, NULL);
 
 	n->key = NULL;
 	n->value = NULL;
@@ -399,6 +684,7 @@ trie_node_destroy(struct trie *t, struct trie_node *n)
 static void
 trie_print_node(struct trie_node *n, struct trie_node *r, const char *suffix)
 {
+	char *seg = trie_segment(n);
 	int i;
 
 	if (n->parent) {
@@ -410,7 +696,7 @@ trie_print_node(struct trie_node *n, struct trie_node *r, const char *suffix)
 
 	printf("[%c", TRIE_INDEX2CHAR(n->idx));
 	for (i = 0; i < n->num_segments; i++) {
-		printf("%c", n->segment[i]);
+		printf("%c", seg[i]);
 	}
 	if (n == r) {
 		printf("] (%d) %s\n", n->refcount, suffix);
@@ -448,47 +734,53 @@ trie_destroy(struct qb_map *map)
 
 	struct trie_node *cur_node = t->header;
 	struct trie_node *fwd_node;
+	struct trie_chunk *c;
 
 	do {
 		fwd_node = trie_node_next(cur_node, t->header, QB_FALSE);
 		trie_node_destroy(t, cur_node);
 	} while ((cur_node = fwd_node));
 
-	free(t);
+	/* only the very long segments live outside the arena */
+	for (cur_node = t->header; cur_node;
+	     cur_node = trie_node_next(cur_node, t->header, QB_TRUE)) {
+		if (cur_node->segment_size > TRIE_ARENA_MAX) {
+			qb_util_free(cur_node->segment.ptr);
+		}
+	}
+	while ((c = t->chunks)) {
+		t->chunks = c->next;
+		qb_util_free(c);
+	}
+	qb_util_free(t);
 }
 
 static void
-trie_destroy_node(struct trie_node *node)
+trie_destroy_node(struct trie *t, struct trie_node *node)
 {
-	free(node->segment);
-	free(node->children);
-	free(node->notifier_head);
-	free(node);
+	trie_free(t, node->children,
+		  trie_children_block_size(node->children_class));
+	if (node->segment_size > TRIE_SEGMENT_INLINE) {
+		trie_free(t, node->segment.ptr, node->segment_size);
+	}
+	trie_free(t, node, sizeof(struct trie_node));
+	t->num_nodes--;
 }
 
 static struct trie_node *
 trie_new_node(struct trie *t, struct trie_node *parent)
 {
-	struct trie_node *new_node = calloc(1, sizeof(struct trie_node));
+	struct trie_node *new_node = trie_alloc(t, sizeof(struct trie_node));
 
 	if (new_node == NULL) {
 		return NULL;
 	}
-
-	new_node->notifier_head = calloc(1, sizeof(struct qb_list_head));
-	if (new_node->notifier_head == NULL) {
-		free(new_node);
-		return NULL;
-	}
+	memset(new_node, 0, sizeof(struct trie_node));
 
 	new_node->parent = parent;
-	new_node->num_children = 0;
-	new_node->children = NULL;
-	new_node->num_segments = 0;
-	new_node->segment = NULL;
+	new_node->segment_size = TRIE_SEGMENT_INLINE;
 	t->num_nodes++;
-	t->mem_used += sizeof(struct trie_node);
-	qb_list_init(new_node->notifier_head);
+	qb_list_init(&new_node->notifier_head);
 	return new_node;
 }
 
@@ -502,7 +794,7 @@ qb_trie_dump(qb_map_t* m)
 		return;
 	}
 
-	printf("nodes: %d, bytes: %d\n", t->num_nodes, t->mem_used);
+	printf("nodes: %d, bytes: %zu\n", t->num_nodes, t->mem_used);
 
 	n = t->header;
 	do {
@@ -528,10 +820,10 @@ trie_put(struct qb_map *map, const char *key, const void *value)
 		if (old_value == NULL) {
 			trie_node_ref(t, n);
 			t->length++;
-			trie_notify(n, QB_MAP_NOTIFY_INSERTED,
+			trie_notify(t, n, QB_MAP_NOTIFY_INSERTED,
 				    n->key, NULL, n->value);
 		} else {
-			trie_notify(n, QB_MAP_NOTIFY_REPLACED,
+			trie_notify(t, n, QB_MAP_NOTIFY_REPLACED,
 				    (char *)old_key, (void *)old_value,
 				    (void *)value);
 		}
@@ -570,7 +862,7 @@ trie_notify_deref(struct qb_map_notifier *f)
 	f->refcount--;
 	if (f->refcount == 0) {
 		qb_list_del(&f->list);
-		free(f);
+		qb_util_free(f);
 	}
 }
 
@@ -581,7 +873,7 @@ trie_notify_ref(struct qb_map_notifier *f)
 }
 
 static void
-trie_notify(struct trie_node *n,
+trie_notify(struct trie *t, struct trie_node *n,
 	    uint32_t event, const char *key, void *old_value, void *value)
 {
 	struct trie_node *c = n;
@@ -591,7 +883,7 @@ trie_notify(struct trie_node *n,
 	struct qb_map_notifier *tn;
 
 	do {
-		head = c->notifier_head;
+		head = &c->notifier_head;
 		qb_list_for_each_safe(list, next, head) {
 			tn = qb_list_entry(list, struct qb_map_notifier, list);
 			trie_notify_ref(tn);
@@ -599,14 +891,15 @@ trie_notify(struct trie_node *n,
 			if ((tn->events & event) &&
 			    ((tn->events & QB_MAP_NOTIFY_RECURSIVE) ||
 			     (n == c))) {
-				tn->callback(event, (char *)key, old_value,
-					     value, tn->user_data);
+				qb_map_notifier_call(&t->map, tn, event, key,
+						     old_value, value);
 			}
 			if (((event & QB_MAP_NOTIFY_DELETED) ||
 			     (event & QB_MAP_NOTIFY_REPLACED)) &&
 			    (tn->events & QB_MAP_NOTIFY_FREE)) {
-				tn->callback(QB_MAP_NOTIFY_FREE, (char *)key,
-					     old_value, value, tn->user_data);
+				qb_map_notifier_call(&t->map, tn,
+						     QB_MAP_NOTIFY_FREE, key,
+						     old_value, value);
 			}
 
 			trie_notify_deref(tn);
@@ -634,7 +927,7 @@ trie_notify_add(qb_map_t * m, const char *key,
 		n = t->header;
 	}
 	if (n) {
-		qb_list_for_each(list, n->notifier_head) {
+		qb_list_for_each(list, &n->notifier_head) {
 			f = qb_list_entry(list, struct qb_map_notifier, list);
 
 			if (events & QB_MAP_NOTIFY_FREE &&
@@ -649,7 +942,7 @@ trie_notify_add(qb_map_t * m, const char *key,
 			}
 		}
 
-		f = malloc(sizeof(struct qb_map_notifier));
+		f = qb_util_malloc(sizeof(struct qb_map_notifier));
 		if (f == NULL) {
 			return -errno;
 		}
@@ -668,9 +961,9 @@ trie_notify_add(qb_map_t * m, const char *key,
 			}
 		}
 		if (add_to_tail) {
-			qb_list_add_tail(&f->list, n->notifier_head);
+			qb_list_add_tail(&f->list, &n->notifier_head);
 		} else {
-			qb_list_add(&f->list, n->notifier_head);
+			qb_list_add(&f->list, &n->notifier_head);
 		}
 		return 0;
 	}
@@ -696,7 +989,7 @@ trie_notify_del(qb_map_t * m, const char *key,
 	if (n == NULL) {
 		return -ENOENT;
 	}
-	qb_list_for_each_safe(list, next, n->notifier_head) {
+	qb_list_for_each_safe(list, next, &n->notifier_head) {
 		struct qb_map_notifier *f = qb_list_entry(list, struct qb_map_notifier, list);
 
 		if (f->events == events && f->callback == fn) {
@@ -721,7 +1014,7 @@ trie_notify_del(qb_map_t * m, const char *key,
 static qb_map_iter_t *
 trie_iter_create(struct qb_map *map, const char *prefix)
 {
-	struct trie_iter *i = malloc(sizeof(struct trie_iter));
+	struct trie_iter *i = qb_util_malloc(sizeof(struct trie_iter));
 	struct trie *t = (struct trie *)map;
 	if (i == NULL) {
 		return NULL;
@@ -778,7 +1071,7 @@ trie_iter_free(qb_map_iter_t * i)
 		 */
 		trie_node_deref(t, si->n);
 	}
-	free(i);
+	qb_util_free(i);
 }
 
 static size_t
@@ -788,10 +1081,36 @@ trie_count_get(struct qb_map *map)
 	return list->length;
 }
 
+static void
+trie_stats_get(struct qb_map *map, struct qb_map_stats *stats)
+{
+	struct trie *t = (struct trie *)map;
+	struct trie_node *n;
+	struct trie_node *p;
+	uint32_t depth;
+
+	stats->count = t->length;
+	stats->nodes = t->num_nodes;
+	for (n = t->header; n; n = trie_node_next(n, t->header, QB_TRUE)) {
+		stats->notifiers += qb_map_notifiers_count(&n->notifier_head);
+		if (!trie_node_alive(n)) {
+			continue;
+		}
+		/* the nodes a lookup has to go through */
+		depth = 0;
+		for (p = n; p != t->header; p = p->parent) {
+			depth++;
+		}
+		qb_map_stats_histogram_add(stats, depth);
+	}
+	stats->mem_used = t->mem_used +
+		stats->notifiers * sizeof(struct qb_map_notifier);
+}
+
 qb_map_t *
 qb_trie_create(void)
 {
-	struct trie *t = malloc(sizeof(struct trie));
+	struct trie *t = qb_util_malloc(sizeof(struct trie));
 	if (t == NULL) {
 		return NULL;
 	}
@@ -806,10 +1125,21 @@ qb_trie_create(void)
 	t->map.destroy = trie_destroy;
 	t->map.notify_add = trie_notify_add;
 	t->map.notify_del = trie_notify_del;
+	t->map.stats_get = trie_stats_get;
+	t->map.batch = NULL;
 	t->length = 0;
 	t->num_nodes = 0;
 	t->mem_used = sizeof(struct trie);
+	t->chunks = NULL;
+	t->chunk_pos = NULL;
+	t->chunk_left = 0;
+	t->chunk_size = TRIE_CHUNK_MIN;
+	memset(t->free_blocks, 0, sizeof(t->free_blocks));
 	t->header = trie_new_node(t, NULL);
+	if (t->header == NULL) {
+		qb_util_free(t);
+		return NULL;
+	}
 
 	return (qb_map_t *) t;
 }
@@ -150,6 +150,13 @@ unlink_exit:
 
 int32_t
 qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
+{
+	return qb_sys_circular_mmap_prot(fd, buf, bytes,
+					 PROT_READ | PROT_WRITE);
+}
+
+int32_t
+qb_sys_circular_mmap_prot(int32_t fd, void **buf, size_t bytes, int32_t prot)
 {
 	void *addr_orig = NULL;
 	void *addr;
@@ -175,7 +182,7 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
 	   the second memory location behind it too. Otherwise the Linux
 	   kernel may map it in the upper memory so that we can't map
 	   the second part afterwards since it will conflict. */
-	addr = mmap(NULL, 2*bytes, PROT_READ | PROT_WRITE,
+	addr = mmap(NULL, 2*bytes, prot,
 		    MAP_SHARED, fd, 0);
 
 	if (addr == MAP_FAILED)
@@ -189,7 +196,7 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
 		return -errno;
 	}
 
-	addr = mmap(addr_orig, bytes, PROT_READ | PROT_WRITE,
+	addr = mmap(addr_orig, bytes, prot,
 		    MAP_FIXED | MAP_SHARED, fd, 0);
 #endif
 
@@ -202,7 +209,7 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
 #endif
 	addr_next = ((char *)addr_orig) + bytes;
 	addr = mmap(addr_next,
-		    bytes, PROT_READ | PROT_WRITE,
+		    bytes, prot,
 		    MAP_FIXED | MAP_SHARED, fd, 0);
 	if (addr != addr_next) {
 		res = -errno;
@@ -53,6 +53,14 @@
 #define qb_util_perror
 #endif
 
+/*
+ * libqb's own allocations go through these, see qb_util_allocator_set().
+ */
+void *qb_util_malloc(size_t size);
+void *qb_util_calloc(size_t nmemb, size_t size);
+void *qb_util_realloc(void *ptr, size_t size);
+void qb_util_free(void *ptr);
+
 /**
  * Create a file to be used to back shared memory.
  *
@@ -75,6 +83,13 @@ int32_t qb_sys_mmap_file_open(char *path, const char *file, size_t bytes,
  */
 int32_t qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes);
 
+/**
+ * Same as qb_sys_circular_mmap() but with the given protection,
+ * e.g. PROT_READ to follow a buffer someone else writes.
+ */
+int32_t qb_sys_circular_mmap_prot(int32_t fd, void **buf, size_t bytes,
+				  int32_t prot);
+
 
 /**
  * Set O_NONBLOCK and FD_CLOEXEC on a file descriptor.
@@ -99,6 +114,21 @@ void qb_sigpipe_ctl(enum qb_sigpipe_ctl ctl);
  */
 void qb_socket_nosigpipe(int32_t s);
 
+/*
+ * Published statistics, see qb_stats_publish(). Each subsystem
+ * instance adds a provider, fill is called from qb_stats_refresh().
+ */
+typedef void (*qb_stats_fill_fn)(void *data, uint64_t *values);
+
+struct qb_stats_provider;
+
+struct qb_stats_provider *qb_stats_provider_add(const char *name,
+						 const char * const *labels,
+						 uint32_t count,
+						 qb_stats_fill_fn fill,
+						 void *data);
+void qb_stats_provider_del(struct qb_stats_provider *p);
+
 #define SERVER_BACKLOG 128
 
 #ifndef UNIX_PATH_MAX
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * How long qb_log_init() takes to find the callsites.
+ *
+ * Pass shared libraries on the command line to have them loaded first,
+ * e.g. bench-log-init /usr/lib64/lib*.so.*
+ */
+#include "os_base.h"
+#ifdef HAVE_LINK_H
+#include <link.h>
+#endif /* HAVE_LINK_H */
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif /* HAVE_DLFCN_H */
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qblog.h>
+
+#define ITERATIONS 1000
+
+static int
+count_objects(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int *count = data;
+
+	*count += 1;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	qb_util_stopwatch_t *sw;
+	uint64_t us;
+	int objects = 0;
+	int loaded = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (dlopen(argv[i], RTLD_NOW | RTLD_GLOBAL)) {
+			loaded++;
+		}
+	}
+	dl_iterate_phdr(count_objects, &objects);
+	printf("%d objects loaded (%d from the command line)\n",
+	       objects, loaded);
+
+	sw = qb_util_stopwatch_create();
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < ITERATIONS; i++) {
+		qb_log_init("bench-log-init", LOG_USER, LOG_INFO);
+		qb_log_fini();
+	}
+	qb_util_stopwatch_stop(sw);
+	us = qb_util_stopwatch_us_elapsed_get(sw);
+	printf("qb_log_init + qb_log_fini:\t%9.3f us\n",
+	       (float)us / ITERATIONS);
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < ITERATIONS; i++) {
+		qb_log_init("bench-log-init", LOG_USER, LOG_INFO);
+		qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+		qb_log(LOG_DEBUG, "first use of this section");
+		qb_log_fini();
+	}
+	qb_util_stopwatch_stop(sw);
+	us = qb_util_stopwatch_us_elapsed_get(sw);
+	printf("... + first qb_log():\t\t%9.3f us\n",
+	       (float)us / ITERATIONS);
+
+	qb_util_stopwatch_free(sw);
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Numeric keys in the string maps (formatted with snprintf, the
+ * way callers have to) against qb_map_u64, with the time per operation
+ * and the memory each map needs for the keys.
+ *
+ * usage: bench-map [number of keys]
+ */
+#include "os_base.h"
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qbmap.h>
+
+#define KEY_LEN 24
+
+static void
+report(const char *name, const char *op, uint32_t count,
+       qb_util_stopwatch_t *sw)
+{
+	uint64_t us = qb_util_stopwatch_us_elapsed_get(sw);
+
+	printf("%-12s %-4s %10.1f ns/op (%u in %.3fs)\n", name, op,
+	       us * 1000.0 / count, count, us / 1000000.0);
+}
+
+static uint64_t
+key_get(uint32_t i)
+{
+	/* something like node ids: sparse, not sequential */
+	return (uint64_t)i * 2654435761U;
+}
+
+static void
+report_mem(const char *name, struct qb_map_stats *stats)
+{
+	printf("%-12s mem  %10.1f bytes/key (%zu bytes, %zu nodes)\n", name,
+	       (double)stats->mem_used / stats->count, stats->mem_used,
+	       stats->nodes);
+}
+
+static void
+bench_strings(const char *name, qb_map_t *m, uint32_t count,
+	      qb_util_stopwatch_t *sw)
+{
+	char *keys = malloc((size_t)count * KEY_LEN);
+	char key[KEY_LEN];
+	struct qb_map_stats stats;
+	uint32_t found = 0;
+	uint32_t i;
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		snprintf(&keys[i * KEY_LEN], KEY_LEN, "%" PRIu64, key_get(i));
+		qb_map_put(m, &keys[i * KEY_LEN], &keys[i * KEY_LEN]);
+	}
+	qb_util_stopwatch_stop(sw);
+	report(name, "put", count, sw);
+	if (qb_map_stats_get(m, &stats) == 0) {
+		report_mem(name, &stats);
+	}
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		snprintf(key, KEY_LEN, "%" PRIu64, key_get(i));
+		if (qb_map_get(m, key)) {
+			found++;
+		}
+	}
+	qb_util_stopwatch_stop(sw);
+	report(name, "get", count, sw);
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		snprintf(key, KEY_LEN, "%" PRIu64, key_get(i));
+		(void)qb_map_rm(m, key);
+	}
+	qb_util_stopwatch_stop(sw);
+	report(name, "rm", count, sw);
+
+	if (found != count) {
+		printf("%s: only found %u of %u\n", name, found, count);
+	}
+	qb_map_destroy(m);
+	free(keys);
+}
+
+static void
+bench_map_u64(uint32_t count, qb_util_stopwatch_t *sw)
+{
+	qb_map_u64_t *m = qb_map_u64_create(count);
+	struct qb_map_stats stats;
+	uint32_t found = 0;
+	uint32_t i;
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		(void)qb_map_u64_put(m, key_get(i), sw);
+	}
+	qb_util_stopwatch_stop(sw);
+	report("map_u64", "put", count, sw);
+	if (qb_map_u64_stats_get(m, &stats) == 0) {
+		report_mem("map_u64", &stats);
+	}
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		if (qb_map_u64_get(m, key_get(i))) {
+			found++;
+		}
+	}
+	qb_util_stopwatch_stop(sw);
+	report("map_u64", "get", count, sw);
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		(void)qb_map_u64_rm(m, key_get(i));
+	}
+	qb_util_stopwatch_stop(sw);
+	report("map_u64", "rm", count, sw);
+
+	if (found != count) {
+		printf("map_u64: only found %u of %u\n", found, count);
+	}
+	qb_map_u64_destroy(m);
+}
+
+int
+main(int argc, char **argv)
+{
+	qb_util_stopwatch_t *sw;
+	uint32_t count = 1000000;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 0);
+	}
+	if (count == 0) {
+		printf("usage: %s [number of keys]\n", argv[0]);
+		return 1;
+	}
+
+	sw = qb_util_stopwatch_create();
+	bench_strings("hashtable", qb_hashtable_create(count), count, sw);
+	bench_strings("trie", qb_trie_create(), count, sw);
+	bench_map_u64(count, sw);
+	qb_util_stopwatch_free(sw);
+	return 0;
+}
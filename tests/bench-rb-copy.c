@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Large ring buffer chunks copied with memcpy() against the streaming
+ * copy (see qb_rb_copy_threshold_set()), for a range of message sizes
+ * with the reader on the same CPU, another core or another socket.
+ *
+ * After every write the writer walks a working set of its own; the
+ * time that takes shows how much of its cache the copy evicted.
+ *
+ * usage: bench-rb-copy [MB per run]
+ */
+#include "os_base.h"
+#include <sys/wait.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qbrb.h>
+
+#define ONE_MEG		1048576
+#define MSG_SIZE_MAX	(4 * ONE_MEG)
+#define WORKING_SET	(512 * 1024)
+
+static const size_t msg_sizes[] = {
+	4096, 65536, 262144, ONE_MEG, MSG_SIZE_MAX,
+};
+
+struct placement {
+	const char *name;
+	int32_t reader_cpu;
+};
+
+static char *msg;
+static char *working_set;
+static volatile uint64_t working_set_sum;
+
+static int32_t
+cpu_topology_get(int32_t cpu, const char *what)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int32_t val = -1;
+
+	snprintf(path, PATH_MAX,
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%d", &val) != 1) {
+		val = -1;
+	}
+	fclose(f);
+	return val;
+}
+
+/*
+ * The writer is always on cpu 0, find a reader cpu for each placement.
+ */
+static int32_t
+placements_get(struct placement *p)
+{
+	int32_t n = 0;
+	int32_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int32_t package = cpu_topology_get(0, "physical_package_id");
+	int32_t core = cpu_topology_get(0, "core_id");
+	int32_t other_core = -1;
+	int32_t other_package = -1;
+	int32_t c;
+
+	for (c = 1; c < cpus; c++) {
+		if (cpu_topology_get(c, "physical_package_id") != package) {
+			if (other_package < 0) {
+				other_package = c;
+			}
+		} else if (cpu_topology_get(c, "core_id") != core) {
+			if (other_core < 0) {
+				other_core = c;
+			}
+		}
+	}
+	p[n].name = "same-cpu";
+	p[n++].reader_cpu = 0;
+	if (other_core >= 0) {
+		p[n].name = "cross-core";
+		p[n++].reader_cpu = other_core;
+	} else {
+		printf("# no other core on the writer's socket, skipping cross-core\n");
+	}
+	if (other_package >= 0) {
+		p[n].name = "cross-socket";
+		p[n++].reader_cpu = other_package;
+	} else {
+		printf("# only one socket, skipping cross-socket\n");
+	}
+	return n;
+}
+
+static void
+pin(int32_t cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		perror("sched_setaffinity");
+	}
+#endif /* HAVE_SCHED_SETAFFINITY */
+}
+
+static uint64_t
+working_set_walk(void)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < WORKING_SET; i += 64) {
+		sum += working_set[i]++;
+	}
+	return sum;
+}
+
+static void
+reader(int32_t cpu, size_t size, uint32_t count)
+{
+	qb_ringbuffer_t *rb;
+	char *buf = malloc(size);
+	ssize_t res;
+	uint32_t i;
+
+	pin(cpu);
+	rb = qb_rb_open("bench-rb-copy", MSG_SIZE_MAX * 4,
+			QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (rb == NULL || buf == NULL) {
+		perror("reader");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		do {
+			res = qb_rb_chunk_read(rb, buf, size, 1000);
+		} while (res == -ETIMEDOUT);
+		if (res != size) {
+			fprintf(stderr, "reader: %zd\n", res);
+			exit(1);
+		}
+	}
+	qb_rb_close(rb);
+	free(buf);
+	exit(0);
+}
+
+static void
+bench(struct placement *p, size_t size, const char *mode, uint32_t count,
+      qb_util_stopwatch_t *sw, qb_util_stopwatch_t *ws_sw)
+{
+	qb_ringbuffer_t *rb;
+	uint64_t ws_us = 0;
+	ssize_t res;
+	uint32_t i;
+	pid_t pid;
+	float secs;
+
+	rb = qb_rb_open("bench-rb-copy", MSG_SIZE_MAX * 4,
+			QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (rb == NULL) {
+		perror("qb_rb_open");
+		exit(1);
+	}
+	/* or the reader prints it again when it exits */
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		reader(p->reader_cpu, size, count);
+	}
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < count; i++) {
+		do {
+			res = qb_rb_chunk_write(rb, msg, size);
+			if (res == -EAGAIN) {
+				sched_yield();
+			}
+		} while (res == -EAGAIN);
+		if (res != size) {
+			fprintf(stderr, "writer: %zd\n", res);
+			break;
+		}
+		qb_util_stopwatch_start(ws_sw);
+		working_set_sum += working_set_walk();
+		qb_util_stopwatch_stop(ws_sw);
+		ws_us += qb_util_stopwatch_us_elapsed_get(ws_sw);
+	}
+	waitpid(pid, NULL, 0);
+	qb_util_stopwatch_stop(sw);
+	qb_rb_close(rb);
+
+	secs = qb_util_stopwatch_sec_elapsed_get(sw);
+	printf("%-12s %8zu %-7s %9.1f MB/s %9.1f us/walk\n", p->name, size,
+	       mode, ((float)count * size / ONE_MEG) / secs,
+	       (float)ws_us / count);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct placement placements[3];
+	qb_util_stopwatch_t *sw;
+	qb_util_stopwatch_t *ws_sw;
+	size_t total = 256 * ONE_MEG;
+	uint32_t count;
+	int32_t n;
+	int32_t p;
+	int32_t s;
+
+	if (argc > 1) {
+		total = strtoul(argv[1], NULL, 0) * ONE_MEG;
+	}
+	if (total == 0) {
+		printf("usage: %s [MB per run]\n", argv[0]);
+		return 1;
+	}
+	msg = malloc(MSG_SIZE_MAX);
+	working_set = malloc(WORKING_SET);
+	if (msg == NULL || working_set == NULL) {
+		return 1;
+	}
+	memset(msg, 'x', MSG_SIZE_MAX);
+	memset(working_set, 0, WORKING_SET);
+
+	sw = qb_util_stopwatch_create();
+	ws_sw = qb_util_stopwatch_create();
+	pin(0);
+	n = placements_get(placements);
+	for (p = 0; p < n; p++) {
+		for (s = 0; s < sizeof(msg_sizes) / sizeof(msg_sizes[0]); s++) {
+			count = QB_MAX(total / msg_sizes[s], 16);
+
+			(void)qb_rb_copy_threshold_set(0);
+			bench(&placements[p], msg_sizes[s], "memcpy", count,
+			      sw, ws_sw);
+			if (qb_rb_copy_threshold_set(1) == -ENOTSUP) {
+				printf("# no streaming stores on this cpu\n");
+			}
+			bench(&placements[p], msg_sizes[s], "stream", count,
+			      sw, ws_sw);
+		}
+	}
+	qb_util_stopwatch_free(sw);
+	qb_util_stopwatch_free(ws_sw);
+	free(msg);
+	free(working_set);
+	return 0;
+}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ring buffer throughput and latency for every combination of message
+ * size, ring size, thread or process sharing, semaphore or
+ * QB_RB_FLAG_NO_SEMAPHORE, overwrite mode and reader placement (the
+ * same cpu as the writer, its SMT sibling or another core).
+ *
+ * Each message carries the time it was written, the reader takes the
+ * difference as the latency. An overwrite ring can't be read while it
+ * is written (the writer reclaims chunks behind the reader's back), so
+ * those runs have no reader and time the writes, as for the blackbox.
+ *
+ * The output is CSV, one line per run, and lines starting with '#'
+ * are notes. Compare two runs with something like:
+ *	join -t, <(sort before.csv) <(sort after.csv)
+ *
+ * usage: bench-rb [messages per run]
+ */
+#include "os_base.h"
+#include <sys/wait.h>
+#include <pthread.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qbrb.h>
+
+#define ONE_MEG		1048576
+#define RB_NAME		"bench-rb"
+#define MSG_SIZE_MAX	16384
+#define BYTES_PER_RUN	(256 * ONE_MEG)
+#define PERCENTILES	5
+#define N_ELEM(a)	(sizeof(a) / sizeof(a[0]))
+
+static const size_t msg_sizes[] = {
+	64, 1024, MSG_SIZE_MAX,
+};
+
+static const size_t ring_sizes[] = {
+	64 * 1024, ONE_MEG,
+};
+
+/* in per mille, the last is the maximum */
+static const uint32_t percentiles[PERCENTILES] = {
+	500, 900, 990, 999, 1000,
+};
+
+struct placement {
+	const char *name;
+	int32_t reader_cpu;
+};
+
+struct bench_run {
+	uint32_t sharing;
+	uint32_t flags;
+	struct placement *p;
+	size_t ring_size;
+	size_t msg_size;
+	uint32_t count;
+	/* the writer's handle, which a reader thread has to share */
+	qb_ringbuffer_t *rb;
+	/* the reader sends a byte when it is ready, then its results */
+	int32_t fd;
+};
+
+struct bench_msg {
+	uint64_t stamp;
+	uint32_t seq;
+};
+
+struct bench_result {
+	uint32_t received;
+	uint64_t end_ns;
+	uint64_t latency_ns[PERCENTILES];
+};
+
+static char *msg;
+
+static int32_t
+cpu_topology_get(int32_t cpu, const char *what)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int32_t val = -1;
+
+	snprintf(path, PATH_MAX,
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%d", &val) != 1) {
+		val = -1;
+	}
+	fclose(f);
+	return val;
+}
+
+/*
+ * The writer is always on cpu 0, find a reader cpu for each placement.
+ */
+static int32_t
+placements_get(struct placement *p)
+{
+	int32_t n = 0;
+	int32_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int32_t package = cpu_topology_get(0, "physical_package_id");
+	int32_t core = cpu_topology_get(0, "core_id");
+	int32_t sibling = -1;
+	int32_t other_core = -1;
+	int32_t c;
+
+	for (c = 1; c < cpus; c++) {
+		if (cpu_topology_get(c, "physical_package_id") != package) {
+			continue;
+		}
+		if (cpu_topology_get(c, "core_id") == core) {
+			if (sibling < 0) {
+				sibling = c;
+			}
+		} else if (other_core < 0) {
+			other_core = c;
+		}
+	}
+	p[n].name = "same-cpu";
+	p[n++].reader_cpu = 0;
+	if (sibling >= 0) {
+		p[n].name = "smt-sibling";
+		p[n++].reader_cpu = sibling;
+	} else {
+		printf("# no SMT sibling of the writer's cpu, skipping smt-sibling\n");
+	}
+	if (other_core >= 0) {
+		p[n].name = "cross-core";
+		p[n++].reader_cpu = other_core;
+	} else {
+		printf("# no other core on the writer's socket, skipping cross-core\n");
+	}
+	return n;
+}
+
+static void
+pin(int32_t cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	/* only the calling thread */
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		perror("sched_setaffinity");
+	}
+#endif /* HAVE_SCHED_SETAFFINITY */
+}
+
+static int
+u64_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+percentiles_get(uint64_t *samples, uint32_t n, uint64_t *latency_ns)
+{
+	int32_t i;
+
+	if (n == 0) {
+		memset(latency_ns, 0, PERCENTILES * sizeof(uint64_t));
+		return;
+	}
+	qsort(samples, n, sizeof(uint64_t), u64_compare);
+	for (i = 0; i < PERCENTILES; i++) {
+		latency_ns[i] = samples[((uint64_t)(n - 1) * percentiles[i]) / 1000];
+	}
+}
+
+static void
+reader(struct bench_run *b)
+{
+	struct bench_result res;
+	struct bench_msg m;
+	qb_ringbuffer_t *rb;
+	uint64_t *samples = calloc(b->count, sizeof(uint64_t));
+	char *buf = malloc(b->msg_size);
+	char ready = 1;
+	ssize_t l;
+
+	memset(&res, 0, sizeof(res));
+	pin(b->p->reader_cpu);
+	if (b->sharing == QB_RB_FLAG_SHARED_THREAD) {
+		/*
+		 * the semaphore isn't process shared, a second mapping
+		 * of the ring would wait on a different address
+		 */
+		rb = b->rb;
+	} else {
+		rb = qb_rb_open(RB_NAME, b->ring_size, b->sharing | b->flags, 0);
+	}
+	if (rb == NULL || samples == NULL || buf == NULL) {
+		perror("reader");
+		exit(1);
+	}
+	if (write(b->fd, &ready, 1) != 1) {
+		perror("reader");
+		exit(1);
+	}
+	while (res.received < b->count) {
+		l = qb_rb_chunk_read(rb, buf, b->msg_size, 1000);
+		if (l == -ETIMEDOUT) {
+			/* nothing to wait on without the semaphore */
+			sched_yield();
+			continue;
+		}
+		if (l != b->msg_size) {
+			fprintf(stderr, "reader: %zd\n", l);
+			exit(1);
+		}
+		memcpy(&m, buf, sizeof(m));
+		samples[res.received++] = qb_util_nano_current_get() - m.stamp;
+	}
+	res.end_ns = qb_util_nano_current_get();
+	if (rb != b->rb) {
+		qb_rb_close(rb);
+	}
+
+	percentiles_get(samples, res.received, res.latency_ns);
+	if (write(b->fd, &res, sizeof(res)) != sizeof(res)) {
+		perror("reader");
+		exit(1);
+	}
+	free(samples);
+	free(buf);
+}
+
+static void *
+reader_thread(void *data)
+{
+	reader((struct bench_run *)data);
+	return NULL;
+}
+
+static void
+report(struct bench_run *b, struct bench_result *res, uint64_t elapsed_ns)
+{
+	double secs = elapsed_ns / 1000000000.0;
+	int32_t i;
+
+	printf("%s,%s,%s,%s,%zu,%zu,%u,%u,%.0f,%.1f",
+	       b->sharing == QB_RB_FLAG_SHARED_PROCESS ? "process" : "thread",
+	       (b->flags & QB_RB_FLAG_NO_SEMAPHORE) ? "no" : "yes",
+	       (b->flags & QB_RB_FLAG_OVERWRITE) ? "yes" : "no",
+	       b->p ? b->p->name : "none",
+	       b->ring_size, b->msg_size, b->count, res->received,
+	       res->received / secs,
+	       ((double)res->received * b->msg_size / ONE_MEG) / secs);
+	for (i = 0; i < PERCENTILES; i++) {
+		printf(",%" PRIu64, res->latency_ns[i]);
+	}
+	printf("\n");
+}
+
+static void
+msg_write(struct bench_run *b, qb_ringbuffer_t *rb, uint32_t seq)
+{
+	struct bench_msg m;
+	ssize_t l;
+
+	m.seq = seq;
+	m.stamp = qb_util_nano_current_get();
+	memcpy(msg, &m, sizeof(m));
+	while ((l = qb_rb_chunk_write(rb, msg, b->msg_size)) == -EAGAIN) {
+		sched_yield();
+	}
+	if (l != b->msg_size) {
+		fprintf(stderr, "writer: %zd\n", l);
+		exit(1);
+	}
+}
+
+/*
+ * Nothing reads an overwrite ring, so time each write instead.
+ */
+static void
+bench_overwrite(struct bench_run *b, qb_ringbuffer_t *rb)
+{
+	struct bench_result res;
+	uint64_t *samples = calloc(b->count, sizeof(uint64_t));
+	uint64_t start;
+	uint64_t t;
+	uint32_t i;
+
+	if (samples == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	memset(&res, 0, sizeof(res));
+	start = qb_util_nano_current_get();
+	for (i = 0; i < b->count; i++) {
+		t = qb_util_nano_current_get();
+		msg_write(b, rb, i);
+		samples[i] = qb_util_nano_current_get() - t;
+	}
+	res.end_ns = qb_util_nano_current_get();
+	res.received = b->count;
+	percentiles_get(samples, b->count, res.latency_ns);
+	report(b, &res, res.end_ns - start);
+	free(samples);
+}
+
+static void
+bench(struct bench_run *b)
+{
+	struct bench_result res;
+	qb_ringbuffer_t *rb;
+	pthread_t thread;
+	pid_t pid = 0;
+	int32_t fds[2];
+	uint64_t start;
+	uint32_t i;
+	char ready;
+
+	rb = qb_rb_open(RB_NAME, b->ring_size,
+			b->sharing | b->flags | QB_RB_FLAG_CREATE, 0);
+	if (rb == NULL) {
+		perror("qb_rb_open");
+		exit(1);
+	}
+	b->rb = rb;
+	if (b->flags & QB_RB_FLAG_OVERWRITE) {
+		bench_overwrite(b, rb);
+		qb_rb_close(rb);
+		return;
+	}
+
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	b->fd = fds[1];
+	if (b->sharing == QB_RB_FLAG_SHARED_PROCESS) {
+		/* or the reader prints it again when it exits */
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			reader(b);
+			exit(0);
+		}
+	} else if (pthread_create(&thread, NULL, reader_thread, b) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	if (read(fds[0], &ready, 1) != 1) {
+		perror("read");
+		exit(1);
+	}
+
+	start = qb_util_nano_current_get();
+	for (i = 0; i < b->count; i++) {
+		msg_write(b, rb, i);
+	}
+	if (read(fds[0], &res, sizeof(res)) != sizeof(res)) {
+		perror("read");
+		exit(1);
+	}
+	if (b->sharing == QB_RB_FLAG_SHARED_PROCESS) {
+		waitpid(pid, NULL, 0);
+	} else {
+		pthread_join(thread, NULL);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	qb_rb_close(rb);
+
+	report(b, &res, res.end_ns - start);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint32_t sharing[] = {
+		QB_RB_FLAG_SHARED_THREAD, QB_RB_FLAG_SHARED_PROCESS,
+	};
+	static const uint32_t flags[] = {
+		0, QB_RB_FLAG_NO_SEMAPHORE, QB_RB_FLAG_OVERWRITE,
+		QB_RB_FLAG_OVERWRITE | QB_RB_FLAG_NO_SEMAPHORE,
+	};
+	struct placement placements[3];
+	struct bench_run b;
+	uint32_t count = 200000;
+	int32_t n;
+	int32_t p;
+	uint32_t sh;
+	uint32_t f;
+	uint32_t r;
+	uint32_t s;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 0);
+	}
+	if (count == 0) {
+		printf("usage: %s [messages per run]\n", argv[0]);
+		return 1;
+	}
+	msg = calloc(1, MSG_SIZE_MAX);
+	if (msg == NULL) {
+		return 1;
+	}
+
+	pin(0);
+	n = placements_get(placements);
+	printf("sharing,semaphore,overwrite,placement,ring_size,msg_size,"
+	       "messages,received,msgs_per_sec,mb_per_sec,"
+	       "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+	for (sh = 0; sh < N_ELEM(sharing); sh++) {
+		for (f = 0; f < N_ELEM(flags); f++) {
+			for (p = 0; p < n; p++) {
+				if ((flags[f] & QB_RB_FLAG_OVERWRITE) && p > 0) {
+					/* there's no reader to place */
+					break;
+				}
+				for (r = 0; r < N_ELEM(ring_sizes); r++) {
+					for (s = 0; s < N_ELEM(msg_sizes); s++) {
+						memset(&b, 0, sizeof(b));
+						b.sharing = sharing[sh];
+						b.flags = flags[f];
+						if (!(flags[f] & QB_RB_FLAG_OVERWRITE)) {
+							b.p = &placements[p];
+						}
+						b.ring_size = ring_sizes[r];
+						b.msg_size = msg_sizes[s];
+						b.count = QB_MIN(count, BYTES_PER_RUN / msg_sizes[s]);
+						bench(&b);
+						fflush(stdout);
+					}
+				}
+			}
+		}
+	}
+	free(msg);
+	return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reconnect storm benchmark.
+ *
+ * A forked server is hit by many clients connecting at once, as
+ * happens when a daemon restarts. Each round all of them connect,
+ * then all of them go away again.
+ */
+#include "os_base.h"
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbutil.h>
+#include <qb/qbloop.h>
+#include <qb/qbipcc.h>
+#include <qb/qbipcs.h>
+
+#define BMCONN_NAME "bmconn"
+
+static int32_t num_conns = 200;
+static int32_t num_threads = 8;
+static int32_t rounds = 3;
+static size_t ring_size = 64 * 1024;
+static enum qb_ipc_type ipc_type = QB_IPC_SHM;
+
+static qb_loop_t *bm_loop;
+static qb_ipcs_service_t *s1;
+
+struct storm_thread {
+	pthread_t thread;
+	int32_t first;
+	int32_t count;
+	int32_t failed;
+	uint64_t max_ns;
+	uint64_t total_ns;
+};
+
+static qb_ipcc_connection_t **conns;
+
+/*
+ * server
+ */
+static int32_t
+s1_msg_process_fn(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	return 0;
+}
+
+static int32_t
+server_stop(int32_t rsignal, void *data)
+{
+	qb_ipcs_destroy(s1);
+	qb_loop_stop(bm_loop);
+	return -1;
+}
+
+static int32_t
+my_job_add(enum qb_loop_priority p, void *data, qb_loop_job_dispatch_fn fn)
+{
+	return qb_loop_job_add(bm_loop, p, data, fn);
+}
+
+static int32_t
+my_dispatch_add(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_add(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_mod(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_del(int32_t fd)
+{
+	return qb_loop_poll_del(bm_loop, fd);
+}
+
+static void
+run_server(void)
+{
+	qb_loop_signal_handle handle;
+	struct qb_ipcs_service_handlers sh = {
+		.connection_accept = NULL,
+		.connection_created = NULL,
+		.msg_process = s1_msg_process_fn,
+		.connection_destroyed = NULL,
+		.connection_closed = NULL,
+	};
+	struct qb_ipcs_poll_handlers ph = {
+		.job_add = my_job_add,
+		.dispatch_add = my_dispatch_add,
+		.dispatch_mod = my_dispatch_mod,
+		.dispatch_del = my_dispatch_del,
+	};
+	int32_t rc;
+
+	bm_loop = qb_loop_create();
+	qb_loop_signal_add(bm_loop, QB_LOOP_HIGH, SIGTERM,
+			   NULL, server_stop, &handle);
+
+	s1 = qb_ipcs_create(BMCONN_NAME, 0, ipc_type, &sh);
+	if (s1 == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcs_create");
+		exit(1);
+	}
+	qb_ipcs_poll_handlers_set(s1, &ph);
+	rc = qb_ipcs_run(s1);
+	if (rc != 0) {
+		errno = -rc;
+		qb_perror(LOG_ERR, "qb_ipcs_run");
+		exit(1);
+	}
+	qb_loop_run(bm_loop);
+	exit(0);
+}
+
+/*
+ * client
+ */
+static void *
+storm_worker(void *data)
+{
+	struct storm_thread *st = data;
+	uint64_t start;
+	uint64_t took;
+	int32_t i;
+
+	for (i = st->first; i < st->first + st->count; i++) {
+		start = qb_util_nano_current_get();
+		conns[i] = qb_ipcc_connect(BMCONN_NAME, ring_size);
+		took = qb_util_nano_current_get() - start;
+		if (conns[i] == NULL) {
+			st->failed++;
+			continue;
+		}
+		st->total_ns += took;
+		st->max_ns = QB_MAX(st->max_ns, took);
+	}
+	return NULL;
+}
+
+static void
+server_wait(void)
+{
+	qb_ipcc_connection_t *conn;
+	int32_t tries = 0;
+
+	do {
+		conn = qb_ipcc_connect(BMCONN_NAME, ring_size);
+		if (conn == NULL) {
+			usleep(100000);
+		}
+	} while (conn == NULL && ++tries < 50);
+	if (conn == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcc_connect");
+		exit(1);
+	}
+	qb_ipcc_disconnect(conn);
+}
+
+static void
+run_round(int32_t round, struct storm_thread *threads)
+{
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t max_ns = 0;
+	uint64_t total_ns = 0;
+	int32_t failed = 0;
+	int32_t per_thread = num_conns / num_threads;
+	int32_t t;
+	int32_t i;
+
+	memset(threads, 0, num_threads * sizeof(struct storm_thread));
+	for (t = 0; t < num_threads; t++) {
+		threads[t].first = t * per_thread;
+		threads[t].count = per_thread;
+	}
+	threads[num_threads - 1].count += num_conns % num_threads;
+
+	start = qb_util_nano_current_get();
+	for (t = 0; t < num_threads; t++) {
+		if (pthread_create(&threads[t].thread, NULL,
+				   storm_worker, &threads[t]) != 0) {
+			qb_perror(LOG_ERR, "pthread_create");
+			exit(1);
+		}
+	}
+	for (t = 0; t < num_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		failed += threads[t].failed;
+		total_ns += threads[t].total_ns;
+		max_ns = QB_MAX(max_ns, threads[t].max_ns);
+	}
+	elapsed = qb_util_nano_current_get() - start;
+
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i]) {
+			qb_ipcc_disconnect(conns[i]);
+			conns[i] = NULL;
+		}
+	}
+
+	qb_log(LOG_INFO, "round, %d, conns, %d, failed, %d, storm ms, %9.3f, "
+	       "conns/s, %9.1f, connect ms avg, %9.3f, max, %9.3f",
+	       round, num_conns, failed,
+	       (double)elapsed / QB_TIME_NS_IN_MSEC,
+	       (num_conns - failed) / ((double)elapsed / QB_TIME_NS_IN_SEC),
+	       num_conns > failed ?
+	       (double)total_ns / (num_conns - failed) / QB_TIME_NS_IN_MSEC : 0,
+	       (double)max_ns / QB_TIME_NS_IN_MSEC);
+}
+
+static void
+run_client(void)
+{
+	struct storm_thread *threads;
+	int32_t r;
+
+	conns = calloc(num_conns, sizeof(qb_ipcc_connection_t *));
+	threads = calloc(num_threads, sizeof(struct storm_thread));
+	if (conns == NULL || threads == NULL) {
+		qb_perror(LOG_ERR, "calloc");
+		exit(1);
+	}
+
+	server_wait();
+	for (r = 0; r < rounds; r++) {
+		run_round(r, threads);
+	}
+	free(threads);
+	free(conns);
+}
+
+static void
+show_usage(const char *name)
+{
+	qb_log(LOG_INFO, "usage: \n");
+	qb_log(LOG_INFO, "%s <options>\n", name);
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  options:\n");
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  -n <count>     clients connecting at once (default 200)\n");
+	qb_log(LOG_INFO, "  -t <count>     client threads (default 8)\n");
+	qb_log(LOG_INFO, "  -r <count>     rounds (default 3)\n");
+	qb_log(LOG_INFO, "  -s <bytes>     ring size (default 65536)\n");
+	qb_log(LOG_INFO, "  -u             use unix sockets instead of shm\n");
+	qb_log(LOG_INFO, "  -h             show this help text\n");
+	qb_log(LOG_INFO, "\n");
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+	const char *options = "n:t:r:s:uh";
+	pid_t server_pid;
+	int32_t opt;
+
+	qb_log_init("bmconn", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'n':
+			num_conns = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			ipc_type = QB_IPC_SOCKET;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	num_conns = QB_MAX(num_conns, 1);
+	num_threads = QB_MAX(QB_MIN(num_threads, num_conns), 1);
+
+	server_pid = fork();
+	if (server_pid == 0) {
+		run_server();
+	}
+
+	run_client();
+
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, NULL, 0);
+
+	return EXIT_SUCCESS;
+}
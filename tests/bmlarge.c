@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Large transfer benchmark.
+ *
+ * Sends big requests to a forked server and times the round trip.
+ * By default the rings are kept small and the requests are passed
+ * by memfd, with -r the rings are made big enough to carry them.
+ */
+#include "os_base.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbutil.h>
+#include <qb/qbloop.h>
+#include <qb/qbipcc.h>
+#include <qb/qbipcs.h>
+
+#define BMLARGE_NAME "bmlarge"
+#define SMALL_RING_SIZE (8192*16)
+
+#define MSG_LARGE (QB_IPC_MSG_USER_START + 1)
+#define MSG_DONE (QB_IPC_MSG_USER_START + 2)
+
+static size_t msg_size = 4 * 1024 * 1024;
+static int32_t iterations = 100;
+static int32_t use_rings = QB_FALSE;
+
+static qb_loop_t *bm_loop;
+static qb_ipcs_service_t *s1;
+
+/*
+ * server
+ */
+static int32_t
+s1_msg_process_fn(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	struct qb_ipc_response_header response;
+	const uint64_t *p = data;
+	uint64_t sum = 0;
+	size_t i;
+
+	/* read all of it, that's what a real server would do */
+	for (i = 0; i < size / sizeof(uint64_t); i++) {
+		sum += p[i];
+	}
+
+	response.size = sizeof(struct qb_ipc_response_header);
+	response.id = MSG_DONE;
+	response.error = sum & 0xff;
+	(void)qb_ipcs_response_send(c, &response, response.size);
+	return 0;
+}
+
+static int32_t
+server_stop(int32_t rsignal, void *data)
+{
+	qb_ipcs_destroy(s1);
+	qb_loop_stop(bm_loop);
+	return -1;
+}
+
+static int32_t
+my_job_add(enum qb_loop_priority p, void *data, qb_loop_job_dispatch_fn fn)
+{
+	return qb_loop_job_add(bm_loop, p, data, fn);
+}
+
+static int32_t
+my_dispatch_add(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_add(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_mod(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_del(int32_t fd)
+{
+	return qb_loop_poll_del(bm_loop, fd);
+}
+
+static void
+run_server(void)
+{
+	qb_loop_signal_handle handle;
+	struct qb_ipcs_service_handlers sh = {
+		.connection_accept = NULL,
+		.connection_created = NULL,
+		.msg_process = s1_msg_process_fn,
+		.connection_destroyed = NULL,
+		.connection_closed = NULL,
+	};
+	struct qb_ipcs_poll_handlers ph = {
+		.job_add = my_job_add,
+		.dispatch_add = my_dispatch_add,
+		.dispatch_mod = my_dispatch_mod,
+		.dispatch_del = my_dispatch_del,
+	};
+	int32_t rc;
+
+	bm_loop = qb_loop_create();
+	qb_loop_signal_add(bm_loop, QB_LOOP_HIGH, SIGTERM,
+			   NULL, server_stop, &handle);
+
+	s1 = qb_ipcs_create(BMLARGE_NAME, 0, QB_IPC_SHM, &sh);
+	if (s1 == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcs_create");
+		exit(1);
+	}
+	qb_ipcs_poll_handlers_set(s1, &ph);
+	rc = qb_ipcs_run(s1);
+	if (rc != 0) {
+		errno = -rc;
+		qb_perror(LOG_ERR, "qb_ipcs_run");
+		exit(1);
+	}
+	qb_loop_run(bm_loop);
+	exit(0);
+}
+
+/*
+ * client
+ */
+static void
+run_client(void)
+{
+	qb_ipcc_connection_t *conn;
+	struct qb_ipc_request_header *hdr;
+	struct qb_ipc_response_header res_header;
+	size_t ring_size;
+	uint64_t start;
+	uint64_t elapsed;
+	char *buf;
+	int32_t tries = 0;
+	int32_t res = 0;
+	int32_t i;
+
+	ring_size = use_rings ? msg_size + SMALL_RING_SIZE : SMALL_RING_SIZE;
+	do {
+		conn = qb_ipcc_connect(BMLARGE_NAME, ring_size);
+		if (conn == NULL) {
+			usleep(100000);
+		}
+	} while (conn == NULL && ++tries < 50);
+	if (conn == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcc_connect");
+		exit(1);
+	}
+	if (!use_rings) {
+		res = qb_ipcc_large_msg_threshold_set(conn, ring_size);
+		if (res != 0) {
+			errno = -res;
+			qb_perror(LOG_ERR, "qb_ipcc_large_msg_threshold_set");
+			exit(1);
+		}
+	}
+
+	buf = calloc(1, msg_size);
+	if (buf == NULL) {
+		qb_perror(LOG_ERR, "calloc");
+		exit(1);
+	}
+	hdr = (struct qb_ipc_request_header *)buf;
+	hdr->id = MSG_LARGE;
+	hdr->size = msg_size;
+
+	start = qb_util_nano_current_get();
+	for (i = 0; i < iterations; i++) {
+		do {
+			res = qb_ipcc_send(conn, buf, msg_size);
+		} while (res == -EAGAIN);
+		if (res < 0) {
+			break;
+		}
+		res = qb_ipcc_recv(conn, &res_header, sizeof(res_header), -1);
+		if (res < 0) {
+			break;
+		}
+	}
+	elapsed = qb_util_nano_current_get() - start;
+	if (i < iterations) {
+		errno = -res;
+		qb_perror(LOG_ERR, "request %d", i);
+		iterations = i;
+	}
+	qb_ipcc_disconnect(conn);
+	free(buf);
+	if (iterations == 0) {
+		return;
+	}
+
+	qb_log(LOG_INFO, "%s, ring KB, %zu, size KB, %zu, "
+	       "rtt usec avg, %9.3f, MB/s, %9.3f",
+	       use_rings ? "rings" : "memfd",
+	       ring_size / 1024, msg_size / 1024,
+	       (double)elapsed / iterations / QB_TIME_NS_IN_USEC,
+	       ((double)msg_size * iterations / (1024 * 1024)) /
+	       ((double)elapsed / QB_TIME_NS_IN_SEC));
+}
+
+static void
+show_usage(const char *name)
+{
+	qb_log(LOG_INFO, "usage: \n");
+	qb_log(LOG_INFO, "%s <options>\n", name);
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  options:\n");
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  -s <bytes>     request size (default 4194304)\n");
+	qb_log(LOG_INFO, "  -i <count>     requests to time (default 100)\n");
+	qb_log(LOG_INFO, "  -r             size the rings to fit the requests\n");
+	qb_log(LOG_INFO, "  -h             show this help text\n");
+	qb_log(LOG_INFO, "\n");
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+	const char *options = "s:i:rh";
+	pid_t server_pid;
+	int32_t opt;
+
+	qb_log_init("bmlarge", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			use_rings = QB_TRUE;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	msg_size = QB_MAX(msg_size, sizeof(struct qb_ipc_request_header));
+	msg_size = QB_MIN(msg_size, INT32_MAX / 2);
+
+	server_pid = fork();
+	if (server_pid == 0) {
+		run_server();
+	}
+
+	run_client();
+
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, NULL, 0);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Noisy neighbour benchmark.
+ *
+ * A server is started along with a number of "noisy" clients that
+ * flood it with large requests. This process then connects as a
+ * "quiet" client and measures the round trip time of small requests.
+ * Compare the latency with and without fair queuing (-q), or with
+ * the server busy polling the rings (-p).
+ */
+#include "os_base.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbutil.h>
+#include <qb/qbloop.h>
+#include <qb/qbipcc.h>
+#include <qb/qbipcs.h>
+
+#define BMNN_NAME "bmnn"
+#define MAX_MSG_SIZE (8192*128)
+#define MAX_NOISY 64
+
+#define MSG_NOISE (QB_IPC_MSG_USER_START + 1)
+#define MSG_PING (QB_IPC_MSG_USER_START + 2)
+#define MSG_PONG (QB_IPC_MSG_USER_START + 3)
+
+static enum qb_ipc_type ipc_type = QB_IPC_SHM;
+static uint32_t quantum = 0;
+static uint32_t quiet_weight = 1;
+static uint32_t busy_poll_usec = 0;
+static int32_t num_noisy = 4;
+static int32_t noise_size = 64 * 1024;
+static int32_t iterations = 1000;
+
+static qb_loop_t *bm_loop;
+static qb_ipcs_service_t *s1;
+static pid_t quiet_pid;
+
+struct my_req {
+	struct qb_ipc_request_header hdr;
+	char message[MAX_MSG_SIZE];
+};
+
+static struct my_req request;
+
+/*
+ * server
+ */
+static int32_t
+s1_connection_accept_fn(qb_ipcs_connection_t *c, uid_t uid, gid_t gid)
+{
+	struct qb_ipcs_connection_stats stats;
+
+	/*
+	 * A real server would pick the class from uid/gid, all our
+	 * clients run as the same user so go by pid instead.
+	 */
+	qb_ipcs_connection_stats_get(c, &stats, QB_FALSE);
+	if (stats.client_pid == quiet_pid) {
+		return qb_ipcs_connection_class_set(c, 1, 1);
+	}
+	return 0;
+}
+
+static int32_t
+s1_msg_process_fn(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	struct qb_ipc_request_header *req_pt = data;
+	struct qb_ipc_response_header response;
+	unsigned char *p = data;
+	uint32_t sum = 0;
+	size_t i;
+
+	/* pretend to do some work on every byte */
+	for (i = 0; i < size; i++) {
+		sum += p[i];
+	}
+
+	if (req_pt->id == MSG_PING) {
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = MSG_PONG;
+		response.error = sum & 0xff;
+		(void)qb_ipcs_response_send(c, &response, response.size);
+	}
+	return 0;
+}
+
+static void
+s1_stats_show(void)
+{
+	struct qb_ipcs_class_stats cs;
+	int32_t i;
+
+	for (i = 0; i < 2; i++) {
+		qb_ipcs_class_stats_get(s1, i, &cs, QB_FALSE);
+		qb_log(LOG_INFO, "class %d (%s): connections %u, requests %"
+		       PRIu64 ", MB %"PRIu64", throttled %"PRIu64,
+		       i, i ? "quiet" : "noisy", cs.connections, cs.requests,
+		       cs.bytes / (1024 * 1024), cs.throttled);
+	}
+}
+
+static int32_t
+server_stop(int32_t rsignal, void *data)
+{
+	s1_stats_show();
+	qb_ipcs_destroy(s1);
+	qb_loop_stop(bm_loop);
+	return -1;
+}
+
+static int32_t
+my_job_add(enum qb_loop_priority p, void *data, qb_loop_job_dispatch_fn fn)
+{
+	return qb_loop_job_add(bm_loop, p, data, fn);
+}
+
+static int32_t
+my_dispatch_add(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_add(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t events,
+		void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_mod(bm_loop, p, fd, events, data, fn);
+}
+
+static int32_t
+my_dispatch_del(int32_t fd)
+{
+	return qb_loop_poll_del(bm_loop, fd);
+}
+
+static void
+run_server(void)
+{
+	qb_loop_signal_handle handle;
+	struct qb_ipcs_service_handlers sh = {
+		.connection_accept = s1_connection_accept_fn,
+		.connection_created = NULL,
+		.msg_process = s1_msg_process_fn,
+		.connection_destroyed = NULL,
+		.connection_closed = NULL,
+	};
+	struct qb_ipcs_poll_handlers ph = {
+		.job_add = my_job_add,
+		.dispatch_add = my_dispatch_add,
+		.dispatch_mod = my_dispatch_mod,
+		.dispatch_del = my_dispatch_del,
+	};
+	int32_t rc;
+
+	bm_loop = qb_loop_create();
+	qb_loop_signal_add(bm_loop, QB_LOOP_HIGH, SIGTERM,
+			   NULL, server_stop, &handle);
+
+	s1 = qb_ipcs_create(BMNN_NAME, 0, ipc_type, &sh);
+	if (s1 == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcs_create");
+		exit(1);
+	}
+	qb_ipcs_poll_handlers_set(s1, &ph);
+	if (quantum > 0) {
+		qb_ipcs_fair_queuing_set(s1, quantum);
+		qb_ipcs_class_weight_set(s1, 1, quiet_weight);
+	}
+	if (busy_poll_usec > 0) {
+		rc = qb_ipcs_busy_poll_set(s1, busy_poll_usec);
+		if (rc != 0) {
+			errno = -rc;
+			qb_perror(LOG_ERR, "qb_ipcs_busy_poll_set");
+			exit(1);
+		}
+	}
+	rc = qb_ipcs_run(s1);
+	if (rc != 0) {
+		errno = -rc;
+		qb_perror(LOG_ERR, "qb_ipcs_run");
+		exit(1);
+	}
+	qb_loop_run(bm_loop);
+	exit(0);
+}
+
+/*
+ * clients
+ */
+static qb_ipcc_connection_t *
+client_connect(void)
+{
+	qb_ipcc_connection_t *conn;
+	int32_t tries = 0;
+
+	do {
+		conn = qb_ipcc_connect(BMNN_NAME, MAX_MSG_SIZE);
+		if (conn == NULL) {
+			usleep(100000);
+		}
+	} while (conn == NULL && ++tries < 50);
+	if (conn == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcc_connect");
+		exit(1);
+	}
+	return conn;
+}
+
+static void
+run_noisy_client(void)
+{
+	qb_ipcc_connection_t *conn = client_connect();
+	int32_t res;
+
+	request.hdr.id = MSG_NOISE;
+	request.hdr.size = noise_size;
+	while (QB_TRUE) {
+		res = qb_ipcc_send(conn, &request, request.hdr.size);
+		if (res == -EAGAIN) {
+			usleep(100);
+		} else if (res < 0) {
+			break;
+		}
+	}
+	qb_ipcc_disconnect(conn);
+	exit(0);
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+run_quiet_client(void)
+{
+	qb_ipcc_connection_t *conn = client_connect();
+	struct qb_ipc_request_header ping;
+	struct qb_ipc_response_header pong;
+	uint64_t *rtt;
+	uint64_t start;
+	uint64_t total = 0;
+	int32_t res;
+	int32_t i;
+
+	rtt = calloc(iterations, sizeof(uint64_t));
+	ping.id = MSG_PING;
+	ping.size = sizeof(ping);
+
+	for (i = 0; i < iterations; i++) {
+		start = qb_util_nano_current_get();
+		do {
+			res = qb_ipcc_send(conn, &ping, ping.size);
+		} while (res == -EAGAIN);
+		if (res < 0) {
+			break;
+		}
+		res = qb_ipcc_recv(conn, &pong, sizeof(pong), -1);
+		if (res < 0) {
+			break;
+		}
+		rtt[i] = qb_util_nano_current_get() - start;
+		total += rtt[i];
+	}
+	if (i < iterations) {
+		errno = -res;
+		qb_perror(LOG_ERR, "ping %d", i);
+		iterations = i;
+	}
+	qb_ipcc_disconnect(conn);
+	if (iterations == 0) {
+		free(rtt);
+		return;
+	}
+
+	qsort(rtt, iterations, sizeof(uint64_t), uint64_cmp);
+	qb_log(LOG_INFO, "quantum, %u, busy poll, %u, noisy, %d, size, %d, "
+	       "rtt usec avg, %9.3f, p50, %9.3f, p99, %9.3f, max, %9.3f",
+	       quantum, busy_poll_usec, num_noisy, noise_size,
+	       (double)total / iterations / QB_TIME_NS_IN_USEC,
+	       (double)rtt[iterations / 2] / QB_TIME_NS_IN_USEC,
+	       (double)rtt[(iterations * 99) / 100] / QB_TIME_NS_IN_USEC,
+	       (double)rtt[iterations - 1] / QB_TIME_NS_IN_USEC);
+	free(rtt);
+}
+
+static void
+show_usage(const char *name)
+{
+	qb_log(LOG_INFO, "usage: \n");
+	qb_log(LOG_INFO, "%s <options>\n", name);
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  options:\n");
+	qb_log(LOG_INFO, "\n");
+	qb_log(LOG_INFO, "  -q <bytes>     fair queuing quantum (default off)\n");
+	qb_log(LOG_INFO, "  -w <weight>    weight of the quiet client's class\n");
+	qb_log(LOG_INFO, "  -p <usec>      busy poll, idle timeout (default off)\n");
+	qb_log(LOG_INFO, "  -n <clients>   number of noisy clients (default 4)\n");
+	qb_log(LOG_INFO, "  -s <bytes>     noisy request size (default 65536)\n");
+	qb_log(LOG_INFO, "  -i <count>     quiet requests to time (default 1000)\n");
+	qb_log(LOG_INFO, "  -u             use unix sockets\n");
+	qb_log(LOG_INFO, "  -h             show this help text\n");
+	qb_log(LOG_INFO, "\n");
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+	const char *options = "q:w:p:n:s:i:uh";
+	pid_t server_pid;
+	pid_t noisy_pids[MAX_NOISY];
+	int32_t opt;
+	int32_t i;
+
+	qb_log_init("bmnn", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'q':
+			quantum = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			quiet_weight = QB_MAX(strtoul(optarg, NULL, 0), 1);
+			break;
+		case 'p':
+			busy_poll_usec = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_noisy = QB_MIN(atoi(optarg), MAX_NOISY);
+			break;
+		case 's':
+			noise_size = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'u':
+			ipc_type = QB_IPC_SOCKET;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	noise_size = QB_MAX(noise_size, sizeof(struct qb_ipc_request_header));
+	noise_size = QB_MIN(noise_size, MAX_MSG_SIZE / 2);
+
+	quiet_pid = getpid();
+	server_pid = fork();
+	if (server_pid == 0) {
+		run_server();
+	}
+
+	for (i = 0; i < num_noisy; i++) {
+		noisy_pids[i] = fork();
+		if (noisy_pids[i] == 0) {
+			run_noisy_client();
+		}
+	}
+
+	/* let the noise build up */
+	sleep(1);
+	run_quiet_client();
+
+	for (i = 0; i < num_noisy; i++) {
+		kill(noisy_pids[i], SIGTERM);
+		waitpid(noisy_pids[i], NULL, 0);
+	}
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, NULL, 0);
+
+	return EXIT_SUCCESS;
+}
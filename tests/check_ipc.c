@@ -24,6 +24,7 @@
 #include "os_base.h"
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 #include <check.h>
 
 #include <qb/qbdefs.h>
@@ -65,8 +66,49 @@ enum my_msg_ids {
 	IPC_MSG_RES_SERVER_FAIL,
 	IPC_MSG_REQ_SERVER_DISCONNECT,
 	IPC_MSG_RES_SERVER_DISCONNECT,
+	IPC_MSG_REQ_ASYNC,
+	IPC_MSG_RES_ASYNC,
+	IPC_MSG_REQ_CLASS_STATS,
+	IPC_MSG_RES_CLASS_STATS,
+	IPC_MSG_REQ_LANE,
+	IPC_MSG_RES_LANE,
+	IPC_MSG_REQ_LARGE,
+	IPC_MSG_RES_LARGE,
+	IPC_MSG_REQ_BACKLOG,
+	IPC_MSG_RES_BACKLOG,
+	IPC_MSG_EVENT_STATE,
+	IPC_MSG_REQ_RESIDENT,
+	IPC_MSG_RES_RESIDENT,
+	IPC_MSG_REQ_RESIZE,
+	IPC_MSG_RES_RESIZE,
+	IPC_MSG_REQ_ASYNC_LATE,
+	IPC_MSG_REQ_ASYNC_UNORDERED,
+	IPC_MSG_REQ_FQ_CLASS,
+	IPC_MSG_RES_FQ_CLASS,
+	IPC_MSG_REQ_FQ_HOLD,
+	IPC_MSG_REQ_FQ_SINK,
+	IPC_MSG_REQ_FQ_SHARE,
+	IPC_MSG_RES_FQ_SHARE,
 };
 
+struct async_req {
+	struct qb_ipc_request_header hdr;
+	int32_t seq;
+};
+
+#define NUM_ASYNC_REQS 5
+#define LARGE_MSG_SIZE (4 * 1024 * 1024)
+
+struct state_event {
+	struct qb_ipc_response_header hdr;
+	int32_t key;
+	int32_t seq;
+	char padding[16 * 1024];
+};
+
+#define NUM_STATE_EVENTS 100
+#define NUM_STATE_KEYS 4
+
 /* Test Cases
  *
  * 1) basic send & recv differnet message sizes
@@ -95,6 +137,18 @@ static int32_t num_bulk_events = 10;
 static int32_t num_stress_events = 30000;
 static int32_t reference_count_test = QB_FALSE;
 static int32_t multiple_connections = QB_FALSE;
+static int32_t fair_queuing = QB_FALSE;
+static int32_t busy_poll = QB_FALSE;
+static int32_t idle_trim = QB_FALSE;
+static int32_t priority_lane = QB_FALSE;
+
+/* one busy connection among idle ones in FQ_CLASS_A, one in FQ_CLASS_B */
+#define FQ_CLASS_A 5
+#define FQ_CLASS_B 6
+#define FQ_IDLE_CONNS 8
+#define FQ_BUSY_REQS 200
+static int32_t fq_sunk[2];
+static int32_t fq_share = -1;
 
 
 static int32_t
@@ -117,6 +171,71 @@ set_ipc_name(const char *prefix)
 	snprintf(ipc_name, 256, "%s-%d", prefix, (int32_t)random());
 }
 
+static void *
+async_worker(void *data)
+{
+	qb_ipcs_pending_t *pending = data;
+	struct async_req *req;
+	struct qb_ipc_response_header response;
+
+	req = qb_ipcs_pending_request_get(pending, NULL);
+
+	/* the first requests take the longest */
+	usleep((NUM_ASYNC_REQS - req->seq) * 20000);
+
+	response.size = sizeof(struct qb_ipc_response_header);
+	response.id = IPC_MSG_RES_ASYNC;
+	response.error = req->seq;
+	ck_assert_int_eq(qb_ipcs_response_complete(pending, &response,
+						   response.size), 0);
+	return NULL;
+}
+
+/*
+ * Only looks at the request after the client had time to go away.
+ */
+static void *
+async_late_worker(void *data)
+{
+	qb_ipcs_pending_t *pending = data;
+	struct async_req *req;
+	struct qb_ipc_response_header response;
+
+	usleep(500000);
+	req = qb_ipcs_pending_request_get(pending, NULL);
+	ck_assert_int_eq(req->hdr.id, IPC_MSG_REQ_ASYNC_LATE);
+	ck_assert_int_eq(req->seq, 42);
+
+	response.size = sizeof(struct qb_ipc_response_header);
+	response.id = IPC_MSG_RES_ASYNC;
+	response.error = req->seq;
+	ck_assert_int_eq(qb_ipcs_response_complete(pending, &response,
+						   response.size), 0);
+	return NULL;
+}
+
+/*
+ * Finishes after a delay that depends on the request, so the
+ * responses go back in a different order than the requests came.
+ */
+static void *
+async_unordered_worker(void *data)
+{
+	qb_ipcs_pending_t *pending = data;
+	struct async_req *req;
+	struct qb_ipc_response_header response;
+
+	req = qb_ipcs_pending_request_get(pending, NULL);
+	usleep(((req->seq * 7) % 5) * 5000);
+
+	response.size = sizeof(struct qb_ipc_response_header);
+	response.id = IPC_MSG_RES_ASYNC;
+	response.error = req->seq;
+	ck_assert_int_eq(qb_ipcs_response_complete(pending, &response,
+						   response.size), 0);
+	return NULL;
+}
+
 static int32_t
 s1_msg_process_fn(qb_ipcs_connection_t *c,
 		void *data, size_t size)
@@ -242,6 +361,184 @@ s1_msg_process_fn(qb_ipcs_connection_t *c,
 	} else if (req_pt->id == IPC_MSG_REQ_SERVER_DISCONNECT) {
 		multiple_connections = QB_FALSE;
 		qb_ipcs_disconnect(c);
+	} else if (req_pt->id == IPC_MSG_REQ_ASYNC) {
+		qb_ipcs_pending_t *pending;
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pending = qb_ipcs_request_defer(c, QB_IPCS_DEFER_ORDERED);
+		fail_if(pending == NULL);
+		fail_if(qb_ipcs_request_defer(c, 0) != NULL);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		res = pthread_create(&thread, &attr, async_worker, pending);
+		ck_assert_int_eq(res, 0);
+		pthread_attr_destroy(&attr);
+		return QB_IPCS_MSG_PENDING;
+	} else if (req_pt->id == IPC_MSG_REQ_ASYNC_LATE) {
+		qb_ipcs_pending_t *pending;
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pending = qb_ipcs_request_defer(c, QB_IPCS_DEFER_ORDERED);
+		fail_if(pending == NULL);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		res = pthread_create(&thread, &attr, async_late_worker, pending);
+		ck_assert_int_eq(res, 0);
+		pthread_attr_destroy(&attr);
+		return QB_IPCS_MSG_PENDING;
+	} else if (req_pt->id == IPC_MSG_REQ_ASYNC_UNORDERED) {
+		qb_ipcs_pending_t *pending;
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pending = qb_ipcs_request_defer(c, 0);
+		fail_if(pending == NULL);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		res = pthread_create(&thread, &attr, async_unordered_worker,
+				     pending);
+		ck_assert_int_eq(res, 0);
+		pthread_attr_destroy(&attr);
+		return QB_IPCS_MSG_PENDING;
+	} else if (req_pt->id == IPC_MSG_REQ_LANE) {
+		struct async_req *req = data;
+
+		if (req->seq == 0) {
+			/* give the client time to queue up behind us */
+			usleep(300000);
+		}
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_LANE;
+		response.error = req->seq;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_LARGE) {
+		unsigned char *p = data;
+		size_t i;
+
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_LARGE;
+		response.error = 0;
+		for (i = sizeof(struct qb_ipc_request_header); i < size; i++) {
+			if (p[i] != (i & 0xff)) {
+				response.error = -EBADMSG;
+				break;
+			}
+		}
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_RESIDENT) {
+		struct qb_ipcs_connection_stats_2 *st;
+
+		st = qb_ipcs_connection_stats_get_2(c, QB_FALSE);
+		fail_if(st == NULL);
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_RESIDENT;
+		response.error = st->resident_bytes / 1024;
+		free(st);
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_RESIZE) {
+		struct state_event ev;
+		int32_t i;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.hdr.id = IPC_MSG_EVENT_STATE;
+		ev.hdr.size = sizeof(ev);
+		for (i = 0; i < 2; i++) {
+			ev.seq = i;
+			res = qb_ipcs_event_send(c, &ev, ev.hdr.size);
+			ck_assert_int_eq(res, ev.hdr.size);
+		}
+		res = qb_ipcs_connection_ring_size_set(c, MAX_MSG_SIZE - 1);
+		ck_assert_int_eq(res, -EINVAL);
+		res = qb_ipcs_connection_ring_size_set(c, 16 * MAX_MSG_SIZE);
+		ck_assert_int_eq(res, 0);
+
+		/* many times what the old ring took */
+		for (; i < NUM_STATE_EVENTS; i++) {
+			ev.seq = i;
+			res = qb_ipcs_event_send(c, &ev, ev.hdr.size);
+			ck_assert_int_eq(res, ev.hdr.size);
+		}
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_RESIZE;
+		response.error = i;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_BACKLOG) {
+		struct state_event ev;
+		struct qb_ipcs_connection_stats_2 *st;
+		int32_t i;
+
+		res = qb_ipcs_event_backlog_set(c, 2 * NUM_STATE_KEYS);
+		ck_assert_int_eq(res, 0);
+
+		/* far more than the client has room for */
+		memset(&ev, 0, sizeof(ev));
+		ev.hdr.id = IPC_MSG_EVENT_STATE;
+		ev.hdr.size = sizeof(ev);
+		for (i = 0; i < NUM_STATE_EVENTS; i++) {
+			ev.key = i % NUM_STATE_KEYS;
+			ev.seq = i;
+			res = qb_ipcs_event_send_keyed(c, ev.key, &ev, ev.hdr.size);
+			ck_assert_int_eq(res, ev.hdr.size);
+		}
+		st = qb_ipcs_connection_stats_get_2(c, QB_FALSE);
+		fail_unless(st->event_backlog_length > 0);
+		fail_unless(st->events_coalesced > 0);
+		free(st);
+
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_BACKLOG;
+		response.error = 0;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_CLASS_STATS) {
+		struct qb_ipcs_class_stats cs;
+
+		res = qb_ipcs_class_stats_get(s1, 3, &cs, QB_FALSE);
+		ck_assert_int_eq(res, 0);
+		ck_assert_int_eq(cs.connections, 1);
+
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_CLASS_STATS;
+		response.error = cs.requests;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_FQ_CLASS) {
+		struct async_req *req = data;
+
+		ck_assert_int_eq(qb_ipcs_class_weight_set(s1, req->seq, 1), 0);
+		ck_assert_int_eq(qb_ipcs_connection_class_set(c, req->seq, 1), 0);
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_FQ_CLASS;
+		response.error = 0;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_FQ_HOLD) {
+		/* let both busy clients fill up their queues */
+		usleep(500000);
+	} else if (req_pt->id == IPC_MSG_REQ_FQ_SINK) {
+		struct async_req *req = data;
+		int32_t i = req->seq - FQ_CLASS_A;
+
+		fq_sunk[i]++;
+		if (fq_sunk[i] == FQ_BUSY_REQS && fq_share < 0) {
+			/* how far the other one got by the time this one is done */
+			fq_share = fq_sunk[!i];
+		}
+	} else if (req_pt->id == IPC_MSG_REQ_FQ_SHARE) {
+		response.size = sizeof(struct qb_ipc_response_header);
+		response.id = IPC_MSG_RES_FQ_SHARE;
+		response.error = fq_share;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
 	}
 	return 0;
 }
@@ -364,6 +661,12 @@ s1_connection_created(qb_ipcs_connection_t *c)
 	}
 
 
+	if (fair_queuing) {
+		ck_assert_int_eq(qb_ipcs_connection_class_set(c, QB_IPCS_CLASSES_MAX, 1),
+				 -EINVAL);
+		ck_assert_int_eq(qb_ipcs_connection_class_set(c, 3, 2), 0);
+	}
+
 	ck_assert_int_eq(max, qb_ipcs_connection_get_buffer_size(c));
 
 }
@@ -403,7 +706,20 @@ run_ipc_server(void)
 	if (enforce_server_buffer) {
 		qb_ipcs_enforce_buffer_size(s1, max_size);
 	}
+	if (fair_queuing) {
+		ck_assert_int_eq(qb_ipcs_fair_queuing_set(s1, 256), 0);
+		ck_assert_int_eq(qb_ipcs_class_weight_set(s1, 3, 4), 0);
+	}
 	qb_ipcs_poll_handlers_set(s1, &ph);
+	if (busy_poll) {
+		ck_assert_int_eq(qb_ipcs_busy_poll_set(s1, 10000), 0);
+	}
+	if (idle_trim) {
+		ck_assert_int_eq(qb_ipcs_idle_trim_set(s1, 200), 0);
+	}
+	if (priority_lane) {
+		ck_assert_int_eq(qb_ipcs_priority_lane_set(s1, QB_TRUE), 0);
+	}
 
 	res = qb_ipcs_run(s1);
 	ck_assert_int_eq(res, 0);
@@ -492,81 +808,892 @@ verify_graceful_stop(pid_t pid)
 	} else {
 		fail_if(rc == 0);
 	}
-	
-	return 0;
-}
+	
+	return 0;
+}
+
+struct my_req {
+	struct qb_ipc_request_header hdr;
+	char message[1024 * 1024];
+};
+
+static struct my_req request;
+static int32_t
+send_and_check(int32_t req_id, uint32_t size,
+	       int32_t ms_timeout, int32_t expect_perfection)
+{
+	struct qb_ipc_response_header res_header;
+	int32_t res;
+	int32_t try_times = 0;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	request.hdr.id = req_id;
+	request.hdr.size = sizeof(struct qb_ipc_request_header) + size;
+
+	/* check that we can't send a message that is too big
+	 * and we get the right return code.
+	 */
+	res = qb_ipcc_send(conn, &request, max_size*2);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+repeat_send:
+	res = qb_ipcc_send(conn, &request, request.hdr.size);
+	try_times++;
+	if (res < 0) {
+		if (res == -EAGAIN && try_times < 10) {
+			goto repeat_send;
+		} else {
+			if (res == -EAGAIN && try_times >= 10) {
+				fc_enabled = QB_TRUE;
+			}
+			errno = -res;
+			qb_perror(LOG_INFO, "qb_ipcc_send");
+			return res;
+		}
+	}
+
+	if (req_id == IPC_MSG_REQ_DISPATCH) {
+		res = qb_ipcc_event_recv(conn, &res_header,
+					 sizeof(struct qb_ipc_response_header),
+					 ms_timeout);
+	} else {
+		res = qb_ipcc_recv(conn, &res_header,
+				   sizeof(struct qb_ipc_response_header),
+				   ms_timeout);
+	}
+	if (res == -EINTR) {
+		return -1;
+	}
+	if (res == -EAGAIN || res == -ETIMEDOUT) {
+		fc_enabled = QB_TRUE;
+		qb_perror(LOG_DEBUG, "qb_ipcc_recv");
+		return res;
+	}
+	if (expect_perfection) {
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+		ck_assert_int_eq(res_header.id, req_id + 1);
+		ck_assert_int_eq(res_header.size, sizeof(struct qb_ipc_response_header));
+	}
+	return res;
+}
+
+static void
+test_ipc_txrx_timeout(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	/* The dispatch response will only come over
+	 * the event channel, we want to verify the receive times
+	 * out when an event is returned with no response */
+	req_header.id = IPC_MSG_REQ_DISPATCH;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = &req_header;
+
+	res = qb_ipcc_sendv_recv(conn, iov, 1,
+				 &res_header,
+				 sizeof(struct qb_ipc_response_header), 5000);
+
+	ck_assert_int_eq(res, -ETIMEDOUT);
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+
+	/*
+	 * wait a bit for the server to die.
+	 */
+	sleep(1);
+
+	/*
+	 * this needs to free up the shared mem
+	 */
+	qb_ipcc_disconnect(conn);
+}
+
+static int32_t recv_timeout = -1;
+static void
+test_ipc_txrx(void)
+{
+	int32_t j;
+	int32_t c = 0;
+	size_t size;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	size = QB_MIN(sizeof(struct qb_ipc_request_header), 64);
+	for (j = 1; j < 19; j++) {
+		size *= 2;
+		if (size >= max_size)
+			break;
+		if (send_and_check(IPC_MSG_REQ_TX_RX, size,
+				   recv_timeout, QB_TRUE) < 0) {
+			break;
+		}
+	}
+	if (turn_on_fc) {
+		/* can't signal server to shutdown if flow control is on */
+		ck_assert_int_eq(fc_enabled, QB_TRUE);
+		qb_ipcc_disconnect(conn);
+		/* TODO - figure out why this sleep is necessary */
+		sleep(1);
+		kill_server(pid);
+	} else {
+		request_server_exit();
+		qb_ipcc_disconnect(conn);
+		verify_graceful_stop(pid);
+	}
+}
+
+static void
+test_ipc_exit(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = &req_header;
+
+	res = qb_ipcc_sendv_recv(conn, iov, 1,
+				 &res_header,
+				 sizeof(struct qb_ipc_response_header), -1);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+
+	/*
+	 * wait a bit for the server to die.
+	 */
+	sleep(1);
+
+	/*
+	 * this needs to free up the shared mem
+	 */
+	qb_ipcc_disconnect(conn);
+}
+
+static void
+test_ipc_async_response(void)
+{
+	struct async_req req;
+	struct qb_ipc_response_header res_header;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	/*
+	 * queue up all the requests, the server completes them
+	 * from worker threads in reverse order.
+	 */
+	req.hdr.id = IPC_MSG_REQ_ASYNC;
+	req.hdr.size = sizeof(struct async_req);
+	for (j = 0; j < NUM_ASYNC_REQS; j++) {
+		req.seq = j;
+		res = qb_ipcc_send(conn, &req, req.hdr.size);
+		ck_assert_int_eq(res, req.hdr.size);
+	}
+
+	/* the responses must still arrive in request order */
+	for (j = 0; j < NUM_ASYNC_REQS; j++) {
+		res = qb_ipcc_recv(conn, &res_header,
+				   sizeof(struct qb_ipc_response_header), 5000);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_ASYNC);
+		ck_assert_int_eq(res_header.error, j);
+	}
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+}
+
+START_TEST(test_ipc_async_response_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_async_response();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_async_response_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_async_response();
+	qb_leave();
+}
+END_TEST
+
+/*
+ * The client goes away while a worker still holds its ordered request.
+ */
+START_TEST(test_ipc_async_disconnect_shm)
+{
+	struct async_req req;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	/* keep the server going when the first client leaves */
+	multiple_connections = QB_TRUE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	req.hdr.id = IPC_MSG_REQ_ASYNC_LATE;
+	req.hdr.size = sizeof(struct async_req);
+	req.seq = 42;
+	res = qb_ipcc_send(conn, &req, req.hdr.size);
+	ck_assert_int_eq(res, req.hdr.size);
+	/* let the server hand it to the worker before we go */
+	usleep(100000);
+	qb_ipcc_disconnect(conn);
+
+	/* the worker reads the request and completes it meanwhile */
+	sleep(1);
+
+	conn = qb_ipcc_connect(ipc_name, max_size);
+	fail_if(conn == NULL);
+	multiple_connections = QB_FALSE;
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+	qb_leave();
+}
+END_TEST
+
+static void
+fq_request_send(qb_ipcc_connection_t *c, int32_t id, int32_t seq)
+{
+	struct async_req req;
+	ssize_t res;
+
+	req.hdr.id = id;
+	req.hdr.size = sizeof(struct async_req);
+	req.seq = seq;
+	do {
+		res = qb_ipcc_send(c, &req, req.hdr.size);
+	} while (res == -EAGAIN);
+	ck_assert_int_eq(res, req.hdr.size);
+}
+
+static int32_t
+fq_request_sendv_recv(qb_ipcc_connection_t *c, int32_t id, int32_t seq,
+		      int32_t res_id)
+{
+	struct async_req req;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	ssize_t res;
+
+	req.hdr.id = id;
+	req.hdr.size = sizeof(struct async_req);
+	req.seq = seq;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = req.hdr.size;
+	res = qb_ipcc_sendv_recv(c, iov, 1, &res_header,
+				 sizeof(res_header), 5000);
+	ck_assert_int_eq(res, sizeof(res_header));
+	ck_assert_int_eq(res_header.id, res_id);
+	return res_header.error;
+}
+
+/*
+ * Idle connections must not water down the share of the busy one
+ * in their class. The extra connections are left to the caller to
+ * close, the server stops when the first of them goes.
+ */
+static void
+test_ipc_fair_queuing_idle(qb_ipcc_connection_t **idle,
+			   qb_ipcc_connection_t **busy)
+{
+	qb_ipcc_connection_t *busy_b;
+	int32_t share;
+	int32_t i;
+
+	busy_b = qb_ipcc_connect(ipc_name, MAX_MSG_SIZE);
+	fail_if(busy_b == NULL);
+	*busy = busy_b;
+	for (i = 0; i < FQ_IDLE_CONNS; i++) {
+		idle[i] = qb_ipcc_connect(ipc_name, MAX_MSG_SIZE);
+		fail_if(idle[i] == NULL);
+		(void)fq_request_sendv_recv(idle[i], IPC_MSG_REQ_FQ_CLASS,
+					    FQ_CLASS_A, IPC_MSG_RES_FQ_CLASS);
+	}
+	(void)fq_request_sendv_recv(conn, IPC_MSG_REQ_FQ_CLASS,
+				    FQ_CLASS_A, IPC_MSG_RES_FQ_CLASS);
+	(void)fq_request_sendv_recv(busy_b, IPC_MSG_REQ_FQ_CLASS,
+				    FQ_CLASS_B, IPC_MSG_RES_FQ_CLASS);
+
+	fq_request_send(conn, IPC_MSG_REQ_FQ_HOLD, 0);
+	usleep(100000);
+	for (i = 0; i < FQ_BUSY_REQS; i++) {
+		fq_request_send(conn, IPC_MSG_REQ_FQ_SINK, FQ_CLASS_A);
+		fq_request_send(busy_b, IPC_MSG_REQ_FQ_SINK, FQ_CLASS_B);
+	}
+	share = fq_request_sendv_recv(busy_b, IPC_MSG_REQ_FQ_SHARE, 0,
+				      IPC_MSG_RES_FQ_SHARE);
+	/* both classes have the same weight, so they keep pace */
+	ck_assert_int_ge(share, FQ_BUSY_REQS / 2);
+}
+
+static void
+test_ipc_fair_queuing(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	qb_ipcc_connection_t *idle[FQ_IDLE_CONNS];
+	qb_ipcc_connection_t *busy;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	fair_queuing = QB_TRUE;
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	/* larger than the quantum, one request per round */
+	for (j = 0; j < 20; j++) {
+		res = send_and_check(IPC_MSG_REQ_TX_RX, 4096, 5000, QB_TRUE);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	}
+
+	req_header.id = IPC_MSG_REQ_CLASS_STATS;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = &req_header;
+	res = qb_ipcc_sendv_recv(conn, iov, 1,
+				 &res_header,
+				 sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_CLASS_STATS);
+	/* all the requests (including this one) are in class 3 */
+	ck_assert_int_eq(res_header.error, 21);
+
+	test_ipc_fair_queuing_idle(idle, &busy);
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+	for (j = 0; j < FQ_IDLE_CONNS; j++) {
+		qb_ipcc_disconnect(idle[j]);
+	}
+	qb_ipcc_disconnect(busy);
+	fair_queuing = QB_FALSE;
+}
+
+START_TEST(test_ipc_fair_queuing_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_fair_queuing();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_fair_queuing_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_fair_queuing();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_priority_lane(void)
+{
+	struct async_req req;
+	struct qb_ipc_response_header res_header;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	priority_lane = QB_TRUE;
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+	priority_lane = QB_FALSE;
+
+	fail_unless(qb_ipcc_priority_msg_size_get(conn) > 0);
+
+	/*
+	 * the first request stalls the server while the bulk requests
+	 * and then the priority one are queued.
+	 */
+	req.hdr.id = IPC_MSG_REQ_LANE;
+	req.hdr.size = sizeof(struct async_req);
+	for (j = 0; j < 10; j++) {
+		req.seq = j;
+		res = qb_ipcc_send(conn, &req, req.hdr.size);
+		ck_assert_int_eq(res, req.hdr.size);
+		if (j == 0) {
+			/* let the server pick up the stalling request first */
+			usleep(100000);
+		}
+	}
+	req.seq = 100;
+	res = qb_ipcc_send_flags(conn, &req, req.hdr.size,
+				 QB_IPCC_SEND_PRIORITY);
+	ck_assert_int_eq(res, req.hdr.size);
+
+	res = qb_ipcc_send_flags(conn, &request,
+				 qb_ipcc_priority_msg_size_get(conn) + 1,
+				 QB_IPCC_SEND_PRIORITY);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+	for (j = 0; j < 11; j++) {
+		res = qb_ipcc_recv(conn, &res_header,
+				   sizeof(struct qb_ipc_response_header), 5000);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_LANE);
+		if (j == 0) {
+			ck_assert_int_eq(res_header.error, 0);
+		} else if (j == 1) {
+			/* overtakes everything queued on the normal lane */
+			ck_assert_int_eq(res_header.error, 100);
+		} else {
+			ck_assert_int_eq(res_header.error, j - 1);
+		}
+	}
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+}
+
+START_TEST(test_ipc_priority_lane_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_priority_lane();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_large_msg(void)
+{
+	struct qb_ipc_request_header *hdr;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[2];
+	unsigned char *buf;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+	/* the service didn't ask for a priority lane */
+	ck_assert_int_eq(qb_ipcc_priority_msg_size_get(conn), 0);
+
+	buf = malloc(LARGE_MSG_SIZE);
+	fail_if(buf == NULL);
+	for (j = 0; j < LARGE_MSG_SIZE; j++) {
+		buf[j] = j & 0xff;
+	}
+	hdr = (struct qb_ipc_request_header *)buf;
+	hdr->id = IPC_MSG_REQ_LARGE;
+
+	/* far bigger than the rings */
+	hdr->size = LARGE_MSG_SIZE;
+	res = qb_ipcc_send(conn, buf, hdr->size);
+	ck_assert_int_eq(res, -EMSGSIZE);
+	res = qb_ipcc_large_msg_threshold_set(conn, max_size);
+	ck_assert_int_eq(res, 0);
+	res = qb_ipcc_send(conn, buf, hdr->size);
+	ck_assert_int_eq(res, LARGE_MSG_SIZE);
+	res = qb_ipcc_recv(conn, &res_header,
+			   sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_LARGE);
+	ck_assert_int_eq(res_header.error, 0);
+
+	/* the server answers a request it can't take itself */
+	res = qb_ipcc_send(conn, buf, LARGE_MSG_SIZE - 8);
+	ck_assert_int_eq(res, LARGE_MSG_SIZE - 8);
+	res = qb_ipcc_recv(conn, &res_header,
+			   sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, QB_IPC_MSG_LARGE);
+	ck_assert_int_eq(res_header.error, -EINVAL);
+
+	/* small enough for the ring, but over the threshold */
+	res = qb_ipcc_large_msg_threshold_set(conn, 1024);
+	ck_assert_int_eq(res, 0);
+	hdr->size = 4096;
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(struct qb_ipc_request_header);
+	iov[1].iov_base = buf + iov[0].iov_len;
+	iov[1].iov_len = hdr->size - iov[0].iov_len;
+	res = qb_ipcc_sendv(conn, iov, 2);
+	ck_assert_int_eq(res, 4096);
+	res = qb_ipcc_recv(conn, &res_header,
+			   sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_LARGE);
+	ck_assert_int_eq(res_header.error, 0);
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+	free(buf);
+}
+
+START_TEST(test_ipc_large_msg_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_large_msg();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_busy_poll(void)
+{
+	struct qb_ipc_response_header res_header;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	int32_t round;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	busy_poll = QB_TRUE;
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	/*
+	 * the first request of each round goes through the socket and
+	 * starts the poller, the pause lets it go back to sleep.
+	 */
+	for (round = 0; round < 3; round++) {
+		for (j = 0; j < 200; j++) {
+			res = send_and_check(IPC_MSG_REQ_TX_RX, 64, 5000, QB_TRUE);
+			ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+		}
+
+		/* several requests in the ring at once */
+		request.hdr.id = IPC_MSG_REQ_TX_RX;
+		request.hdr.size = sizeof(struct qb_ipc_request_header) + 64;
+		for (j = 0; j < 20; j++) {
+			res = qb_ipcc_send(conn, &request, request.hdr.size);
+			ck_assert_int_eq(res, request.hdr.size);
+		}
+		for (j = 0; j < 20; j++) {
+			res = qb_ipcc_recv(conn, &res_header,
+					   sizeof(struct qb_ipc_response_header),
+					   5000);
+			ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+			ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+		}
+		usleep(100000);
+	}
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+	busy_poll = QB_FALSE;
+}
+
+START_TEST(test_ipc_busy_poll_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_busy_poll();
+	qb_leave();
+}
+END_TEST
+
+static int32_t
+resident_kb_get(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	int32_t res;
+
+	req_header.id = IPC_MSG_REQ_RESIDENT;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = &req_header;
+	res = qb_ipcc_sendv_recv(conn, iov, 1,
+				 &res_header,
+				 sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_RESIDENT);
+	return res_header.error;
+}
+
+static void
+test_ipc_idle_trim(void)
+{
+	int32_t before;
+	int32_t after;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	idle_trim = QB_TRUE;
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	/* new rings are all in memory */
+	before = resident_kb_get();
+	fail_unless(before >= 3 * (max_size / 1024));
+
+	/* the response and event rings go */
+	usleep(800000);
+	after = resident_kb_get();
+	fail_unless(after <= before - 2 * (max_size / 1024));
+
+	/* and come back as needed */
+	for (j = 0; j < 10; j++) {
+		res = send_and_check(IPC_MSG_REQ_TX_RX, 64, 5000, QB_TRUE);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+		res = send_and_check(IPC_MSG_REQ_DISPATCH, 64, 5000, QB_TRUE);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	}
 
-struct my_req {
-	struct qb_ipc_request_header hdr;
-	char message[1024 * 1024];
-};
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+	idle_trim = QB_FALSE;
+}
 
-static struct my_req request;
-static int32_t
-send_and_check(int32_t req_id, uint32_t size,
-	       int32_t ms_timeout, int32_t expect_perfection)
+START_TEST(test_ipc_idle_trim_shm)
 {
-	struct qb_ipc_response_header res_header;
-	int32_t res;
-	int32_t try_times = 0;
-	uint32_t max_size = MAX_MSG_SIZE;
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_idle_trim();
+	qb_leave();
+}
+END_TEST
 
-	request.hdr.id = req_id;
-	request.hdr.size = sizeof(struct qb_ipc_request_header) + size;
+#define NUM_SHARED_THREADS 4
+#define NUM_SHARED_REQS 500
+#define NUM_SHARED_UNORDERED_REQS 50
 
-	/* check that we can't send a message that is too big
-	 * and we get the right return code.
-	 */
-	res = qb_ipcc_send(conn, &request, max_size*2);
-	ck_assert_int_eq(res, -EMSGSIZE);
+/* the server answers these out of order */
+static int32_t shared_conn_unordered = QB_FALSE;
 
-repeat_send:
-	res = qb_ipcc_send(conn, &request, request.hdr.size);
-	try_times++;
-	if (res < 0) {
-		if (res == -EAGAIN && try_times < 10) {
-			goto repeat_send;
-		} else {
-			if (res == -EAGAIN && try_times >= 10) {
-				fc_enabled = QB_TRUE;
-			}
-			errno = -res;
-			qb_perror(LOG_INFO, "qb_ipcc_send");
-			return res;
-		}
-	}
+static void *
+shared_conn_worker(void *data)
+{
+	intptr_t t = (intptr_t)data;
+	struct async_req req;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	ssize_t res;
+	int32_t i;
+	int32_t num_reqs = NUM_SHARED_REQS;
+	int32_t res_id = IPC_MSG_RES_LANE;
 
-	if (req_id == IPC_MSG_REQ_DISPATCH) {
-		res = qb_ipcc_event_recv(conn, &res_header,
-					 sizeof(struct qb_ipc_response_header),
-					 ms_timeout);
-	} else {
-		res = qb_ipcc_recv(conn, &res_header,
-				   sizeof(struct qb_ipc_response_header),
-				   ms_timeout);
-	}
-	if (res == -EINTR) {
-		return -1;
-	}
-	if (res == -EAGAIN || res == -ETIMEDOUT) {
-		fc_enabled = QB_TRUE;
-		qb_perror(LOG_DEBUG, "qb_ipcc_recv");
-		return res;
+	if (shared_conn_unordered) {
+		num_reqs = NUM_SHARED_UNORDERED_REQS;
+		res_id = IPC_MSG_RES_ASYNC;
 	}
-	if (expect_perfection) {
-		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
-		ck_assert_int_eq(res_header.id, req_id + 1);
-		ck_assert_int_eq(res_header.size, sizeof(struct qb_ipc_response_header));
+	for (i = 0; i < num_reqs; i++) {
+		req.hdr.id = shared_conn_unordered ?
+			     IPC_MSG_REQ_ASYNC_UNORDERED : IPC_MSG_REQ_LANE;
+		req.hdr.size = sizeof(struct async_req);
+		/* seq 0 makes the server sleep */
+		req.seq = t * num_reqs + i + 1;
+		iov[0].iov_base = &req;
+		iov[0].iov_len = req.hdr.size;
+		do {
+			res = qb_ipcc_sendv_recv(conn, iov, 1, &res_header,
+						 sizeof(res_header), 5000);
+		} while (res == -EAGAIN);
+		if (res != sizeof(res_header) ||
+		    res_header.id != res_id ||
+		    res_header.error != req.seq) {
+			return (void *)-1;
+		}
 	}
-	return res;
+	return NULL;
 }
 
 static void
-test_ipc_txrx_timeout(void)
+test_ipc_shared_conn(void)
 {
-	struct qb_ipc_request_header req_header;
-	struct qb_ipc_response_header res_header;
-	struct iovec iov[1];
+	pthread_t threads[NUM_SHARED_THREADS];
+	void *thread_res;
+	intptr_t t;
 	int32_t res;
 	int32_t c = 0;
 	int32_t j = 0;
@@ -588,42 +1715,79 @@ test_ipc_txrx_timeout(void)
 	} while (conn == NULL && c < 5);
 	fail_if(conn == NULL);
 
-	/* The dispatch response will only come over
-	 * the event channel, we want to verify the receive times
-	 * out when an event is returned with no response */
-	req_header.id = IPC_MSG_REQ_DISPATCH;
-	req_header.size = sizeof(struct qb_ipc_request_header);
-
-	iov[0].iov_len = req_header.size;
-	iov[0].iov_base = &req_header;
-
-	res = qb_ipcc_sendv_recv(conn, iov, 1,
-				 &res_header,
-				 sizeof(struct qb_ipc_response_header), 5000);
+	res = qb_ipcc_thread_safe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
 
-	ck_assert_int_eq(res, -ETIMEDOUT);
+	for (t = 0; t < NUM_SHARED_THREADS; t++) {
+		res = pthread_create(&threads[t], NULL, shared_conn_worker,
+				     (void *)t);
+		ck_assert_int_eq(res, 0);
+	}
+	for (t = 0; t < NUM_SHARED_THREADS; t++) {
+		pthread_join(threads[t], &thread_res);
+		fail_if(thread_res != NULL);
+	}
 
 	request_server_exit();
 	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+}
 
-	/*
-	 * wait a bit for the server to die.
-	 */
-	sleep(1);
+START_TEST(test_ipc_shared_conn_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_shared_conn();
+	qb_leave();
+}
+END_TEST
 
-	/*
-	 * this needs to free up the shared mem
-	 */
-	qb_ipcc_disconnect(conn);
+START_TEST(test_ipc_shared_conn_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_shared_conn();
+	qb_leave();
 }
+END_TEST
+
+START_TEST(test_ipc_shared_conn_unordered_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	shared_conn_unordered = QB_TRUE;
+	test_ipc_shared_conn();
+	shared_conn_unordered = QB_FALSE;
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_shared_conn_unordered_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	shared_conn_unordered = QB_TRUE;
+	test_ipc_shared_conn();
+	shared_conn_unordered = QB_FALSE;
+	qb_leave();
+}
+END_TEST
 
-static int32_t recv_timeout = -1;
 static void
-test_ipc_txrx(void)
+test_ipc_event_backlog(void)
 {
-	int32_t j;
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	static struct state_event ev;
+	int32_t last_seq[NUM_STATE_KEYS];
+	int32_t received = 0;
+	int32_t res;
 	int32_t c = 0;
-	size_t size;
+	int32_t j = 0;
 	pid_t pid;
 	uint32_t max_size = MAX_MSG_SIZE;
 
@@ -642,42 +1806,68 @@ test_ipc_txrx(void)
 	} while (conn == NULL && c < 5);
 	fail_if(conn == NULL);
 
-	size = QB_MIN(sizeof(struct qb_ipc_request_header), 64);
-	for (j = 1; j < 19; j++) {
-		size *= 2;
-		if (size >= max_size)
-			break;
-		if (send_and_check(IPC_MSG_REQ_TX_RX, size,
-				   recv_timeout, QB_TRUE) < 0) {
+	req_header.id = IPC_MSG_REQ_BACKLOG;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	res = qb_ipcc_send(conn, &req_header, req_header.size);
+	ck_assert_int_eq(res, req_header.size);
+	res = qb_ipcc_recv(conn, &res_header,
+			   sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_BACKLOG);
+
+	for (j = 0; j < NUM_STATE_KEYS; j++) {
+		last_seq[j] = -1;
+	}
+	/*
+	 * the backlog drains as we read, without any further requests,
+	 * and every key ends up at its latest value.
+	 */
+	while (QB_TRUE) {
+		res = qb_ipcc_event_recv(conn, &ev, sizeof(ev), 1000);
+		if (res == -EAGAIN || res == -ETIMEDOUT) {
 			break;
 		}
+		ck_assert_int_eq(res, sizeof(ev));
+		ck_assert_int_eq(ev.hdr.id, IPC_MSG_EVENT_STATE);
+		fail_unless(ev.seq > last_seq[ev.key]);
+		last_seq[ev.key] = ev.seq;
+		received++;
 	}
-	if (turn_on_fc) {
-		/* can't signal server to shutdown if flow control is on */
-		ck_assert_int_eq(fc_enabled, QB_TRUE);
-		qb_ipcc_disconnect(conn);
-		/* TODO - figure out why this sleep is necessary */
-		sleep(1);
-		kill_server(pid);
-	} else {
-		request_server_exit();
-		qb_ipcc_disconnect(conn);
-		verify_graceful_stop(pid);
+	for (j = 0; j < NUM_STATE_KEYS; j++) {
+		ck_assert_int_eq(last_seq[j],
+				 NUM_STATE_EVENTS - NUM_STATE_KEYS + j);
 	}
+	fail_unless(received < NUM_STATE_EVENTS);
+
+	request_server_exit();
+	verify_graceful_stop(pid);
+	qb_ipcc_disconnect(conn);
+}
+
+START_TEST(test_ipc_event_backlog_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_event_backlog();
+	qb_leave();
 }
+END_TEST
 
 static void
-test_ipc_exit(void)
+test_ipc_resize(void)
 {
 	struct qb_ipc_request_header req_header;
 	struct qb_ipc_response_header res_header;
-	struct iovec iov[1];
+	static struct state_event ev;
 	int32_t res;
 	int32_t c = 0;
 	int32_t j = 0;
 	pid_t pid;
 	uint32_t max_size = MAX_MSG_SIZE;
 
+	/* the busy poll thread has to find the new response ring */
+	busy_poll = QB_TRUE;
 	pid = run_function_in_new_process(run_ipc_server);
 	fail_if(pid == -1);
 	sleep(1);
@@ -693,31 +1883,42 @@ test_ipc_exit(void)
 	} while (conn == NULL && c < 5);
 	fail_if(conn == NULL);
 
-	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.id = IPC_MSG_REQ_RESIZE;
 	req_header.size = sizeof(struct qb_ipc_request_header);
+	res = qb_ipcc_send(conn, &req_header, req_header.size);
+	ck_assert_int_eq(res, req_header.size);
+	res = qb_ipcc_recv(conn, &res_header,
+			   sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_RESIZE);
+	ck_assert_int_eq(res_header.error, NUM_STATE_EVENTS);
+
+	/* the ones from before the resize come first */
+	for (j = 0; j < NUM_STATE_EVENTS; j++) {
+		res = qb_ipcc_event_recv(conn, &ev, sizeof(ev), 1000);
+		ck_assert_int_eq(res, sizeof(ev));
+		ck_assert_int_eq(ev.seq, j);
+	}
 
-	iov[0].iov_len = req_header.size;
-	iov[0].iov_base = &req_header;
-
-	res = qb_ipcc_sendv_recv(conn, iov, 1,
-				 &res_header,
-				 sizeof(struct qb_ipc_response_header), -1);
+	/* and the connection carries on as normal */
+	res = send_and_check(IPC_MSG_REQ_TX_RX, 64, 5000, QB_TRUE);
 	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
 
 	request_server_exit();
 	verify_graceful_stop(pid);
-
-	/*
-	 * wait a bit for the server to die.
-	 */
-	sleep(1);
-
-	/*
-	 * this needs to free up the shared mem
-	 */
 	qb_ipcc_disconnect(conn);
 }
 
+START_TEST(test_ipc_resize_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_resize();
+	qb_leave();
+}
+END_TEST
+
 START_TEST(test_ipc_exit_us)
 {
 	qb_enter();
@@ -1542,6 +2743,63 @@ make_shm_suite(void)
 	tcase_set_timeout(tc, 200);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_async_response_shm");
+	tcase_add_test(tc, test_ipc_async_response_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_async_disconnect_shm");
+	tcase_add_test(tc, test_ipc_async_disconnect_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_fair_queuing_shm");
+	tcase_add_test(tc, test_ipc_fair_queuing_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_priority_lane_shm");
+	tcase_add_test(tc, test_ipc_priority_lane_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_event_backlog_shm");
+	tcase_add_test(tc, test_ipc_event_backlog_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_resize_shm");
+	tcase_add_test(tc, test_ipc_resize_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_busy_poll_shm");
+	tcase_add_test(tc, test_ipc_busy_poll_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_idle_trim_shm");
+	tcase_add_test(tc, test_ipc_idle_trim_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_shared_conn_shm");
+	tcase_add_test(tc, test_ipc_shared_conn_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_shared_conn_unordered_shm");
+	tcase_add_test(tc, test_ipc_shared_conn_unordered_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+#ifdef HAVE_MEMFD_CREATE
+	tc = tcase_create("ipc_large_msg_shm");
+	tcase_add_test(tc, test_ipc_large_msg_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+#endif /* HAVE_MEMFD_CREATE */
+
 	return s;
 }
 
@@ -1621,6 +2879,26 @@ make_soc_suite(void)
 	tcase_set_timeout(tc, 200);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_async_response_us");
+	tcase_add_test(tc, test_ipc_async_response_us);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_fair_queuing_us");
+	tcase_add_test(tc, test_ipc_fair_queuing_us);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_shared_conn_us");
+	tcase_add_test(tc, test_ipc_shared_conn_us);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_shared_conn_unordered_us");
+	tcase_add_test(tc, test_ipc_shared_conn_unordered_us);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
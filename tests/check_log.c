@@ -23,6 +23,11 @@
 
 #include "os_base.h"
 #include <pthread.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <check.h>
 
 #include <qb/qbdefs.h>
@@ -267,6 +272,33 @@ START_TEST(test_log_filter_fn)
 }
 END_TEST
 
+#ifdef QB_HAVE_ATTRIBUTE_SECTION
+START_TEST(test_log_callsite_discovery)
+{
+	int32_t t;
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	/* qb_log_init() found the callsites of this program on its own */
+	ck_assert_int_eq(qb_log_callsites_register(__start___verbose,
+						   __stop___verbose),
+			 -EEXIST);
+
+	/* filters added before the first use still apply */
+	t = qb_log_custom_open(_test_logger, NULL, NULL, NULL);
+	qb_log_filter_ctl(t, QB_LOG_FILTER_ADD, QB_LOG_FILTER_FILE,
+			  __FILE__, LOG_INFO);
+	qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	num_msgs = 0;
+	qb_log(LOG_DEBUG, "not this one");
+	qb_log(LOG_INFO, "this one");
+	ck_assert_int_eq(num_msgs, 1);
+	qb_log_fini();
+}
+END_TEST
+#endif /* QB_HAVE_ATTRIBUTE_SECTION */
+
 START_TEST(test_log_basic)
 {
 	int32_t t;
@@ -668,6 +700,414 @@ START_TEST(test_log_long_msg)
 }
 END_TEST
 
+/*
+ * Read lines from the follower until one contains marker,
+ * counting the "follow" records and the lost ones.
+ */
+static int
+_follow_read_until(FILE *f, const char *marker, int *seen, int *lost)
+{
+	char line[QB_LOG_MAX_LEN * 2];
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = fileno(f);
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 5000) == 1 && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "--- %d records lost ---", &n) == 1) {
+			*lost += n;
+		} else if (strstr(line, "follow ")) {
+			*seen += 1;
+		}
+		if (strstr(line, marker)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+START_TEST(test_log_blackbox_follow)
+{
+	char name[PATH_MAX];
+	int fds[2];
+	int seen = 0;
+	int lost = 0;
+	int status;
+	int rc;
+	int i;
+	pid_t pid;
+	FILE *f;
+
+	qb_log_init("test", LOG_USER, LOG_DEBUG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_ctl(QB_LOG_BLACKBOX, QB_LOG_CONF_SIZE, 1024);
+	qb_log_ctl(QB_LOG_BLACKBOX, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_filter_ctl(QB_LOG_BLACKBOX, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	snprintf(name, sizeof(name), "test-%d-blackbox", getpid());
+
+	for (i = 0; i < 5; i++) {
+		qb_log(LOG_INFO, "follow %d", i);
+	}
+	qb_log(LOG_INFO, "first done");
+
+	fail_if(pipe(fds) != 0);
+	pid = fork();
+	fail_if(pid == -1);
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		_exit(qb_log_blackbox_follow(name, 500) == 0 ? 0 : 1);
+	}
+	close(fds[1]);
+	f = fdopen(fds[0], "r");
+	fail_if(f == NULL);
+	/* so that poll() sees everything the follower wrote */
+	setvbuf(f, NULL, _IONBF, 0);
+
+	/* what was already there */
+	rc = _follow_read_until(f, "first done", &seen, &lost);
+	if (rc == 0) {
+		ck_assert_int_eq(seen, 5);
+		ck_assert_int_eq(lost, 0);
+
+		/* far more than fits while the follower sleeps */
+		for (i = 5; i < 505; i++) {
+			qb_log(LOG_INFO, "follow %d", i);
+		}
+		qb_log(LOG_INFO, "second done");
+		rc = _follow_read_until(f, "second done", &seen, &lost);
+	}
+
+	/* closing the blackbox ends the follow */
+	qb_log_ctl(QB_LOG_BLACKBOX, QB_LOG_CONF_ENABLED, QB_FALSE);
+	ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+	fclose(f);
+	qb_log_fini();
+
+	ck_assert_int_eq(rc, 0);
+	fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	fail_if(lost == 0);
+	ck_assert_int_eq(seen + lost, 505);
+}
+END_TEST
+
+START_TEST(test_log_net_udp)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct pollfd pfd;
+	char address[64];
+	char expected[64];
+	char buf[QB_LOG_MAX_LEN];
+	int32_t received = 0;
+	int32_t t;
+	int32_t rc;
+	ssize_t res;
+	int fd;
+	int i;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	fail_if(fd < 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0);
+	fail_if(getsockname(fd, (struct sockaddr *)&sin, &len) != 0);
+	snprintf(address, sizeof(address), "udp:127.0.0.1:%d",
+		 ntohs(sin.sin_port));
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	ck_assert_int_eq(qb_log_net_open("udp:127.0.0.1"), -EINVAL);
+	ck_assert_int_eq(qb_log_net_open("sctp:127.0.0.1:1"), -EINVAL);
+
+	t = qb_log_net_open(address);
+	fail_if(t < 0);
+	rc = qb_log_filter_ctl(t, QB_LOG_FILTER_ADD,
+			       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	ck_assert_int_eq(rc, 0);
+	qb_log_format_set(t, "%b");
+	rc = qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_log_ctl(t, QB_LOG_CONF_THREADED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	qb_log_thread_start();
+
+	for (i = 0; i < 100; i++) {
+		qb_log(LOG_INFO, "net %d", i);
+	}
+	/* the log thread sends everything before it stops */
+	qb_log_fini();
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 1000) == 1) {
+		res = recv(fd, buf, sizeof(buf) - 1, 0);
+		if (res <= 0) {
+			break;
+		}
+		buf[res] = '\0';
+		/* one record per datagram, without the newline */
+		snprintf(expected, sizeof(expected), "net %d", received);
+		ck_assert_str_eq(buf, expected);
+		received++;
+	}
+	close(fd);
+	ck_assert_int_eq(received, 100);
+}
+END_TEST
+
+/*
+ * Close threaded targets while the log thread keeps retrying them.
+ */
+START_TEST(test_log_net_close_threaded)
+{
+	struct qb_log_net_stats stats;
+	int32_t t;
+	int32_t rc;
+	int i;
+	int j;
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_thread_start();
+
+	for (i = 0; i < 200; i++) {
+		/* no SO_BROADCAST, so the connect never succeeds */
+		t = qb_log_net_open("udp:255.255.255.255:9");
+		fail_if(t < 0);
+		rc = qb_log_filter_ctl(t, QB_LOG_FILTER_ADD,
+				       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+		ck_assert_int_eq(rc, 0);
+		rc = qb_log_ctl(t, QB_LOG_CONF_THREADED, QB_TRUE);
+		ck_assert_int_eq(rc, 0);
+		rc = qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+		ck_assert_int_eq(rc, 0);
+
+		/* keep the thread busy with it while it is closed */
+		for (j = 0; j < 50; j++) {
+			qb_log(LOG_INFO, "net %d %d", i, j);
+		}
+		if (i == 0) {
+			/* let the thread get to it */
+			usleep(200000);
+			rc = qb_log_net_stats_get(t, &stats);
+			ck_assert_int_eq(rc, 0);
+			ck_assert_int_eq(stats.connects, 0);
+			fail_if(stats.connect_failures == 0);
+			fail_if(stats.bytes_pending == 0);
+		} else if (i % 2) {
+			usleep(i % 5 * 100);
+		}
+		/* the slot is reused, don't leave the filter behind */
+		rc = qb_log_filter_ctl(t, QB_LOG_FILTER_REMOVE,
+				       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+		ck_assert_int_eq(rc, 0);
+		qb_log_net_close(t);
+	}
+	qb_log_fini();
+}
+END_TEST
+
+START_TEST(test_log_net_unix)
+{
+	struct qb_log_net_stats stats;
+	struct sockaddr_un un;
+	struct pollfd pfd;
+	char path[64];
+	char address[80];
+	char line[QB_LOG_MAX_LEN];
+	int32_t received = 0;
+	int32_t t;
+	int32_t rc;
+	int fd;
+	int cfd;
+	int i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "qb-test-log-net-%d", getpid());
+	snprintf(address, sizeof(address), "unix:%s", path);
+	unlink(path);
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	t = qb_log_net_open(address);
+	fail_if(t < 0);
+	rc = qb_log_filter_ctl(t, QB_LOG_FILTER_ADD,
+			       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	ck_assert_int_eq(rc, 0);
+	qb_log_format_set(t, "%b");
+	rc = qb_log_ctl(t, QB_LOG_CONF_SIZE, 1024);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(qb_log_net_stats_get(QB_LOG_STDERR, &stats), -EBADF);
+
+	/* nobody listening yet, the buffer fills up */
+	for (i = 0; i < 300; i++) {
+		qb_log(LOG_INFO, "net %d", i);
+	}
+	rc = qb_log_net_stats_get(t, &stats);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(stats.connects, 0);
+	fail_if(stats.connect_failures == 0);
+	fail_if(stats.records_dropped == 0);
+	fail_if(stats.bytes_pending == 0);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strcpy(un.sun_path, path);
+	fail_if(bind(fd, (struct sockaddr *)&un, sizeof(un)) != 0);
+	fail_if(listen(fd, 1) != 0);
+
+	/* past the reconnect backoff */
+	usleep(500000);
+	qb_log(LOG_INFO, "net done");
+
+	rc = qb_log_net_stats_get(t, &stats);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(stats.connects, 1);
+	ck_assert_int_eq(stats.bytes_pending, 0);
+
+	cfd = accept(fd, NULL, NULL);
+	fail_if(cfd < 0);
+	f = fdopen(cfd, "r");
+	fail_if(f == NULL);
+	setvbuf(f, NULL, _IONBF, 0);
+	pfd.fd = cfd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 1000) == 1 && fgets(line, sizeof(line), f)) {
+		fail_if(strncmp(line, "net ", 4) != 0);
+		received++;
+		if (strcmp(line, "net done\n") == 0) {
+			break;
+		}
+	}
+	fclose(f);
+	close(fd);
+	unlink(path);
+	qb_log_fini();
+
+	ck_assert_int_eq(received, stats.records_sent);
+	ck_assert_int_eq(received + stats.records_dropped, 301);
+}
+END_TEST
+
+static void
+_log_repeat(int32_t count, int32_t value)
+{
+	int32_t i;
+
+	for (i = 0; i < count; i++) {
+		qb_log(LOG_INFO, "repeat %d", value);
+	}
+}
+
+START_TEST(test_log_coalesce)
+{
+	int32_t t;
+	int32_t rc;
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	t = qb_log_custom_open(_test_logger, NULL, NULL, NULL);
+	rc = qb_log_filter_ctl(t, QB_LOG_FILTER_ADD,
+			       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	ck_assert_int_eq(rc, 0);
+	qb_log_format_set(t, "%b");
+	rc = qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(qb_log_ctl(t, QB_LOG_CONF_COALESCE, -1), -EINVAL);
+	rc = qb_log_ctl(t, QB_LOG_CONF_COALESCE, 60);
+	ck_assert_int_eq(rc, 0);
+
+	num_msgs = 0;
+	_log_repeat(99, 0);
+	_log_repeat(1, 1);
+	/* the first, the count of the other 98 and the one that differs */
+	ck_assert_int_eq(num_msgs, 3);
+	ck_assert_str_eq(test_buf, "repeat 1");
+
+	_log_repeat(5, 1);
+	ck_assert_int_eq(num_msgs, 3);
+	/* disabling the target writes out the count */
+	qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_FALSE);
+	ck_assert_int_eq(num_msgs, 4);
+	ck_assert_str_eq(test_buf, "last message repeated 5 times");
+
+	/* off again */
+	qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_ctl(t, QB_LOG_CONF_COALESCE, 0);
+	_log_repeat(5, 1);
+	ck_assert_int_eq(num_msgs, 9);
+	qb_log_fini();
+}
+END_TEST
+
+static void
+_coalesce_loop_stop(void *data)
+{
+	qb_loop_stop((qb_loop_t *)data);
+}
+
+START_TEST(test_log_coalesce_timer)
+{
+	qb_loop_timer_handle th;
+	qb_loop_t *l;
+	int32_t t;
+	int32_t i;
+	int32_t rc;
+
+	qb_log_init("test", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	t = qb_log_custom_open(_test_logger, NULL, NULL, NULL);
+	rc = qb_log_filter_ctl(t, QB_LOG_FILTER_ADD,
+			       QB_LOG_FILTER_FILE, "*", LOG_INFO);
+	ck_assert_int_eq(rc, 0);
+	qb_log_format_set(t, "%b");
+	rc = qb_log_ctl(t, QB_LOG_CONF_ENABLED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_log_ctl(t, QB_LOG_CONF_COALESCE, 1);
+	ck_assert_int_eq(rc, 0);
+
+	/* the loop writes the count out once the second is up */
+	l = qb_loop_create();
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_log_coalesce_loop_set(l), 0);
+	num_msgs = 0;
+	_log_repeat(5, 2);
+	ck_assert_int_eq(num_msgs, 1);
+	rc = qb_loop_timer_add(l, QB_LOOP_LOW, 3 * QB_TIME_NS_IN_SEC, l,
+			       _coalesce_loop_stop, &th);
+	ck_assert_int_eq(rc, 0);
+	qb_loop_run(l);
+	ck_assert_int_eq(num_msgs, 2);
+	ck_assert_str_eq(test_buf, "last message repeated 4 times");
+	ck_assert_int_eq(qb_log_coalesce_loop_set(NULL), 0);
+	qb_loop_destroy(l);
+
+	/* and so does the logging thread for a threaded target */
+	rc = qb_log_ctl(t, QB_LOG_CONF_THREADED, QB_TRUE);
+	ck_assert_int_eq(rc, 0);
+	qb_log_thread_start();
+	num_msgs = 0;
+	_log_repeat(5, 3);
+	for (i = 0; i < 30 && num_msgs < 2; i++) {
+		usleep(100000);
+	}
+	ck_assert_int_eq(num_msgs, 2);
+	ck_assert_str_eq(test_buf, "last message repeated 4 times");
+	qb_log_fini();
+}
+END_TEST
+
 START_TEST(test_threaded_logging)
 {
 	int32_t t;
@@ -783,6 +1223,12 @@ log_suite(void)
 	tcase_add_test(tc, test_log_basic);
 	suite_add_tcase(s, tc);
 
+#ifdef QB_HAVE_ATTRIBUTE_SECTION
+	tc = tcase_create("callsite_discovery");
+	tcase_add_test(tc, test_log_callsite_discovery);
+	suite_add_tcase(s, tc);
+#endif /* QB_HAVE_ATTRIBUTE_SECTION */
+
 	tc = tcase_create("format");
 	tcase_add_test(tc, test_log_format);
 	suite_add_tcase(s, tc);
@@ -800,6 +1246,26 @@ log_suite(void)
 	tcase_add_test(tc, test_log_long_msg);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("blackbox_follow");
+	tcase_add_test(tc, test_log_blackbox_follow);
+	tcase_set_timeout(tc, 30);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("net");
+	tcase_add_test(tc, test_log_net_udp);
+	tcase_add_test(tc, test_log_net_close_threaded);
+	tcase_add_test(tc, test_log_net_unix);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("coalesce");
+	tcase_add_test(tc, test_log_coalesce);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("coalesce_timer");
+	tcase_add_test(tc, test_log_coalesce_timer);
+	tcase_set_timeout(tc, 30);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("filter_ft");
 	tcase_add_test(tc, test_log_filter_fn);
 	suite_add_tcase(s, tc);
@@ -23,6 +23,7 @@
 
 #include "os_base.h"
 #include <check.h>
+#include <poll.h>
 
 #include <qb/qbdefs.h>
 #include <qb/qbutil.h>
@@ -753,6 +754,233 @@ loop_signal_suite(void)
 	return s;
 }
 
+static void
+job_slow(void *data)
+{
+	usleep(30000);
+	job_2_run_count++;
+}
+
+START_TEST(test_loop_watchdog)
+{
+	int32_t res;
+	struct qb_loop_stall stalls[4];
+	qb_loop_t *l = qb_loop_create();
+	fail_if(l == NULL);
+
+	res = qb_loop_stalls_get(l, stalls, 4);
+	ck_assert_int_eq(res, 0);
+
+	res = qb_loop_watchdog_set(l, 10 * QB_TIME_NS_IN_MSEC);
+	ck_assert_int_eq(res, 0);
+
+	job_1_run_count = 0;
+	job_2_run_count = 0;
+	res = qb_loop_job_add(l, QB_LOOP_HIGH, NULL, job_1);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_job_add(l, QB_LOOP_HIGH, NULL, job_slow);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_job_add(l, QB_LOOP_HIGH, NULL, job_slow);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_job_add(l, QB_LOOP_LOW, l, job_stop);
+	ck_assert_int_eq(res, 0);
+	qb_loop_run(l);
+	ck_assert_int_eq(job_1_run_count, 1);
+	ck_assert_int_eq(job_2_run_count, 2);
+
+	res = qb_loop_stalls_get(l, stalls, 4);
+	ck_assert_int_eq(res, 1);
+	ck_assert(stalls[0].dispatch_fn == (void *)job_slow);
+	ck_assert_int_eq(stalls[0].type, QB_LOOP_SOURCE_JOB);
+	ck_assert_int_eq(stalls[0].p, QB_LOOP_HIGH);
+	ck_assert_int_eq(stalls[0].fd, -1);
+	ck_assert_int_eq(stalls[0].count, 2);
+	ck_assert(stalls[0].duration >= 30 * QB_TIME_NS_IN_MSEC);
+
+	/* disabled: nothing new is recorded */
+	res = qb_loop_watchdog_set(l, 0);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_job_add(l, QB_LOOP_HIGH, NULL, job_slow);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_job_add(l, QB_LOOP_LOW, l, job_stop);
+	ck_assert_int_eq(res, 0);
+	qb_loop_run(l);
+	res = qb_loop_stalls_get(l, stalls, 4);
+	ck_assert_int_eq(res, 1);
+	ck_assert_int_eq(stalls[0].count, 2);
+
+	qb_loop_destroy(l);
+}
+END_TEST
+
+/*
+ * -----------------------------------------------------------------------
+ *  Embedding
+ */
+static int32_t embed_fd_dispatched = 0;
+
+static int32_t
+embed_fd_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	char c;
+
+	ck_assert_int_eq(read(fd, &c, 1), 1);
+	embed_fd_dispatched++;
+	return 0;
+}
+
+static void
+embed_timer_fn(void *data)
+{
+	job_2_run_count++;
+}
+
+static int32_t
+embed_fd_readable(int32_t fd, int32_t ms_timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, ms_timeout) == 1 && (pfd.revents & POLLIN));
+}
+
+START_TEST(test_loop_embed)
+{
+	int32_t res;
+	int32_t fd;
+	int32_t pipefd[2];
+	qb_loop_timer_handle th;
+	qb_loop_t *l = qb_loop_create();
+	fail_if(l == NULL);
+
+	fd = qb_loop_fd_get(l);
+	ck_assert(fd >= 0);
+	ck_assert_int_eq(qb_loop_fd_get(l), fd);
+
+	/* nothing to do: not readable */
+	ck_assert_int_eq(embed_fd_readable(fd, 10), QB_FALSE);
+	ck_assert_int_eq(qb_loop_run_once(l, 0), 0);
+
+	/* a job makes it readable */
+	job_1_run_count = 0;
+	res = qb_loop_job_add(l, QB_LOOP_MED, NULL, job_1);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(embed_fd_readable(fd, 0), QB_TRUE);
+	ck_assert_int_eq(qb_loop_run_once(l, 0), 1);
+	ck_assert_int_eq(job_1_run_count, 1);
+	ck_assert_int_eq(embed_fd_readable(fd, 0), QB_FALSE);
+
+	/* a timer makes it readable when it expires */
+	job_2_run_count = 0;
+	res = qb_loop_timer_add(l, QB_LOOP_LOW, 20 * QB_TIME_NS_IN_MSEC,
+				NULL, embed_timer_fn, &th);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(embed_fd_readable(fd, 0), QB_FALSE);
+	ck_assert_int_eq(embed_fd_readable(fd, 1000), QB_TRUE);
+	while (job_2_run_count == 0) {
+		res = qb_loop_run_once(l, 0);
+		ck_assert(res >= 0);
+	}
+	ck_assert_int_eq(job_2_run_count, 1);
+
+	/* and so does a file descriptor */
+	ck_assert_int_eq(pipe(pipefd), 0);
+	res = qb_loop_poll_add(l, QB_LOOP_HIGH, pipefd[0], POLLIN,
+			       NULL, embed_fd_dispatch);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(embed_fd_readable(fd, 0), QB_FALSE);
+	ck_assert_int_eq(write(pipefd[1], "x", 1), 1);
+	ck_assert_int_eq(embed_fd_readable(fd, 1000), QB_TRUE);
+	ck_assert_int_eq(qb_loop_run_once(l, 0), 1);
+	ck_assert_int_eq(embed_fd_dispatched, 1);
+	ck_assert_int_eq(embed_fd_readable(fd, 0), QB_FALSE);
+
+	qb_loop_poll_del(l, pipefd[0]);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	qb_loop_destroy(l);
+}
+END_TEST
+
+START_TEST(test_loop_stats)
+{
+	struct qb_stats_values v;
+	qb_stats_region_t *r;
+	char name[64];
+	int32_t found = QB_FALSE;
+	uint32_t i;
+	uint32_t j;
+	int32_t res;
+	qb_loop_t *l = qb_loop_create();
+	fail_if(l == NULL);
+
+	job_1_run_count = 0;
+	for (i = 0; i < 3; i++) {
+		res = qb_loop_job_add(l, QB_LOOP_MED, NULL, job_1);
+		ck_assert_int_eq(res, 0);
+	}
+	while (job_1_run_count < 3) {
+		ck_assert(qb_loop_run_once(l, 0) >= 0);
+	}
+
+	snprintf(name, sizeof(name), "check-loop-%d", getpid());
+	res = qb_stats_publish(name);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(qb_stats_publish(name), -EEXIST);
+
+	r = qb_stats_open(name);
+	fail_if(r == NULL);
+	ck_assert_int_eq(qb_stats_pid_get(r), getpid());
+	ck_assert(qb_stats_refreshed_get(r) == 0);
+
+	qb_stats_refresh();
+	ck_assert(qb_stats_refreshed_get(r) > 0);
+
+	for (i = 0; qb_stats_read(r, i, &v) != -ERANGE; i++) {
+		if (strncmp(v.name, "loop-", 5) != 0) {
+			continue;
+		}
+		for (j = 0; j < v.count; j++) {
+			if (strcmp(v.labels[j], "jobs_dispatched") == 0 &&
+			    v.values[j] >= 3) {
+				found = QB_TRUE;
+			}
+		}
+	}
+	ck_assert_int_eq(found, QB_TRUE);
+
+	qb_stats_close(r);
+	qb_stats_withdraw();
+	qb_loop_destroy(l);
+}
+END_TEST
+
+static Suite *
+loop_embed_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("loop_embed_suite");
+
+	tc = tcase_create("embed");
+	tcase_add_test(tc, test_loop_embed);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("watchdog");
+	tcase_add_test(tc, test_loop_watchdog);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats");
+	tcase_add_test(tc, test_loop_stats);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
 int32_t
 main(void)
 {
@@ -760,6 +988,7 @@ main(void)
 	SRunner *sr = srunner_create(loop_job_suite());
 	srunner_add_suite (sr, loop_timer_suite());
 	srunner_add_suite (sr, loop_signal_suite());
+	srunner_add_suite (sr, loop_embed_suite());
 
 	qb_log_init("check", LOG_USER, LOG_EMERG);
 	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
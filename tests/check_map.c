@@ -25,6 +25,7 @@
 #include <qb/qbdefs.h>
 #include <qb/qblog.h>
 #include <qb/qbmap.h>
+#include <qb/qbutil.h>
 
 const char *chars[] = {
 	"0","1","2","3","4","5","6","7","8","9",
@@ -904,6 +905,397 @@ START_TEST(test_trie_partial_iterate)
 END_TEST
 
 
+static int32_t batch_events[QB_MAP_NOTIFY_FREE + 1];
+static void *batch_last_value;
+
+static void
+batch_notify_fn(uint32_t event, char *key, void *old_value, void *value,
+		void *user_data)
+{
+	batch_events[event]++;
+	if (event != QB_MAP_NOTIFY_FREE) {
+		batch_last_value = value;
+	}
+}
+
+static void
+batch_loop_stop(void *data)
+{
+	qb_loop_stop((qb_loop_t *)data);
+}
+
+START_TEST(test_map_notifications_batch)
+{
+	qb_map_t *m = qb_trie_create();
+	qb_loop_t *l;
+	int32_t i;
+	int32_t rc;
+
+	rc = qb_map_notify_add(m, NULL, batch_notify_fn,
+			       QB_MAP_NOTIFY_INSERTED |
+			       QB_MAP_NOTIFY_DELETED |
+			       QB_MAP_NOTIFY_REPLACED |
+			       QB_MAP_NOTIFY_RECURSIVE, NULL);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_map_notify_add(m, NULL, batch_notify_fn,
+			       QB_MAP_NOTIFY_FREE, NULL);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), -EINVAL);
+
+	/* nothing until the commit */
+	memset(batch_events, 0, sizeof(batch_events));
+	ck_assert_int_eq(qb_map_notify_batch_start(m, 0), 0);
+	ck_assert_int_eq(qb_map_notify_batch_start(m, 0), -EEXIST);
+	for (i = 0; i < 26; i++) {
+		qb_map_put(m, chars[i], chars[i]);
+	}
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 0);
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), 0);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 26);
+	for (i = 0; i < 26; i++) {
+		qb_map_rm(m, chars[i]);
+	}
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_DELETED], 26);
+
+	/* folded per key */
+	memset(batch_events, 0, sizeof(batch_events));
+	ck_assert_int_eq(qb_map_notify_batch_start(m, QB_MAP_BATCH_DEDUP), 0);
+	qb_map_put(m, "a", chars[0]);
+	qb_map_put(m, "a", chars[1]);
+	qb_map_put(m, "a", chars[2]);
+	qb_map_put(m, "b", chars[3]);
+	qb_map_rm(m, "b");
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), 0);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 1);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_REPLACED], 0);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_DELETED], 0);
+	ck_assert(batch_last_value == chars[2]);
+	/* the values that went away still get freed */
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_FREE], 3);
+
+	/* delivered by a job */
+	memset(batch_events, 0, sizeof(batch_events));
+	l = qb_loop_create();
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_map_notify_batch_start(m, 0), 0);
+	ck_assert_int_eq(qb_map_notify_batch_loop_set(m, l, QB_LOOP_HIGH), 0);
+	qb_map_put(m, "c", chars[4]);
+	qb_map_rm(m, "a");
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 0);
+	rc = qb_loop_job_add(l, QB_LOOP_LOW, l, batch_loop_stop);
+	ck_assert_int_eq(rc, 0);
+	qb_loop_run(l);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 1);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_DELETED], 1);
+
+	/* destroying commits the batch first */
+	qb_map_destroy(m);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_DELETED], 2);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_FREE], 2);
+	qb_loop_destroy(l);
+}
+END_TEST
+
+/*
+ * Blocks from tagged_malloc() carry a header, anything else handed
+ * to tagged_free() came from somewhere other than the allocator.
+ */
+#define TAG_MAGIC 0x7a6b0cafU
+#define TAG_HDR 16
+
+static int32_t tagged_outstanding;
+static int32_t tagged_foreign;
+
+static void *
+tagged_malloc(void *data, size_t size)
+{
+	char *p = malloc(size + TAG_HDR);
+
+	if (p == NULL) {
+		return NULL;
+	}
+	*(uint32_t *)p = TAG_MAGIC;
+	tagged_outstanding++;
+	return p + TAG_HDR;
+}
+
+static void *
+tagged_realloc(void *data, void *ptr, size_t size)
+{
+	char *p;
+
+	if (ptr == NULL) {
+		return tagged_malloc(data, size);
+	}
+	p = (char *)ptr - TAG_HDR;
+	ck_assert_int_eq(*(uint32_t *)p, TAG_MAGIC);
+	p = realloc(p, size + TAG_HDR);
+	return p ? p + TAG_HDR : NULL;
+}
+
+static void
+tagged_free(void *data, void *ptr)
+{
+	char *p;
+
+	if (ptr == NULL) {
+		return;
+	}
+	p = (char *)ptr - TAG_HDR;
+	if (*(uint32_t *)p != TAG_MAGIC) {
+		/* leak it rather than hand it to the wrong free() */
+		tagged_foreign++;
+		return;
+	}
+	*(uint32_t *)p = 0;
+	tagged_outstanding--;
+	free(p);
+}
+
+START_TEST(test_map_notifications_batch_allocator)
+{
+	struct qb_allocator a = {
+		.malloc_fn = tagged_malloc,
+		.realloc_fn = tagged_realloc,
+		.free_fn = tagged_free,
+		.data = NULL,
+	};
+	qb_map_t *m;
+	int32_t i;
+	int32_t rc;
+
+	tagged_outstanding = 0;
+	tagged_foreign = 0;
+	ck_assert_int_eq(qb_util_allocator_set(&a), 0);
+
+	m = qb_trie_create();
+	ck_assert(m != NULL);
+	rc = qb_map_notify_add(m, NULL, batch_notify_fn,
+			       QB_MAP_NOTIFY_INSERTED |
+			       QB_MAP_NOTIFY_DELETED |
+			       QB_MAP_NOTIFY_RECURSIVE, NULL);
+	ck_assert_int_eq(rc, 0);
+
+	/* the queued entries copy their keys */
+	memset(batch_events, 0, sizeof(batch_events));
+	ck_assert_int_eq(qb_map_notify_batch_start(m, 0), 0);
+	for (i = 0; i < 26; i++) {
+		qb_map_put(m, chars[i], chars[i]);
+	}
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), 0);
+	ck_assert_int_eq(batch_events[QB_MAP_NOTIFY_INSERTED], 26);
+
+	ck_assert_int_eq(qb_map_notify_batch_start(m, QB_MAP_BATCH_DEDUP), 0);
+	for (i = 0; i < 26; i++) {
+		qb_map_rm(m, chars[i]);
+		qb_map_put(m, chars[i], chars[25 - i]);
+	}
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), 0);
+
+	rc = qb_map_notify_del(m, NULL, batch_notify_fn,
+			       QB_MAP_NOTIFY_INSERTED |
+			       QB_MAP_NOTIFY_DELETED |
+			       QB_MAP_NOTIFY_RECURSIVE);
+	ck_assert_int_eq(rc, 0);
+	qb_map_destroy(m);
+	ck_assert_int_eq(tagged_foreign, 0);
+	ck_assert_int_eq(tagged_outstanding, 0);
+	ck_assert_int_eq(qb_util_allocator_set(NULL), 0);
+}
+END_TEST
+
+static int32_t u64_inserted;
+static int32_t u64_replaced;
+static int32_t u64_deleted;
+static int32_t u64_freed;
+
+static void
+u64_notify_fn(uint32_t event, uint64_t key, void *old_value, void *value,
+	      void *user_data)
+{
+	if (event == QB_MAP_NOTIFY_INSERTED) {
+		ck_assert(old_value == NULL);
+		u64_inserted++;
+	} else if (event == QB_MAP_NOTIFY_REPLACED) {
+		u64_replaced++;
+	} else if (event == QB_MAP_NOTIFY_DELETED) {
+		ck_assert(value == NULL);
+		u64_deleted++;
+	} else if (event == QB_MAP_NOTIFY_FREE) {
+		ck_assert(old_value != NULL);
+		u64_freed++;
+	}
+}
+
+START_TEST(test_map_u64)
+{
+	qb_map_u64_t *m = qb_map_u64_create(4);
+	qb_map_u64_iter_t *it;
+	uint64_t key;
+	uint64_t i;
+	void *value;
+	int32_t rc;
+	int32_t n;
+
+	ck_assert(m != NULL);
+	rc = qb_map_u64_notify_add(m, u64_notify_fn,
+				   QB_MAP_NOTIFY_INSERTED |
+				   QB_MAP_NOTIFY_REPLACED |
+				   QB_MAP_NOTIFY_DELETED, NULL);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_map_u64_notify_add(m, u64_notify_fn, QB_MAP_NOTIFY_FREE, NULL);
+	ck_assert_int_eq(rc, 0);
+	rc = qb_map_u64_notify_add(m, u64_notify_fn, QB_MAP_NOTIFY_FREE, m);
+	ck_assert_int_eq(rc, -EEXIST);
+
+	/* grows well past the size it was created with */
+	for (i = 1; i <= 10000; i++) {
+		rc = qb_map_u64_put(m, i << 32, (void *)(uintptr_t)i);
+		ck_assert_int_eq(rc, 0);
+	}
+	ck_assert_int_eq(qb_map_u64_count_get(m), 10000);
+	ck_assert_int_eq(u64_inserted, 10000);
+	for (i = 1; i <= 10000; i++) {
+		value = qb_map_u64_get(m, i << 32);
+		ck_assert(value == (void *)(uintptr_t)i);
+	}
+	ck_assert(qb_map_u64_get(m, 0) == NULL);
+	ck_assert(qb_map_u64_get(m, 1) == NULL);
+
+	rc = qb_map_u64_put(m, 1ULL << 32, (void *)(uintptr_t)42);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(u64_replaced, 1);
+	ck_assert_int_eq(u64_freed, 1);
+	ck_assert(qb_map_u64_get(m, 1ULL << 32) == (void *)(uintptr_t)42);
+	ck_assert_int_eq(qb_map_u64_count_get(m), 10000);
+
+	/* remove the odd ones while iterating */
+	n = 0;
+	it = qb_map_u64_iter_create(m);
+	while (qb_map_u64_iter_next(it, &key, &value)) {
+		n++;
+		if ((key >> 32) & 1) {
+			ck_assert_int_eq(qb_map_u64_rm(m, key), QB_TRUE);
+		}
+	}
+	ck_assert_int_eq(n, 10000);
+	/* can't move things around under the iterator */
+	for (i = 20001; i <= 30000; i++) {
+		rc = qb_map_u64_put(m, i << 32, (void *)(uintptr_t)i);
+		if (rc != 0) {
+			break;
+		}
+	}
+	ck_assert_int_eq(rc, -EBUSY);
+	qb_map_u64_iter_free(it);
+	for (; i <= 30000; i++) {
+		rc = qb_map_u64_put(m, i << 32, (void *)(uintptr_t)i);
+		ck_assert_int_eq(rc, 0);
+	}
+
+	ck_assert_int_eq(qb_map_u64_count_get(m), 15000);
+	ck_assert_int_eq(u64_deleted, 5000);
+	ck_assert_int_eq(qb_map_u64_rm(m, 1ULL << 32), QB_FALSE);
+	ck_assert(qb_map_u64_get(m, 2ULL << 32) == (void *)(uintptr_t)2);
+
+	rc = qb_map_u64_notify_del(m, u64_notify_fn, QB_MAP_NOTIFY_FREE, m);
+	ck_assert_int_eq(rc, -ENOENT);
+	qb_map_u64_destroy(m);
+	ck_assert_int_eq(u64_deleted, 20000);
+	ck_assert_int_eq(u64_freed, 20001);
+}
+END_TEST
+
+static uint32_t
+stats_histogram_sum(struct qb_map_stats *stats)
+{
+	uint32_t sum = 0;
+	int32_t i;
+
+	for (i = 0; i < QB_MAP_STATS_HISTOGRAM_LEN; i++) {
+		sum += stats->histogram[i];
+	}
+	return sum;
+}
+
+static void
+test_map_stats(qb_map_t *m, int32_t per_bucket)
+{
+	struct qb_map_stats stats;
+	int32_t n;
+
+	for (n = 0; chars[n]; n++) {
+		qb_map_put(m, chars[n], chars[n]);
+	}
+	ck_assert_int_eq(qb_map_notify_add(m, NULL, batch_notify_fn,
+					   QB_MAP_NOTIFY_FREE, NULL), 0);
+	ck_assert_int_eq(qb_map_notify_add(m, "a", batch_notify_fn,
+					   QB_MAP_NOTIFY_DELETED, NULL), 0);
+
+	ck_assert_int_eq(qb_map_stats_get(m, &stats), 0);
+	ck_assert_int_eq(stats.count, n);
+	ck_assert_int_eq(stats.notifiers, 2);
+	ck_assert_int_eq(stats.batched, 0);
+	ck_assert(stats.nodes >= n);
+	ck_assert(stats.mem_used > stats.nodes);
+	ck_assert(stats.longest > 0);
+	if (per_bucket) {
+		ck_assert_int_eq(stats_histogram_sum(&stats), stats.slots);
+	} else {
+		ck_assert_int_eq(stats_histogram_sum(&stats), n);
+	}
+
+	ck_assert_int_eq(qb_map_notify_batch_start(m, 0), 0);
+	qb_map_put(m, "b", chars[0]);
+	ck_assert_int_eq(qb_map_stats_get(m, &stats), 0);
+	ck_assert_int_eq(stats.batched, 1);
+	ck_assert_int_eq(qb_map_notify_batch_commit(m), 0);
+
+	ck_assert_int_eq(qb_map_stats_get(m, NULL), -EINVAL);
+	qb_map_destroy(m);
+}
+
+START_TEST(test_hashtable_stats)
+{
+	test_map_stats(qb_hashtable_create(32), QB_TRUE);
+}
+END_TEST
+
+START_TEST(test_skiplist_stats)
+{
+	test_map_stats(qb_skiplist_create(), QB_FALSE);
+}
+END_TEST
+
+START_TEST(test_trie_stats)
+{
+	test_map_stats(qb_trie_create(), QB_FALSE);
+}
+END_TEST
+
+START_TEST(test_map_u64_stats)
+{
+	qb_map_u64_t *m = qb_map_u64_create(1000);
+	struct qb_map_stats stats;
+	uint64_t i;
+
+	for (i = 0; i < 1000; i++) {
+		ck_assert_int_eq(qb_map_u64_put(m, i, m), 0);
+	}
+	ck_assert_int_eq(qb_map_u64_notify_add(m, u64_notify_fn,
+					       QB_MAP_NOTIFY_FREE, NULL), 0);
+	ck_assert_int_eq(qb_map_u64_stats_get(m, &stats), 0);
+	ck_assert_int_eq(stats.count, 1000);
+	ck_assert_int_eq(stats.notifiers, 1);
+	ck_assert(stats.slots >= 1000 * 4 / 3);
+	ck_assert(stats.mem_used > stats.slots * sizeof(uint64_t));
+	/* nothing is found without looking at its own slot */
+	ck_assert_int_eq(stats.histogram[0], 0);
+	ck_assert_int_eq(stats_histogram_sum(&stats), 1000);
+	qb_map_u64_destroy(m);
+}
+END_TEST
+
 static Suite *
 map_suite(void)
 {
@@ -970,6 +1362,25 @@ map_suite(void)
 	tcase_add_test(tc, test_trie_traverse);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("notifications_batch");
+	tcase_add_test(tc, test_map_notifications_batch);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("notifications_batch_allocator");
+	tcase_add_test(tc, test_map_notifications_batch_allocator);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("map_u64");
+	tcase_add_test(tc, test_map_u64);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("map_stats");
+	tcase_add_test(tc, test_hashtable_stats);
+	tcase_add_test(tc, test_skiplist_stats);
+	tcase_add_test(tc, test_trie_stats);
+	tcase_add_test(tc, test_map_u64_stats);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("skiplist_load");
 	tcase_add_test(tc, test_skiplist_load);
 	tcase_set_timeout(tc, 30);
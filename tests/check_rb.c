@@ -23,6 +23,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include <syslog.h>
 #include <errno.h>
 #include <check.h>
@@ -188,6 +191,208 @@ START_TEST(test_ring_buffer4)
 }
 END_TEST
 
+START_TEST(test_ring_buffer_read_only)
+{
+	qb_ringbuffer_t *t;
+	qb_ringbuffer_t *ro;
+	char msg[32];
+	char out[32];
+	uint32_t read_pos;
+	uint32_t write_pos;
+	uint32_t pos;
+	int32_t i;
+	ssize_t l;
+
+	t = qb_rb_open("test5", 1024, QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	fail_if(t == NULL);
+	for (i = 0; i < 3; i++) {
+		snprintf(msg, sizeof(msg), "msg-%d", i);
+		l = qb_rb_chunk_write(t, msg, strlen(msg) + 1);
+		ck_assert_int_eq(l, strlen(msg) + 1);
+	}
+
+	ro = qb_rb_open(qb_rb_name_get(t), 0, QB_RB_FLAG_READ_ONLY, 0);
+	fail_if(ro == NULL);
+	ck_assert_int_eq(qb_rb_refcount_get(t), 1);
+	ck_assert_int_eq(qb_rb_chunk_write(ro, msg, 4), -EPERM);
+	ck_assert_int_eq(qb_rb_chunk_read(ro, out, sizeof(out), 0), -EPERM);
+
+	ck_assert_int_eq(qb_rb_position_get(ro, &read_pos, &write_pos), 0);
+	ck_assert_int_eq(qb_rb_chunk_copy_at(ro, read_pos, out, 2, NULL),
+			 -ENOBUFS);
+	pos = read_pos;
+	for (i = 0; i < 3; i++) {
+		snprintf(msg, sizeof(msg), "msg-%d", i);
+		l = qb_rb_chunk_copy_at(ro, pos, out, sizeof(out), &pos);
+		ck_assert_int_eq(l, strlen(msg) + 1);
+		ck_assert_str_eq(out, msg);
+	}
+	ck_assert_int_eq(pos, write_pos);
+	ck_assert_int_eq(qb_rb_chunk_copy_at(ro, pos, out, sizeof(out), NULL),
+			 -EAGAIN);
+
+	/* lap the reader, it has to start again from the read position */
+	for (i = 3; i < 2000; i++) {
+		snprintf(msg, sizeof(msg), "msg-%d", i);
+		l = qb_rb_chunk_write(t, msg, strlen(msg) + 1);
+		ck_assert_int_eq(l, strlen(msg) + 1);
+	}
+	ck_assert_int_eq(qb_rb_position_get(ro, &pos, &write_pos), 0);
+	do {
+		l = qb_rb_chunk_copy_at(ro, pos, out, sizeof(out), &pos);
+		ck_assert_int_gt(l, 0);
+	} while (pos != write_pos);
+	ck_assert_str_eq(out, "msg-1999");
+
+	/* the reader doesn't change anything */
+	l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+	fail_if(l <= 0);
+	qb_rb_close(ro);
+	ck_assert_int_eq(qb_rb_refcount_get(t), 1);
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_copy)
+{
+	qb_ringbuffer_t *t;
+	const size_t sizes[] = { 1, 63, 64, 4097, 100003 };
+	char *in = malloc(100004);
+	char *out = malloc(100004);
+	int32_t rc;
+	size_t i;
+	size_t s;
+	ssize_t l;
+
+	fail_if(in == NULL || out == NULL);
+	for (i = 0; i < 100004; i++) {
+		in[i] = (char)(i * 7);
+	}
+	t = qb_rb_open("test6", 300000, QB_RB_FLAG_CREATE, 0);
+	fail_if(t == NULL);
+
+	/* everything goes through the streaming copy */
+	rc = qb_rb_copy_threshold_set(1);
+	fail_if(rc != 0 && rc != -ENOTSUP);
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		/* and not from an aligned address */
+		l = qb_rb_chunk_write(t, in + 1, sizes[s]);
+		ck_assert_int_eq(l, sizes[s]);
+		memset(out, 0, sizes[s] + 1);
+		l = qb_rb_chunk_read(t, out + 1, sizes[s], 0);
+		ck_assert_int_eq(l, sizes[s]);
+		ck_assert_int_eq(memcmp(in + 1, out + 1, sizes[s]), 0);
+		ck_assert_int_eq(out[0], 0);
+	}
+	(void)qb_rb_copy_threshold_set(1024 * 1024);
+	qb_rb_close(t);
+	free(in);
+	free(out);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_resize)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	char msg[16];
+	char out[16];
+	char old_path[PATH_MAX];
+	int32_t *user_data;
+	int32_t written;
+	int32_t i;
+	ssize_t l;
+
+	w = qb_rb_open("test7", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_PROCESS,
+		       sizeof(int32_t));
+	fail_if(w == NULL);
+	r = qb_rb_open("test7", 2000, QB_RB_FLAG_SHARED_PROCESS,
+		       sizeof(int32_t));
+	fail_if(r == NULL);
+	user_data = qb_rb_shared_user_data_get(w);
+	*user_data = 42;
+	ck_assert_int_eq(qb_rb_resize(r, 64000), -EPERM);
+
+	for (written = 0; ; written++) {
+		snprintf(msg, sizeof(msg), "msg-%d", written);
+		l = qb_rb_chunk_write(w, msg, sizeof(msg));
+		if (l == -EAGAIN) {
+			break;
+		}
+		ck_assert_int_eq(l, sizeof(msg));
+	}
+	ck_assert_int_eq(qb_rb_resize(w, 2000), 0);
+	ck_assert_int_eq(qb_rb_resize(w, 64000), -EAGAIN);
+	l = qb_rb_chunk_read(r, out, sizeof(out), 0);
+	ck_assert_int_eq(l, sizeof(msg));
+	ck_assert_str_eq(out, "msg-0");
+
+	snprintf(old_path, PATH_MAX, "%s", qb_rb_name_get(w));
+	ck_assert_int_eq(qb_rb_resize(w, 64000), 0);
+	fail_if(strstr(qb_rb_name_get(w), "test7-r1") == NULL);
+	user_data = qb_rb_shared_user_data_get(w);
+	ck_assert_int_eq(*user_data, 42);
+	/* more than the old ring could take */
+	for (i = 0; i < 1000; i++) {
+		snprintf(msg, sizeof(msg), "msg-%d", written + i);
+		l = qb_rb_chunk_write(w, msg, sizeof(msg));
+		ck_assert_int_eq(l, sizeof(msg));
+	}
+	written += 1000;
+
+	/* the reader drains the old ring first, then follows */
+	for (i = 1; i < written; i++) {
+		snprintf(msg, sizeof(msg), "msg-%d", i);
+		l = qb_rb_chunk_read(r, out, sizeof(out), 0);
+		ck_assert_int_eq(l, sizeof(msg));
+		ck_assert_str_eq(out, msg);
+	}
+	ck_assert_int_eq(qb_rb_chunk_read(r, out, sizeof(out), 0), -ETIMEDOUT);
+	ck_assert_str_eq(qb_rb_name_get(r), qb_rb_name_get(w));
+	ck_assert_int_eq(qb_rb_refcount_get(w), 2);
+	ck_assert_int_eq(access(old_path, F_OK), -1);
+
+	/* and back down */
+	ck_assert_int_eq(qb_rb_resize(w, 2000), 0);
+	l = qb_rb_chunk_write(w, "shrunk", 7);
+	ck_assert_int_eq(l, 7);
+	l = qb_rb_chunk_read(r, out, sizeof(out), 0);
+	ck_assert_int_eq(l, 7);
+	ck_assert_str_eq(out, "shrunk");
+	fail_if(strstr(qb_rb_name_get(r), "test7-r2") == NULL);
+
+	qb_rb_close(r);
+	snprintf(old_path, PATH_MAX, "%s", qb_rb_name_get(w));
+	qb_rb_close(w);
+	ck_assert_int_eq(access(old_path, F_OK), -1);
+
+	/* a reader that turns up later follows every marker */
+	w = qb_rb_open("test8", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(w == NULL);
+	ck_assert_int_eq(qb_rb_chunk_write(w, "one", 4), 4);
+	ck_assert_int_eq(qb_rb_resize(w, 8000), 0);
+	ck_assert_int_eq(qb_rb_resize(w, 16000), 0);
+	ck_assert_int_eq(qb_rb_chunk_write(w, "two", 4), 4);
+	r = qb_rb_open("test8", 2000, QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(r == NULL);
+	ck_assert_int_eq(qb_rb_chunk_read(r, out, sizeof(out), 0), 4);
+	ck_assert_str_eq(out, "one");
+	ck_assert_int_eq(qb_rb_chunk_read(r, out, sizeof(out), 0), 4);
+	ck_assert_str_eq(out, "two");
+	fail_if(strstr(qb_rb_name_get(r), "test8-r2") == NULL);
+	qb_rb_close(r);
+	qb_rb_close(w);
+
+	w = qb_rb_open("test9", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	fail_if(w == NULL);
+	ck_assert_int_eq(qb_rb_resize(w, 8000), -ENOTSUP);
+	qb_rb_close(w);
+}
+END_TEST
+
 static Suite *rb_suite(void)
 {
 	TCase *tc;
@@ -209,6 +414,18 @@ static Suite *rb_suite(void)
 	tcase_add_test(tc, test_ring_buffer4);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("read_only");
+	tcase_add_test(tc, test_ring_buffer_read_only);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("copy");
+	tcase_add_test(tc, test_ring_buffer_copy);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("resize");
+	tcase_add_test(tc, test_ring_buffer_resize);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
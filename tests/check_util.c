@@ -27,6 +27,8 @@
 #include <qb/qbdefs.h>
 #include <qb/qbutil.h>
 #include <qb/qblog.h>
+#include <qb/qbmap.h>
+#include <qb/qbrb.h>
 
 #define assert_int_between(_c, _lower, _upper) \
 _ck_assert_int(_c, >=, _lower); \
@@ -154,6 +156,164 @@ START_TEST(test_check_normal)
 }
 END_TEST
 
+static char keys[500][16];
+static int32_t my_mallocs = 0;
+static int32_t my_frees = 0;
+
+static void *
+my_malloc(void *data, size_t size)
+{
+	my_mallocs++;
+	return malloc(size);
+}
+
+static void *
+my_realloc(void *data, void *ptr, size_t size)
+{
+	my_mallocs++;
+	return realloc(ptr, size);
+}
+
+static void
+my_free(void *data, void *ptr)
+{
+	my_frees++;
+	free(ptr);
+}
+
+START_TEST(test_alloc_counting)
+{
+	struct qb_allocator a = {
+		.malloc_fn = my_malloc,
+		.realloc_fn = my_realloc,
+		.free_fn = my_free,
+		.data = NULL,
+	};
+	qb_ringbuffer_t *rb;
+	qb_map_t *m;
+	char buf[64];
+	int32_t allocs;
+	int32_t frees;
+	int32_t i;
+
+	a.malloc_fn = NULL;
+	ck_assert_int_eq(qb_util_allocator_set(&a), -EINVAL);
+	a.malloc_fn = my_malloc;
+	ck_assert_int_eq(qb_util_allocator_set(&a), 0);
+
+	/* maps allocate their nodes through the hooks */
+	for (i = 0; i < 500; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+	}
+	qb_util_alloc_counting_set(QB_TRUE);
+	m = qb_hashtable_create(64);
+	fail_if(m == NULL);
+	for (i = 0; i < 100; i++) {
+		qb_map_put(m, keys[i], NULL);
+	}
+	qb_util_alloc_count_get(&allocs, &frees);
+	ck_assert(allocs > 100);
+	ck_assert_int_eq(allocs, my_mallocs);
+
+	/* lookups don't allocate */
+	qb_util_alloc_counting_set(QB_TRUE);
+	for (i = 0; i < 100; i++) {
+		(void)qb_map_get(m, keys[i]);
+	}
+	qb_util_alloc_count_get(&allocs, &frees);
+	ck_assert_int_eq(allocs, 0);
+	ck_assert_int_eq(frees, 0);
+
+	qb_util_alloc_counting_set(QB_TRUE);
+	qb_map_destroy(m);
+	qb_util_alloc_count_get(&allocs, &frees);
+	ck_assert(frees > 100);
+	ck_assert_int_eq(frees, my_frees);
+
+	/* and neither does passing messages through a ring buffer */
+	rb = qb_rb_open("check-alloc", 8192, QB_RB_FLAG_CREATE, 0);
+	fail_if(rb == NULL);
+	qb_util_alloc_counting_set(QB_TRUE);
+	for (i = 0; i < 1000; i++) {
+		ck_assert_int_eq(qb_rb_chunk_write(rb, buf, sizeof(buf)),
+				 sizeof(buf));
+		ck_assert_int_eq(qb_rb_chunk_read(rb, buf, sizeof(buf), 0),
+				 sizeof(buf));
+	}
+	qb_util_alloc_count_get(&allocs, &frees);
+	ck_assert_int_eq(allocs, 0);
+	ck_assert_int_eq(frees, 0);
+	qb_rb_close(rb);
+
+	qb_util_alloc_counting_set(QB_FALSE);
+	ck_assert_int_eq(qb_util_allocator_set(NULL), 0);
+}
+END_TEST
+
+START_TEST(test_alloc_pool)
+{
+	struct qb_allocator *pool;
+	qb_map_t *m;
+	int32_t allocs;
+	int32_t frees;
+	int32_t round;
+	int32_t i;
+	void *p;
+	void *q;
+
+	for (i = 0; i < 500; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+	}
+	pool = qb_util_pool_create();
+	fail_if(pool == NULL);
+	ck_assert_int_eq(qb_util_allocator_set(pool), 0);
+
+	/* freed blocks are reused by their size class */
+	p = pool->malloc_fn(pool->data, 20);
+	fail_if(p == NULL);
+	pool->free_fn(pool->data, p);
+	q = pool->malloc_fn(pool->data, 30);
+	ck_assert(q == p);
+
+	/* realloc keeps the contents, in and out of the pool */
+	memset(q, 'x', 30);
+	q = pool->realloc_fn(pool->data, q, 32);
+	ck_assert(q == p);
+	q = pool->realloc_fn(pool->data, q, 3000);
+	fail_if(q == NULL);
+	q = pool->realloc_fn(pool->data, q, 100000);
+	fail_if(q == NULL);
+	q = pool->realloc_fn(pool->data, q, 40);
+	fail_if(q == NULL);
+	for (i = 0; i < 30; i++) {
+		ck_assert_int_eq(((char *)q)[i], 'x');
+	}
+	pool->free_fn(pool->data, q);
+
+	qb_util_alloc_counting_set(QB_TRUE);
+	for (round = 0; round < 3; round++) {
+		m = qb_skiplist_create();
+		fail_if(m == NULL);
+		for (i = 0; i < 500; i++) {
+			qb_map_put(m, keys[i], NULL);
+		}
+		ck_assert_int_eq(qb_map_count_get(m), 500);
+		for (i = 0; i < 500; i += 2) {
+			ck_assert_int_eq(qb_map_rm(m, keys[i]), QB_TRUE);
+		}
+		ck_assert_int_eq(qb_map_count_get(m), 250);
+		qb_map_destroy(m);
+	}
+	qb_util_alloc_count_get(&allocs, &frees);
+	ck_assert(allocs > 0);
+	ck_assert_int_eq(allocs, frees);
+
+	qb_util_alloc_counting_set(QB_FALSE);
+	ck_assert_int_eq(qb_util_allocator_set(NULL), 0);
+	qb_util_pool_destroy(pool);
+}
+END_TEST
+
 static Suite *util_suite(void)
 {
 	TCase *tc;
@@ -167,6 +327,14 @@ static Suite *util_suite(void)
 	tcase_add_test(tc, test_check_normal);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("alloc_counting");
+	tcase_add_test(tc, test_alloc_counting);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("alloc_pool");
+	tcase_add_test(tc, test_alloc_pool);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -15,18 +15,38 @@
  * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include <qb/qblog.h>
 
 int
 main(int argc, char **argv)
 {
 	int lpc = 0;
+	int rc;
 
         qb_log_init("qb_blackbox", LOG_USER, LOG_TRACE);
         qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
         qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD, QB_LOG_FILTER_FILE, "*", LOG_TRACE);
 
 	for(lpc = 1; lpc < argc && argv[lpc] != NULL; lpc++) {
+		if (strcmp(argv[lpc], "--follow") == 0 ||
+		    strcmp(argv[lpc], "-f") == 0) {
+			if (++lpc >= argc) {
+				fprintf(stderr,
+					"usage: %s --follow <name>-<pid>-blackbox\n",
+					argv[0]);
+				return 1;
+			}
+			rc = qb_log_blackbox_follow(argv[lpc], 100);
+			if (rc < 0) {
+				fprintf(stderr, "couldn't follow %s: %s\n",
+					argv[lpc], strerror(-rc));
+				return 1;
+			}
+			continue;
+		}
 		printf("Dumping the contents of %s\n", argv[lpc]);
 		qb_log_blackbox_print_from_file(argv[lpc]);
 	}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Print the statistics a process publishes with qb_stats_publish().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+
+static void
+show_usage(const char *name)
+{
+	printf("usage: %s [-w <seconds>] <name>\n", name);
+	printf("\n");
+	printf("  -w <seconds>   print again every <seconds>\n");
+	printf("  -h             show this help text\n");
+}
+
+static int
+print_region(qb_stats_region_t *r)
+{
+	struct qb_stats_values v;
+	uint64_t refreshed;
+	uint64_t now;
+	uint32_t i;
+	uint32_t j;
+	int32_t rc;
+
+	refreshed = qb_stats_refreshed_get(r);
+	now = qb_util_nano_from_epoch_get();
+	if (refreshed == 0) {
+		printf("pid %d, never refreshed\n", (int)qb_stats_pid_get(r));
+	} else {
+		printf("pid %d, refreshed %"PRIu64" ms ago\n",
+		       (int)qb_stats_pid_get(r),
+		       (uint64_t)(now > refreshed ?
+				  (now - refreshed) / QB_TIME_NS_IN_MSEC : 0));
+	}
+
+	for (i = 0; ; i++) {
+		rc = qb_stats_read(r, i, &v);
+		if (rc == -ERANGE) {
+			break;
+		} else if (rc == -ENOENT) {
+			continue;
+		} else if (rc < 0) {
+			printf("%u: %s\n", i, strerror(-rc));
+			continue;
+		}
+		printf("%s\n", v.name);
+		for (j = 0; j < v.count; j++) {
+			printf("  %-24s %"PRIu64"\n", v.labels[j], v.values[j]);
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	qb_stats_region_t *r;
+	int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			interval = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc) {
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	r = qb_stats_open(argv[optind]);
+	if (r == NULL) {
+		fprintf(stderr, "couldn't open %s: %s\n",
+			argv[optind], strerror(errno));
+		return 1;
+	}
+	for (;;) {
+		print_region(r);
+		if (interval <= 0) {
+			break;
+		}
+		printf("\n");
+		fflush(stdout);
+		sleep(interval);
+	}
+	qb_stats_close(r);
+	return 0;
+}